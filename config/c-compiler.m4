@@ -285,6 +285,23 @@ fi])# PGAC_C_BUILTIN_UNREACHABLE
 
 
 
+# PGAC_C_BUILTIN_PREFETCH
+# -----------------------
+# Check if the C compiler understands __builtin_prefetch(),
+# and define HAVE__BUILTIN_PREFETCH if so.
+AC_DEFUN([PGAC_C_BUILTIN_PREFETCH],
+[AC_CACHE_CHECK(for __builtin_prefetch, pgac_cv__builtin_prefetch,
+[AC_TRY_COMPILE([static int x;],
+[__builtin_prefetch(&x);],
+[pgac_cv__builtin_prefetch=yes],
+[pgac_cv__builtin_prefetch=no])])
+if test x"$pgac_cv__builtin_prefetch" = xyes ; then
+AC_DEFINE(HAVE__BUILTIN_PREFETCH, 1,
+          [Define to 1 if your compiler understands __builtin_prefetch.])
+fi])# PGAC_C_BUILTIN_PREFETCH
+
+
+
 # PGAC_C_VA_ARGS
 # --------------
 # Check if the C compiler understands C99-style variadic macros,
@@ -503,3 +520,32 @@ if test x"$Ac_cachevar" = x"yes"; then
 fi
 undefine([Ac_cachevar])dnl
 ])# PGAC_SSE42_CRC32_INTRINSICS
+
+
+# PGAC_AVX2_INTRINSICS
+# -----------------------
+# Check if the compiler supports the x86 SSE2 intrinsics with the default
+# CFLAGS, the AVX2 ones in functions declared with
+# __attribute__((target("avx2"))), and __builtin_cpu_supports to check for
+# AVX2 at runtime. Sets pgac_avx2_intrinsics if all of them are supported.
+AC_DEFUN([PGAC_AVX2_INTRINSICS],
+[AC_CACHE_CHECK([for _mm_max_epu8 and _mm256_max_epu8 with a runtime check], pgac_cv_avx2_intrinsics,
+[AC_TRY_LINK([#include <immintrin.h>
+__attribute__((target("avx2")))
+static int avx2_test(void)
+{
+  __m256i x = _mm256_set1_epi8(1);
+  return _mm256_movemask_epi8(_mm256_max_epu8(x, x));
+}],
+  [__m128i x = _mm_set1_epi8(1);
+   int r = _mm_movemask_epi8(_mm_max_epu8(x, x));
+   /* return computed values, to prevent the above being optimized away */
+   if (__builtin_cpu_supports("avx2"))
+     r += avx2_test();
+   return r == 0;],
+  [pgac_cv_avx2_intrinsics=yes],
+  [pgac_cv_avx2_intrinsics=no])])
+if test x"$pgac_cv_avx2_intrinsics" = x"yes"; then
+  pgac_avx2_intrinsics=yes
+fi
+])# PGAC_AVX2_INTRINSICS
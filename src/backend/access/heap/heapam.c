@@ -58,6 +58,7 @@
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "pipeline/scheduler.h"
+#include "pipeline/table_version.h"
 #include "storage/bufmgr.h"
 #include "storage/freespace.h"
 #include "storage/lmgr.h"
@@ -2308,6 +2309,7 @@ heap_insert(Relation relation, HeapTuple tup, CommandId cid,
 
 	/* Note: speculative insertions are counted too, even if aborted later */
 	pgstat_count_heap_insert(relation, 1);
+	TableVersionNoteModified(RelationGetRelid(relation));
 
 	/*
 	 * If heaptup is a private copy, release it.  Don't forget to copy t_self
@@ -2677,6 +2679,7 @@ heap_multi_insert(Relation relation, HeapTuple *tuples, int ntuples,
 		tuples[i]->t_self = heaptuples[i]->t_self;
 
 	pgstat_count_heap_insert(relation, ntuples);
+	TableVersionNoteModified(RelationGetRelid(relation));
 }
 
 /*
@@ -3132,6 +3135,7 @@ l1:
 		UnlockTupleTuplock(relation, &(tp.t_self), LockTupleExclusive);
 
 	pgstat_count_heap_delete(relation);
+	TableVersionNoteModified(RelationGetRelid(relation));
 
 	if (old_key_tuple != NULL && old_key_copied)
 		heap_freetuple(old_key_tuple);
@@ -3982,6 +3986,7 @@ l2:
 		UnlockTupleTuplock(relation, &(oldtup.t_self), *lockmode);
 
 	pgstat_count_heap_update(relation, use_hot_update);
+	TableVersionNoteModified(RelationGetRelid(relation));
 
 	/*
 	 * If heaptup is a private copy, release it.  Don't forget to copy t_self
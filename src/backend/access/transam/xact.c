@@ -41,6 +41,7 @@
 #include "libpq/pqsignal.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "pipeline/table_version.h"
 #include "replication/logical.h"
 #include "replication/origin.h"
 #include "replication/syncrep.h"
@@ -2119,6 +2120,7 @@ CommitTransaction(void)
 	AtEOXact_ComboCid();
 	AtEOXact_HashTables(true);
 	AtEOXact_PgStat(true);
+	AtEOXact_TableVersion(true);
 	AtEOXact_Snapshot(true);
 	pgstat_report_xact_timestamp(0);
 
@@ -2302,6 +2304,7 @@ PrepareTransaction(void)
 	AtPrepare_Locks();
 	AtPrepare_PredicateLocks();
 	AtPrepare_PgStat();
+	AtPrepare_TableVersion();
 	AtPrepare_MultiXact();
 	AtPrepare_RelationMap();
 
@@ -2353,6 +2356,7 @@ PrepareTransaction(void)
 	/* notify doesn't need a postprepare call */
 
 	PostPrepare_PgStat();
+	PostPrepare_TableVersion();
 
 	PostPrepare_Inval();
 
@@ -2586,6 +2590,7 @@ AbortTransaction(void)
 		AtEOXact_ComboCid();
 		AtEOXact_HashTables(false);
 		AtEOXact_PgStat(false);
+		AtEOXact_TableVersion(false);
 		pgstat_report_xact_timestamp(0);
 	}
 
@@ -620,6 +620,8 @@ GetContQueryForId(Oid id)
 	query = (Query *) stringToNode(TextDatumGetCString(tmp));
 	cq->sql = deparse_query_def(query);
 	cq->cvdef = query;
+	cq->delta_storage = query->deltaStorage;
+	cq->ttl_partition = query->ttlPartition;
 
 	if (is_sw(row))
 	{
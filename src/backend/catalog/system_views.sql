@@ -943,14 +943,20 @@ CREATE VIEW pipeline_proc_stats AS
 	SELECT type, pid, start_time,
 		input_rows, output_rows, updated_rows, input_bytes,
 		output_bytes, updated_bytes, executions, tuples_ps, bytes_ps,
-		time_pb, tuples_pb, memory, errors, exec_ms
+		time_pb, tuples_pb, memory, errors, exec_ms,
+		read_p50, read_p95, read_p99, exec_p50, exec_p95, exec_p99,
+		combine_p50, combine_p95, combine_p99, sync_p50, sync_p95, sync_p99,
+		ack_wait_p50, ack_wait_p95, ack_wait_p99
 	FROM cq_proc_stat_get() ORDER BY type, pid;
 
 -- continuous query stats
 CREATE VIEW pipeline_query_stats AS
 	SELECT name, type, input_rows, output_rows, updated_rows, input_bytes,
 		output_bytes, updated_bytes, tuples_ps, bytes_ps, time_pb, tuples_pb,
-		errors, exec_ms
+		errors, exec_ms,
+		read_p50, read_p95, read_p99, exec_p50, exec_p95, exec_p99,
+		combine_p50, combine_p95, combine_p99, sync_p50, sync_p95, sync_p99,
+		ack_wait_p50, ack_wait_p95, ack_wait_p99
 	FROM cq_stat_get() ORDER BY name, type;
 
 -- stream stats
@@ -520,13 +520,15 @@ check_relation_already_exists(RangeVar *rv)
  * extract_ttl_params
  */
 static void
-extract_ttl_params(List **options, List *coldefs, bool has_sw, int *ttl, char **ttl_column)
+extract_ttl_params(List **options, List *coldefs, bool has_sw, int *ttl, char **ttl_column, int *ttl_partition)
 {
 	ListCell *lc;
 	DefElem *opt_ttl = NULL;
 	DefElem *opt_ttl_col = NULL;
+	DefElem *opt_ttl_partition = NULL;
 
 	Assert(ttl);
+	Assert(ttl_partition);
 
 	foreach(lc, *options)
 	{
@@ -574,8 +576,27 @@ extract_ttl_params(List **options, List *coldefs, bool has_sw, int *ttl, char **
 
 			opt_ttl_col = e;
 		}
+		else if (pg_strcasecmp(e->defname, OPTION_TTL_PARTITION) == 0)
+		{
+			Interval *parti;
+
+			if (!IsA(e->arg, String))
+				elog(ERROR, "ttl_partition must be expressed as an interval");
+
+			parti = (Interval *) DirectFunctionCall3(interval_in,
+					(Datum) strVal(e->arg), 0, (Datum) -1);
+
+			opt_ttl_partition = e;
+			*ttl_partition = IntervalToEpoch(parti);
+
+			if (*ttl_partition <= 0)
+				elog(ERROR, "ttl_partition must be at least one second");
+		}
 	}
 
+	if (opt_ttl_partition && !opt_ttl)
+		elog(ERROR, "ttl must be specified in conjunction with ttl_partition");
+
 	if (!opt_ttl && !opt_ttl_col)
 		return;
 
@@ -591,8 +612,43 @@ extract_ttl_params(List **options, List *coldefs, bool has_sw, int *ttl, char **
 	Assert(opt_ttl);
 	Assert(opt_ttl_col);
 
+	if (opt_ttl_partition && *ttl_partition > *ttl)
+		elog(ERROR, "ttl_partition cannot be longer than ttl");
+
 	*options = list_delete(*options, opt_ttl);
 	*options = list_delete(*options, opt_ttl_col);
+
+	if (opt_ttl_partition)
+		*options = list_delete(*options, opt_ttl_partition);
+}
+
+/*
+ * check_ttl_partition
+ *
+ * Rows must never move between TTL partitions, so when a view updates its groups, its ttl_column
+ * must be one of the columns it groups on
+ */
+static void
+check_ttl_partition(Query *query, SelectStmt *select, char *ttl_column)
+{
+	ListCell *lc;
+
+	if (select->deltaStorage)
+		elog(ERROR, "ttl_partition cannot be specified in conjunction with \"%s\" storage", STORAGE_DELTA);
+
+	if (!query->hasAggs && !query->groupClause)
+		return;
+
+	foreach(lc, query->groupClause)
+	{
+		SortGroupClause *g = (SortGroupClause *) lfirst(lc);
+		TargetEntry *te = get_sortgroupclause_tle(g, query->targetList);
+
+		if (te->resname && pg_strcasecmp(te->resname, ttl_column) == 0)
+			return;
+	}
+
+	elog(ERROR, "the ttl_column of an aggregate continuous view with ttl_partition must be a grouping column");
 }
 
 /*
@@ -645,6 +701,7 @@ ExecCreateContViewStmt(CreateContViewStmt *stmt, const char *querystring)
 	int ttl = -1;
 	AttrNumber ttl_attno = InvalidAttrNumber;
 	char *ttl_column = NULL;
+	int ttl_partition = 0;
 
 	Assert(((SelectStmt *) stmt->query)->forContinuousView);
 
@@ -669,7 +726,7 @@ ExecCreateContViewStmt(CreateContViewStmt *stmt, const char *querystring)
 	RewriteFromClause((SelectStmt *) stmt->query);
 	MakeSelectsContinuous((SelectStmt *) stmt->query);
 
-	/* Apply any CQ storage options like sw, step_factor */
+	/* Apply any CQ storage options like sw, step_factor, storage */
 	ApplyStorageOptions(stmt, &has_sw, &ttl, &ttl_column);
 
 	ValidateParsedContQuery(stmt->into->rel, stmt->query, querystring);
@@ -679,6 +736,7 @@ ExecCreateContViewStmt(CreateContViewStmt *stmt, const char *querystring)
 	cont_select_sql = deparse_query_def(cont_query);
 	select = (SelectStmt *) linitial(pg_parse_query(cont_select_sql));
 	select->swStepFactor = ((SelectStmt *) stmt->query)->swStepFactor;
+	select->deltaStorage = ((SelectStmt *) stmt->query)->deltaStorage;
 
 	/*
 	 * Get the transformed SelectStmt used by CQ workers. We do this
@@ -704,7 +762,13 @@ ExecCreateContViewStmt(CreateContViewStmt *stmt, const char *querystring)
 	}
 
 	tableElts = create_coldefs_from_tlist(query);
-	extract_ttl_params(&stmt->into->options, tableElts, has_sw, &ttl, &ttl_column);
+	extract_ttl_params(&stmt->into->options, tableElts, has_sw, &ttl, &ttl_column, &ttl_partition);
+
+	if (ttl_partition)
+	{
+		check_ttl_partition(query, select, ttl_column);
+		cont_query->ttlPartition = ttl_partition;
+	}
 
 	pk = GetContinuousViewOption(stmt->into->options, OPTION_PK);
 	if (pk)
@@ -907,6 +971,10 @@ ExecCreateContViewStmt(CreateContViewStmt *stmt, const char *querystring)
 	GetContPlan(cv, Worker);
 	GetCombinerLookupPlan(cv);
 
+	/* Partitions are otherwise created by the reaper, which may not get to them before the first rows arrive */
+	if (cv->ttl_partition)
+		CreateMatRelPartitions(cv);
+
 	heap_close(pipeline_query, NoLock);
 
 	pgstat_report_create_drop_cv(true);
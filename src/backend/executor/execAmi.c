@@ -47,6 +47,7 @@
 #include "executor/nodeSubplan.h"
 #include "executor/nodeSubqueryscan.h"
 #include "executor/nodeTidscan.h"
+#include "executor/nodeTuplestoreScan.h"
 #include "executor/nodeUnique.h"
 #include "executor/nodeValuesscan.h"
 #include "executor/nodeWindowAgg.h"
@@ -205,6 +206,10 @@ ExecReScan(PlanState *node)
 			ExecReScanForeignScan((ForeignScanState *) node);
 			break;
 
+		case T_TuplestoreScanState:
+			ExecReScanTuplestoreScan((TuplestoreScanState *) node);
+			break;
+
 		case T_CustomScanState:
 			ExecReScanCustomScan((CustomScanState *) node);
 			break;
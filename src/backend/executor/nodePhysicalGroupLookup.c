@@ -81,7 +81,18 @@ lnext:
 	tup = inner->tts_tuple;
 	Assert(inner->tts_tuple);
 
-	scan = (ScanState *) outer->js.ps.righttree;
+	/*
+	 * Matrels with TTL partitions are scanned through an Append of the matrel and its partitions,
+	 * in which case the tuple came from whichever one the Append is currently scanning
+	 */
+	if (IsA(outer->js.ps.righttree, AppendState))
+	{
+		AppendState *append = (AppendState *) outer->js.ps.righttree;
+		scan = (ScanState *) append->appendplans[append->as_whichplan];
+	}
+	else
+		scan = (ScanState *) outer->js.ps.righttree;
+
 	rel = scan->ss_currentRelation;
 
 	/* lock the physical tuple for update */
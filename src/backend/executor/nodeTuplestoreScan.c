@@ -15,6 +15,7 @@
  *		ExecTuplestoreScan				sequentially scans a tuplestore.
  *		ExecInitTuplestoreScan			creates and initializes a tuplestore scan node.
  *		ExecEndTuplestoreScan			releases any storage allocated.
+ *		ExecReScanTuplestoreScan		rescans the tuplestore.
  */
 #include "postgres.h"
 
@@ -35,6 +36,7 @@ ExecInitTuplestoreScan(TuplestoreScan *node, EState *estate, int eflags)
 	scanstate = makeNode(TuplestoreScanState);
 	scanstate->ss.ps.plan = (Plan *) node;
 	scanstate->ss.ps.state = estate;
+	scanstate->next_tuple = 0;
 
 	ExecAssignExprContext(estate, &scanstate->ss.ps);
 
@@ -65,6 +67,10 @@ TuplestoreNext(TuplestoreScanState * node)
 	TuplestoreScan *scan = (TuplestoreScan *) node->ss.ps.plan;
 	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
 
+	/* Externally referenced tuples are returned first, without copying them */
+	if (node->next_tuple < scan->ntuples)
+		return ExecStoreTuple(scan->tuples[node->next_tuple++], slot, InvalidBuffer, false);
+
 	if (!tuplestore_gettupleslot(scan->store, true, false, slot))
 		return NULL;
 
@@ -90,3 +96,19 @@ ExecEndTuplestoreScan(TuplestoreScanState *node)
 {
 
 }
+
+/*
+ * Rewinds the scan so that it can be re-executed against whatever the
+ * tuplestore holds next, e.g. the next batch of partial tuples to combine
+ */
+extern void
+ExecReScanTuplestoreScan(TuplestoreScanState *node)
+{
+	TuplestoreScan *scan = (TuplestoreScan *) node->ss.ps.plan;
+
+	node->next_tuple = 0;
+	if (scan->store)
+		tuplestore_rescan(scan->store);
+
+	ExecScanReScan((ScanState *) node);
+}
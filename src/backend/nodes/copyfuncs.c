@@ -641,6 +641,8 @@ _copyTuplestoreScan(const TuplestoreScan *from)
 	CopyScanFields((const Scan *) from, (Scan *) newnode);
 	COPY_SCALAR_FIELD(store);
 	COPY_SCALAR_FIELD(desc);
+	COPY_SCALAR_FIELD(tuples);
+	COPY_SCALAR_FIELD(ntuples);
 
 	return newnode;
 }
@@ -2739,6 +2741,8 @@ _copyQuery(const Query *from)
 	COPY_SCALAR_FIELD(isCombine);
 	COPY_SCALAR_FIELD(isCombineLookup);
 	COPY_SCALAR_FIELD(swStepFactor);
+	COPY_SCALAR_FIELD(deltaStorage);
+	COPY_SCALAR_FIELD(ttlPartition);
 
 	return newnode;
 }
@@ -2812,6 +2816,7 @@ _copySelectStmt(const SelectStmt *from)
 	COPY_NODE_FIELD(rarg);
 	COPY_SCALAR_FIELD(forContinuousView);
 	COPY_SCALAR_FIELD(swStepFactor);
+	COPY_SCALAR_FIELD(deltaStorage);
 
 	return newnode;
 }
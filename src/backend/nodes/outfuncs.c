@@ -2219,6 +2219,7 @@ _outSelectStmt(StringInfo str, const SelectStmt *node)
 	WRITE_BOOL_FIELD(all);
 	WRITE_BOOL_FIELD(forContinuousView);
 	WRITE_FLOAT_FIELD(swStepFactor, "%.2f");
+	WRITE_BOOL_FIELD(deltaStorage);
 	WRITE_NODE_FIELD(larg);
 	WRITE_NODE_FIELD(rarg);
 }
@@ -2416,6 +2417,8 @@ _outQuery(StringInfo str, const Query *node)
 	WRITE_BOOL_FIELD(isCombine);
 	WRITE_BOOL_FIELD(isCombineLookup);
 	WRITE_FLOAT_FIELD(swStepFactor, "%.2f");
+	WRITE_BOOL_FIELD(deltaStorage);
+	WRITE_INT_FIELD(ttlPartition);
 }
 
 static void
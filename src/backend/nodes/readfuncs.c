@@ -233,6 +233,8 @@ _readQuery(void)
 	READ_BOOL_FIELD(isCombine);
 	READ_BOOL_FIELD(isCombineLookup);
 	READ_INT_FIELD(swStepFactor);
+	READ_BOOL_FIELD(deltaStorage);
+	READ_INT_FIELD(ttlPartition);
 
 	READ_DONE();
 }
@@ -17,15 +17,19 @@
 #include <math.h>
 
 #include "executor/executor.h"
+#include "executor/nodeHash.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "foreign/fdwapi.h"
 #include "nodes/relation.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "parser/parsetree.h"
+#include "pipeline/executor.h"
 #include "pipeline/planner.h"
+#include "pipeline/scheduler.h"
 #include "utils/rel.h"
 
 /* Hook for plugins to get control in add_paths_to_joinrel() */
@@ -72,6 +76,137 @@ try_stream_index_join_path(PlannerInfo *root,
 						List *restrict_clauses,
 						JoinPathExtraData *extra);
 
+/*
+ * stream_hashclauses
+ *
+ * Returns the clauses that a hash join of the given stream-table join could hash on
+ */
+static List *
+stream_hashclauses(List *restrictlist, JoinType jointype, RelOptInfo *outerrel, RelOptInfo *innerrel)
+{
+	List *hashclauses = NIL;
+	ListCell *lc;
+
+	foreach(lc, restrictlist)
+	{
+		RestrictInfo *restrictinfo = (RestrictInfo *) lfirst(lc);
+
+		/*
+		 * If processing an outer join, only use its own join clauses for
+		 * hashing.  For inner joins we need not be so picky.
+		 */
+		if (IS_OUTER_JOIN(jointype) && restrictinfo->is_pushed_down)
+			continue;
+
+		if (!restrictinfo->can_join ||
+			restrictinfo->hashjoinoperator == InvalidOid)
+			continue;			/* not hashjoinable */
+
+		/*
+		 * Check if clause has the form "outer op inner" or "inner op outer".
+		 */
+		if (!clause_sides_match_join(restrictinfo, outerrel, innerrel))
+			continue;			/* no good for these input relations */
+
+		hashclauses = lappend(hashclauses, restrictinfo);
+	}
+
+	return hashclauses;
+}
+
+/*
+ * cached_join_path
+ *
+ * If the given table can be the hashed side of a stream-table join whose hash table workers keep
+ * across batches, returns the path to hash it with. It must be a plain sequential scan, and the
+ * whole table must fit in a single in-memory hash table within what's left of this process's
+ * join cache budget.
+ */
+static Path *
+cached_join_path(PlannerInfo *root, RelOptInfo *rel)
+{
+	RangeTblEntry *rte;
+	ListCell *lc;
+	int available = ContPlanJoinCacheAvailable();
+	int nbuckets;
+	int nbatches;
+	int nskew;
+
+	if (!ContPlanCanCacheJoins() || available <= 0)
+		return NULL;
+
+	if (rel->reloptkind != RELOPT_BASEREL || rel->rtekind != RTE_RELATION)
+		return NULL;
+
+	rte = planner_rt_fetch(rel->relid, root);
+	if (rte->relkind != RELKIND_RELATION)
+		return NULL;
+
+	foreach(lc, rel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+		if (contain_volatile_functions((Node *) rinfo->clause))
+			return NULL;
+	}
+
+	ExecChooseHashTableSize(rel->rows, rel->width, false, available,
+			&nbuckets, &nbatches, &nskew);
+
+	if (nbatches > 1)
+		return NULL;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path *path = (Path *) lfirst(lc);
+
+		if (path->pathtype == T_SeqScan && path->param_info == NULL)
+			return path;
+	}
+
+	return NULL;
+}
+
+/*
+ * add_cached_join_path
+ *
+ * Adds a hash join path for a stream-table join whose table side workers can hash once and keep
+ * across batches. Reading and hashing the table is then only paid for when it changes, so that
+ * part of the cost is left out when comparing the path to ones that read the table every batch.
+ */
+static void
+add_cached_join_path(PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *outerrel,
+		RelOptInfo *innerrel, JoinType jointype, JoinPathExtraData *extra)
+{
+	Path *innerpath;
+	List *hashclauses;
+	HashPath *path;
+	Cost build_cost;
+
+	if (jointype != JOIN_INNER)
+		return;
+
+	innerpath = cached_join_path(root, innerrel);
+	if (innerpath == NULL)
+		return;
+
+	hashclauses = stream_hashclauses(extra->restrictlist, jointype, outerrel, innerrel);
+	if (hashclauses == NIL)
+		return;
+
+	path = create_stream_hashjoin_path(root, joinrel, jointype,
+			outerrel->cheapest_total_path, innerpath, NULL, hashclauses, extra);
+
+	/* see initial_cost_hashjoin */
+	build_cost = innerpath->total_cost +
+		(cpu_operator_cost * list_length(hashclauses) + cpu_tuple_cost) * innerpath->rows;
+	path->jpath.path.startup_cost = Max(path->jpath.path.startup_cost - build_cost, 0);
+	path->jpath.path.total_cost = Max(path->jpath.path.total_cost - build_cost,
+			path->jpath.path.startup_cost);
+
+	add_path(joinrel, (Path *) path);
+}
+
 static void
 physical_group_lookup(PlannerInfo *root,
 					RelOptInfo *joinrel,
@@ -184,35 +319,12 @@ add_paths_to_joinrel(PlannerInfo *root,
 		Path *outerpath = outerrel->cheapest_total_path;
 		Path *innerpath = innerrel->cheapest_total_path;
 		Relids requiredouter = NULL;
-		ListCell *lc;
-		List *hashclauses = NIL;
+		List *hashclauses;
 
 		if (outerrel->rtekind == RTE_RELATION)
 		 requiredouter = calc_non_nestloop_required_outer(outerpath, innerpath);
 
-		foreach(lc, restrictlist)
-		{
-			RestrictInfo *restrictinfo = (RestrictInfo *) lfirst(lc);
-
-			/*
-			 * If processing an outer join, only use its own join clauses for
-			 * hashing.  For inner joins we need not be so picky.
-			 */
-			if (IS_OUTER_JOIN(jointype) && restrictinfo->is_pushed_down)
-				continue;
-
-			if (!restrictinfo->can_join ||
-				restrictinfo->hashjoinoperator == InvalidOid)
-				continue;			/* not hashjoinable */
-
-			/*
-			 * Check if clause has the form "outer op inner" or "inner op outer".
-			 */
-			if (!clause_sides_match_join(restrictinfo, outerrel, innerrel))
-				continue;			/* no good for these input relations */
-
-			hashclauses = lappend(hashclauses, restrictinfo);
-		}
+		hashclauses = stream_hashclauses(restrictlist, jointype, outerrel, innerrel);
 
 		path = create_stream_hashjoin_path(root, joinrel, jointype,
 				outerpath, innerpath, requiredouter, hashclauses, &extra);
@@ -225,7 +337,8 @@ add_paths_to_joinrel(PlannerInfo *root,
 
 	/*
 	 * If this is a stream-table join and the stream is the outer relation, then we should
-	 * only consider a nested loop join with the stream on the outside.
+	 * only consider a nested loop join with the stream on the outside, or a hash join of
+	 * the table if workers can keep its hash table across batches.
 	 */
 	if (IS_STREAM_RTE(outerrel->relid, root))
 	{
@@ -253,6 +366,7 @@ add_paths_to_joinrel(PlannerInfo *root,
 		/* Set the cheapest path, only if we actually added any paths. */
 		if (joinrel->pathlist)
 		{
+			add_cached_join_path(root, joinrel, outerrel, innerrel, jointype, &extra);
 			set_cheapest(joinrel);
 			return;
 		}
@@ -391,6 +505,9 @@ add_paths_to_joinrel(PlannerInfo *root,
 												 outerrel, innerrel,
 												 jointype, &extra);
 
+	if (IS_STREAM_RTE(outerrel->relid, root))
+		add_cached_join_path(root, joinrel, outerrel, innerrel, jointype, &extra);
+
 	/*
 	 * 6. Finally, give extensions a chance to manipulate the path list.
 	 */
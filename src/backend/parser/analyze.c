@@ -126,6 +126,7 @@ parse_analyze(Node *parseTree, const char *sourceText,
 		query->isContinuous = stmt->forContinuousView;
 		query->isCombineLookup = stmt->forCombineLookup;
 		query->swStepFactor = stmt->swStepFactor;
+		query->deltaStorage = stmt->deltaStorage;
 	}
 
 	if (post_parse_analyze_hook)
@@ -26,6 +26,7 @@
 #include "catalog/pipeline_query.h"
 #include "catalog/pipeline_query_fn.h"
 #include "catalog/pipeline_stream_fn.h"
+#include "commands/defrem.h"
 #include "commands/pipelinecmds.h"
 #include "executor/executor.h"
 #include "lib/stringinfo.h"
@@ -973,6 +974,29 @@ ValidateParsedContQuery(RangeVar *name, Node *node, const char *sql)
 				parser_errposition(context->pstate, rv->location)));
 	}
 
+	/*
+	 * Combiners of views with delta storage never see a group's full old and new values, so their
+	 * output streams are never written to and nothing may read from them
+	 */
+	if (list_length(context->streams) == 1)
+	{
+		RangeVar *rv = (RangeVar *) linitial(context->streams);
+		Oid relid = RangeVarGetRelid(rv, NoLock, true);
+		Oid cqid;
+
+		if (OidIsValid(relid) && RelIdIsForOutputStream(relid, &cqid))
+		{
+			ContQuery *cq = GetContQueryForId(cqid);
+
+			if (cq && cq->delta_storage)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("continuous queries can't read from the output stream of a continuous view with \"%s\" storage",
+								STORAGE_DELTA),
+						parser_errposition(context->pstate, rv->location)));
+		}
+	}
+
 	/*
 	 * Ensure that we have no `*` in the target list.
 	 *
@@ -2225,8 +2249,9 @@ TransformSelectStmtForContProcess(RangeVar *mat_relation, SelectStmt *stmt, Sele
 
 	/*
 	 * The view combines for WINDOWs or if there is a grouping/aggregation on a sliding window.
+	 * Delta storage keeps multiple rows per group in the matrel, so its view must always combine.
 	 */
-	context->view_combines = (context->is_sw &&
+	context->view_combines = ((context->is_sw || stmt->deltaStorage) &&
 			(list_length(context->funcs) || list_length(stmt->groupClause)));
 
 	if (context->is_sw)
@@ -3982,6 +4007,39 @@ ApplyStorageOptions(CreateContViewStmt *stmt, bool *has_sw, int *ttl, char **ttl
 	{
 		select->swStepFactor = sliding_window_step_factor;
 	}
+
+	/* storage */
+	select->deltaStorage = false;
+	def = GetContinuousViewOption(stmt->into->options, OPTION_STORAGE);
+	if (def)
+	{
+		char *storage = defGetString(def);
+
+		if (pg_strcasecmp(storage, STORAGE_DELTA) == 0)
+		{
+			ContAnalyzeContext *context = MakeContAnalyzeContext(NULL, select, Worker);
+
+			collect_agg_funcs((Node *) select->targetList, context);
+
+			if (has_clock_timestamp(select->whereClause, NULL))
+				elog(ERROR, "\"storage\" cannot be \"%s\" for sliding window queries", STORAGE_DELTA);
+			if (select->distinctClause || !list_length(context->funcs))
+				elog(ERROR, "\"storage\" can only be \"%s\" for aggregate queries without DISTINCT", STORAGE_DELTA);
+			if (GetContinuousViewOption(stmt->into->options, OPTION_PK))
+				elog(ERROR, "\"pk\" cannot be specified in conjunction with \"%s\" storage", STORAGE_DELTA);
+
+			/* Such views have no output stream values, see ValidateParsedContQuery */
+
+			select->deltaStorage = true;
+		}
+		else if (pg_strcasecmp(storage, STORAGE_HEAP) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("\"storage\" must be either \"%s\" or \"%s\"", STORAGE_HEAP, STORAGE_DELTA),
+					 errhint("For example, ... WITH (storage = '%s') ...", STORAGE_DELTA)));
+
+		stmt->into->options = list_delete(stmt->into->options, def);
+	}
 }
 
 AttrNumber
@@ -11,8 +11,10 @@
  */
 #include <limits.h>
 #include <math.h>
+
 #include "pipeline/cmsketch.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/simd.h"
 #include "utils/elog.h"
 #include "utils/palloc.h"
 
@@ -24,10 +26,29 @@
 #define DEFAULT_EPS 0.002
 #define MURMUR_SEED 0x99496f1ddc863e6fL
 
+/*
+ * Finding a counter within a row of a sketch with a power of two width is a mask rather
+ * than a division. Widths derived from an error bound aren't rounded up to one, since
+ * sketches can only be merged with sketches of the same width and existing sketches
+ * have to keep merging with new ones.
+ */
+#define IS_POW2(w) (((w) & ((w) - 1)) == 0)
+#define COUNTER_IDX(cms, h) (IS_POW2((cms)->w) ? ((h) & ((cms)->w - 1)) : ((h) % (cms)->w))
+
+/*
+ * Even for p as close to 1 as a float8 can be, d = ceil(log(1 / (1 - p))) is at most 37
+ */
+#define MAX_DEPTH 64
+
 CountMinSketch *
 CountMinSketchCreateWithDAndW(uint32_t d, uint32_t w)
 {
-	CountMinSketch *cms = palloc0(sizeof(CountMinSketch) + (sizeof(uint32_t) * d * w));
+	CountMinSketch *cms;
+
+	if (d > MAX_DEPTH)
+		elog(ERROR, "count-min sketch depth can't be more than %d", MAX_DEPTH);
+
+	cms = palloc0(sizeof(CountMinSketch) + (sizeof(uint32_t) * d * w));
 	cms->d = d;
 	cms->w = w;
 
@@ -65,8 +86,29 @@ CountMinSketchCopy(CountMinSketch *cms)
 	return (CountMinSketch *) new;
 }
 
-void
-CountMinSketchAdd(CountMinSketch *cms, void *key, Size size, uint32_t count)
+/*
+ * get_counters
+ *
+ * Sets idx to the position of the given hash's counter in each row, and returns the
+ * minimum of those counters
+ */
+static inline uint32_t
+get_counters(CountMinSketch *cms, uint64_t *hash, uint32_t *idx)
+{
+	uint32_t min = UINT_MAX;
+	uint32_t i;
+
+	for (i = 0; i < cms->d; i++)
+	{
+		idx[i] = i * cms->w + COUNTER_IDX(cms, hash[0] + (i * hash[1]));
+		min = Min(min, cms->table[idx[i]]);
+	}
+
+	return min;
+}
+
+static inline void
+add_hash(CountMinSketch *cms, uint64_t *hash, uint32_t count)
 {
 	/*
 	 * Since we only have positive increments, we're using the conservative update
@@ -74,46 +116,34 @@ CountMinSketchAdd(CountMinSketch *cms, void *key, Size size, uint32_t count)
 	 *
 	 * http://dimacs.rutgers.edu/~graham/pubs/papers/cmencyc.pdf
 	 */
-	uint32_t min = UINT_MAX;
+	uint32_t idx[MAX_DEPTH];
+	uint32_t min = get_counters(cms, hash, idx);
 	uint32_t i;
-	uint64_t hash[2];
-
-	MurmurHash3_128(key, size, MURMUR_SEED, &hash);
 
 	for (i = 0; i < cms->d; i++)
-	{
-		uint32_t start = i * cms->w;
-		uint32_t j = (hash[0] + (i * hash[1])) % cms->w;
-		min = Min(min, cms->table[start + j]);
-	}
-
-	for (i = 0; i < cms->d; i++)
-	{
-		uint32_t start = i * cms->w;
-		uint32_t j = (hash[0] + (i * hash[1])) % cms->w;
-		cms->table[start + j] = Max(cms->table[start + j], min + count);
-	}
+		cms->table[idx[i]] = Max(cms->table[idx[i]], min + count);
 
 	cms->count += count;
 }
 
+void
+CountMinSketchAdd(CountMinSketch *cms, void *key, Size size, uint32_t count)
+{
+	uint64_t hash[2];
+
+	MurmurHash3_128(key, size, MURMUR_SEED, &hash);
+	add_hash(cms, hash, count);
+}
+
 uint32_t
 CountMinSketchEstimateFrequency(CountMinSketch *cms, void *key, Size size)
 {
-	uint32_t count = UINT_MAX;
-	uint32_t i;
 	uint64_t hash[2];
+	uint32_t idx[MAX_DEPTH];
 
 	MurmurHash3_128(key, size, MURMUR_SEED, &hash);
 
-	for (i = 0; i < cms->d; i++)
-	{
-		uint32_t start = i * cms->w;
-		uint32_t j = (hash[0] + (i * hash[1])) % cms->w;
-		count = Min(count, cms->table[start + j]);
-	}
-
-	return count;
+	return get_counters(cms, hash, idx);
 }
 
 uint64_t
@@ -128,16 +158,93 @@ CountMinSketchEstimateNormFrequency(CountMinSketch *cms, void *key, Size size)
 	return 1.0 * CountMinSketchEstimateFrequency(cms, key, size) / cms->count;
 }
 
-CountMinSketch *
-CountMinSketchMerge(CountMinSketch *result, CountMinSketch* incoming)
+/*
+ * Merging adds counters with saturation, so counters that would overflow stay at UINT_MAX
+ * rather than wrapping around to small counts. a + min(b, ~a) is a saturating add, since
+ * ~a is the headroom left in a.
+ */
+static void
+saturating_add_scalar(uint32_t *a, uint32_t *b, uint32_t n)
 {
 	uint32_t i;
 
+	for (i = 0; i < n; i++)
+		a[i] += Min(b[i], ~a[i]);
+}
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+
+static void
+saturating_add_sse2(uint32_t *a, uint32_t *b, uint32_t n)
+{
+	/* SSE2 has no unsigned 32-bit compare, so flip the sign bits and compare signed */
+	__m128i sign = _mm_set1_epi32(0x80000000);
+	uint32_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i va = _mm_loadu_si128((__m128i *) (a + i));
+		__m128i vb = _mm_loadu_si128((__m128i *) (b + i));
+		__m128i sum = _mm_add_epi32(va, vb);
+		__m128i overflow = _mm_cmpgt_epi32(_mm_xor_si128(va, sign), _mm_xor_si128(sum, sign));
+
+		_mm_storeu_si128((__m128i *) (a + i), _mm_or_si128(sum, overflow));
+	}
+
+	saturating_add_scalar(a + i, b + i, n - i);
+}
+
+pg_attribute_avx2
+static void
+saturating_add_avx2(uint32_t *a, uint32_t *b, uint32_t n)
+{
+	__m256i ones = _mm256_set1_epi32(-1);
+	uint32_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i va = _mm256_loadu_si256((__m256i *) (a + i));
+		__m256i vb = _mm256_loadu_si256((__m256i *) (b + i));
+		__m256i headroom = _mm256_xor_si256(va, ones);
+
+		_mm256_storeu_si256((__m256i *) (a + i), _mm256_add_epi32(va, _mm256_min_epu32(vb, headroom)));
+	}
+
+	saturating_add_scalar(a + i, b + i, n - i);
+}
+
+#endif
+
+static void saturating_add_choose(uint32_t *a, uint32_t *b, uint32_t n);
+
+static void (*saturating_add) (uint32_t *a, uint32_t *b, uint32_t n) = saturating_add_choose;
+
+/*
+ * This gets called on the first call. It replaces the function pointer so that subsequent
+ * calls are routed directly to the best available implementation.
+ */
+static void
+saturating_add_choose(uint32_t *a, uint32_t *b, uint32_t n)
+{
+	saturating_add = saturating_add_scalar;
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+	if (pg_avx2_available())
+		saturating_add = saturating_add_avx2;
+	else
+		saturating_add = saturating_add_sse2;
+#endif
+
+	saturating_add(a, b, n);
+}
+
+CountMinSketch *
+CountMinSketchMerge(CountMinSketch *result, CountMinSketch* incoming)
+{
 	if (result->d != incoming->d || result->w != incoming->w)
 		elog(ERROR, "cannot merge count-min sketches of different sizes");
 
-	for (i = 0; i < result->d * result->w; i++)
-		result->table[i] += incoming->table[i];
+	saturating_add(result->table, incoming->table, result->d * result->w);
 
 	result->count += incoming->count;
 
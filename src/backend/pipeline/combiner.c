@@ -35,12 +35,14 @@
 #include "pgstat.h"
 #include "pipeline/combiner_receiver.h"
 #include "pipeline/analyzer.h"
+#include "pipeline/ipc/microbatch.h"
 #include "pipeline/planner.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/matrel.h"
 #include "pipeline/miscutils.h"
 #include "pipeline/stream.h"
 #include "pipeline/stream_fdw.h"
+#include "storage/bufmgr.h"
 #include "storage/ipc.h"
 #include "tcop/dest.h"
 #include "tcop/pquery.h"
@@ -60,6 +62,7 @@
 #include "utils/timestamp.h"
 
 #define GROUPS_PLAN_LIFESPAN (10 * 1000)
+#define MAX_MULTI_INSERT_TUPLES 1000
 #define MURMUR_SEED 0x155517D2
 
 #define SHOULD_UPDATE(state) ((state)->base.query->cvdef->distinctClause == NIL)
@@ -86,6 +89,21 @@ typedef struct
 	MemoryContext context;
 	TimestampTz last_tick;
 	TimestampTz last_matrel_sync;
+
+	/*
+	 * Closed, fully in-window blocks of block_panes consecutive step tuples are combined into
+	 * a single tuple per group, so that ticking only needs to run the overlay plan over those and
+	 * the step tuples at the edges of the window. block_panes is 0 if the window is too short
+	 * for that to be worth it.
+	 */
+	int block_panes;
+	int num_stale_blocks;
+	TupleHashTable blocks;
+	TupleTableSlot *block_slot;
+	PlannedStmt *block_plan;
+	Tuplestorestate *block_input;
+	DestReceiver *block_dest;
+	Tuplestorestate *block_output;
 } SWOutputState;
 
 typedef struct
@@ -94,10 +112,56 @@ typedef struct
 	TimestampTz last_touched;
 } OverlayTupleEntry;
 
+typedef struct
+{
+	HeapTupleEntryData base;
+	/* is this step tuple included in its block's combined tuple? */
+	bool in_block;
+} SWStepEntry;
+
+typedef struct
+{
+	HeapTupleEntryData base;
+	/* has one of this block's step tuples changed since it was combined? */
+	bool stale;
+} SWBlockEntry;
+
+/*
+ * Bounded cache of the matrel tuples most recently written by this combiner, keyed by group hash.
+ * Cached tuples are used instead of looking groups up in the matrel, as long as their physical
+ * tuple is still the live version that we wrote. Entries are evicted using the CLOCK algorithm.
+ */
+typedef struct GroupCacheEntry
+{
+	int64 hash; /* hash key */
+	HeapTuple tuple;
+	int clock_pos;
+	bool referenced;
+} GroupCacheEntry;
+
+typedef struct GroupCache
+{
+	MemoryContext cxt;
+	HTAB *htab;
+	GroupCacheEntry **clock;
+	int clock_size;
+	int clock_used;
+	int hand;
+	Size size;
+	Size max_size;
+	Oid relfilenode;
+} GroupCache;
+
+#define GROUP_CACHE_ENTRY_SIZE(tup) (sizeof(GroupCacheEntry) + HEAPTUPLESIZE + (tup)->t_len)
+
 typedef struct
 {
 	ContQueryState base;
 	PlannedStmt *combine_plan;
+	/* if combine_plan can be reused, it's initialized once and kept across batches */
+	bool reuse_combine_plan;
+	ContPlanState *combine_planstate;
+	TuplestoreScan *batch_scan;
 	PlannedStmt *groups_plan;
 	TimestampTz last_groups_plan;
 	TupleDesc desc;
@@ -111,6 +175,13 @@ typedef struct
 	TupleTableSlot *os_slot;
 	bool isagg;
 	int ngroupatts;
+
+	/*
+	 * Combiner that merges and syncs partial results of an ungrouped aggregate, which may be spread
+	 * across all combiners when continuous_query_parallel_combine is on
+	 */
+	int owner_id;
+	uint64 name_hash;
 	AttrNumber *groupatts;
 	FmgrInfo *eq_funcs;
 	FmgrInfo *hash_funcs;
@@ -118,11 +189,19 @@ typedef struct
 	FuncExpr *hashfunc;
 	TupleHashTable existing;
 	TupleHashTable deltas;
+	GroupCache *group_cache;
 	long pending_tuples;
 
 	/* Stores the hashes of the current batch, in parallel to the order of the batch's tuplestore */
 	int64 *group_hashes;
 	int group_hashes_len;
+
+	/*
+	 * Tuples read from the current microbatch, referenced in place and scanned by the combine
+	 * plan before the batch tuplestore
+	 */
+	HeapTuple *batch_tups;
+	int batch_tups_len;
 	AttrNumber pk;
 	bool seq_pk;
 	FunctionCallInfo hash_fcinfo;
@@ -165,6 +244,7 @@ prepare_combine_plan(ContQueryCombinerState *state, PlannedStmt *plan)
 	scan->desc = CreateTupleDescCopy(RelationGetDescr(rel));
 
 	state->combine_plan = plan;
+	state->batch_scan = scan;
 	state->desc = scan->desc;
 
 	heap_close(rel, AccessShareLock);
@@ -398,6 +478,294 @@ hash_groups(ContQueryCombinerState *state)
 	return groups;
 }
 
+/*
+ * group_cache_new
+ */
+static GroupCache *
+group_cache_new(ContQueryCombinerState *state)
+{
+	HASHCTL ctl;
+	GroupCache *cache;
+	MemoryContext cxt = AllocSetContextCreate(state->base.state_cxt, "CombinerGroupCacheCxt",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+
+	cache = MemoryContextAllocZero(cxt, sizeof(GroupCache));
+	cache->cxt = cxt;
+	cache->max_size = continuous_query_combiner_work_mem * 1024L;
+	cache->clock_size = 1024;
+	cache->clock = MemoryContextAllocZero(cxt, cache->clock_size * sizeof(GroupCacheEntry *));
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(int64);
+	ctl.entrysize = sizeof(GroupCacheEntry);
+	ctl.hcxt = cxt;
+	ctl.hash = tag_hash;
+	cache->htab = hash_create("CombinerGroupCache", 1024, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	return cache;
+}
+
+/*
+ * group_cache_remove
+ */
+static void
+group_cache_remove(GroupCache *cache, GroupCacheEntry *entry)
+{
+	bool found;
+
+	cache->size -= GROUP_CACHE_ENTRY_SIZE(entry->tuple);
+	cache->clock[entry->clock_pos] = NULL;
+	heap_freetuple(entry->tuple);
+
+	hash_search(cache->htab, &entry->hash, HASH_REMOVE, &found);
+	Assert(found);
+}
+
+/*
+ * group_cache_reset
+ *
+ * Removes all entries, used when the matrel's physical storage has changed (TRUNCATE, VACUUM FULL, etc.)
+ */
+static void
+group_cache_reset(GroupCache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->clock_used; i++)
+	{
+		if (cache->clock[i])
+			group_cache_remove(cache, cache->clock[i]);
+	}
+
+	cache->clock_used = 0;
+	cache->hand = 0;
+	Assert(cache->size == 0);
+}
+
+/*
+ * group_cache_check_rel
+ *
+ * Cached tuple locations are meaningless once the matrel has been rewritten, so reset the cache if
+ * the matrel's physical storage has changed since we last saw it
+ */
+static void
+group_cache_check_rel(GroupCache *cache, Relation matrel)
+{
+	if (cache->relfilenode == matrel->rd_node.relNode)
+		return;
+
+	group_cache_reset(cache);
+	cache->relfilenode = matrel->rd_node.relNode;
+}
+
+/*
+ * group_cache_get_slot
+ *
+ * Returns a free clock position, evicting entries until there is room for an entry of the given size
+ */
+static int
+group_cache_get_slot(GroupCache *cache, Size size)
+{
+	int pos = -1;
+
+	while (cache->size + size > cache->max_size && cache->size > 0)
+	{
+		GroupCacheEntry *entry = cache->clock[cache->hand];
+
+		if (entry && entry->referenced)
+		{
+			entry->referenced = false;
+		}
+		else if (entry)
+		{
+			pos = cache->hand;
+			group_cache_remove(cache, entry);
+		}
+
+		cache->hand = (cache->hand + 1) % cache->clock_used;
+	}
+
+	if (pos >= 0)
+		return pos;
+
+	if (cache->clock_used == cache->clock_size)
+	{
+		int i;
+
+		/* Reuse a position freed by a removed entry before growing */
+		for (i = 0; i < cache->clock_used; i++)
+		{
+			if (cache->clock[i] == NULL)
+				return i;
+		}
+
+		cache->clock_size *= 2;
+		cache->clock = repalloc(cache->clock, cache->clock_size * sizeof(GroupCacheEntry *));
+		MemSet(cache->clock + cache->clock_used, 0, (cache->clock_size - cache->clock_used) * sizeof(GroupCacheEntry *));
+	}
+
+	return cache->clock_used++;
+}
+
+/*
+ * group_cache_put
+ *
+ * Caches a matrel tuple that was just written for the given group
+ */
+static void
+group_cache_put(GroupCache *cache, int64 hash, HeapTuple tup)
+{
+	GroupCacheEntry *entry;
+	MemoryContext old;
+	bool found;
+	Size size = GROUP_CACHE_ENTRY_SIZE(tup);
+
+	entry = (GroupCacheEntry *) hash_search(cache->htab, &hash, HASH_FIND, NULL);
+	if (entry)
+		group_cache_remove(cache, entry);
+
+	if (size > cache->max_size)
+		return;
+
+	old = MemoryContextSwitchTo(cache->cxt);
+
+	entry = (GroupCacheEntry *) hash_search(cache->htab, &hash, HASH_ENTER, &found);
+	Assert(!found);
+
+	entry->tuple = heap_copytuple(tup);
+	entry->referenced = false;
+	entry->clock_pos = group_cache_get_slot(cache, size);
+	cache->clock[entry->clock_pos] = entry;
+	cache->size += size;
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * lock_cached_group
+ *
+ * Locks the physical matrel tuple for the given cache entry, and verifies that it is still the
+ * version we cached. If the group has been updated, deleted or vacuumed away by anyone else,
+ * the entry is useless and false is returned.
+ */
+static bool
+lock_cached_group(Relation matrel, GroupCacheEntry *entry)
+{
+	HeapTupleData tup;
+	Buffer buffer;
+	HeapUpdateFailureData hufd;
+	HTSU_Result res;
+	Relation rel = matrel;
+	bool valid;
+
+	/* The group may live in a TTL partition, which may have been dropped since we cached it */
+	if (entry->tuple->t_tableOid != RelationGetRelid(matrel))
+	{
+		rel = try_relation_open(entry->tuple->t_tableOid, RowShareLock);
+		if (rel == NULL)
+			return false;
+	}
+
+	tup.t_self = entry->tuple->t_self;
+	valid = heap_fetch(rel, GetActiveSnapshot(), &tup, &buffer, false, NULL);
+
+	if (valid)
+	{
+		valid = HeapTupleHeaderGetRawXmin(tup.t_data) == HeapTupleHeaderGetRawXmin(entry->tuple->t_data);
+		ReleaseBuffer(buffer);
+	}
+
+	if (valid)
+	{
+		res = heap_lock_tuple(rel, &tup, GetCurrentCommandId(true),
+				LockTupleExclusive, LockWaitBlock, true, &buffer, &hufd);
+		ReleaseBuffer(buffer);
+		valid = res == HeapTupleMayBeUpdated;
+	}
+
+	if (rel != matrel)
+		relation_close(rel, NoLock);
+
+	return valid;
+}
+
+/*
+ * load_cached_groups
+ *
+ * Adds any of the batch's groups that are in the group cache to the existing groups, so that they don't
+ * need to be looked up in the matrel. Returns the number of groups that were loaded.
+ */
+static int
+load_cached_groups(ContQueryCombinerState *state)
+{
+	GroupCache *cache = state->group_cache;
+	TupleHashTable existing = state->existing;
+	TupleTableSlot *slot = state->slot;
+	Relation matrel;
+	int pos = 0;
+	int loaded = 0;
+
+	if (!cache || !hash_get_num_entries(cache->htab))
+		return 0;
+
+	matrel = heap_openrv(state->base.query->matrel, RowShareLock);
+
+	group_cache_check_rel(cache, matrel);
+	if (!hash_get_num_entries(cache->htab))
+	{
+		heap_close(matrel, NoLock);
+		return 0;
+	}
+
+	foreach_tuple(slot, state->batch)
+	{
+		GroupCacheEntry *entry;
+		HeapTupleEntry existing_entry;
+		MemoryContext old;
+		int64 hash = state->ngroupatts ? state->group_hashes[pos] : 0;
+		bool isnew;
+
+		pos++;
+
+		if (LookupTupleHashEntry(existing, slot, NULL))
+			continue;
+
+		entry = (GroupCacheEntry *) hash_search(cache->htab, &hash, HASH_FIND, NULL);
+		if (!entry)
+			continue;
+
+		/* Group hashes may collide, so make sure this is really the same group */
+		ExecStoreTuple(entry->tuple, state->prev_slot, InvalidBuffer, false);
+		if (state->ngroupatts && !execTuplesMatch(slot, state->prev_slot, state->ngroupatts,
+					state->groupatts, state->eq_funcs, existing->tempcxt))
+			continue;
+
+		if (!lock_cached_group(matrel, entry))
+		{
+			group_cache_remove(cache, entry);
+			continue;
+		}
+
+		entry->referenced = true;
+
+		old = MemoryContextSwitchTo(existing->tablecxt);
+		existing_entry = (HeapTupleEntry) LookupTupleHashEntry(existing, state->prev_slot, &isnew);
+		existing_entry->tuple = heap_copytuple(entry->tuple);
+		existing_entry->flags = 0;
+		MemoryContextSwitchTo(old);
+
+		loaded++;
+	}
+
+	tuplestore_rescan(state->batch);
+	ExecClearTuple(state->prev_slot);
+	heap_close(matrel, NoLock);
+
+	return loaded;
+}
+
 /*
  * select_existing_groups
  *
@@ -423,6 +791,7 @@ select_existing_groups(ContQueryCombinerState *state)
 	{
 		Assert(state->existing);
 
+		load_cached_groups(state);
 		values = get_values(state);
 
 		/*
@@ -440,6 +809,9 @@ select_existing_groups(ContQueryCombinerState *state)
 		 */
 		if (hash_get_num_entries(state->existing->hashtab))
 			return;
+
+		if (load_cached_groups(state))
+			goto finish;
 	}
 
 	matrel = heap_openrv(state->base.query->matrel, RowShareLock);
@@ -765,6 +1137,228 @@ compare_slots(TupleTableSlot *lslot, TupleTableSlot *rslot,
 	return num_changed;
 }
 
+/*
+ * get_sw_block_start
+ *
+ * Returns the start of the block that the step tuple with the given timestamp belongs to
+ */
+static TimestampTz
+get_sw_block_start(ContQueryCombinerState *state, TimestampTz ts)
+{
+	int64 width = (int64) state->sw->block_panes * state->base.query->sw_step_ms * 1000;
+	int64 block = ts / width;
+
+	if (ts < 0 && ts % width)
+		block--;
+
+	return block * width;
+}
+
+/*
+ * get_sw_block_ts
+ *
+ * Returns the timestamp of the given block's combined tuple, which is that of its last step.
+ * The combined tuple must pass the overlay plan's window predicate for as long as the block is live.
+ */
+static TimestampTz
+get_sw_block_ts(ContQueryCombinerState *state, TimestampTz start)
+{
+	return start + (int64) (state->sw->block_panes - 1) * state->base.query->sw_step_ms * 1000;
+}
+
+/*
+ * sw_block_is_live
+ *
+ * A block can be represented by its combined tuple once no new steps can be added to it, and until
+ * its first step leaves the window
+ */
+static bool
+sw_block_is_live(ContQueryCombinerState *state, TimestampTz start, TimestampTz now)
+{
+	if ((now - start) / 1000 > state->base.query->sw_interval_ms)
+		return false;
+
+	return start < get_sw_block_start(state, now);
+}
+
+/*
+ * store_sw_block_key
+ *
+ * Stores a copy of the given step tuple with its step timestamp replaced by that of its block
+ */
+static TupleTableSlot *
+store_sw_block_key(ContQueryCombinerState *state, HeapTuple tup, TimestampTz start)
+{
+	int natts = state->desc->natts;
+	Datum *values = palloc0(sizeof(Datum) * natts);
+	bool *nulls = palloc0(sizeof(bool) * natts);
+	bool *replaces = palloc0(sizeof(bool) * natts);
+	HeapTuple key;
+
+	values[state->sw->arrival_ts_attr - 1] = TimestampTzGetDatum(get_sw_block_ts(state, start));
+	replaces[state->sw->arrival_ts_attr - 1] = true;
+
+	key = heap_modify_tuple(tup, state->desc, values, nulls, replaces);
+
+	pfree(values);
+	pfree(nulls);
+	pfree(replaces);
+
+	return ExecStoreTuple(key, state->sw->block_slot, InvalidBuffer, true);
+}
+
+/*
+ * invalidate_sw_block
+ *
+ * Called when a step tuple is added or changed, so that the combined tuple of its block
+ * is rebuilt the next time it's needed
+ */
+static void
+invalidate_sw_block(ContQueryCombinerState *state, HeapTuple tup)
+{
+	TimestampTz ts;
+	TimestampTz start;
+	SWBlockEntry *entry;
+	bool isnull;
+
+	if (!state->sw->block_panes)
+		return;
+
+	ExecStoreTuple(tup, state->sw->block_slot, InvalidBuffer, false);
+	ts = DatumGetTimestampTz(slot_getattr(state->sw->block_slot, state->sw->arrival_ts_attr, &isnull));
+	Assert(!isnull);
+
+	/* Most changes are to the current step, whose block hasn't been combined yet */
+	start = get_sw_block_start(state, ts);
+	if (start >= get_sw_block_start(state, GetCurrentTimestamp()))
+		return;
+
+	store_sw_block_key(state, tup, start);
+	entry = (SWBlockEntry *) LookupTupleHashEntry(state->sw->blocks, state->sw->block_slot, NULL);
+
+	if (entry && !entry->stale)
+	{
+		entry->stale = true;
+		state->sw->num_stale_blocks++;
+	}
+}
+
+/*
+ * sw_block_is_stale
+ */
+static bool
+sw_block_is_stale(ContQueryCombinerState *state, HeapTuple tup, TimestampTz start)
+{
+	SWBlockEntry *entry;
+
+	if (!state->sw->num_stale_blocks)
+		return false;
+
+	store_sw_block_key(state, tup, start);
+	entry = (SWBlockEntry *) LookupTupleHashEntry(state->sw->blocks, state->sw->block_slot, NULL);
+
+	return entry == NULL || entry->stale;
+}
+
+/*
+ * execute_sw_plan
+ *
+ * Execute one of the sliding-window plans, writing its output to the given tuplestore
+ */
+static void
+execute_sw_plan(PlannedStmt *pstmt, DestReceiver *dest, Tuplestorestate *output)
+{
+	QueryDesc *query_desc;
+	struct Plan *plan;
+
+	tuplestore_clear(output);
+	query_desc = CreateQueryDesc(pstmt, NULL, InvalidSnapshot, InvalidSnapshot, dest, NULL, 0);
+	query_desc->estate = CreateEState(query_desc);
+
+	plan = pstmt->planTree;
+	query_desc->planstate = ExecInitNode(plan, query_desc->estate, 0);
+	ExecutePlan(query_desc->estate, query_desc->planstate,
+			query_desc->operation,
+			true, 0, ForwardScanDirection, dest);
+	ExecEndNode(query_desc->planstate);
+
+	query_desc->planstate = NULL;
+	query_desc->estate = NULL;
+
+	tuplestore_rescan(output);
+}
+
+/*
+ * add_sw_blocks_to_overlay_input
+ *
+ * Combine the step tuples of any blocks that became live or stale, and add the combined tuples
+ * of all live blocks to the overlay plan's input. Blocks that are no longer live are removed,
+ * and the step tuples they still have in the window go to the overlay plan individually.
+ */
+static void
+add_sw_blocks_to_overlay_input(ContQueryCombinerState *state, TimestampTz now, int num_block_tuples)
+{
+	HASH_SEQ_STATUS seq;
+	SWBlockEntry *entry;
+	List *to_delete = NIL;
+	ListCell *lc;
+
+	if (num_block_tuples)
+	{
+		tuplestore_rescan(state->sw->block_input);
+		execute_sw_plan(state->sw->block_plan, state->sw->block_dest, state->sw->block_output);
+
+		foreach_tuple(state->sw->block_slot, state->sw->block_output)
+		{
+			bool isnew;
+			MemoryContext old;
+
+			entry = (SWBlockEntry *) LookupTupleHashEntry(state->sw->blocks, state->sw->block_slot, &isnew);
+			if (!isnew)
+				heap_freetuple(entry->base.tuple);
+
+			old = MemoryContextSwitchTo(state->sw->blocks->tablecxt);
+			entry->base.tuple = ExecCopySlotTuple(state->sw->block_slot);
+			MemoryContextSwitchTo(old);
+
+			entry->stale = false;
+		}
+
+		tuplestore_clear(state->sw->block_input);
+		tuplestore_clear(state->sw->block_output);
+	}
+
+	state->sw->num_stale_blocks = 0;
+
+	hash_seq_init(&seq, state->sw->blocks->hashtab);
+	while ((entry = (SWBlockEntry *) hash_seq_search(&seq)) != NULL)
+	{
+		TimestampTz ts;
+		bool isnull;
+
+		ExecStoreTuple(entry->base.tuple, state->sw->block_slot, InvalidBuffer, false);
+		ts = DatumGetTimestampTz(slot_getattr(state->sw->block_slot, state->sw->arrival_ts_attr, &isnull));
+		Assert(!isnull);
+
+		if (!sw_block_is_live(state, get_sw_block_start(state, ts), now))
+		{
+			to_delete = lappend(to_delete, entry->base.tuple);
+			continue;
+		}
+
+		tuplestore_puttuple(state->sw->overlay_input, entry->base.tuple);
+	}
+
+	foreach(lc, to_delete)
+	{
+		HeapTuple tup = (HeapTuple) lfirst(lc);
+
+		ExecStoreTuple(tup, state->sw->block_slot, InvalidBuffer, false);
+		RemoveTupleHashEntry(state->sw->blocks, state->sw->block_slot);
+		heap_freetuple(tup);
+	}
+}
+
 /*
  * add_matrel_tuples_to_overlay_input
  *
@@ -773,34 +1367,62 @@ compare_slots(TupleTableSlot *lslot, TupleTableSlot *rslot,
  * not have been modified by the most recent combine call, because their
  * corresponding values in the overlay output are dependent on the current
  * time.
+ *
+ * Step tuples belonging to live blocks are represented by their block's
+ * combined tuple instead, so for long windows the overlay plan's input only
+ * grows with the square root of the number of steps in the window.
  */
 static List *
 add_cached_sw_tuples_to_overlay_input(ContQueryCombinerState *state)
 {
 	HASH_SEQ_STATUS seq;
-	HeapTupleEntry matrel_entry;
+	SWStepEntry *matrel_entry;
 	List *to_delete = NIL;
+	TimestampTz now = GetCurrentTimestamp();
+	int num_block_tuples = 0;
 
 	hash_seq_init(&seq, state->sw->step_groups->hashtab);
-	while ((matrel_entry = (HeapTupleEntry) hash_seq_search(&seq)) != NULL)
+	while ((matrel_entry = (SWStepEntry *) hash_seq_search(&seq)) != NULL)
 	{
 		Datum d;
 		bool isnull;
 		TimestampTz ts;
 
-		ExecStoreTuple(matrel_entry->tuple, state->slot, InvalidBuffer, false);
+		ExecStoreTuple(matrel_entry->base.tuple, state->slot, InvalidBuffer, false);
 		d = slot_getattr(state->slot, state->sw->arrival_ts_attr, &isnull);
 		ts = DatumGetTimestampTz(d);
 		Assert(!isnull);
 
-		if ((GetCurrentTimestamp() - ts) / 1000 > state->base.query->sw_interval_ms)
+		if ((now - ts) / 1000 > state->base.query->sw_interval_ms)
 		{
-			to_delete = lappend(to_delete, matrel_entry->tuple);
+			to_delete = lappend(to_delete, matrel_entry->base.tuple);
 			continue;
 		}
 
-		tuplestore_puttuple(state->sw->overlay_input, matrel_entry->tuple);
+		if (state->sw->block_panes)
+		{
+			TimestampTz start = get_sw_block_start(state, ts);
+
+			if (sw_block_is_live(state, start, now))
+			{
+				/* This step tuple's block needs to be combined (again) */
+				if (!matrel_entry->in_block || sw_block_is_stale(state, matrel_entry->base.tuple, start))
+				{
+					store_sw_block_key(state, matrel_entry->base.tuple, start);
+					tuplestore_puttupleslot(state->sw->block_input, state->sw->block_slot);
+					matrel_entry->in_block = true;
+					num_block_tuples++;
+				}
+				continue;
+			}
+		}
+
+		tuplestore_puttuple(state->sw->overlay_input, matrel_entry->base.tuple);
 	}
+
+	if (state->sw->block_panes)
+		add_sw_blocks_to_overlay_input(state, now, num_block_tuples);
+
 	tuplestore_rescan(state->sw->overlay_input);
 
 	return to_delete;
@@ -886,39 +1508,6 @@ gc_cached_overlay_tuples(ContQueryCombinerState *state,
 	}
 }
 
-/*
- * execute_sw_overlay_plan
- *
- * Execute the overlay plan to compute the instantaneous values over the sliding window
- */
-static void
-execute_sw_overlay_plan(ContQueryCombinerState *state)
-{
-	QueryDesc *query_desc;
-	struct Plan *plan;
-
-	Assert(state->sw);
-	Assert(state->sw->overlay_plan);
-	Assert(state->sw->overlay_dest);
-
-	tuplestore_clear(state->sw->overlay_output);
-	query_desc = CreateQueryDesc(state->sw->overlay_plan,
-			NULL, InvalidSnapshot, InvalidSnapshot, state->sw->overlay_dest, NULL, 0);
-	query_desc->estate = CreateEState(query_desc);
-
-	plan = state->sw->overlay_plan->planTree;
-	query_desc->planstate = ExecInitNode(plan, query_desc->estate, 0);
-	ExecutePlan(query_desc->estate, query_desc->planstate,
-			query_desc->operation,
-			true, 0, ForwardScanDirection, state->sw->overlay_dest);
-	ExecEndNode(query_desc->planstate);
-
-	query_desc->planstate = NULL;
-	query_desc->estate = NULL;
-
-	tuplestore_rescan(state->sw->overlay_output);
-}
-
 /*
  * tick_sw_groups
  *
@@ -977,7 +1566,7 @@ tick_sw_groups(ContQueryCombinerState *state, Relation matrel, bool force)
 	 */
 	to_delete = add_cached_sw_tuples_to_overlay_input(state);
 	gc_cached_matrel_tuples(state, to_delete);
-	execute_sw_overlay_plan(state);
+	execute_sw_plan(state->sw->overlay_plan, state->sw->overlay_dest, state->sw->overlay_output);
 
 	/*
 	 * Write out any changed sliding-window values to the output stream
@@ -1104,7 +1693,73 @@ set_overlay_group_attrs(Agg *agg, AttrNumber *overlay_group_idx)
 		attno++;
 	}
 
-	Assert(i == agg->numCols);
+	Assert(i == agg->numCols);
+}
+
+/*
+ * init_sw_blocks
+ *
+ * Set up the state used to combine blocks of step tuples. Blocks are sqrt(window / step) steps
+ * long, which minimizes the number of tuples the overlay plan has to aggregate on every tick.
+ * They're combined by a private copy of the combine plan, so they're just like any other matrel
+ * tuple as far as the overlay plan is concerned.
+ */
+static void
+init_sw_blocks(ContQueryCombinerState *state)
+{
+	ContQuery *query = state->base.query;
+	MemoryContext tmp_cxt;
+	MemoryContext old;
+	TuplestoreScan *scan;
+	int steps;
+	int panes = 0;
+	int i;
+	bool grouped = false;
+
+	if (query->sw_step_ms <= 0)
+		return;
+
+	/* Blocks replace the step timestamp, so it must be part of the combine plan's grouping */
+	for (i = 0; i < state->ngroupatts; i++)
+		if (state->groupatts[i] == state->sw->arrival_ts_attr)
+			grouped = true;
+
+	if (!grouped)
+		return;
+
+	steps = query->sw_interval_ms / query->sw_step_ms;
+	while ((panes + 1) * (panes + 1) <= steps)
+		panes++;
+
+	if (panes < 2)
+		return;
+
+	state->sw->block_panes = panes;
+
+	tmp_cxt = AllocSetContextCreate(CurrentMemoryContext, "SWBlocksTmpCxt",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+
+	state->sw->blocks = BuildTupleHashTable(state->ngroupatts,
+			state->groupatts, state->eq_funcs, state->hash_funcs, 1000,
+			sizeof(SWBlockEntry), CurrentMemoryContext, tmp_cxt);
+	state->sw->block_slot = MakeSingleTupleTableSlot(state->desc);
+
+	old = MemoryContextSwitchTo(state->sw->context);
+	state->sw->block_input = tuplestore_begin_heap(true, true, work_mem);
+	state->sw->block_output = tuplestore_begin_heap(true, true, work_mem);
+	MemoryContextSwitchTo(old);
+
+	state->sw->block_plan = (PlannedStmt *) copyObject(state->combine_plan);
+	state->sw->block_plan->isContinuous = false;
+	scan = SetCombinerPlanTuplestorestate(state->sw->block_plan, state->sw->block_input);
+	scan->desc = state->desc;
+	scan->tuples = NULL;
+	scan->ntuples = 0;
+
+	state->sw->block_dest = CreateDestReceiver(DestTuplestore);
+	SetTuplestoreDestReceiverParams(state->sw->block_dest, state->sw->block_output, state->sw->context, true);
 }
 
 /*
@@ -1143,7 +1798,7 @@ init_sw_state(ContQueryCombinerState *state, Relation matrel)
 
 	state->sw->step_groups = BuildTupleHashTable(state->ngroupatts,
 			state->groupatts, state->eq_funcs, state->hash_funcs, 1000,
-			sizeof(HeapTupleEntryData), CurrentMemoryContext, tmp_cxt);
+			sizeof(SWStepEntry), CurrentMemoryContext, tmp_cxt);
 
 	state->sw->overlay_plan = GetContinuousViewOverlayPlan(state->base.query);
 	state->sw->context = AllocSetContextCreate(CurrentMemoryContext, "SWOutputCxt",
@@ -1188,6 +1843,8 @@ init_sw_state(ContQueryCombinerState *state, Relation matrel)
 	execTuplesHashPrepare(n_group_attr, group_ops, &eq_funcs, &hash_funcs);
 	state->sw->overlay_groups = BuildTupleHashTable(n_group_attr,
 			group_idx, eq_funcs, hash_funcs, 1000, sizeof(OverlayTupleEntry), CurrentMemoryContext, tmp_cxt);
+
+	init_sw_blocks(state);
 }
 
 /*
@@ -1213,21 +1870,62 @@ project_sw_overlay_into_ostream(ContQueryCombinerState *state, Relation matrel)
 	{
 		bool isnew;
 		MemoryContext old;
-		HeapTupleEntry entry = (HeapTupleEntry)
+		SWStepEntry *entry = (SWStepEntry *)
 				LookupTupleHashEntry(state->sw->step_groups, state->slot, &isnew);
 
 		if (!isnew)
-			heap_freetuple(entry->tuple);
+			heap_freetuple(entry->base.tuple);
 
 		old = MemoryContextSwitchTo(state->sw->step_groups->tablecxt);
-		entry->tuple = ExecCopySlotTuple(state->slot);
+		entry->base.tuple = ExecCopySlotTuple(state->slot);
 		MemoryContextSwitchTo(old);
+
+		entry->in_block = false;
+		invalidate_sw_block(state, entry->base.tuple);
 	}
 
 	/* Force a tick */
 	tick_sw_groups(state, matrel, true);
 }
 
+/*
+ * exec_combine_plan
+ *
+ * Runs the combine plan over the current batch without reinitializing it for every batch
+ */
+static void
+exec_combine_plan(ContQueryCombinerState *state, DestReceiver *dest)
+{
+	ContPlanState *plan = state->combine_planstate;
+
+	if (plan && !ContPlanPrepare(plan))
+	{
+		ContPlanEnd(plan);
+		plan = NULL;
+	}
+
+	if (plan == NULL)
+	{
+		MemoryContext old = MemoryContextSwitchTo(state->base.state_cxt);
+		QueryDesc *query_desc = CreateQueryDesc(state->combine_plan, NULL, InvalidSnapshot,
+				InvalidSnapshot, dest, NULL, 0);
+
+		plan = ContPlanStart(query_desc, state->base.state_cxt, EXEC_FLAG_COMBINE);
+		pfree(query_desc);
+		MemoryContextSwitchTo(old);
+	}
+
+	state->combine_planstate = plan;
+
+	SetEStateSnapshot(plan->estate);
+
+	(*dest->rStartup) (dest, CMD_SELECT, ExecGetResultType(plan->planstate));
+	ContPlanExecute(plan, CMD_SELECT, dest);
+	(*dest->rShutdown) (dest);
+
+	UnsetEStateSnapshot(plan->estate);
+}
+
 /*
  * combine
  *
@@ -1252,30 +1950,40 @@ combine(ContQueryCombinerState *state, bool lookup)
 	}
 	tuplestore_clear(state->combined);
 
-	portal = CreatePortal("combine", true, true);
-	portal->visible = false;
-
-	PortalDefineQuery(portal,
-					  NULL,
-					  state->base.query->matrel->relname,
-					  "SELECT",
-					  list_make1(state->combine_plan),
-					  NULL);
-
 	dest = CreateDestReceiver(DestTuplestore);
 	SetTuplestoreDestReceiverParams(dest, state->combined, state->combine_cxt, true);
 
-	PortalStart(portal, NULL, EXEC_FLAG_COMBINE, NULL);
-
-	(void) PortalRun(portal,
-					 FETCH_ALL,
-					 true,
-					 dest,
-					 dest,
-					 NULL);
+	if (state->reuse_combine_plan)
+		exec_combine_plan(state, dest);
+	else
+	{
+		portal = CreatePortal("combine", true, true);
+		portal->visible = false;
+
+		PortalDefineQuery(portal,
+						  NULL,
+						  state->base.query->matrel->relname,
+						  "SELECT",
+						  list_make1(state->combine_plan),
+						  NULL);
+
+		PortalStart(portal, NULL, EXEC_FLAG_COMBINE, NULL);
+
+		(void) PortalRun(portal,
+						 FETCH_ALL,
+						 true,
+						 dest,
+						 dest,
+						 NULL);
+
+		PortalDrop(portal, false);
+	}
 
-	PortalDrop(portal, false);
 	tuplestore_clear(state->batch);
+
+	/* The microbatch these tuples point into is released at the end of the batch */
+	state->batch_scan->tuples = NULL;
+	state->batch_scan->ntuples = 0;
 }
 
 /*
@@ -1302,6 +2010,212 @@ set_group_hash(ContQueryCombinerState *state, int index, int64 hash)
 	state->group_hashes[index] = hash;
 }
 
+/*
+ * set_batch_tuple
+ *
+ * Set the batch tuple reference at the given index, increasing the size of the batch tuple array if necessary
+ */
+static void
+set_batch_tuple(ContQueryCombinerState *state, int index, HeapTuple tup)
+{
+	int start = state->batch_tups_len;
+
+	while (index >= state->batch_tups_len)
+		state->batch_tups_len *= 2;
+
+	if (start != state->batch_tups_len)
+	{
+		MemoryContext old = MemoryContextSwitchTo(state->base.state_cxt);
+		state->batch_tups = repalloc(state->batch_tups, state->batch_tups_len * sizeof(HeapTuple));
+		MemoryContextSwitchTo(old);
+	}
+
+	Assert(index < state->batch_tups_len);
+	state->batch_tups[index] = tup;
+}
+
+/*
+ * cache_written_group
+ *
+ * Adds a matrel tuple that sync_combine just wrote to the group cache. Its t_self now points
+ * to the new physical tuple.
+ */
+static void
+cache_written_group(ContQueryCombinerState *state, Relation matrel, TupleTableSlot *slot)
+{
+	int64 hash = 0;
+
+	if (!state->group_cache)
+		return;
+
+	group_cache_check_rel(state->group_cache, matrel);
+
+	if (state->ngroupatts)
+		hash = slot_hash_group(slot, state->hashfunc, state->hash_fcinfo);
+
+	group_cache_put(state->group_cache, hash, slot->tts_tuple);
+}
+
+/*
+ * flush_inserts
+ *
+ * Writes all new groups accumulated by sync_combine to the matrel at once
+ */
+static void
+flush_inserts(ContQueryCombinerState *state, Relation matrel, ResultRelInfo *ri, EState *estate,
+		HeapTuple *inserts, int ninserts)
+{
+	int i;
+
+	ExecCQMatRelMultiInsert(ri, inserts, ninserts, state->slot, estate);
+
+	/* Index expressions may have changed the scan tuple used for output stream projections */
+	estate->es_per_tuple_exprcontext->ecxt_scantuple = state->proj_input_slot;
+
+	/* heap_multi_insert has set each tuple's t_self, so they can be cached now */
+	for (i = 0; i < ninserts; i++)
+	{
+		ExecStoreTuple(inserts[i], state->slot, InvalidBuffer, false);
+		cache_written_group(state, matrel, state->slot);
+	}
+
+	ExecClearTuple(state->slot);
+}
+
+/*
+ * get_partition_ri
+ *
+ * Returns the ResultRelInfo of the given TTL partition, opening it the first time it's written to
+ * during this sync. Falls back to the matrel itself if the partition has been dropped.
+ */
+static ResultRelInfo *
+get_partition_ri(ResultRelInfo *ri, List **partitions, Oid relid)
+{
+	ListCell *lc;
+	Relation rel;
+	ResultRelInfo *pri;
+
+	if (relid == RelationGetRelid(ri->ri_RelationDesc))
+		return ri;
+
+	foreach(lc, *partitions)
+	{
+		pri = (ResultRelInfo *) lfirst(lc);
+		if (RelationGetRelid(pri->ri_RelationDesc) == relid)
+			return pri;
+	}
+
+	rel = try_relation_open(relid, RowExclusiveLock);
+	if (rel == NULL)
+		return ri;
+
+	pri = CQMatRelOpen(rel);
+	*partitions = lappend(*partitions, pri);
+
+	return pri;
+}
+
+/*
+ * plan_scans
+ *
+ * Does the given plan tree scan the relation with the given range table index? Relations that
+ * were excluded by the planner are still in the range table, so we look at the scans themselves.
+ */
+static bool
+plan_scans(Plan *plan, Index scanrelid)
+{
+	ListCell *lc;
+
+	if (plan == NULL)
+		return false;
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+			if (((Scan *) plan)->scanrelid == scanrelid)
+				return true;
+			break;
+		case T_Append:
+			foreach(lc, ((Append *) plan)->appendplans)
+				if (plan_scans((Plan *) lfirst(lc), scanrelid))
+					return true;
+			break;
+		case T_MergeAppend:
+			foreach(lc, ((MergeAppend *) plan)->mergeplans)
+				if (plan_scans((Plan *) lfirst(lc), scanrelid))
+					return true;
+			break;
+		default:
+			break;
+	}
+
+	return plan_scans(plan->lefttree, scanrelid) || plan_scans(plan->righttree, scanrelid);
+}
+
+/*
+ * groups_plan_scans
+ *
+ * Does our cached existing groups retrieval plan scan the given relation?
+ */
+static bool
+groups_plan_scans(ContQueryCombinerState *state, Oid relid)
+{
+	ListCell *lc;
+	Index rti = 1;
+
+	if (state->groups_plan == NULL)
+		return false;
+
+	foreach(lc, state->groups_plan->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		if (rte->rtekind == RTE_RELATION && rte->relid == relid &&
+				plan_scans(state->groups_plan->planTree, rti))
+			return true;
+		rti++;
+	}
+
+	return false;
+}
+
+/*
+ * get_insert_ri
+ *
+ * Returns the ResultRelInfo that a new group should be inserted into, which is the TTL partition
+ * for its ttl_column value if the matrel is partitioned and that partition exists. Groups are only
+ * written to partitions that our existing groups retrieval plan knows about, since we'd otherwise
+ * never find them again until it's replanned.
+ */
+static ResultRelInfo *
+get_insert_ri(ContQueryCombinerState *state, ResultRelInfo *ri, List **partitions, HeapTuple tup)
+{
+	ContQuery *cq = state->base.query;
+	Datum ttl_value;
+	bool isnull;
+	Oid relid;
+
+	if (!cq->ttl_partition)
+		return ri;
+
+	ttl_value = heap_getattr(tup, cq->ttl_attno, state->slot->tts_tupleDescriptor, &isnull);
+	if (isnull)
+		return ri;
+
+	relid = GetMatRelPartition(cq, ri->ri_RelationDesc, ttl_value);
+	if (!OidIsValid(relid))
+		return ri;
+
+	if (state->isagg && !groups_plan_scans(state, relid))
+		return ri;
+
+	return get_partition_ri(ri, partitions, relid);
+}
+
 /*
  * sync_combine
  *
@@ -1328,6 +2242,11 @@ sync_combine(ContQueryCombinerState *state)
 	Bitmapset *os_targets = NULL;
 	Bitmapset *orig_targets = NULL;
 	int pending = 0;
+	HeapTuple *inserts = palloc(sizeof(HeapTuple) * MAX_MULTI_INSERT_TUPLES);
+	int ninserts = 0;
+	ResultRelInfo *insert_ri;
+	List *partitions = NIL;
+	ListCell *lc;
 
 	estate->es_range_table = state->combine_plan->rtable;
 
@@ -1365,8 +2284,14 @@ sync_combine(ContQueryCombinerState *state)
 		}
 	}
 
-	/* Do a final combine with existing on-disk groups */
-	combine(state, true);
+	/*
+	 * Do a final combine with existing on-disk groups. Views with delta storage append what
+	 * we've combined so far as new rows and leave merging them to the reaper and overlay view.
+	 */
+	if (state->base.query->delta_storage)
+		tuplestore_clear(state->batch);
+	else
+		combine(state, true);
 
 	osri = CQOSRelOpen(osrel);
 
@@ -1380,9 +2305,11 @@ sync_combine(ContQueryCombinerState *state)
 	 * If nothing is reading from the output stream, close it immediately.
 	 *
 	 * We'll also handle output stream writes separately for SWs since
-	 * they require the execution of an overlay plan.
+	 * they require the execution of an overlay plan. Views with delta
+	 * storage only have partial group values, so they never write to
+	 * their output streams.
 	 */
-	if (state->base.query->is_sw || os_targets == NULL)
+	if (state->base.query->is_sw || state->base.query->delta_storage || os_targets == NULL)
 	{
 		EndStreamModify(NULL, osri);
 		CQOSRelClose(osri);
@@ -1392,6 +2319,7 @@ sync_combine(ContQueryCombinerState *state)
 	}
 
 	ri = CQMatRelOpen(matrel);
+	insert_ri = ri;
 
 	estate->es_per_tuple_exprcontext = CreateStandaloneExprContext();
 	estate->es_per_tuple_exprcontext->ecxt_scantuple = state->proj_input_slot;
@@ -1404,6 +2332,7 @@ sync_combine(ContQueryCombinerState *state)
 		HeapTupleEntry update = NULL;
 		HeapTuple tup = NULL;
 		HeapTuple os_tup;
+		ResultRelInfo *target;
 		Datum os_values[3];
 		bool os_nulls[3];
 		int replaces = 0;
@@ -1441,7 +2370,8 @@ sync_combine(ContQueryCombinerState *state)
 			tup = heap_modify_tuple(update->tuple, slot->tts_tupleDescriptor,
 					slot->tts_values, slot->tts_isnull, replace_all);
 			ExecStoreTuple(tup, slot, InvalidBuffer, false);
-			ExecCQMatRelUpdate(ri, slot, estate);
+			if (ExecCQMatRelUpdate(get_partition_ri(ri, &partitions, update->tuple->t_tableOid), slot, estate))
+				cache_written_group(state, matrel, slot);
 
 			if (os_targets)
 				os_values[NEW_TUPLE] = project_overlay(state, tup, &os_nulls[NEW_TUPLE]);
@@ -1456,8 +2386,23 @@ sync_combine(ContQueryCombinerState *state)
 				slot->tts_values[state->pk - 1] = nextval_internal(state->base.query->seqrelid);
 			slot->tts_isnull[state->pk - 1] = false;
 			tup = heap_form_tuple(slot->tts_tupleDescriptor, slot->tts_values, slot->tts_isnull);
+
+			/*
+			 * New groups are written in batches once we've gone through the combine result. A batch
+			 * only goes to a single TTL partition, so flush it early if this group belongs in another.
+			 */
+			target = get_insert_ri(state, ri, &partitions, tup);
+			if (target != insert_ri)
+			{
+				flush_inserts(state, matrel, insert_ri, estate, inserts, ninserts);
+				ninserts = 0;
+				insert_ri = target;
+			}
+
 			ExecStoreTuple(tup, slot, InvalidBuffer, false);
-			ExecCQMatRelInsert(ri, slot, estate);
+
+			if (ExecCQMatRelCheckConstraints(insert_ri, slot, estate))
+				inserts[ninserts++] = tup;
 
 			if (os_targets)
 			{
@@ -1489,9 +2434,28 @@ sync_combine(ContQueryCombinerState *state)
 			ExecStreamInsert(NULL, osri, state->os_slot, NULL);
 		}
 
+		if (ninserts == MAX_MULTI_INSERT_TUPLES)
+		{
+			flush_inserts(state, matrel, insert_ri, estate, inserts, ninserts);
+			ninserts = 0;
+		}
+
 		ResetPerTupleExprContext(estate);
 	}
 
+	flush_inserts(state, matrel, insert_ri, estate, inserts, ninserts);
+	pfree(inserts);
+
+	foreach(lc, partitions)
+	{
+		ResultRelInfo *pri = (ResultRelInfo *) lfirst(lc);
+		Relation rel = pri->ri_RelationDesc;
+
+		CQMatRelClose(pri);
+		heap_close(rel, RowExclusiveLock);
+	}
+	list_free(partitions);
+
 	if (sis)
 	{
 		EndStreamModify(NULL, osri);
@@ -1521,6 +2485,87 @@ sync_combine(ContQueryCombinerState *state)
 	FreeExecutorState(estate);
 }
 
+/*
+ * forward_partials
+ *
+ * Send this combiner's partial result for an ungrouped aggregate to the combiner that owns it
+ * instead of syncing it ourselves. The owner reads it just like worker partials and combines
+ * it with its own before syncing to the matrel.
+ */
+static void
+forward_partials(ContQueryCombinerState *state)
+{
+	microbatch_t *mb = microbatch_new(CombinerTuple, bms_make_singleton(state->base.query->id), NULL);
+	int ntups = 0;
+	uint32 pin = ContQueryShardMapPin(MyContQueryProc->db_meta, true);
+
+	microbatch_add_acks(mb, state->acks);
+
+	/* The owner will ack these once it has read them, so count them before they're sent */
+	foreach_tuple(state->slot, state->combined)
+		ntups++;
+	tuplestore_rescan(state->combined);
+
+	microbatch_acks_check_and_exec(mb->acks, microbatch_ack_increment_ctups, ntups);
+
+	foreach_tuple(state->slot, state->combined)
+	{
+		HeapTuple tup = ExecFetchSlotTuple(state->slot);
+
+		if (!microbatch_add_tuple(mb, tup, 0))
+		{
+			microbatch_send_to_combiner(mb, state->owner_id);
+			microbatch_add_tuple(mb, tup, 0);
+		}
+	}
+
+	if (!microbatch_is_empty(mb))
+		microbatch_send_to_combiner(mb, state->owner_id);
+
+	ContQueryShardMapUnpin(MyContQueryProc->db_meta, pin);
+	microbatch_destroy(mb);
+	tuplestore_clear(state->combined);
+}
+
+#define should_forward_partials(state) \
+	((state)->isagg && (state)->ngroupatts == 0 && !(state)->base.query->is_sw && \
+	 !(state)->base.query->delta_storage && (state)->owner_id != MyContQueryProc->group_id)
+
+/*
+ * record_ack_latency
+ *
+ * Record how long the inserts waiting on this batch's acks have been waiting by the time
+ * their tuples are synced
+ */
+static void
+record_ack_latency(ContQueryCombinerState *state)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	ListCell *lc;
+
+	foreach(lc, state->acks)
+	{
+		tagged_ref_t *ref = lfirst(lc);
+		microbatch_ack_t *ack = (microbatch_ack_t *) ref->ptr;
+		TimestampTz created;
+		long secs;
+		int usecs;
+
+		/*
+		 * The inserting backend may free the ack and have it reused at any point, so only trust
+		 * the creation time if the ack is still ours after reading it
+		 */
+		created = ack->created;
+		pg_read_barrier();
+
+		if (!microbatch_ack_ref_is_valid(ref))
+			continue;
+
+		TimestampDifference(created, now, &secs, &usecs);
+		pgstat_increment_cq_latency(CQ_PHASE_ACK_WAIT, secs * USECS_PER_SEC + usecs);
+	}
+}
+
 /*
  * sync_all
  */
@@ -1549,8 +2594,17 @@ sync_all(ContExecutor *cont_exec)
 
 		PG_TRY();
 		{
-			if (state->pending_tuples > 0)
+			/*
+			 * Forwarded partials carry their acks along, so their wait is recorded by the owner once
+			 * it syncs them rather than here
+			 */
+			if (state->pending_tuples > 0 && should_forward_partials(state))
+				forward_partials(state);
+			else if (state->pending_tuples > 0)
+			{
 				sync_combine(state);
+				record_ack_latency(state);
+			}
 		}
 		PG_CATCH();
 		{
@@ -1564,6 +2618,8 @@ sync_all(ContExecutor *cont_exec)
 
 		TimestampDifference(start_time, GetCurrentTimestamp(), &secs, &usecs);
 		pgstat_increment_cq_exec_time(secs * 1000 + (usecs / 1000));
+		if (state->pending_tuples > 0)
+			pgstat_increment_cq_latency(CQ_PHASE_SYNC, secs * USECS_PER_SEC + usecs);
 
 		pgstat_report_cqstat(false);
 
@@ -1677,14 +2733,18 @@ init_query_state(ContExecutor *cont_exec, ContQueryState *base)
 
 	/* this also sets the state's desc field */
 	prepare_combine_plan(state, pstmt);
+	state->reuse_combine_plan = IsContQueryCombinerProcess() && ContPlanIsReusable(state->combine_plan);
+	state->combine_planstate = NULL;
 	state->slot = MakeSingleTupleTableSlot(state->desc);
 	state->delta_slot = MakeSingleTupleTableSlot(state->desc);
 	state->prev_slot = MakeSingleTupleTableSlot(state->desc);
 	state->groups_plan = NULL;
 
-	/* this will grow dynamically when needed, but this is a good starting size */
+	/* these will grow dynamically when needed, but this is a good starting size */
 	state->group_hashes_len = continuous_query_batch_size;
 	state->group_hashes = palloc0(state->group_hashes_len * sizeof(int64));
+	state->batch_tups_len = continuous_query_batch_size;
+	state->batch_tups = palloc0(state->batch_tups_len * sizeof(HeapTuple));
 
 	if (matrel == NULL)
 	{
@@ -1705,12 +2765,17 @@ init_query_state(ContExecutor *cont_exec, ContQueryState *base)
 	{
 		Agg *agg = (Agg *) state->combine_plan->planTree;
 		ResultRelInfo *ri;
+		char *relname = state->base.query->name->relname;
 
 		state->groupatts = agg->grpColIdx;
 		state->ngroupatts = agg->numCols;
 		state->groupops = agg->grpOperators;
 		state->isagg = true;
 
+		/* This must match the combiner that workers shard ungrouped aggregates to by default */
+		state->name_hash = MurmurHash3_64(relname, strlen(relname), MURMUR_SEED);
+		state->owner_id = get_combiner_for_shard_hash(state->name_hash);
+
 		ri = CQMatRelOpen(matrel);
 
 		if (state->ngroupatts)
@@ -1731,6 +2796,16 @@ init_query_state(ContExecutor *cont_exec, ContQueryState *base)
 
 		execTuplesHashPrepare(state->ngroupatts, state->groupops, &state->eq_funcs, &state->hash_funcs);
 		state->existing = build_existing_hashtable(state, "CombinerExistingGroups");
+
+		/*
+		 * Sliding-window views keep their own group state, and views that don't update groups
+		 * or only append deltas never look up the groups they've written
+		 */
+		if (SHOULD_UPDATE(state) && !base->query->is_sw && !base->query->delta_storage)
+		{
+			state->group_cache = group_cache_new(state);
+			state->group_cache->relfilenode = matrel->rd_node.relNode;
+		}
 	}
 
 	/*
@@ -1776,25 +2851,25 @@ read_batch(ContExecutor *exec, ContQueryCombinerState *state, Oid query_id)
 	if (!exec->batch)
 		return 0;
 
+	/*
+	 * Partial tuples aren't copied into the batch tuplestore. The microbatches they were read from
+	 * stay pinned until the end of this ContExecutor batch, so the combine plan scans them in place.
+	 */
 	while ((itup = ipc_tuple_reader_next(query_id)) != NULL)
 	{
-		if (!TupIsNull(state->slot))
-			ExecClearTuple(state->slot);
-		ExecStoreTuple(heap_copytuple(itup->tup), state->slot, InvalidBuffer, false);
-		tuplestore_puttupleslot(state->batch, state->slot);
-
+		set_batch_tuple(state, ntups, itup->tup);
 		set_group_hash(state, ntups, itup->hash);
 
 		nbytes += itup->tup->t_len + HEAPTUPLESIZE;
 		ntups++;
 	}
 
+	state->batch_scan->tuples = state->batch_tups;
+	state->batch_scan->ntuples = ntups;
+
 	state->acks = exec->batch->sync_acks;
 	ipc_tuple_reader_rewind();
 
-	if (!TupIsNull(state->slot))
-		ExecClearTuple(state->slot);
-
 	pgstat_increment_cq_read(ntups, nbytes);
 
 	return ntups;
@@ -1809,9 +2884,65 @@ need_sync(ContExecutor *exec, TimestampTz last_sync)
 	if ((exec->batch && exec->batch->has_acks) || !continuous_query_commit_interval)
 		return true;
 
+	/* The scheduler is waiting for us to commit everything so it can move groups between combiners */
+	if (MyContQueryProc->db_meta->shard_map.draining)
+		return true;
+
 	return TimestampDifferenceExceeds(last_sync, GetCurrentTimestamp(), continuous_query_commit_interval);
 }
 
+/* the shard map buckets as of the last time we synced with the shard map */
+static uint16 MyShardMapBuckets[SHARD_MAP_NUM_BUCKETS];
+
+/*
+ * sync_shard_map
+ *
+ * If buckets were moved to or from us we own different groups now, so we drop all of our query
+ * states and let them be rebuilt for the new shard map. Their previous owners committed them before
+ * the map changed, so we read them from the matrel like any other existing group. This is only
+ * called when we have nothing pending, and the scheduler doesn't route anything new to us until
+ * we're done.
+ */
+static void
+sync_shard_map(ContExecutor *exec)
+{
+	ContQueryShardMap *map = &MyContQueryProc->db_meta->shard_map;
+	uint32 version = pg_atomic_read_u32(&map->version);
+	int me = MyContQueryProc->group_id;
+	bool moved = false;
+	int id;
+
+	if (MyContQueryProc->shard_map_version == version)
+		return;
+
+	for (id = 0; id < SHARD_MAP_NUM_BUCKETS && !moved; id++)
+		moved = (MyShardMapBuckets[id] == me) != (map->buckets[id] == me);
+
+	for (id = 0; id < MAX_CQS; id++)
+	{
+		ContQueryCombinerState *state = (ContQueryCombinerState *) exec->states[id];
+
+		if (!state)
+			continue;
+
+		/* Ungrouped aggregates may have a new owner even if none of our own groups moved */
+		if (!moved)
+		{
+			if (state->isagg)
+				state->owner_id = get_combiner_for_shard_hash(state->name_hash);
+			continue;
+		}
+
+		MyStatCQEntry = (PgStat_StatCQEntry *) &state->base.stats;
+		pgstat_report_cqstat(true);
+		MemoryContextDelete(state->base.state_cxt);
+		exec->states[id] = NULL;
+	}
+
+	memcpy(MyShardMapBuckets, map->buckets, sizeof(MyShardMapBuckets));
+	MyContQueryProc->shard_map_version = version;
+}
+
 static int
 get_min_tick_ms(void)
 {
@@ -1855,6 +2986,8 @@ ContinuousQueryCombinerMain(void)
 	int min_tick_ms;
 
 	min_tick_ms = get_min_tick_ms();
+	memcpy(MyShardMapBuckets, MyContQueryProc->db_meta->shard_map.buckets, sizeof(MyShardMapBuckets));
+	MyContQueryProc->shard_map_version = pg_atomic_read_u32(&MyContQueryProc->db_meta->shard_map.version);
 
 	/* Set the commit level */
 	synchronous_commit = continuous_query_combiner_synchronous_commit;
@@ -1863,7 +2996,7 @@ ContinuousQueryCombinerMain(void)
 	{
 		CHECK_FOR_INTERRUPTS();
 
-		if (get_sigterm_flag())
+		if (get_sigterm_flag() || (cont_exec->retired && total_pending == 0))
 			break;
 
 		ContExecutorStartBatch(cont_exec, min_tick_ms);
@@ -1886,6 +3019,10 @@ ContinuousQueryCombinerMain(void)
 				start_time = GetCurrentTimestamp();
 				MemoryContextSwitchTo(state->base.tmp_cxt);
 
+				/*
+				 * Reading the whole batch is timed once by the executor, so pulling this query's
+				 * tuples out of it counts towards combining them
+				 */
 				count = read_batch(cont_exec, state, query_id);
 				if (count)
 				{
@@ -1894,6 +3031,9 @@ ContinuousQueryCombinerMain(void)
 
 					combine(state, false);
 
+					TimestampDifference(start_time, GetCurrentTimestamp(), &secs, &usecs);
+					pgstat_increment_cq_latency(CQ_PHASE_COMBINE, secs * USECS_PER_SEC + usecs);
+
 					if (!first_seen)
 						first_seen = GetCurrentTimestamp();
 				}
@@ -1947,7 +3087,20 @@ next:
 		else
 			do_commit = false;
 
+		/*
+		 * The scheduler considers us drained once nothing sent to us is unread, so we must say that
+		 * we're holding on to uncommitted results before the tuples we've read stop counting
+		 */
+		if (!do_commit)
+			MyContQueryProc->pending = true;
+
 		ContExecutorEndBatch(cont_exec, do_commit);
+
+		if (do_commit)
+		{
+			MyContQueryProc->pending = false;
+			sync_shard_map(cont_exec);
+		}
 	}
 
 	for (query_id = 0; query_id < MAX_CQS; query_id++)
@@ -35,6 +35,20 @@
 CombinerReceiveFunc CombinerReceiveHook = NULL;
 CombinerFlushFunc CombinerFlushHook = NULL;
 
+/* tuples routed to each shard map bucket by this flush, which are added to the shared counters */
+static uint32 BucketTuples[SHARD_MAP_NUM_BUCKETS];
+static int TouchedBuckets[SHARD_MAP_NUM_BUCKETS];
+
+/*
+ * Tuples are only assigned to combiners when they're flushed, since the number of combiners
+ * may change while a batch is being executed
+ */
+typedef struct
+{
+	tagged_ref_t ref;
+	uint32 shard_hash;
+} CombinerTupleRef;
+
 typedef struct
 {
 	DestReceiver pub;
@@ -44,7 +58,11 @@ typedef struct
 	FuncExpr *hashfn;
 
 	uint64 name_hash;
-	List **tups_per_combiner;
+	List *tups;
+
+	/* ungrouped aggregates can be spread across combiners when continuous_query_parallel_combine is on */
+	bool ungrouped_agg;
+	uint32 next_combiner;
 } CombinerState;
 
 static void
@@ -65,6 +83,7 @@ combiner_receive(TupleTableSlot *slot, DestReceiver *self)
 {
 	CombinerState *c = (CombinerState *) self;
 	MemoryContext old = MemoryContextSwitchTo(ContQueryBatchContext);
+	CombinerTupleRef *cref;
 	tagged_ref_t *ref;
 	uint32 shard_hash;
 	bool received = false;
@@ -74,7 +93,8 @@ combiner_receive(TupleTableSlot *slot, DestReceiver *self)
 
 	Assert(c->cont_query->type == CONT_VIEW);
 
-	ref = palloc(sizeof(tagged_ref_t));
+	cref = palloc(sizeof(CombinerTupleRef));
+	ref = &cref->ref;
 	ref->ptr = ExecCopySlotTuple(slot);
 
 	/* Shard by groups or name if no grouping. */
@@ -87,6 +107,13 @@ combiner_receive(TupleTableSlot *slot, DestReceiver *self)
 	{
 		ref->tag = c->name_hash;
 		shard_hash = c->name_hash;
+
+		/*
+		 * There is only a single group, so we round-robin partials across combiners and let the
+		 * combiner that owns the name hash merge them.
+		 */
+		if (c->ungrouped_agg && continuous_query_parallel_combine)
+			shard_hash = c->next_combiner++;
 	}
 
 	if (CombinerReceiveHook)
@@ -94,8 +121,8 @@ combiner_receive(TupleTableSlot *slot, DestReceiver *self)
 
 	if (!received)
 	{
-		int i = get_combiner_for_shard_hash(shard_hash);
-		c->tups_per_combiner[i] = lappend(c->tups_per_combiner[i], ref);
+		cref->shard_hash = shard_hash;
+		c->tups = lappend(c->tups, cref);
 	}
 
 	MemoryContextSwitchTo(old);
@@ -107,7 +134,6 @@ combiner_destroy(DestReceiver *self)
 	CombinerState *c = (CombinerState *) self;
 	if (c->hash_fcinfo)
 		pfree(c->hash_fcinfo);
-	pfree(c->tups_per_combiner);
 	pfree(c);
 }
 
@@ -122,7 +148,9 @@ CreateCombinerDestReceiver(void)
 	self->pub.rDestroy = combiner_destroy;
 	self->pub.mydest = DestCombiner;
 
-	self->tups_per_combiner = palloc0(sizeof(List *) * continuous_query_num_combiners);
+	/* stagger workers so they don't all start round-robining from the same combiner */
+	if (MyContQueryProc)
+		self->next_combiner = MyContQueryProc->group_id;
 
 	return (DestReceiver *) self;
 }
@@ -169,13 +197,31 @@ SetCombinerDestReceiverHashFunc(DestReceiver *self, FuncExpr *hash)
 	c->hashfn = hash;
 }
 
+/*
+ * SetCombinerDestReceiverUngroupedAgg
+ *
+ * Marks the receiver's query as an aggregate without any grouping columns
+ */
+void
+SetCombinerDestReceiverUngroupedAgg(DestReceiver *self)
+{
+	CombinerState *c = (CombinerState *) self;
+	c->ungrouped_agg = true;
+}
+
 void
 CombinerDestReceiverFlush(DestReceiver *self)
 {
 	CombinerState *c = (CombinerState *) self;
+	ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
+	List **tups_per_combiner = NULL;
+	int ncombiners = 0;
+	int ntouched = 0;
+	uint32 pin = 0;
 	int i;
 	int ntups = 0;
 	Size size = 0;
+	ListCell *lc;
 	microbatch_t *mb;
 
 	if (CombinerFlushHook)
@@ -184,10 +230,29 @@ CombinerDestReceiverFlush(DestReceiver *self)
 	mb = microbatch_new(CombinerTuple, bms_make_singleton(c->cont_query->id), NULL);
 	microbatch_add_acks(mb, c->cont_exec->batch->sync_acks);
 
-	for (i = 0; i < continuous_query_num_combiners; i++)
+	/* Groups can't change owners until we're done sending them to the combiners that own them now */
+	if (c->tups != NIL)
+	{
+		pin = ContQueryShardMapPin(db_meta, true);
+		ncombiners = db_meta->shard_map.num_combiners;
+		tups_per_combiner = palloc0(sizeof(List *) * ncombiners);
+
+		foreach(lc, c->tups)
+		{
+			CombinerTupleRef *cref = lfirst(lc);
+			int bucket = ShardMapBucket(cref->shard_hash);
+			int id = db_meta->shard_map.buckets[bucket];
+
+			tups_per_combiner[id] = lappend(tups_per_combiner[id], &cref->ref);
+
+			if (BucketTuples[bucket]++ == 0)
+				TouchedBuckets[ntouched++] = bucket;
+		}
+	}
+
+	for (i = 0; i < ncombiners; i++)
 	{
-		List *tups = c->tups_per_combiner[i];
-		ListCell *lc;
+		List *tups = tups_per_combiner[i];
 
 		if (tups == NIL)
 			continue;
@@ -215,8 +280,24 @@ CombinerDestReceiverFlush(DestReceiver *self)
 			microbatch_reset(mb);
 		}
 
-		list_free_deep(tups);
-		c->tups_per_combiner[i] = NIL;
+		list_free(tups);
+	}
+
+	if (tups_per_combiner)
+	{
+		/* The scheduler uses these to find hot buckets worth moving to less loaded combiners */
+		for (i = 0; i < ntouched; i++)
+		{
+			int bucket = TouchedBuckets[i];
+
+			pg_atomic_fetch_add_u32(&db_meta->shard_map.bucket_tuples[bucket], BucketTuples[bucket]);
+			BucketTuples[bucket] = 0;
+		}
+
+		ContQueryShardMapUnpin(db_meta, pin);
+		pfree(tups_per_combiner);
+		list_free_deep(c->tups);
+		c->tups = NIL;
 	}
 
 	microbatch_acks_check_and_exec(mb->acks, microbatch_ack_increment_ctups, ntups);
@@ -13,21 +13,31 @@
 
 #include "access/htup.h"
 #include "access/htup_details.h"
+#include "access/relscan.h"
 #include "access/xact.h"
 #include "catalog/namespace.h"
 #include "catalog/pipeline_query.h"
 #include "catalog/pipeline_stream_fn.h"
 #include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "executor/hashjoin.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "optimizer/clauses.h"
+#include "parser/parsetree.h"
 #include "pgstat.h"
 #include "pipeline/executor.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/ipc/microbatch.h"
 #include "pipeline/ipc/reader.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/planner.h"
 #include "pipeline/stream.h"
+#include "pipeline/stream_route.h"
+#include "pipeline/table_version.h"
+#include "storage/lmgr.h"
 #include "tcop/tcopprot.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
@@ -36,6 +46,21 @@
 #define MAX_IN_XACT_TIMEOUT 5 /* 5ms */
 #define MAX_NOT_IN_XACT_TIMEOUT 3000 /* 3s */
 
+/*
+ * Bumped whenever a pipeline_query row is invalidated, which invalidates all ContPlanStates.
+ * Generation 0 is never valid and marks plans that failed during execution.
+ */
+static uint64 ContPlanGeneration = 1;
+
+/* memory used by all of the stream-table join hash tables this process is keeping */
+static Size JoinCacheSize = 0;
+
+static void
+invalidate_cont_plans(Datum arg, int cacheid, uint32 hashvalue)
+{
+	ContPlanGeneration++;
+}
+
 ContExecutor *
 ContExecutorNew(ContQueryStateInit initfn)
 {
@@ -73,6 +98,8 @@ ContExecutorNew(ContQueryStateInit initfn)
 	ipc_tuple_reader_init();
 	pgstat_report_activity(STATE_RUNNING, exec->pname);
 
+	CacheRegisterSyscacheCallback(PIPELINEQUERYID, invalidate_cont_plans, (Datum) 0);
+
 	debug_query_string = NULL;
 	MyStatCQEntry = NULL;
 
@@ -90,9 +117,17 @@ void
 ContExecutorStartBatch(ContExecutor *exec, int timeout)
 {
 	bool success;
+	bool retire;
 
 	exec->batch = NULL;
 
+	/*
+	 * Once we're retired, nothing new is routed to us, so anything sent before then is seen
+	 * by the poll below
+	 */
+	retire = MyContQueryProc->retire;
+	pg_read_barrier();
+
 	/*
 	 * We should never sleep forever, since there is a race in setting got_SIGTERM and
 	 * zmq_poll(). If we set got_SIGTERM right before calling zmq_poll(), we will
@@ -109,13 +144,22 @@ ContExecutorStartBatch(ContExecutor *exec, int timeout)
 	/* TODO(usmanm): report activity */
 	success = ipc_tuple_reader_poll(timeout);
 
+	exec->retired = retire && !success && (int32) pg_atomic_read_u32(&MyContQueryProc->inflight) <= 0;
+
 	if (!IsTransactionState())
 		StartTransactionCommand();
 
 	if (success)
 	{
+		TimestampTz start = GetCurrentTimestamp();
+		long secs;
+		int usecs;
+
 		exec->batch = ipc_tuple_reader_pull();
 
+		TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+		pgstat_increment_cq_latency(CQ_PHASE_READ, secs * USECS_PER_SEC + usecs);
+
 		if (bms_is_empty(exec->all_queries))
 		{
 			MemoryContext old;
@@ -223,6 +267,7 @@ get_query_state(ContExecutor *exec)
 		 */
 		if (HeapTupleGetOid(tup) != state->query->oid)
 		{
+			StreamRouteRemoveQuery(exec->curr_query_id);
 			MemoryContextDelete(state->state_cxt);
 			exec->states[exec->curr_query_id] = NULL;
 			state = NULL;
@@ -340,6 +385,8 @@ ContExecutorPurgeQuery(ContExecutor *exec)
 		exec->states[exec->curr_query_id] = NULL;
 	}
 
+	StreamRouteRemoveQuery(exec->curr_query_id);
+
 	exec->curr_query = NULL;
 }
 
@@ -382,8 +429,11 @@ ContExecutorEndBatch(ContExecutor *exec, bool commit)
 	{
 		pgstat_end_cq_batch(exec->batch->ntups, exec->batch->nbytes);
 
-		if (exec->ptype == Worker)
+		if (exec->ptype == Worker && exec->batch->flush_acks != NIL)
 		{
+			ContQueryDatabaseMetadata *db_meta = MyContQueryProc->db_meta;
+			uint32 pin = ContQueryShardMapPin(db_meta, true);
+			int ncombiners = db_meta->shard_map.num_combiners;
 			ListCell *lc;
 
 			foreach(lc, exec->batch->flush_acks)
@@ -399,14 +449,15 @@ ContExecutorEndBatch(ContExecutor *exec, bool commit)
 				mb = microbatch_new(FlushTuple, NULL, NULL);
 				microbatch_add_ack(mb, ack);
 
-				for (i = 0; i < continuous_query_num_combiners; i++)
+				for (i = 0; i < ncombiners; i++)
 					microbatch_send_to_combiner(mb, i);
 
 				microbatch_destroy(mb);
 			}
 
 			microbatch_acks_check_and_exec(exec->batch->flush_acks, microbatch_ack_increment_ctups,
-					continuous_query_num_combiners);
+					ncombiners);
+			ContQueryShardMapUnpin(db_meta, pin);
 		}
 	}
 
@@ -421,3 +472,477 @@ ContExecutorEndBatch(ContExecutor *exec, bool commit)
 	debug_query_string = NULL;
 	MyStatCQEntry = NULL;
 }
+
+/*
+ * ContPlanCanCacheJoins
+ *
+ * Can stream-table join hash tables be kept across batches?
+ */
+bool
+ContPlanCanCacheJoins(void)
+{
+	return continuous_query_join_cache_mem > 0;
+}
+
+/*
+ * ContPlanJoinCacheAvailable
+ *
+ * Returns how many kilobytes of its join cache budget this process hasn't used yet
+ */
+int
+ContPlanJoinCacheAvailable(void)
+{
+	Size budget = (Size) continuous_query_join_cache_mem * 1024;
+
+	if (JoinCacheSize >= budget)
+		return 0;
+
+	return (int) ((budget - JoinCacheSize) / 1024);
+}
+
+/*
+ * is_cached_hash
+ *
+ * Is the given plan a Hash of a table that's read by nothing but a sequential scan? The hash
+ * table such a plan builds only depends on the table, so it can be kept until the table changes.
+ */
+static bool
+is_cached_hash(Plan *plan, List *rtable)
+{
+	Plan *scan;
+	RangeTblEntry *rte;
+
+	if (!IsA(plan, Hash) || plan->initPlan != NIL)
+		return false;
+
+	scan = outerPlan(plan);
+	if (!IsA(scan, SeqScan) || scan->initPlan != NIL)
+		return false;
+
+	rte = rt_fetch(((Scan *) scan)->scanrelid, rtable);
+	if (rte->rtekind != RTE_RELATION || rte->relkind != RELKIND_RELATION)
+		return false;
+
+	return !contain_volatile_functions((Node *) scan->qual) &&
+		!contain_volatile_functions((Node *) scan->targetlist);
+}
+
+/*
+ * plan_is_reusable
+ *
+ * Only plans that read nothing but the stream (or combiner input) and have no parameters
+ * are kept across batches, with the exception of tables hashed by stream-table joins. Anything
+ * else scanning a relation must see each transaction's own snapshot and locks, so it's still
+ * initialized for every batch.
+ */
+static bool
+plan_is_reusable(Plan *plan, List *rtable)
+{
+	if (plan == NULL)
+		return true;
+
+	if (plan->initPlan != NIL)
+		return false;
+
+	switch (nodeTag(plan))
+	{
+		case T_HashJoin:
+			if (!ContPlanCanCacheJoins() || !is_cached_hash(innerPlan(plan), rtable))
+				return false;
+			return plan_is_reusable(outerPlan(plan), rtable);
+		case T_Agg:
+		case T_Material:
+		case T_Result:
+		case T_Sort:
+		case T_TuplestoreScan:
+		case T_Unique:
+		case T_WindowAgg:
+			break;
+		case T_ForeignScan:
+			{
+				Index scanrelid = ((ForeignScan *) plan)->scan.scanrelid;
+
+				if (!IsStream(getrelid(scanrelid, rtable)))
+					return false;
+			}
+			break;
+		case T_SubqueryScan:
+			if (!plan_is_reusable(((SubqueryScan *) plan)->subplan, rtable))
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	return plan_is_reusable(outerPlan(plan), rtable) && plan_is_reusable(innerPlan(plan), rtable);
+}
+
+/*
+ * ContPlanIsReusable
+ *
+ * Can the given plan be executed repeatedly by a single ContPlanState?
+ */
+bool
+ContPlanIsReusable(PlannedStmt *pstmt)
+{
+	if (pstmt->subplans != NIL || pstmt->nParamExec > 0)
+		return false;
+
+	return plan_is_reusable(pstmt->planTree, pstmt->rtable);
+}
+
+/*
+ * get_cached_tables
+ *
+ * Returns the OIDs of the tables hashed by the given plan's cacheable stream-table joins
+ */
+static List *
+get_cached_tables(Plan *plan, List *rtable, List *tables)
+{
+	if (plan == NULL)
+		return tables;
+
+	if (IsA(plan, HashJoin) && is_cached_hash(innerPlan(plan), rtable))
+	{
+		Scan *scan = (Scan *) outerPlan(innerPlan(plan));
+
+		tables = list_append_unique_oid(tables, getrelid(scan->scanrelid, rtable));
+	}
+
+	if (IsA(plan, SubqueryScan))
+		tables = get_cached_tables(((SubqueryScan *) plan)->subplan, rtable, tables);
+
+	tables = get_cached_tables(outerPlan(plan), rtable, tables);
+
+	return get_cached_tables(innerPlan(plan), rtable, tables);
+}
+
+/*
+ * get_cached_joins
+ *
+ * Returns the given plan's HashJoinStates whose hash tables can be kept across executions
+ */
+static List *
+get_cached_joins(PlanState *planstate, List *rtable, List *joins)
+{
+	if (planstate == NULL)
+		return joins;
+
+	if (IsA(planstate, HashJoinState) && is_cached_hash(innerPlan(planstate->plan), rtable))
+		joins = lappend(joins, planstate);
+
+	if (IsA(planstate, SubqueryScanState))
+		joins = get_cached_joins(((SubqueryScanState *) planstate)->subplan, rtable, joins);
+
+	joins = get_cached_joins(outerPlanState(planstate), rtable, joins);
+
+	return get_cached_joins(innerPlanState(planstate), rtable, joins);
+}
+
+/*
+ * lock_tables
+ *
+ * Locks the plan's tables for the current transaction, which also processes any pending
+ * invalidations for them. Their versions must be read after this and before taking the
+ * snapshot they are read with.
+ */
+static void
+lock_tables(ContPlanState *plan)
+{
+	int i;
+
+	for (i = 0; i < plan->ntables; i++)
+		LockRelationOid(plan->tables[i], AccessShareLock);
+}
+
+/*
+ * release_plan
+ *
+ * Releases everything acquired while initializing a ContPlanState, however its memory goes away
+ */
+static void
+release_plan(void *arg)
+{
+	ContPlanState *plan = (ContPlanState *) arg;
+
+	JoinCacheSize -= plan->join_cache_size;
+
+	ResourceOwnerRelease(plan->owner, RESOURCE_RELEASE_BEFORE_LOCKS, false, false);
+	ResourceOwnerRelease(plan->owner, RESOURCE_RELEASE_LOCKS, false, false);
+	ResourceOwnerRelease(plan->owner, RESOURCE_RELEASE_AFTER_LOCKS, false, false);
+	ResourceOwnerDelete(plan->owner);
+}
+
+/*
+ * ContPlanStart
+ *
+ * Initializes the given query's plan so that it can be executed once per batch. Resources acquired
+ * during initialization belong to the plan rather than to the current transaction, and are released
+ * when the plan is ended or parent is reset, e.g. when the query is purged after an error.
+ */
+ContPlanState *
+ContPlanStart(QueryDesc *query_desc, MemoryContext parent, int eflags)
+{
+	ResourceOwner res = CurrentResourceOwner;
+	MemoryContext old;
+	MemoryContext cxt;
+	ContPlanState *plan;
+	PlannedStmt *pstmt = query_desc->plannedstmt;
+	List *tables;
+	ListCell *lc;
+	volatile bool snapshot_set = false;
+	int i = 0;
+
+	cxt = AllocSetContextCreate(parent, "ContPlanContext",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+
+	old = MemoryContextSwitchTo(cxt);
+
+	plan = palloc0(sizeof(ContPlanState));
+	plan->cxt = cxt;
+	plan->generation = ContPlanGeneration;
+	plan->owner = ResourceOwnerCreate(NULL, "ContPlanOwner");
+	plan->callback.func = release_plan;
+	plan->callback.arg = (void *) plan;
+	MemoryContextRegisterResetCallback(cxt, &plan->callback);
+
+	tables = get_cached_tables(pstmt->planTree, pstmt->rtable, NIL);
+	plan->ntables = list_length(tables);
+	plan->tables = palloc0(sizeof(Oid) * plan->ntables);
+	plan->table_versions = palloc0(sizeof(uint32) * plan->ntables);
+
+	foreach(lc, tables)
+		plan->tables[i++] = lfirst_oid(lc);
+
+	plan->estate = CreateEState(query_desc);
+	plan->estate->es_top_eflags |= eflags;
+
+	CurrentResourceOwner = plan->owner;
+
+	PG_TRY();
+	{
+		lock_tables(plan);
+		for (i = 0; i < plan->ntables; i++)
+			plan->table_versions[i] = GetTableVersion(plan->tables[i]);
+
+		/* table scans are started during initialization, so they need a snapshot */
+		if (plan->ntables)
+		{
+			SetEStateSnapshot(plan->estate);
+			snapshot_set = true;
+		}
+
+		MemoryContextSwitchTo(plan->estate->es_query_cxt);
+		plan->planstate = ExecInitNode(pstmt->planTree, plan->estate, eflags);
+
+		if (snapshot_set)
+		{
+			UnsetEStateSnapshot(plan->estate);
+			snapshot_set = false;
+		}
+	}
+	PG_CATCH();
+	{
+		if (snapshot_set)
+			UnsetEStateSnapshot(plan->estate);
+		CurrentResourceOwner = res;
+		MemoryContextSwitchTo(old);
+		MemoryContextDelete(cxt);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	plan->cached_joins = get_cached_joins(plan->planstate, pstmt->rtable, NIL);
+
+	foreach(lc, plan->cached_joins)
+	{
+		HashState *hash = (HashState *) innerPlanState(lfirst(lc));
+
+		hash->hash_mem = continuous_query_join_cache_mem;
+	}
+
+	CurrentResourceOwner = res;
+	MemoryContextSwitchTo(old);
+
+	return plan;
+}
+
+/*
+ * ContPlanPrepare
+ *
+ * Prepares the plan for execution within the current transaction, returning false if anything
+ * it was built from has changed since it was started, in which case it must be rebuilt
+ */
+bool
+ContPlanPrepare(ContPlanState *plan)
+{
+	int i;
+
+	if (plan->generation != ContPlanGeneration)
+		return false;
+
+	lock_tables(plan);
+
+	/* locking may have processed invalidations */
+	if (plan->generation != ContPlanGeneration)
+		return false;
+
+	for (i = 0; i < plan->ntables; i++)
+	{
+		if (GetTableVersion(plan->tables[i]) != plan->table_versions[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void
+mark_changed(PlanState *planstate, List *cached)
+{
+	if (planstate == NULL)
+		return;
+
+	if (planstate->chgParam == NULL)
+		planstate->chgParam = bms_make_singleton(0);
+
+	if (IsA(planstate, SubqueryScanState))
+		mark_changed(((SubqueryScanState *) planstate)->subplan, cached);
+
+	mark_changed(outerPlanState(planstate), cached);
+
+	/* hash joins keep their hash tables as long as their inner side hasn't changed */
+	if (!list_member_ptr(cached, planstate))
+		mark_changed(innerPlanState(planstate), cached);
+}
+
+static void
+rescan(PlanState *planstate, List *cached)
+{
+	if (planstate == NULL)
+		return;
+
+	ExecReScan(planstate);
+
+	if (IsA(planstate, SubqueryScanState))
+		rescan(((SubqueryScanState *) planstate)->subplan, cached);
+
+	rescan(outerPlanState(planstate), cached);
+
+	if (!list_member_ptr(cached, planstate))
+		rescan(innerPlanState(planstate), cached);
+}
+
+/*
+ * cache_joins
+ *
+ * Decides whether the hash tables built by the plan's stream-table joins are kept for its next
+ * execution. They're only kept if they all fit in memory and within what's left of the budget.
+ */
+static bool
+cache_joins(ContPlanState *plan)
+{
+	Size size = 0;
+	ListCell *lc;
+
+	foreach(lc, plan->cached_joins)
+	{
+		HashJoinTable hashtable = ((HashJoinState *) lfirst(lc))->hj_HashTable;
+
+		/* the hash table isn't built if there was nothing to probe it with */
+		if (hashtable == NULL)
+			continue;
+
+		if (hashtable->nbatch > 1)
+		{
+			size = 0;
+			break;
+		}
+
+		size += hashtable->spaceUsed + hashtable->nbuckets * sizeof(HashJoinTuple);
+	}
+
+	JoinCacheSize -= plan->join_cache_size;
+	plan->join_cache_size = 0;
+
+	if (size == 0 || JoinCacheSize + size > (Size) continuous_query_join_cache_mem * 1024)
+		return false;
+
+	plan->join_cache_size = size;
+	JoinCacheSize += size;
+
+	return true;
+}
+
+/*
+ * ContPlanExecute
+ *
+ * Runs the plan to completion and then resets it for the next batch. Every node is rescanned
+ * immediately rather than lazily on its next execution so that sorts, hash tables and the like
+ * don't outlive the transaction they were built in. The only exception are the hash tables of
+ * stream-table joins, which are kept until the tables they were built from change.
+ */
+void
+ContPlanExecute(ContPlanState *plan, CmdType operation, DestReceiver *dest)
+{
+	MemoryContext old = MemoryContextSwitchTo(plan->estate->es_query_cxt);
+	List *cached = NIL;
+	ListCell *lc;
+
+	/* any tables that are scanned again are read with this execution's snapshot */
+	foreach(lc, plan->cached_joins)
+	{
+		ScanState *scan = (ScanState *) outerPlanState(innerPlanState(lfirst(lc)));
+
+		scan->ss_currentScanDesc->rs_snapshot = plan->estate->es_snapshot;
+	}
+
+	PG_TRY();
+	{
+		ExecutePlan(plan->estate, plan->planstate, operation, true, 0, ForwardScanDirection, dest);
+	}
+	PG_CATCH();
+	{
+		/* the plan is left partially executed, so it must be rebuilt before it's used again */
+		plan->generation = 0;
+		MemoryContextSwitchTo(old);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (plan->cached_joins && cache_joins(plan))
+		cached = plan->cached_joins;
+
+	/*
+	 * Parents only reuse their children's output if the children's parameters haven't changed,
+	 * so mark everything as changed before rescanning from the top down
+	 */
+	mark_changed(plan->planstate, cached);
+	rescan(plan->planstate, cached);
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * ContPlanEnd
+ */
+void
+ContPlanEnd(ContPlanState *plan)
+{
+	ResourceOwner res = CurrentResourceOwner;
+
+	/*
+	 * A plan that failed may still reference things its aborted transaction already released,
+	 * so the plan owner is left to clean up after it
+	 */
+	if (plan->generation != 0)
+	{
+		CurrentResourceOwner = plan->owner;
+		ExecEndNode(plan->planstate);
+		CurrentResourceOwner = res;
+	}
+
+	FreeExecutorState(plan->estate);
+	MemoryContextDelete(plan->cxt);
+}
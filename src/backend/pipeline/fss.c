@@ -26,6 +26,29 @@
 
 #define MURMUR_SEED 0x02cd1b4c451c1fb8L
 
+/*
+ * Monitored elements are indexed by their stored value in an open addressing hash table
+ * that immediately follows the monitored element array, so that increments don't have to
+ * scan all m elements. Each index entry holds a monitored element slot + 1, so that zero
+ * marks an empty entry. The table is kept at most half full.
+ */
+#define INDEX_EMPTY 0
+#define INDEX_MIN_SIZE 8
+
+#define FSS_INDEX(fss) ((uint16_t *) ((fss)->monitored_elements + (fss)->m))
+#define FSS_INDEX_BYTES(fss) (sizeof(uint16_t) * index_size((fss)->m))
+
+static inline uint32
+index_size(uint16_t m)
+{
+	uint32 size = INDEX_MIN_SIZE;
+
+	while (size < 2 * (uint32) m)
+		size <<= 1;
+
+	return size;
+}
+
 FSS *
 FSSFromBytes(struct varlena *bytes)
 {
@@ -42,6 +65,7 @@ FSSFromBytes(struct varlena *bytes)
 	if (FSS_STORES_DATUMS(fss))
 	{
 		pos += sizeof(MonitoredElement) * fss->m;
+		pos += FSS_INDEX_BYTES(fss);
 		fss->top_k = (ArrayType *) pos;
 	}
 	else
@@ -53,7 +77,8 @@ FSSFromBytes(struct varlena *bytes)
 FSS *
 FSSCreateWithMAndH(uint16_t k, TypeCacheEntry *typ, uint16_t m, uint16_t h)
 {
-	Size sz = sizeof(FSS) + (sizeof(Counter) * h) + (sizeof(MonitoredElement) * m);
+	Size sz = sizeof(FSS) + (sizeof(Counter) * h) + (sizeof(MonitoredElement) * m) +
+			(sizeof(uint16_t) * index_size(m));
 	char *pos;
 	FSS *fss;
 
@@ -75,6 +100,7 @@ FSSCreateWithMAndH(uint16_t k, TypeCacheEntry *typ, uint16_t m, uint16_t h)
 			fss->monitored_elements[i].varlen_index = (Datum ) i;
 
 		pos += sizeof(MonitoredElement) * m;
+		pos += sizeof(uint16_t) * index_size(m);
 		fss->top_k = construct_empty_array(typ->type_id);
 	}
 	else
@@ -247,15 +273,217 @@ hash_datum(FSS* fss, Datum d)
 	return h;
 }
 
+/*
+ * index_hash
+ *
+ * Byref values are stored as murmur hashes already, but byval values need to be spread out
+ */
+static inline uint32
+index_hash(Datum value, uint32 mask)
+{
+	return (uint32) (((uint64) value * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) & mask;
+}
+
+#define ELEMENT_MATCHES(el, v, isnull) ((el)->value == (v) && (IS_NULL(el) != 0) == (isnull))
+
+/*
+ * index_lookup
+ *
+ * Find the slot of the monitored element with the given stored value, or -1 if it isn't monitored
+ */
+static int
+index_lookup(FSS *fss, Datum value, bool isnull)
+{
+	uint16_t *index = FSS_INDEX(fss);
+	uint32 mask = index_size(fss->m) - 1;
+	uint32 pos = index_hash(value, mask);
+
+	while (index[pos] != INDEX_EMPTY)
+	{
+		int slot = index[pos] - 1;
+
+		if (ELEMENT_MATCHES(&fss->monitored_elements[slot], value, isnull))
+			return slot;
+
+		pos = (pos + 1) & mask;
+	}
+
+	return -1;
+}
+
+/*
+ * index_entry
+ *
+ * Get the index entry pointing to the given slot
+ */
+static uint16_t *
+index_entry(FSS *fss, int slot)
+{
+	uint16_t *index = FSS_INDEX(fss);
+	uint32 mask = index_size(fss->m) - 1;
+	uint32 pos = index_hash(fss->monitored_elements[slot].value, mask);
+
+	while (index[pos] != slot + 1)
+	{
+		Assert(index[pos] != INDEX_EMPTY);
+		pos = (pos + 1) & mask;
+	}
+
+	return &index[pos];
+}
+
+static void
+index_insert(FSS *fss, int slot)
+{
+	uint16_t *index = FSS_INDEX(fss);
+	uint32 mask = index_size(fss->m) - 1;
+	uint32 pos = index_hash(fss->monitored_elements[slot].value, mask);
+
+	while (index[pos] != INDEX_EMPTY)
+		pos = (pos + 1) & mask;
+
+	index[pos] = slot + 1;
+}
+
+/*
+ * index_delete
+ *
+ * Remove the entry for the given slot, shifting back any entries after it in its probe sequence
+ * so that lookups never need tombstones
+ */
+static void
+index_delete(FSS *fss, int slot)
+{
+	uint16_t *index = FSS_INDEX(fss);
+	uint32 mask = index_size(fss->m) - 1;
+	uint32 i = index_entry(fss, slot) - index;
+	uint32 j = i;
+
+	index[i] = INDEX_EMPTY;
+
+	for (;;)
+	{
+		uint32 home;
+
+		j = (j + 1) & mask;
+		if (index[j] == INDEX_EMPTY)
+			break;
+
+		home = index_hash(fss->monitored_elements[index[j] - 1].value, mask);
+
+		/* Entries whose home is cyclically within (i, j] can stay where they are */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		index[i] = index[j];
+		index[j] = INDEX_EMPTY;
+		i = j;
+	}
+}
+
+static void
+index_build(FSS *fss)
+{
+	int i;
+
+	MemSet(FSS_INDEX(fss), 0, FSS_INDEX_BYTES(fss));
+
+	for (i = 0; i < fss->m; i++)
+	{
+		if (!IS_SET(&fss->monitored_elements[i]))
+			break;
+		index_insert(fss, i);
+	}
+}
+
+/*
+ * first_free_slot
+ *
+ * Set elements always precede unset ones, so we can binary search for the first unset one
+ */
+static int
+first_free_slot(FSS *fss)
+{
+	int lo = 0;
+	int hi = fss->m;
+
+	if (IS_SET(&fss->monitored_elements[fss->m - 1]))
+		return -1;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (IS_SET(&fss->monitored_elements[mid]))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * run_start
+ *
+ * Find the first element in the sorted prefix [0, slot] that compares equal to the element at slot
+ */
+static int
+run_start(MonitoredElement *elts, int slot)
+{
+	int lo = 0;
+	int hi = slot;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (element_cmp(&elts[mid], &elts[slot]) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * sift_up
+ *
+ * Restore the (-frequency, error) order of the monitored element array after the element at the
+ * given slot was incremented or inserted. Elements with equal keys form contiguous runs, so rather than
+ * shifting every element it passes, we swap the element with the first element of each run it passes,
+ * which keeps that run contiguous. This is the same trick used by Stream-Summary.
+ */
+static void
+sift_up(FSS *fss, int slot)
+{
+	MonitoredElement *elts = fss->monitored_elements;
+
+	while (slot > 0 && element_cmp(&elts[slot - 1], &elts[slot]) > 0)
+	{
+		int first = run_start(elts, slot - 1);
+		uint16_t *first_entry = index_entry(fss, first);
+		uint16_t *slot_entry = index_entry(fss, slot);
+		MonitoredElement tmp = elts[first];
+
+		elts[first] = elts[slot];
+		elts[slot] = tmp;
+
+		*first_entry = slot + 1;
+		*slot_entry = first + 1;
+
+		slot = first;
+	}
+}
+
 FSS *
 FSSIncrementWeighted(FSS *fss, Datum incoming, bool incoming_null, uint64_t weight)
 {
 	uint64_t incoming_hash;
 	Counter *counter;
-	int free_slot = -1;
 	MonitoredElement *m_elt;
-	int slot;
-	bool needs_sort = true;
+	int slot = -1;
 	int counter_idx;
 	Datum store_value;
 
@@ -265,58 +493,25 @@ FSSIncrementWeighted(FSS *fss, Datum incoming, bool incoming_null, uint64_t weig
 
 	store_value = fss->typ.typbyval ? incoming : incoming_hash;
 
+	/* Only values whose counter has monitored elements can be monitored */
 	if (counter->count > 0)
-	{
-		int i;
-		bool found = false;
-
-		for (i = 0; i < fss->m; i++)
-		{
-			m_elt = &fss->monitored_elements[i];
-
-			if (!IS_SET(m_elt))
-			{
-				free_slot = i;
-				break;
-			}
-
-			if (m_elt->value == store_value && (incoming_null == IS_NULL(m_elt)))
-			{
-				found = true;
-				break;
-			}
-		}
+		slot = index_lookup(fss, store_value, incoming_null);
 
+	if (slot >= 0)
+	{
 		/* We found datum, so its monitored */
-		if (found)
-		{
-			m_elt->frequency += weight;
-			slot = i;
-			goto done;
-		}
+		fss->monitored_elements[slot].frequency += weight;
+		sift_up(fss, slot);
 	}
-	else if (!IS_SET(&fss->monitored_elements[fss->m - 1]))
+	else if (counter->alpha + weight >= fss->monitored_elements[fss->m - 1].frequency)
 	{
-		int i;
-
-		/* Find the first free slot */
-		for (i = 0; i < fss->m; i++)
-		{
-			if (!IS_SET(&fss->monitored_elements[i]))
-			{
-				free_slot = i;
-				break;
-			}
-		}
-	}
+		slot = first_free_slot(fss);
 
-	/* This is only executed if datum is not monitored */
-	if (counter->alpha + weight >= fss->monitored_elements[fss->m - 1].frequency)
-	{
 		/* Need to evict an element? */
-		if (free_slot == -1)
+		if (slot < 0)
 		{
 			Counter *c;
+
 			/*
 			 * We always evict the last element because the monitored element array is
 			 * sorted by (-frequency, error).
@@ -326,13 +521,13 @@ FSSIncrementWeighted(FSS *fss, Datum incoming, bool incoming_null, uint64_t weig
 			c = &fss->bitmap_counter[m_elt->counter];
 			c->count--;
 			c->alpha = m_elt->frequency;
-		}
-		else
-		{
-			slot = free_slot;
-			m_elt = &fss->monitored_elements[slot];
+
+			index_delete(fss, slot);
 		}
 
+		m_elt = &fss->monitored_elements[slot];
+
+		m_elt->flags = 0;
 		SET(m_elt);
 		if (incoming_null)
 			SET_NULL(m_elt);
@@ -343,42 +538,15 @@ FSSIncrementWeighted(FSS *fss, Datum incoming, bool incoming_null, uint64_t weig
 		m_elt->value = store_value;
 		counter->count++;
 
+		index_insert(fss, slot);
+
 		if (!fss->typ.typbyval)
-		{
 			fss = set_varlena(fss, m_elt, incoming, incoming_null);
-			m_elt = &fss->monitored_elements[slot];
-		}
+
+		sift_up(fss, slot);
 	}
 	else
-	{
 		counter->alpha += weight;
-		needs_sort = false;
-	}
-
-done:
-	if (needs_sort)
-	{
-		Assert(m_elt);
-
-		/* First slot updated? Don't need to sort. */
-		if (slot == 0)
-			needs_sort = false;
-		else
-		{
-			MonitoredElement *tmp = &fss->monitored_elements[slot - 1];
-
-			/*
-			 * Is the slot before us still good? This should be enough to check because we only
-			 * ever increase the frequency or swap the last element on the monitored element array
-			 * when a new frequency is entered
-			 */
-			if (element_cmp((void *) tmp, (void *) m_elt) <= 0)
-				needs_sort = false;
-		}
-
-		if (needs_sort)
-			qsort(fss->monitored_elements, fss->m, sizeof(MonitoredElement), element_cmp);
-	}
 
 	fss->count++;
 
@@ -387,24 +555,68 @@ done:
 	return fss;
 }
 
+/*
+ * merge_sorted
+ *
+ * Merge two arrays of monitored elements that are sorted by (-frequency, error), keeping
+ * at most max elements
+ */
+static int
+merge_sorted(MonitoredElement *a, int na, MonitoredElement *b, int nb, MonitoredElement *result, int max)
+{
+	int i = 0;
+	int j = 0;
+	int n = 0;
+
+	while (n < max && (i < na || j < nb))
+	{
+		if (j == nb || (i < na && element_cmp(&a[i], &b[j]) <= 0))
+			result[n++] = a[i++];
+		else
+			result[n++] = b[j++];
+	}
+
+	return n;
+}
+
 /*
  * FSSMerge
  *
  * SpaceSaving summaries are mergeable:
  *   http://www.cs.utah.edu/~jeffp/papers/merge-summ.pdf
+ *
+ * Both monitored element arrays are already sorted, so only the elements monitored by
+ * both summaries need to be re-sorted after their frequencies are summed. The result is
+ * then a merge of three sorted arrays.
  */
 FSS *
 FSSMerge(FSS *fss, FSS *incoming)
 {
-	int i, j, k;
+	int i;
+	int nkept = 0;
+	int nmatched = 0;
+	int nnew = 0;
+	int nfree = 0;
+	int nmerged;
+	bool *matched;
+	MonitoredElement *kept;
+	MonitoredElement *summed;
+	MonitoredElement *new;
+	MonitoredElement *free_elts;
 	MonitoredElement *tmp;
+	MonitoredElement *result;
 	ArrayType *top_k;
 
 	Assert(fss->h == incoming->h);
 	Assert(fss->m == incoming->m);
 
-	tmp = palloc0(sizeof(MonitoredElement) * 2 * fss->m);
-	memcpy(tmp, fss->monitored_elements, sizeof(MonitoredElement) * fss->m);
+	matched = palloc0(sizeof(bool) * fss->m);
+	kept = palloc(sizeof(MonitoredElement) * fss->m);
+	summed = palloc(sizeof(MonitoredElement) * fss->m);
+	new = palloc(sizeof(MonitoredElement) * fss->m);
+	free_elts = palloc(sizeof(MonitoredElement) * fss->m);
+	tmp = palloc(sizeof(MonitoredElement) * fss->m);
+	result = palloc0(sizeof(MonitoredElement) * fss->m);
 
 	for (i = 0; i < fss->h; i++)
 	{
@@ -413,43 +625,49 @@ FSSMerge(FSS *fss, FSS *incoming)
 		fss->bitmap_counter[i].count = 0;
 	}
 
-	k = fss->m;
-	for (i = 0; i < fss->m; i++)
+	for (i = 0; i < incoming->m; i++)
 	{
-		bool found = false;
 		MonitoredElement *incoming_elt = &incoming->monitored_elements[i];
+		MonitoredElement *elt;
+		int slot;
 
 		if (!IS_SET(incoming_elt))
 			break;
 
-		for (j = 0; j < fss->m; j++)
+		slot = index_lookup(fss, incoming_elt->value, IS_NULL(incoming_elt) != 0);
+		if (slot < 0)
 		{
-			MonitoredElement *elt = &tmp[j];
+			new[nnew] = *incoming_elt;
+			SET_NEW(&new[nnew]);
+			nnew++;
+			continue;
+		}
 
-			if (!IS_SET(elt))
-				break;
+		elt = &fss->monitored_elements[slot];
+		elt->frequency += incoming_elt->frequency;
+		elt->error += incoming_elt->error;
+		matched[slot] = true;
+	}
 
-			if (incoming_elt->value == elt->value && (IS_NULL(incoming_elt) == IS_NULL(elt)))
-			{
-				elt->frequency += incoming_elt->frequency;
-				elt->error += incoming_elt->error;
-				found = true;
-				break;
-			}
-		}
+	for (i = 0; i < fss->m; i++)
+	{
+		MonitoredElement *elt = &fss->monitored_elements[i];
 
-		if (!found)
-		{
-			tmp[k] = *incoming_elt;
-			SET_NEW(&tmp[k]);
-			k++;
-		}
+		if (!IS_SET(elt))
+			free_elts[nfree++] = *elt;
+		else if (matched[i])
+			summed[nmatched++] = *elt;
+		else
+			kept[nkept++] = *elt;
 	}
 
-	qsort(tmp, k, sizeof(MonitoredElement), element_cmp);
+	qsort(summed, nmatched, sizeof(MonitoredElement), element_cmp);
+
+	nmerged = merge_sorted(kept, nkept, summed, nmatched, tmp, fss->m);
+	nmerged = merge_sorted(tmp, nmerged, new, nnew, result, fss->m);
 
 	/* If we added any new byref elements, we need to rebuild the varlena array */
-	if (k - fss->m > 0 && !fss->typ.typbyval)
+	if (nnew > 0 && !fss->typ.typbyval)
 	{
 		top_k = construct_empty_array(fss->typ.typoid);
 
@@ -459,32 +677,49 @@ FSSMerge(FSS *fss, FSS *incoming)
 		 */
 		for (i = 0; i < fss->m; i++)
 		{
-			MonitoredElement *elt = &tmp[i];
-			Datum value;
-			bool isnull;
-
-			if (!IS_SET(elt))
-				break;
+			MonitoredElement *elt = &result[i];
 
-			if (IS_NEW(elt))
+			if (IS_SET(elt))
 			{
-				value = get_monitored_value(incoming, elt, &isnull);
-				UNSET_NEW(elt);
-			}
-			else
-				value = get_monitored_value(fss, elt, &isnull);
+				Datum value;
+				bool isnull;
 
-			top_k = array_set(top_k, 1, &i, value,
-					isnull, -1, fss->typ.typlen, fss->typ.typbyval, fss->typ.typalign);
+				if (IS_NEW(elt))
+					value = get_monitored_value(incoming, elt, &isnull);
+				else
+					value = get_monitored_value(fss, elt, &isnull);
+
+				top_k = array_set(top_k, 1, &i, value,
+						isnull, -1, fss->typ.typlen, fss->typ.typbyval, fss->typ.typalign);
+			}
 
 			elt->varlen_index = (Datum ) i;
 		}
 
 		fss = fss_resize_topk(fss, top_k);
 	}
+	else if (nnew == 0)
+	{
+		/*
+		 * All of the elements we kept are our own, so hold on to our unset elements as well.
+		 * For byref types, each one of them owns a distinct varlena array index.
+		 */
+		Assert(nmerged + nfree == fss->m);
+		memcpy(&result[nmerged], free_elts, sizeof(MonitoredElement) * nfree);
+	}
 
-	memcpy(fss->monitored_elements, tmp, sizeof(MonitoredElement) * fss->m);
+	for (i = 0; i < nmerged; i++)
+		UNSET_NEW(&result[i]);
+
+	memcpy(fss->monitored_elements, result, sizeof(MonitoredElement) * fss->m);
+
+	pfree(matched);
+	pfree(kept);
+	pfree(summed);
+	pfree(new);
+	pfree(free_elts);
 	pfree(tmp);
+	pfree(result);
 
 	for (i = 0; i < fss->m; i++)
 	{
@@ -496,6 +731,8 @@ FSSMerge(FSS *fss, FSS *incoming)
 		fss->bitmap_counter[elt->counter].count++;
 	}
 
+	index_build(fss);
+
 	fss->count += incoming->count;
 
 	SET_VARSIZE(fss, FSSSize(fss));
@@ -576,7 +813,8 @@ FSSTotal(FSS *fss)
 Size
 FSSSize(FSS *fss)
 {
-	Size sz = sizeof(FSS) + (sizeof(Counter) * fss->h) + (sizeof(MonitoredElement) * fss->m);
+	Size sz = sizeof(FSS) + (sizeof(Counter) * fss->h) + (sizeof(MonitoredElement) * fss->m) +
+			FSS_INDEX_BYTES(fss);
 
 	if (FSS_STORES_DATUMS(fss))
 		sz += ARR_SIZE(fss->top_k);
@@ -52,6 +52,7 @@
 
 #include "pipeline/hll.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/simd.h"
 #include "utils/elog.h"
 #include "utils/palloc.h"
 
@@ -328,65 +329,363 @@
 #define MURMUR_SEED 0xbee5bf4112801383L
 
 /*
- * hll_sparse_to_dense
+ * Register kernels
+ * ===
  *
- * Promote a sparse representation to a dense representation
+ * Unions and cardinality estimation operate on unpacked registers, one byte per register,
+ * which lets us take the max of and sum many registers at once. Dense HLLs are unpacked
+ * in chunks of HLL_UNPACK_CHUNK registers, four registers for every three bytes.
+ *
+ * The max and sum kernels have SSE2 and AVX2 implementations on x86-64, and the best
+ * available implementation is chosen on the first call based on what the CPU supports.
  */
-static HyperLogLog *
-hll_sparse_to_dense(HyperLogLog *sparse)
+#define HLL_UNPACK_CHUNK 1024
+
+static void
+hll_unpack_registers(uint8 *regs, uint8 *packed, int start, int n)
 {
-	HyperLogLog *dense;
-  int idx = 0;
-  int runlen;
-  int regval;
-  uint8 *pos = (uint8 *) sparse->M;
-  uint8 *end = pos + sparse->mlen;
-  Size size;
-  int m = (((1 << sparse->p) * HLL_BITS_PER_REGISTER) / 8);
+	uint8 *p = packed + start * HLL_BITS_PER_REGISTER / 8;
+	int i = 0;
 
-  if (HLL_IS_DENSE(sparse))
-		return sparse;
+	Assert(start % 4 == 0);
+
+#ifndef WORDS_BIGENDIAN
+	/*
+	 * Spread every three bytes into a four byte lane, then shift each register into its own
+	 * byte of that lane
+	 */
+	for (; i + 8 <= n; i += 8)
+	{
+		uint32 lo;
+		uint16 hi;
+		uint64 w;
+
+		memcpy(&lo, p, sizeof(uint32));
+		memcpy(&hi, p + sizeof(uint32), sizeof(uint16));
+		w = (lo & 0xffffff) | ((((uint64) hi << 8) | (lo >> 24)) << 32);
+		w = (w & UINT64CONST(0x0000003f0000003f)) |
+			((w << 2) & UINT64CONST(0x00003f0000003f00)) |
+			((w << 4) & UINT64CONST(0x003f0000003f0000)) |
+			((w << 6) & UINT64CONST(0x3f0000003f000000));
+		memcpy(regs + i, &w, 8);
+		p += 6;
+	}
+#endif
 
-  size = sizeof(HyperLogLog) + m + 1;
-  dense = palloc0(size);
-  dense->card = sparse->card;
-  dense->p = sparse->p;
-  dense->encoding = HLL_IS_CLEAN(sparse) ? HLL_DENSE_CLEAN : HLL_DENSE_DIRTY;
-  dense->mlen = m;
+	for (; i + 4 <= n; i += 4)
+	{
+		regs[i] = p[0] & HLL_REGISTER_MAX;
+		regs[i + 1] = (p[0] >> 6 | p[1] << 2) & HLL_REGISTER_MAX;
+		regs[i + 2] = (p[1] >> 4 | p[2] << 4) & HLL_REGISTER_MAX;
+		regs[i + 3] = p[2] >> 2;
+		p += 3;
+	}
 
-  /*
-   * Read the sparse representation and set non-zero registers
-   * accordingly.
-   */
-  while (pos < end)
-  {
+	for (; i < n; i++)
+		HLL_DENSE_GET_REGISTER(regs[i], packed, (start + i));
+}
+
+static void
+hll_pack_registers(uint8 *packed, uint8 *regs, int n)
+{
+	uint8 *p = packed;
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		p[0] = regs[i] | regs[i + 1] << 6;
+		p[1] = regs[i + 1] >> 2 | regs[i + 2] << 4;
+		p[2] = regs[i + 2] >> 4 | regs[i + 3] << 2;
+		p += 3;
+	}
+
+	for (; i < n; i++)
+		HLL_DENSE_SET_REGISTER(packed, i, regs[i]);
+}
+
+/*
+ * Sets each register in dst to the max of itself and the corresponding register in src
+ */
+static void
+hll_max_registers_scalar(uint8 *dst, uint8 *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = Max(dst[i], src[i]);
+}
+
+/*
+ * Returns the sum of 2^-reg over all registers, and sets ez to the number of zero registers
+ */
+static double
+hll_sum_registers_scalar(uint8 *regs, int n, int *ez)
+{
+	int counts[HLL_REGISTER_MAX + 1];
+	double E = 0;
+	int i;
+
+	MemSet(counts, 0, sizeof(counts));
+
+	for (i = 0; i < n; i++)
+		counts[regs[i]]++;
+
+	for (i = 0; i <= HLL_REGISTER_MAX; i++)
+		E += ldexp(counts[i], -i);
+
+	*ez = counts[0];
+
+	return E;
+}
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+
+/*
+ * 2^-reg is computed directly as a double by subtracting reg from the exponent of 1.0
+ */
+#define DOUBLE_EXP_SHIFT 52
+#define DOUBLE_EXP_BIAS 1023
+
+static void
+hll_max_registers_sse2(uint8 *dst, uint8 *src, int n)
+{
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((__m128i *) (dst + i));
+		__m128i b = _mm_loadu_si128((__m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_max_epu8(a, b));
+	}
+
+	hll_max_registers_scalar(dst + i, src + i, n - i);
+}
+
+static inline __m128d
+sse2_pow2_neg(__m128i v)
+{
+	__m128i e = _mm_sub_epi64(_mm_set1_epi64x(DOUBLE_EXP_BIAS), v);
+
+	return _mm_castsi128_pd(_mm_slli_epi64(e, DOUBLE_EXP_SHIFT));
+}
+
+static double
+hll_sum_registers_sse2(uint8 *regs, int n, int *ez)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+	double lanes[2];
+	double E;
+	int zeroes = 0;
+	int rest;
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i *) (regs + i));
+		__m128i w[2];
+		int j;
+
+		zeroes += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+
+		/* Widen the 16 registers to 64-bit lanes, two at a time */
+		w[0] = _mm_unpacklo_epi8(v, zero);
+		w[1] = _mm_unpackhi_epi8(v, zero);
+
+		for (j = 0; j < 2; j++)
+		{
+			__m128i lo = _mm_unpacklo_epi16(w[j], zero);
+			__m128i hi = _mm_unpackhi_epi16(w[j], zero);
+
+			acc0 = _mm_add_pd(acc0, sse2_pow2_neg(_mm_unpacklo_epi32(lo, zero)));
+			acc1 = _mm_add_pd(acc1, sse2_pow2_neg(_mm_unpackhi_epi32(lo, zero)));
+			acc0 = _mm_add_pd(acc0, sse2_pow2_neg(_mm_unpacklo_epi32(hi, zero)));
+			acc1 = _mm_add_pd(acc1, sse2_pow2_neg(_mm_unpackhi_epi32(hi, zero)));
+		}
+	}
+
+	_mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+	E = lanes[0] + lanes[1];
+
+	E += hll_sum_registers_scalar(regs + i, n - i, &rest);
+	*ez = zeroes + rest;
+
+	return E;
+}
+
+pg_attribute_avx2
+static void
+hll_max_registers_avx2(uint8 *dst, uint8 *src, int n)
+{
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((__m256i *) (dst + i));
+		__m256i b = _mm256_loadu_si256((__m256i *) (src + i));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_max_epu8(a, b));
+	}
+
+	hll_max_registers_scalar(dst + i, src + i, n - i);
+}
+
+pg_attribute_avx2
+static double
+hll_sum_registers_avx2(uint8 *regs, int n, int *ez)
+{
+	__m256i bias = _mm256_set1_epi64x(DOUBLE_EXP_BIAS);
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double lanes[4];
+	double E;
+	int zeroes = 0;
+	int rest;
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i *) (regs + i));
+		__m256i e0, e1, e2, e3;
+
+		zeroes += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+
+		e0 = _mm256_sub_epi64(bias, _mm256_cvtepu8_epi64(v));
+		e1 = _mm256_sub_epi64(bias, _mm256_cvtepu8_epi64(_mm_srli_si128(v, 4)));
+		e2 = _mm256_sub_epi64(bias, _mm256_cvtepu8_epi64(_mm_srli_si128(v, 8)));
+		e3 = _mm256_sub_epi64(bias, _mm256_cvtepu8_epi64(_mm_srli_si128(v, 12)));
+
+		acc0 = _mm256_add_pd(acc0, _mm256_castsi256_pd(_mm256_slli_epi64(e0, DOUBLE_EXP_SHIFT)));
+		acc1 = _mm256_add_pd(acc1, _mm256_castsi256_pd(_mm256_slli_epi64(e1, DOUBLE_EXP_SHIFT)));
+		acc0 = _mm256_add_pd(acc0, _mm256_castsi256_pd(_mm256_slli_epi64(e2, DOUBLE_EXP_SHIFT)));
+		acc1 = _mm256_add_pd(acc1, _mm256_castsi256_pd(_mm256_slli_epi64(e3, DOUBLE_EXP_SHIFT)));
+	}
+
+	_mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+	E = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+	E += hll_sum_registers_scalar(regs + i, n - i, &rest);
+	*ez = zeroes + rest;
+
+	return E;
+}
+
+#endif
+
+static void hll_max_registers_choose(uint8 *dst, uint8 *src, int n);
+static double hll_sum_registers_choose(uint8 *regs, int n, int *ez);
+
+static void (*hll_max_registers) (uint8 *dst, uint8 *src, int n) = hll_max_registers_choose;
+static double (*hll_sum_registers) (uint8 *regs, int n, int *ez) = hll_sum_registers_choose;
+
+/*
+ * These get called on the first call. They replace the function pointers so that
+ * subsequent calls are routed directly to the best available implementation.
+ */
+static void
+hll_choose_kernels(void)
+{
+	hll_max_registers = hll_max_registers_scalar;
+	hll_sum_registers = hll_sum_registers_scalar;
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+	if (pg_avx2_available())
+	{
+		hll_max_registers = hll_max_registers_avx2;
+		hll_sum_registers = hll_sum_registers_avx2;
+	}
+	else
+	{
+		/* configure only defines this if SSE2 is usable without extra CFLAGS */
+		hll_max_registers = hll_max_registers_sse2;
+		hll_sum_registers = hll_sum_registers_sse2;
+	}
+#endif
+}
+
+static void
+hll_max_registers_choose(uint8 *dst, uint8 *src, int n)
+{
+	hll_choose_kernels();
+	hll_max_registers(dst, src, n);
+}
+
+static double
+hll_sum_registers_choose(uint8 *regs, int n, int *ez)
+{
+	hll_choose_kernels();
+	return hll_sum_registers(regs, n, ez);
+}
+
+/*
+ * hll_sparse_unpack
+ *
+ * Set the given unpacked registers from a sparse representation
+ */
+static void
+hll_sparse_unpack(uint8 *regs, HyperLogLog *sparse)
+{
+	int idx = 0;
+	int runlen;
+	uint8 *pos = (uint8 *) sparse->M;
+	uint8 *end = pos + sparse->mlen;
+
+	while (pos < end)
+	{
 		if (HLL_SPARSE_IS_ZERO(pos))
 		{
-			runlen = HLL_SPARSE_ZERO_LEN(pos);
-			idx += runlen;
+			idx += HLL_SPARSE_ZERO_LEN(pos);
 			pos++;
 		}
 		else if (HLL_SPARSE_IS_XZERO(pos))
 		{
-			runlen = HLL_SPARSE_XZERO_LEN(pos);
-			idx += runlen;
+			idx += HLL_SPARSE_XZERO_LEN(pos);
 			pos += 2;
 		}
 		else
 		{
 			runlen = HLL_SPARSE_VAL_LEN(pos);
-			regval = HLL_SPARSE_VAL_VALUE(pos);
-
-			while (runlen--)
-			{
-				HLL_DENSE_SET_REGISTER(dense->M, idx, regval);
-				idx++;
-			}
+			memset(regs + idx, HLL_SPARSE_VAL_VALUE(pos), runlen);
+			idx += runlen;
 			pos++;
 		}
-  }
+	}
+}
+
+/*
+ * hll_sparse_to_dense
+ *
+ * Promote a sparse representation to a dense representation
+ */
+static HyperLogLog *
+hll_sparse_to_dense(HyperLogLog *sparse)
+{
+	HyperLogLog *dense;
+	uint8 *regs;
+	Size size;
+	int m = (((1 << sparse->p) * HLL_BITS_PER_REGISTER) / 8);
+
+	if (HLL_IS_DENSE(sparse))
+		return sparse;
 
-  return dense;
+	size = sizeof(HyperLogLog) + m + 1;
+	dense = palloc0(size);
+	dense->card = sparse->card;
+	dense->p = sparse->p;
+	dense->encoding = HLL_IS_CLEAN(sparse) ? HLL_DENSE_CLEAN : HLL_DENSE_DIRTY;
+	dense->mlen = m;
+
+	/*
+	 * Read the sparse representation into unpacked registers and pack them
+	 */
+	regs = palloc0(1 << sparse->p);
+	hll_sparse_unpack(regs, sparse);
+	hll_pack_registers(dense->M, regs, 1 << sparse->p);
+	pfree(regs);
+
+	return dense;
 }
 
 /*
@@ -994,59 +1293,20 @@ hll_sparse_sum(HyperLogLog *hll, double *PE, int *ezp)
 static double
 hll_dense_sum(HyperLogLog *hll, double *PE, int *ezp)
 {
+  uint8 regs[HLL_UNPACK_CHUNK];
   double E = 0;
-  int j;
   int ez = 0;
   int m = 1 << hll->p;
+  int i;
 
-  if (m == (1 << 14) && HLL_BITS_PER_REGISTER == 6)
-  {
-		/* fast path when p == 14 */
-		uint8 *r = hll->M;
-		unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
-									r10, r11, r12, r13, r14, r15;
-		for (j = 0; j < 1024; j++)
-		{
-			/* handle 16 registers per iteration.*/
-			r0 = r[0] & 63; if (r0 == 0) ez++;
-			r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-			r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-			r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-
-			r4 = r[3] & 63; if (r4 == 0) ez++;
-			r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-			r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-			r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-
-			r8 = r[6] & 63; if (r8 == 0) ez++;
-			r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-			r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-			r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-
-			r12 = r[9] & 63; if (r12 == 0) ez++;
-			r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-			r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-			r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-			E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-					 (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-					 (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-
-			r += 12;
-		}
-  }
-  else
+  for (i = 0; i < m; i += HLL_UNPACK_CHUNK)
   {
-		for (j = 0; j < m; j++) {
-			unsigned long reg;
+		int n = Min(HLL_UNPACK_CHUNK, m - i);
+		int chunk_ez;
 
-			HLL_DENSE_GET_REGISTER(reg, hll->M, j);
-			if (reg == 0)
-				ez++;
-			else
-				E += PE[reg]; /* precomputed 2^(-reg[j]) */
-		}
-		E += ez;
+		hll_unpack_registers(regs, hll->M, i, n);
+		E += hll_sum_registers(regs, n, &chunk_ez);
+		ez += chunk_ez;
   }
 
   *ezp = ez;
@@ -1054,6 +1314,15 @@ hll_dense_sum(HyperLogLog *hll, double *PE, int *ezp)
   return E;
 }
 
+/*
+ * hll_unpacked_sum
+ */
+static double
+hll_unpacked_sum(HyperLogLog *hllu, int *ezp)
+{
+	return hll_sum_registers(hllu->M, 1 << hllu->p, ezp);
+}
+
 /*
  * HLLCreate
  *
@@ -1159,7 +1428,7 @@ HLLAdd(HyperLogLog *hll, void *elem, Size len, int *result)
 		ret->encoding =	HLL_IS_SPARSE(ret) ? HLL_SPARSE_DIRTY :
 				(HLL_IS_DENSE(ret) ? HLL_DENSE_DIRTY : HLL_EXPLICIT_DIRTY);
 
-	SET_VARSIZE(hll, HLLSize(hll));
+	SET_VARSIZE(ret, HLLSize(ret));
 
 	return ret;
 }
@@ -1196,13 +1465,6 @@ HLLCardinality(HyperLogLog *hll)
 		initialized = true;
   }
 
-  /*
-   * XXX(derekjn) This function should accept a (HyperLogLog **) that we can store
-   * this new pointer in for the caller, since it will likely want to use the new HLL.
-   */
-  if (HLL_IS_UNPACKED(hll))
-		hll = HLLPack(hll);
-
   /*
    * If nothing has changed since the last cardinality computation,
    * we can just use the last result
@@ -1210,7 +1472,10 @@ HLLCardinality(HyperLogLog *hll)
   if (HLL_IS_CLEAN(hll))
 		return hll->card;
 
-  if (HLL_IS_DENSE(hll))
+  /* Unpacked HLLs don't cache their cardinality, so always compute it */
+  if (HLL_IS_UNPACKED(hll))
+		E = hll_unpacked_sum(hll, &ez);
+  else if (HLL_IS_DENSE(hll))
   {
 		E = hll_dense_sum(hll, PE, &ez);
 		hll->encoding = HLL_DENSE_CLEAN;
@@ -1277,24 +1542,19 @@ hll_dense_union(HyperLogLog *hllu, HyperLogLog *incoming)
 	if (HLL_IS_UNPACKED(incoming))
 	{
 		/* easy, just take the max of each HLL's registers */
-		for (reg=0; reg<m; reg++)
-		{
-			uint8 v = incoming->M[reg];
-
-			if (v > hllu->M[reg])
-				hllu->M[reg] = v;
-		}
+		hll_max_registers(hllu->M, incoming->M, m);
 	}
 	else if (HLL_IS_DENSE(incoming))
 	{
-		/* easy, just take the max of each HLL's registers */
-		for (reg=0; reg<m; reg++)
+		/* unpack the incoming registers a chunk at a time and take the max of each */
+		uint8 regs[HLL_UNPACK_CHUNK];
+
+		for (reg = 0; reg < m; reg += HLL_UNPACK_CHUNK)
 		{
-			uint8 v;
+			int n = Min(HLL_UNPACK_CHUNK, m - reg);
 
-			HLL_DENSE_GET_REGISTER(v, incoming->M, reg);
-			if (v > hllu->M[reg])
-				hllu->M[reg] = v;
+			hll_unpack_registers(regs, incoming->M, reg, n);
+			hll_max_registers(hllu->M + reg, regs, n);
 		}
 	}
 	else if (HLL_IS_SPARSE(incoming))
@@ -1465,32 +1725,34 @@ HLLUnion(HyperLogLog *result, HyperLogLog *incoming)
 HyperLogLog *
 HLLUnpack(HyperLogLog *initial)
 {
-	int reg;
 	int m = (1 << initial->p);
-	HyperLogLog *result = palloc0(sizeof(HyperLogLog) + m);
+	HyperLogLog *result;
 
-	/*
-	 * We don't support any other unions for now, so just upgrade result
-	 * to the DENSE representation.
-	 */
 	if (HLL_IS_UNPACKED(initial))
 		return initial;
 
-	if (HLL_IS_EXPLICIT(initial))
-		initial = hll_explicit_to_sparse(initial);
-	if (HLL_IS_SPARSE(initial))
-		initial = hll_sparse_to_dense(initial);
-
+	result = palloc0(sizeof(HyperLogLog) + m);
 	result->encoding = HLL_UNPACKED;
 	result->mlen = m;
 	result->p = initial->p;
 
-	for (reg = 0; reg < m; reg++)
+	if (HLL_IS_EXPLICIT(initial))
 	{
-		uint8 v;
-		HLL_DENSE_GET_REGISTER(v, initial->M, reg);
-		result->M[reg] = v;
+		uint8 *pos = initial->M;
+		uint8 *end = initial->M + initial->mlen;
+
+		while (pos < end)
+		{
+			int reg = HLL_EXPLICIT_GET_REGISTER(pos);
+
+			result->M[reg] = Max(result->M[reg], HLL_EXPLICIT_GET_NUM_LEADING(pos));
+			pos += HLL_EXPLICIT_ENTRY_SIZE;
+		}
 	}
+	else if (HLL_IS_SPARSE(initial))
+		hll_sparse_unpack(result->M, initial);
+	else
+		hll_unpack_registers(result->M, initial->M, 0, m);
 
 	SET_VARSIZE(result, HLLSize(result));
 
@@ -1503,7 +1765,6 @@ HLLUnpack(HyperLogLog *initial)
 HyperLogLog *
 HLLPack(HyperLogLog *hllu)
 {
-	int reg;
 	int m = (((1 << hllu->p) * HLL_BITS_PER_REGISTER) / 8);
 	HyperLogLog *result = palloc0(sizeof(HyperLogLog) + m);
 
@@ -1511,10 +1772,7 @@ HLLPack(HyperLogLog *hllu)
 	result->p = hllu->p;
 	result->mlen = m;
 
-	for (reg = 0; reg < hllu->mlen; reg++)
-	{
-		HLL_DENSE_SET_REGISTER(result->M, reg, hllu->M[reg]);
-	}
+	hll_pack_registers(result->M, hllu->M, hllu->mlen);
 
 	SET_VARSIZE(result, HLLSize(result));
 
@@ -14,14 +14,19 @@
 #include "nodes/value.h"
 #include "pipeline/ipc/microbatch.h"
 #include "pipeline/ipc/pzmq.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/miscutils.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "utils/typcache.h"
 
 int continuous_query_batch_size;
 int continuous_query_batch_mem;
 int continuous_query_ipc_hwm;
+int continuous_query_worker_routing;
 
 #define MAX_PACKED_SIZE (MAX_MICROBATCH_SIZE - 2048) /* subtract 2kb for buffer for acks */
 #define MAX_TUPDESC_SIZE(desc) ((desc)->natts * (sizeof(NameData) + (3 * sizeof(int))))
@@ -99,6 +104,8 @@ microbatch_ack_new(StreamInsertLevel level)
 		pg_atomic_write_u32(&ack->num_wacks, 0);
 		pg_atomic_write_u32(&ack->num_wrecv, 0);
 		pg_atomic_write_u32(&ack->num_wtups, 0);
+		ack->created = GetCurrentTimestamp();
+		ack->latch = &MyProc->procLatch;
 
 		/*
 		 * TODO(usmanm): If MAX_MICROBATCHES insert procs crash before freeing their ack,
@@ -117,24 +124,103 @@ microbatch_ack_free(microbatch_ack_t *ack)
 	pg_atomic_write_u64(&ack->id, 0);
 }
 
+/*
+ * ack_wakeup
+ *
+ * Wake up the process waiting on the given ack
+ */
+static inline void
+ack_wakeup(microbatch_ack_t *ack)
+{
+	Latch *latch = ack->latch;
+
+	/*
+	 * The ack may have been freed and reused by another process since we checked it, but the latch
+	 * always points to some PGPROC's latch and a spurious wakeup is harmless.
+	 */
+	if (latch)
+		SetLatch(latch);
+}
+
+void
+microbatch_ack_increment_wrecv(microbatch_ack_t *ack, int n)
+{
+	pg_atomic_fetch_add_u32(&ack->num_wrecv, n);
+
+	if (microbatch_ack_is_received(ack))
+		ack_wakeup(ack);
+}
+
+void
+microbatch_ack_increment_acks(microbatch_ack_t *ack, int n)
+{
+	if (IsContQueryWorkerProcess())
+		pg_atomic_fetch_add_u32(&ack->num_wacks, n);
+	else
+		pg_atomic_fetch_add_u32(&ack->num_cacks, n);
+
+	if (microbatch_ack_is_acked(ack))
+		ack_wakeup(ack);
+}
+
+static inline bool
+ack_is_done(microbatch_ack_t *ack, StreamInsertLevel level)
+{
+	if (level == STREAM_INSERT_SYNCHRONOUS_RECEIVE)
+		return microbatch_ack_is_received(ack);
+
+	Assert(level == STREAM_INSERT_SYNCHRONOUS_COMMIT || level == STREAM_INSERT_FLUSH);
+	return microbatch_ack_is_acked(ack);
+}
+
+/*
+ * Before sleeping on our latch, we spin for a bit in case the ack is about to complete. Just like
+ * spins_per_delay in s_lock.c, the number of spins adapts to how often spinning actually pays off:
+ * it's increased rapidly when an ack completes while spinning and decreased slowly when it doesn't.
+ */
+#define MIN_ACK_SPINS 10
+#define MAX_ACK_SPINS 1000
+#define DEFAULT_ACK_SPINS 100
+
+/*
+ * We still wake up periodically to notice crashed CQ processes, since they'll never ack
+ */
+#define ACK_WAIT_TIMEOUT 100 /* ms */
+
+static int ack_spins = DEFAULT_ACK_SPINS;
+
 bool
 microbatch_ack_wait(microbatch_ack_t *ack, ContQueryDatabaseMetadata *db_meta, uint64 start_generation)
 {
 	bool success = false;
 	uint64 generation;
 	StreamInsertLevel level = microbatch_ack_get_level(ack);
+	int spins;
 
 	if (level == STREAM_INSERT_ASYNCHRONOUS)
 		return true;
 
-	for (;;)
+	for (spins = 0; spins < ack_spins; spins++)
 	{
-		if (level == STREAM_INSERT_SYNCHRONOUS_RECEIVE && microbatch_ack_is_received(ack))
+		if (ack_is_done(ack, level))
 		{
-			success = true;
-			break;
+			ack_spins = Min(ack_spins + 100, MAX_ACK_SPINS);
+			return true;
 		}
-		else if ((level == STREAM_INSERT_SYNCHRONOUS_COMMIT || level == STREAM_INSERT_FLUSH) && microbatch_ack_is_acked(ack))
+
+		pg_spin_delay();
+	}
+
+	ack_spins = Max(ack_spins - 1, MIN_ACK_SPINS);
+
+	for (;;)
+	{
+		int rc;
+
+		/* Reset before checking so that we don't miss a wakeup sent in between */
+		ResetLatch(MyLatch);
+
+		if (ack_is_done(ack, level))
 		{
 			success = true;
 			break;
@@ -147,8 +233,11 @@ microbatch_ack_wait(microbatch_ack_t *ack, ContQueryDatabaseMetadata *db_meta, u
 			break;
 		}
 
-		/* TODO(usmanm): exponential backoff? */
-		pg_usleep(1000);
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, ACK_WAIT_TIMEOUT);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
 		CHECK_FOR_INTERRUPTS();
 	}
 
@@ -222,9 +311,6 @@ microbatch_new(microbatch_type_t type, Bitmapset *queries, TupleDesc desc)
 void
 microbatch_reset(microbatch_t *mb)
 {
-	if (mb->tups)
-		pfree(mb->tups);
-
 	mb->tups = NULL;
 	mb->ntups = 0;
 
@@ -487,25 +573,21 @@ microbatch_unpack(char *buf, int len)
 	memcpy(&mb->ntups, pos, sizeof(int));
 	pos += sizeof(int);
 
-	mb->tups = palloc(sizeof(tagged_ref_t) * mb->ntups);
+	/*
+	 * Tuples are left where they are in the buffer and only have their data pointers fixed up,
+	 * readers walk them sequentially with microbatch_next_tuple().
+	 */
+	mb->tups = pos;
 
 	for (i = 0; i < mb->ntups; i++)
 	{
-		tagged_ref_t *ref = &mb->tups[i];
 		HeapTuple tup = (HeapTuple) pos;
 		pos += HEAPTUPLESIZE;
 		tup->t_data = (HeapTupleHeader) pos;
 		pos += tup->t_len;
 
-		ref->ptr = tup;
-
 		if (mb->type == CombinerTuple)
-		{
-			memcpy(&ref->tag, pos, sizeof(uint64));
 			pos += sizeof(uint64);
-		}
-		else
-			ref->tag = 0;
 	}
 
 	if (mb->type == WorkerTuple)
@@ -550,60 +632,136 @@ microbatch_unpack(char *buf, int len)
 	return mb;
 }
 
-void
-microbatch_send(microbatch_t *mb, uint64 recv_id, bool async, ContQueryDatabaseMetadata *db_meta)
+/*
+ * microbatch_next_tuple
+ *
+ * Returns the tuple packed at the given position of an unpacked microbatch and advances
+ * the position past it. The tuple is not copied and is valid for as long as the buffer
+ * the microbatch was unpacked from.
+ */
+HeapTuple
+microbatch_next_tuple(microbatch_t *mb, char **pos, uint64 *hash)
 {
-	int len;
-	char *buf = microbatch_pack(mb, &len);
+	HeapTuple tup = (HeapTuple) *pos;
+
+	Assert(mb->allow_iter);
+
+	*pos += HEAPTUPLESIZE + tup->t_len;
+
+	if (mb->type == CombinerTuple)
+	{
+		memcpy(hash, *pos, sizeof(uint64));
+		*pos += sizeof(uint64);
+	}
+	else
+		*hash = 0;
+
+	return tup;
+}
 
-	pzmq_connect(recv_id);
+/*
+ * send_to_proc
+ *
+ * Returns whether the microbatch was handed off to the receiver or to a queue process that will
+ * forward it, which can only fail if we're terminating. buf may be repalloc'd for the queue process.
+ */
+static bool
+send_to_proc(ContQueryProc *proc, char **buf, int *len, bool async, ContQueryDatabaseMetadata *db_meta)
+{
+	uint64 recv_id = proc->pzmq_id;
+	bool sent = true;
+	int queue_id;
 
-	if (!async)
+	if (ipc_transport_is_shm())
 	{
+		/*
+		 * Workers and combiners only ever read from their ring buffer, and a blocking write to it
+		 * only gives up if we're terminating.
+		 */
+		sent = shmq_send(proc, *buf, *len, !async);
+		if (!async)
+			return sent;
+	}
+	else if (!async)
+	{
+		pzmq_connect(recv_id);
+
 		/*
 		 * Simple blocking write
 		 */
 		for (;;)
 		{
-			if (pzmq_send(recv_id, buf, len, true))
-				break;
+			if (pzmq_send(recv_id, *buf, *len, true))
+				return true;
 
 			if (get_sigterm_flag())
-				break;
+				return false;
 		}
 	}
-	else if (!pzmq_send(recv_id, buf, len, false))
+	else
 	{
-		/*
-		 * It's an asynchronous write, which works as follows:
-		 *
-		 * 1) Attempt a nonblocking write to the given socket, if it succeeds, we're done
-		 * 2) The nonblocking write failed, so we do a blocking write to the queue process, which
-		 *    will eventually write the batch to the target receiver.
-		 */
-		int queue_id = rand() % continuous_query_num_queues;
-		int offset = continuous_query_num_workers + continuous_query_num_combiners;
+		pzmq_connect(recv_id);
+		sent = pzmq_send(recv_id, *buf, *len, false);
+	}
 
-		/* TODO(derekjn) encapsulate this offset arithmetic in a function */
-		queue_id = db_meta->db_procs[offset + queue_id].pzmq_id;
-		buf = microbatch_pack_for_queue(recv_id, buf, &len);
+	if (sent)
+		return true;
 
-		pzmq_connect(queue_id);
+	/*
+	 * It's an asynchronous write, which works as follows:
+	 *
+	 * 1) Attempt a nonblocking write to the given socket (or ring buffer), if it succeeds, we're done
+	 * 2) The nonblocking write failed, so we do a blocking write to the queue process, which
+	 *    will eventually write the batch to the target receiver.
+	 */
+	queue_id = db_meta->queues[rand() % continuous_query_num_queues].pzmq_id;
 
-		/*
-		 * Async writes are used to prevent blocking write cycles between processes,
-		 * so it might seem strange to do a blocking write here. However, the queue process
-		 * by design will never block indefinitely, so this is fine.
-		 */
-		for (;;)
-		{
-			if (pzmq_send(queue_id, buf, len, true))
-				break;
+	*buf = microbatch_pack_for_queue(recv_id, *buf, len);
 
-			if (get_sigterm_flag())
-				break;
-		}
+	pzmq_connect(queue_id);
+
+	/*
+	 * Async writes are used to prevent blocking write cycles between processes,
+	 * so it might seem strange to do a blocking write here. However, the queue process
+	 * by design will never block indefinitely, so this is fine.
+	 */
+	for (;;)
+	{
+		if (pzmq_send(queue_id, *buf, *len, true))
+			return true;
+
+		if (get_sigterm_flag())
+			return false;
+	}
+}
+
+void
+microbatch_send(microbatch_t *mb, ContQueryProc *proc, bool async, ContQueryDatabaseMetadata *db_meta)
+{
+	int len;
+	char *buf = microbatch_pack(mb, &len);
+	bool sent = false;
+
+	/*
+	 * Count this microbatch against the receiver's load until it has been read. This is done before
+	 * sending it so that the receiver never sees its load drop below what it still has to read, and
+	 * undone if it never gets there.
+	 */
+	pg_atomic_fetch_add_u32(&proc->inflight, mb->ntups);
+
+	PG_TRY();
+	{
+		sent = send_to_proc(proc, &buf, &len, async, db_meta);
+	}
+	PG_CATCH();
+	{
+		pg_atomic_fetch_sub_u32(&proc->inflight, mb->ntups);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+
+	if (!sent)
+		pg_atomic_fetch_sub_u32(&proc->inflight, mb->ntups);
 
 	pfree(buf);
 }
@@ -626,12 +784,91 @@ microbatch_add_acks(microbatch_t *mb, List *acks)
 	MemoryContextSwitchTo(old);
 }
 
+/*
+ * proc_load
+ *
+ * Number of tuples sent to the given proc that it hasn't finished reading. The counter is reset when a
+ * proc restarts, so readers may briefly decrement it below zero and we treat that as idle.
+ */
+static inline int32
+proc_load(ContQueryProc *proc)
+{
+	int32 load = (int32) pg_atomic_read_u32(&proc->inflight);
+	return Max(load, 0);
+}
+
+/*
+ * microbatch_proc_done
+ *
+ * Called by a receiving proc once it's done with a batch of tuples
+ */
+void
+microbatch_proc_done(ContQueryProc *proc, int ntups)
+{
+	if (ntups)
+		pg_atomic_fetch_sub_u32(&proc->inflight, ntups);
+}
+
+/*
+ * choose_worker
+ *
+ * Picks a worker to write to according to continuous_query_worker_routing. Load is measured by
+ * the number of tuples that have been sent to a worker but not yet read by it, so a worker
+ * stuck behind an expensive query stops getting new work until it catches up.
+ */
+static int
+choose_worker(ContQueryDatabaseMetadata *db_meta)
+{
+	int n = db_meta->shard_map.num_workers;
+	int worker_id = rand() % n;
+
+	if (n == 1)
+		return 0;
+
+	switch (continuous_query_worker_routing)
+	{
+		case WORKER_ROUTING_POWER_OF_TWO:
+			{
+				/* Sample a second distinct worker and keep whichever of the two is less loaded */
+				int other = (worker_id + 1 + rand() % (n - 1)) % n;
+
+				if (proc_load(&db_meta->workers[other]) < proc_load(&db_meta->workers[worker_id]))
+					worker_id = other;
+			}
+			break;
+		case WORKER_ROUTING_LEAST_LOADED:
+			{
+				/* Start scanning from a random worker so that ties are spread out */
+				int start = worker_id;
+				int32 min = proc_load(&db_meta->workers[start]);
+				int i;
+
+				for (i = 1; i < n && min > 0; i++)
+				{
+					int id = (start + i) % n;
+					int32 load = proc_load(&db_meta->workers[id]);
+
+					if (load < min)
+					{
+						min = load;
+						worker_id = id;
+					}
+				}
+			}
+			break;
+		default:
+			break;
+	}
+
+	return worker_id;
+}
+
 void
 microbatch_send_to_worker(microbatch_t *mb, int worker_id)
 {
 	ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
-	int recv_id;
 	bool async = false;
+	uint32 pin = ContQueryShardMapPin(db_meta, false);
 
 	if (worker_id == -1)
 	{
@@ -641,7 +878,7 @@ microbatch_send_to_worker(microbatch_t *mb, int worker_id)
 			 * Combiners need to shard over workers so that updates to a specific group are always
 			 * written in order to the output stream.
 			 */
-			worker_id = MyContQueryProc->group_id % continuous_query_num_workers;
+			worker_id = MyContQueryProc->group_id % db_meta->shard_map.num_workers;
 
 			/*
 			 * It's a combiner -> worker (output stream) write, so we need the write to be asynchronous
@@ -651,7 +888,7 @@ microbatch_send_to_worker(microbatch_t *mb, int worker_id)
 		}
 		else if (IsContQueryWorkerProcess())
 		{
-			worker_id = rand() % continuous_query_num_workers;
+			worker_id = choose_worker(db_meta);
 
 			/*
 			 * It's a worker -> worker write, which means we're a transform writing to a stream.
@@ -665,15 +902,12 @@ microbatch_send_to_worker(microbatch_t *mb, int worker_id)
 			 * We're a client write process (INSERT or COPY), so we can do a blocking write to the worker
 			 * proc because blocking write cycles are not possible in this case.
 			 */
-
-			/* TODO(usmanm): Poll all workers and send to first non-blocking one? */
-			worker_id = rand() % continuous_query_num_workers;
+			worker_id = choose_worker(db_meta);
 		}
 	}
 
-	recv_id = db_meta->db_procs[worker_id].pzmq_id;
-
-	microbatch_send(mb, recv_id, async, db_meta);
+	microbatch_send(mb, &db_meta->workers[worker_id], async, db_meta);
+	ContQueryShardMapUnpin(db_meta, pin);
 	microbatch_reset(mb);
 }
 
@@ -681,13 +915,19 @@ void
 microbatch_send_to_combiner(microbatch_t *mb, int combiner_id)
 {
 	static ContQueryDatabaseMetadata *db_meta = NULL;
-	int recv_id;
+
+	/*
+	 * Combiner -> combiner writes (partial results being merged by the owning combiner) must be asynchronous
+	 * to prevent blocking write cycles between combiner procs.
+	 */
+	bool async = IsContQueryCombinerProcess();
 
 	if (!db_meta)
 		db_meta = GetContQueryDatabaseMetadata(MyDatabaseId);
 
-	recv_id = db_meta->db_procs[continuous_query_num_workers + combiner_id].pzmq_id;
+	microbatch_send(mb, &db_meta->combiners[combiner_id], async, db_meta);
 
-	microbatch_send(mb, recv_id, false, db_meta);
+	/* Lets the scheduler tell whether partials were in flight while it checked combiners for any */
+	pg_atomic_fetch_add_u64(&db_meta->shard_map.combiner_sends, 1);
 	microbatch_reset(mb);
 }
@@ -13,27 +13,54 @@
 #include "pipeline/ipc/microbatch.h"
 #include "pipeline/ipc/pzmq.h"
 #include "pipeline/ipc/reader.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/scheduler.h"
+#include "pipeline/stream_route.h"
 #include "utils/memutils.h"
 #include "utils/timestamp.h"
 
 typedef struct ipc_tuple_reader_scan
 {
 	ListCell *batch;
+	int batch_start;
 	int tup_idx;
+	char *tup_pos;
+	microbatch_t *routed_batch;
 	bool scan_started;
 	bool exhausted;
 } ipc_tuple_reader_scan;
 
-static ipc_tuple_reader_scan my_rscan = { NULL, -1, false, false };
+static ipc_tuple_reader_scan my_rscan = { NULL, 0, -1, NULL, NULL, false, false };
 static ipc_tuple_reader_batch my_rbatch = { NULL, false, NULL, 0, 0 };
 static ipc_tuple my_rscan_tup;
 
+/*
+ * Workers route the tuples of each batch to the queries whose predicates they can match, see
+ * stream_route.c. Routed queries then only read the batch positions routed to them.
+ */
+typedef struct ipc_tuple_ref
+{
+	microbatch_t *mb;
+	HeapTuple tup;
+} ipc_tuple_ref;
+
+typedef struct ipc_tuple_route
+{
+	int ntups;
+	int size;
+	int *tups;
+} ipc_tuple_route;
+
 typedef struct ipc_tuple_reader
 {
 	MemoryContext cxt;
 	List *batches;
 	List *flush_acks;
+
+	/* only set if some of this batch's queries are routed */
+	ipc_tuple_ref *refs;
+	ipc_tuple_route **routes;
 } ipc_tuple_reader;
 
 static ipc_tuple_reader *my_reader = NULL;
@@ -70,6 +97,129 @@ ipc_tuple_reader_destroy(void)
 	my_reader->cxt = NULL;
 }
 
+bool
+ipc_tuple_reader_poll(int timeout)
+{
+	if (shmq_is_bound())
+		return shmq_poll(timeout);
+
+	return pzmq_poll(timeout);
+}
+
+/*
+ * recv_batch
+ *
+ * Microbatches received over pzmq are copied into our memory context, while those
+ * received through a shmq ring buffer are returned in place and stay valid until
+ * the reader is reset.
+ */
+static char *
+recv_batch(int *len, int timeout)
+{
+	if (shmq_is_bound())
+	{
+		char *buf = shmq_recv(len);
+
+		if (!buf && shmq_poll(timeout))
+			buf = shmq_recv(len);
+
+		return buf;
+	}
+
+	return pzmq_recv(len, timeout);
+}
+
+static void
+route_add(ipc_tuple_route *route, int idx)
+{
+	if (route->ntups == route->size)
+	{
+		route->size = Max(route->size * 2, 64);
+		if (route->tups)
+			route->tups = repalloc(route->tups, sizeof(int) * route->size);
+		else
+			route->tups = palloc(sizeof(int) * route->size);
+	}
+
+	route->tups[route->ntups++] = idx;
+}
+
+/*
+ * route_batch
+ *
+ * Finds the batch positions each routed query needs to read, and removes routed queries that
+ * none of the batch's tuples were routed to from the batch's queries
+ */
+static void
+route_batch(void)
+{
+	Bitmapset *routed = StreamRouteGetQueries();
+	int matches[MAX_CQS];
+	MemoryContext old;
+	ListCell *lc;
+	int idx = 0;
+	int q;
+
+	if (!bms_overlap(routed, my_rbatch.queries))
+		return;
+
+	old = MemoryContextSwitchTo(my_reader->cxt);
+
+	my_reader->refs = palloc(sizeof(ipc_tuple_ref) * my_rbatch.ntups);
+	my_reader->routes = palloc0(sizeof(ipc_tuple_route *) * MAX_CQS);
+
+	foreach(lc, my_reader->batches)
+	{
+		microbatch_t *mb = (microbatch_t *) lfirst(lc);
+		Bitmapset *queries = bms_intersect(mb->queries, routed);
+		StreamRouter *router;
+		char *pos;
+		int i;
+
+		if (bms_is_empty(queries))
+		{
+			idx += mb->ntups;
+			continue;
+		}
+
+		q = -1;
+		while ((q = bms_next_member(queries, q)) >= 0)
+		{
+			if (my_reader->routes[q] == NULL)
+				my_reader->routes[q] = palloc0(sizeof(ipc_tuple_route));
+		}
+
+		router = StreamRouteBegin(mb->desc, queries);
+		pos = mb->tups;
+
+		for (i = 0; i < mb->ntups; i++, idx++)
+		{
+			uint64 hash;
+			int n;
+			int j;
+
+			my_reader->refs[idx].mb = mb;
+			my_reader->refs[idx].tup = microbatch_next_tuple(mb, &pos, &hash);
+
+			n = StreamRouteTuple(router, my_reader->refs[idx].tup, matches);
+			for (j = 0; j < n; j++)
+				route_add(my_reader->routes[matches[j]], idx);
+		}
+
+		StreamRouteEnd(router);
+		bms_free(queries);
+	}
+
+	q = -1;
+	while ((q = bms_next_member(routed, q)) >= 0)
+	{
+		if (my_reader->routes[q] && my_reader->routes[q]->ntups == 0)
+			my_rbatch.queries = bms_del_member(my_rbatch.queries, q);
+	}
+
+	MemoryContextSwitchTo(old);
+}
+
 ipc_tuple_reader_batch *
 ipc_tuple_reader_pull(void)
 {
@@ -103,7 +253,7 @@ ipc_tuple_reader_pull(void)
 		if (timeout <= 0)
 			break;
 
-		buf = pzmq_recv(&len, timeout);
+		buf = recv_batch(&len, timeout);
 		if (!buf)
 			continue;
 
@@ -174,6 +324,9 @@ ipc_tuple_reader_pull(void)
 
 	my_reader->flush_acks = flush_acks;
 
+	if (IsContQueryWorkerProcess())
+		route_batch();
+
 	return &my_rbatch;
 }
 
@@ -181,8 +334,16 @@ void
 ipc_tuple_reader_reset(void)
 {
 	MemoryContextReset(my_reader->cxt);
+	shmq_release();
+
+	if (MyContQueryProc)
+		microbatch_proc_done(MyContQueryProc, my_rbatch.ntups);
+	my_rbatch.ntups = 0;
+
 	my_reader->batches = NIL;
 	my_reader->flush_acks = NIL;
+	my_reader->refs = NULL;
+	my_reader->routes = NULL;
 	ipc_tuple_reader_rewind();
 }
 
@@ -200,9 +361,76 @@ ipc_tuple_reader_ack(void)
 	microbatch_acks_check_and_exec(my_reader->flush_acks, microbatch_ack_increment_acks, 1);
 }
 
+/*
+ * add_sync_acks
+ *
+ * Adds the acks of a microbatch the current query has started reading to the batch's sync acks
+ */
+static void
+add_sync_acks(microbatch_t *mb)
+{
+	ListCell *lc;
+	MemoryContext old;
+
+	/*
+	 * Instead of using the ContQueryBatchContext we use the CacheMemoryContext
+	 * since these acks could be used by the combiner across batches and transactions
+	 * when in async mode.
+	 */
+	old = MemoryContextSwitchTo(ContQueryTransactionContext);
+
+	foreach(lc, mb->acks)
+	{
+		tagged_ref_t *ref = palloc(sizeof(tagged_ref_t));
+		*ref = *(tagged_ref_t *) lfirst(lc);
+
+		my_rbatch.sync_acks = lappend(my_rbatch.sync_acks, ref);
+	}
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * read_routed
+ *
+ * Returns the next tuple that was routed to the current query
+ */
+static ipc_tuple *
+read_routed(ipc_tuple_route *route)
+{
+	ipc_tuple_ref *ref;
+	int idx;
+
+	my_rscan.tup_idx++;
+	if (my_rscan.tup_idx >= route->ntups)
+	{
+		my_rscan.exhausted = true;
+		return NULL;
+	}
+
+	idx = route->tups[my_rscan.tup_idx];
+	ref = &my_reader->refs[idx];
+
+	/* routed positions are in order, so each microbatch's tuples are contiguous */
+	if (ref->mb != my_rscan.routed_batch)
+	{
+		my_rscan.routed_batch = ref->mb;
+		my_rscan_tup.desc = ref->mb->desc;
+
+		if (ref->mb->acks)
+			add_sync_acks(ref->mb);
+	}
+
+	my_rscan_tup.tup = ref->tup;
+	my_rscan_tup.idx = idx;
+
+	return &my_rscan_tup;
+}
+
 static inline ipc_tuple *
-read_from_next_batch(Oid query_id)
+read_from_next_batch(microbatch_t *mb, Oid query_id)
 {
+	my_rscan.batch_start += mb->ntups;
 	my_rscan.batch = lnext(my_rscan.batch);
 	my_rscan.tup_idx = -1;
 	return ipc_tuple_reader_next(query_id);
@@ -212,11 +440,13 @@ ipc_tuple *
 ipc_tuple_reader_next(Oid query_id)
 {
 	microbatch_t *mb;
-	tagged_ref_t *ref;
 
 	if (my_rscan.exhausted)
 		return NULL;
 
+	if (my_reader->routes && my_reader->routes[query_id])
+		return read_routed(my_reader->routes[query_id]);
+
 	/* Are we started a new reader scan? */
 	if (!my_rscan.scan_started)
 	{
@@ -237,49 +467,28 @@ ipc_tuple_reader_next(Oid query_id)
 
 	/* If this microbatch isn't for the desired query, skip it */
 	if (!bms_is_member(query_id, mb->queries) || !mb->ntups)
-		return read_from_next_batch(query_id);
+		return read_from_next_batch(mb, query_id);
 
 	/* Have we started reading this microbatch? */
 	if (my_rscan.tup_idx == -1)
 	{
 		my_rscan.tup_idx = 0;
+		my_rscan.tup_pos = mb->tups;
 		my_rscan_tup.desc = mb->desc;
 
 		if (mb->acks)
-		{
-			ListCell *lc;
-			MemoryContext old;
-
-			/*
-			 * Instead of using the ContQueryBatchContext we use the CacheMemoryContext
-			 * since these acks could be used by the combiner across batches and transactions
-			 * when in async mode.
-			 */
-			old = MemoryContextSwitchTo(ContQueryTransactionContext);
-
-			foreach(lc, mb->acks)
-			{
-				tagged_ref_t *ref = palloc(sizeof(tagged_ref_t));
-				*ref = *(tagged_ref_t *) lfirst(lc);
-
-				my_rbatch.sync_acks = lappend(my_rbatch.sync_acks, ref);
-			}
-
-			MemoryContextSwitchTo(old);
-		}
+			add_sync_acks(mb);
 	}
 	else
 	{
 		my_rscan.tup_idx++;
 		if (my_rscan.tup_idx == mb->ntups)
-			return read_from_next_batch(query_id);
+			return read_from_next_batch(mb, query_id);
 	}
 
 	Assert(my_rscan.tup_idx < mb->ntups);
-	ref = &mb->tups[my_rscan.tup_idx];
-
-	my_rscan_tup.tup = (HeapTuple) ref->ptr;
-	my_rscan_tup.hash = ref->tag;
+	my_rscan_tup.tup = microbatch_next_tuple(mb, &my_rscan.tup_pos, &my_rscan_tup.hash);
+	my_rscan_tup.idx = my_rscan.batch_start + my_rscan.tup_idx;
 
 	return &my_rscan_tup;
 }
@@ -0,0 +1,531 @@
+/*-------------------------------------------------------------------------
+ *
+ * shmq.c
+ *	  Multi-producer, single-consumer shared memory ring buffers used as an
+ *	  alternative to pzmq for delivering microbatches to worker and combiner
+ *	  processes.
+ *
+ * Each worker and combiner creates a DSM segment holding its ring buffer on
+ * startup and advertises the segment's handle in its ContQueryProc. Producers
+ * attach lazily, reserve space under a spinlock, copy the packed microbatch
+ * in without holding the lock and then publish the entry. The consumer reads
+ * published entries in place and only releases the space they occupy once the
+ * whole batch has been processed, so tuples are never copied out of the ring.
+ * Producers that find the ring full leave their latch behind and are woken up
+ * as soon as the consumer releases space.
+ *
+ * Copyright (c) 2013-2016, PipelineDB
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pipeline/ipc/shmq.h"
+#include "pipeline/miscutils.h"
+#include "pipeline/placement.h"
+#include "port/atomics.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/spin.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#define SHMQ_ENTRY_RESERVED 0
+#define SHMQ_ENTRY_READY 1
+#define SHMQ_ENTRY_WRAP 2
+
+/* How long a waiting producer sleeps if it couldn't ask to be woken up */
+#define SHMQ_WAIT_TIMEOUT 1 /* 1ms */
+#define SHMQ_MAX_WAITERS 64
+
+typedef struct shmq_entry_t
+{
+	pg_atomic_uint32 state;
+	int len;
+} shmq_entry_t;
+
+#define SHMQ_ENTRY_HDRSZ MAXALIGN(sizeof(shmq_entry_t))
+#define SHMQ_ENTRY_SIZE(len) (SHMQ_ENTRY_HDRSZ + MAXALIGN(len))
+
+typedef struct shmq_t
+{
+	slock_t mutex;
+	Size size;
+	/* next byte to be reserved by a producer */
+	uint64 head;
+	/* first byte still in use by the consumer */
+	uint64 tail;
+	Latch *consumer_latch;
+	/* producers waiting for the consumer to release space */
+	int nwaiters;
+	Latch *waiters[SHMQ_MAX_WAITERS];
+	char bytes[FLEXIBLE_ARRAY_MEMBER];
+} shmq_t;
+
+#define SHMQ_HDRSZ MAXALIGN(offsetof(shmq_t, bytes))
+
+typedef struct shmq_dest_t
+{
+	ContQueryProc *proc;
+	dsm_handle handle;
+	dsm_segment *seg;
+	shmq_t *shmq;
+} shmq_dest_t;
+
+typedef struct shmq_state_t
+{
+	MemoryContext mem_cxt;
+	HTAB *dests;
+
+	/* consumer side, only set for the ring this process owns */
+	dsm_segment *seg;
+	shmq_t *me;
+	uint64 read_pos;
+} shmq_state_t;
+
+int continuous_query_ipc_transport = IPC_TRANSPORT_ZMQ;
+int continuous_query_ipc_shared_mem;
+
+static shmq_state_t *shmq_state = NULL;
+
+static void
+shmq_init(void)
+{
+	MemoryContext cxt;
+	MemoryContext old;
+	shmq_state_t *ss;
+	HASHCTL ctl;
+
+	if (shmq_state)
+		return;
+
+	cxt = AllocSetContextCreate(TopMemoryContext, "shmq MemoryContext",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+
+	old = MemoryContextSwitchTo(cxt);
+
+	ss = palloc0(sizeof(shmq_state_t));
+	ss->mem_cxt = cxt;
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(ContQueryProc *);
+	ctl.entrysize = sizeof(shmq_dest_t);
+	ctl.hcxt = cxt;
+	ctl.hash = tag_hash;
+	ss->dests = hash_create("shmq dests HTAB", continuous_query_num_workers + continuous_query_num_combiners,
+			&ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	MemoryContextSwitchTo(old);
+
+	shmq_state = ss;
+}
+
+/*
+ * shmq_bind
+ *
+ * Create the ring buffer for the given process and advertise it to producers
+ */
+void
+shmq_bind(ContQueryProc *proc)
+{
+	Size size = MAXALIGN((Size) continuous_query_ipc_shared_mem * 1024);
+	dsm_segment *seg;
+	shmq_t *shmq;
+
+	Assert(ShmqIsReceiver(proc));
+	Assert(proc == MyContQueryProc);
+
+	shmq_init();
+
+	if (shmq_state->me)
+		elog(ERROR, "shmq is already bound");
+
+	seg = dsm_create(SHMQ_HDRSZ + size, 0);
+	dsm_pin_mapping(seg);
+
+	shmq = (shmq_t *) dsm_segment_address(seg);
+	MemSet(shmq, 0, SHMQ_HDRSZ);
+
+	/*
+	 * Touch the whole ring now so that its pages are allocated on our NUMA node rather than on
+	 * that of whichever producer first writes to them
+	 */
+	if (ContQueryProcIsPlaced())
+		MemSet((char *) shmq + SHMQ_HDRSZ, 0, size);
+	SpinLockInit(&shmq->mutex);
+	shmq->size = size;
+	shmq->head = 0;
+	shmq->tail = 0;
+	shmq->consumer_latch = MyLatch;
+
+	shmq_state->seg = seg;
+	shmq_state->me = shmq;
+	shmq_state->read_pos = 0;
+
+	pg_write_barrier();
+	proc->shmq_handle = dsm_segment_handle(seg);
+}
+
+bool
+shmq_is_bound(void)
+{
+	return shmq_state && shmq_state->me;
+}
+
+void
+shmq_destroy(void)
+{
+	HASH_SEQ_STATUS iter;
+	shmq_dest_t *dest;
+
+	if (!shmq_state)
+		return;
+
+	hash_seq_init(&iter, shmq_state->dests);
+	while ((dest = (shmq_dest_t *) hash_seq_search(&iter)) != NULL)
+	{
+		if (dest->seg)
+			dsm_detach(dest->seg);
+	}
+
+	if (shmq_state->me)
+	{
+		MyContQueryProc->shmq_handle = 0;
+		dsm_detach(shmq_state->seg);
+	}
+
+	MemoryContextDelete(shmq_state->mem_cxt);
+
+	shmq_state = NULL;
+}
+
+/*
+ * get_dest
+ *
+ * Returns the ring buffer currently advertised by the given process, (re)attaching to it
+ * if the process was restarted since we last sent to it
+ */
+static shmq_t *
+get_dest(ContQueryProc *proc)
+{
+	shmq_dest_t *dest;
+	dsm_handle handle;
+	bool found;
+
+	if (proc == MyContQueryProc && shmq_state->me)
+		return shmq_state->me;
+
+	handle = proc->shmq_handle;
+	pg_read_barrier();
+
+	dest = (shmq_dest_t *) hash_search(shmq_state->dests, &proc, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		MemSet(dest, 0, sizeof(shmq_dest_t));
+		dest->proc = proc;
+	}
+
+	if (dest->seg && dest->handle == handle)
+		return dest->shmq;
+
+	if (dest->seg)
+	{
+		dsm_detach(dest->seg);
+		dest->seg = NULL;
+		dest->shmq = NULL;
+	}
+
+	/* The receiver hasn't created its ring buffer yet */
+	if (handle == 0)
+		return NULL;
+
+	dest->seg = dsm_attach(handle);
+
+	/* The receiver went away while we were attaching */
+	if (dest->seg == NULL)
+		return NULL;
+
+	dsm_pin_mapping(dest->seg);
+	dest->handle = handle;
+	dest->shmq = (shmq_t *) dsm_segment_address(dest->seg);
+
+	return dest->shmq;
+}
+
+/*
+ * add_waiter
+ *
+ * Asks the consumer to set the given latch the next time it releases space. The caller must
+ * hold the ring's mutex.
+ */
+static void
+add_waiter(shmq_t *shmq, Latch *latch)
+{
+	int i;
+
+	for (i = 0; i < shmq->nwaiters; i++)
+		if (shmq->waiters[i] == latch)
+			return;
+
+	/* Too many producers are waiting already, so this one will have to poll */
+	if (shmq->nwaiters == SHMQ_MAX_WAITERS)
+		return;
+
+	shmq->waiters[shmq->nwaiters++] = latch;
+}
+
+/*
+ * reserve
+ *
+ * Reserves a contiguous entry of the given length, returns NULL if there isn't enough
+ * free space in the ring buffer, in which case waiter will be set once there may be
+ */
+static shmq_entry_t *
+reserve(shmq_t *shmq, int len, Latch *waiter)
+{
+	Size needed = SHMQ_ENTRY_SIZE(len);
+	Size pos;
+	Size contiguous;
+	Size total;
+	shmq_entry_t *entry;
+
+	SpinLockAcquire(&shmq->mutex);
+
+	pos = shmq->head % shmq->size;
+	contiguous = shmq->size - pos;
+	total = needed;
+
+	/* Entries never wrap around, so we skip whatever is left at the end of the buffer */
+	if (contiguous < needed)
+		total += contiguous;
+
+	if (shmq->size - (shmq->head - shmq->tail) < total)
+	{
+		if (waiter)
+			add_waiter(shmq, waiter);
+		SpinLockRelease(&shmq->mutex);
+		return NULL;
+	}
+
+	if (contiguous < needed)
+	{
+		entry = (shmq_entry_t *) (shmq->bytes + pos);
+		entry->len = contiguous;
+		pg_atomic_init_u32(&entry->state, SHMQ_ENTRY_WRAP);
+
+		shmq->head += contiguous;
+		pos = 0;
+	}
+
+	entry = (shmq_entry_t *) (shmq->bytes + pos);
+	entry->len = len;
+	pg_atomic_init_u32(&entry->state, SHMQ_ENTRY_RESERVED);
+
+	shmq->head += needed;
+
+	SpinLockRelease(&shmq->mutex);
+
+	return entry;
+}
+
+/*
+ * shmq_send
+ *
+ * Copies the given buffer into the ring buffer of the given process. If wait is true,
+ * this blocks until there is enough space and only returns false if we were asked to
+ * terminate in the meantime.
+ */
+bool
+shmq_send(ContQueryProc *proc, char *buf, int len, bool wait)
+{
+	shmq_entry_t *entry = NULL;
+	shmq_t *shmq;
+
+	Assert(ShmqIsReceiver(proc));
+
+	if (len > SHMQ_MAX_MESSAGE_SIZE)
+		elog(ERROR, "shmq message of size %d exceeds the maximum size of %d", len, (int) SHMQ_MAX_MESSAGE_SIZE);
+
+	shmq_init();
+
+	for (;;)
+	{
+		int rc;
+
+		/* Reset before reserving, so that a release in between still wakes us up */
+		if (wait)
+			ResetLatch(MyLatch);
+
+		shmq = get_dest(proc);
+
+		if (shmq)
+			entry = reserve(shmq, len, wait ? MyLatch : NULL);
+
+		if (entry || !wait)
+			break;
+
+		if (get_sigterm_flag())
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/*
+		 * The timeout covers receivers that aren't up yet or were restarted, and producers that
+		 * couldn't be added to the waiters
+		 */
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, SHMQ_WAIT_TIMEOUT);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	if (!entry)
+		return false;
+
+	memcpy((char *) entry + SHMQ_ENTRY_HDRSZ, buf, len);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&entry->state, SHMQ_ENTRY_READY);
+
+	SetLatch(shmq->consumer_latch);
+
+	return true;
+}
+
+/*
+ * next_entry
+ *
+ * Returns the next published entry after read_pos, skipping over wrap markers
+ */
+static shmq_entry_t *
+next_entry(void)
+{
+	shmq_t *shmq = shmq_state->me;
+	uint64 head;
+
+	SpinLockAcquire(&shmq->mutex);
+	head = shmq->head;
+	SpinLockRelease(&shmq->mutex);
+
+	while (shmq_state->read_pos < head)
+	{
+		shmq_entry_t *entry = (shmq_entry_t *) (shmq->bytes + shmq_state->read_pos % shmq->size);
+		uint32 state = pg_atomic_read_u32(&entry->state);
+
+		/* The producer is still copying this entry in, and we must consume in order */
+		if (state == SHMQ_ENTRY_RESERVED)
+			return NULL;
+
+		pg_read_barrier();
+
+		if (state == SHMQ_ENTRY_READY)
+			return entry;
+
+		Assert(state == SHMQ_ENTRY_WRAP);
+		shmq_state->read_pos += entry->len;
+	}
+
+	return NULL;
+}
+
+/*
+ * shmq_recv
+ *
+ * Returns a pointer to the next message in our ring buffer, or NULL if there is none.
+ * The message stays valid until shmq_release() is called.
+ */
+char *
+shmq_recv(int *len)
+{
+	shmq_entry_t *entry;
+
+	if (!shmq_is_bound())
+		elog(ERROR, "shmq is not bound");
+
+	entry = next_entry();
+	if (!entry)
+	{
+		*len = 0;
+		return NULL;
+	}
+
+	shmq_state->read_pos += SHMQ_ENTRY_SIZE(entry->len);
+	*len = entry->len;
+
+	return (char *) entry + SHMQ_ENTRY_HDRSZ;
+}
+
+/*
+ * shmq_poll
+ *
+ * Waits up to timeout ms for a message to be published to our ring buffer
+ */
+bool
+shmq_poll(int timeout)
+{
+	TimestampTz start = GetCurrentTimestamp();
+
+	if (!shmq_is_bound())
+		elog(ERROR, "shmq is not bound");
+
+	for (;;)
+	{
+		long secs;
+		int usecs;
+		long remaining;
+		int rc;
+
+		ResetLatch(MyLatch);
+
+		if (next_entry())
+			return true;
+
+		if (get_sigterm_flag())
+			return false;
+
+		TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+		remaining = timeout - (secs * 1000 + usecs / 1000);
+		if (remaining <= 0)
+			return false;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, remaining);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+}
+
+/*
+ * shmq_release
+ *
+ * Releases all messages returned by shmq_recv() back to the producers
+ */
+void
+shmq_release(void)
+{
+	shmq_t *shmq;
+	Latch *waiters[SHMQ_MAX_WAITERS];
+	int nwaiters;
+	int i;
+
+	if (!shmq_is_bound())
+		return;
+
+	shmq = shmq_state->me;
+
+	SpinLockAcquire(&shmq->mutex);
+	shmq->tail = shmq_state->read_pos;
+	nwaiters = shmq->nwaiters;
+	memcpy(waiters, shmq->waiters, sizeof(Latch *) * nwaiters);
+	shmq->nwaiters = 0;
+	SpinLockRelease(&shmq->mutex);
+
+	for (i = 0; i < nwaiters; i++)
+		SetLatch(waiters[i]);
+}
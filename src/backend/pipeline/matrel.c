@@ -12,18 +12,41 @@
  */
 #include "postgres.h"
 
+#include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/xact.h"
+#include "catalog/dependency.h"
 #include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
 #include "executor/executor.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
+#include "nodes/makefuncs.h"
 #include "pipeline/matrel.h"
 #include "pipeline/miscutils.h"
+#include "storage/lmgr.h"
+#include "utils/builtins.h"
 #include "utils/rel.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+/*
+ * A TTL partition is created along with its indexes, which LIKE copies from the matrel, and then
+ * attached to the matrel. Attaching it separately avoids a NOTICE for every merged column.
+ */
+#define CREATE_PARTITION_TEMPLATE "CREATE TABLE %s.%s (LIKE %s.%s INCLUDING DEFAULTS INCLUDING INDEXES INCLUDING STORAGE, " \
+	"CHECK (%s >= %s::%s AND %s < %s::%s)) WITH (fillfactor = %d); ALTER TABLE %s.%s INHERIT %s.%s"
+
+/*
+ * Expired partitions are kept around a little longer than their TTL, since combiners cache the plans
+ * they look up existing groups with for up to 10 seconds, and those may still scan them
+ */
+#define PARTITION_DROP_DELAY_S 20
 
 bool continuous_query_materialization_table_updatable;
 
@@ -146,21 +169,18 @@ ExecInsertCQMatRelIndexTuples(ResultRelInfo *indstate, TupleTableSlot *slot, ESt
 }
 
 /*
- * ExecCQMatViewUpdate
+ * ExecCQMatRelCheckConstraints
  *
- * Update an existing row of a CV materialization table.
+ * Checks a row's constraints before it's written to a CV materialization table. Returns false
+ * if any of them fail, without failing the entire sync transaction.
  */
-void
-ExecCQMatRelUpdate(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate)
+bool
+ExecCQMatRelCheckConstraints(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate)
 {
-	HeapTuple tup;
 	bool result = true;
 
 	if (ri->ri_RelationDesc->rd_att->constr)
 	{
-		/*
-		 * We don't want the entire sync transaction to fail when a constraint fails
-		 */
 		PG_TRY();
 		{
 			ExecConstraints(ri, slot, estate);
@@ -175,53 +195,106 @@ ExecCQMatRelUpdate(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate)
 		PG_END_TRY();
 	}
 
-	if (!result)
-		return;
+	return result;
+}
+
+/*
+ * ExecCQMatViewUpdate
+ *
+ * Update an existing row of a CV materialization table. Returns false if the
+ * row violated a constraint and wasn't updated.
+ *
+ * Combiners never modify group columns, and the only indexes on a matrel are on group
+ * columns or the primary key, so updates are HOT whenever the page has room (see
+ * continuous_view_fillfactor) and then don't touch any indexes.
+ */
+bool
+ExecCQMatRelUpdate(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate)
+{
+	HeapTuple tup;
+
+	if (!ExecCQMatRelCheckConstraints(ri, slot, estate))
+		return false;
 
 	tup = ExecMaterializeSlot(slot);
 	simple_heap_update(ri->ri_RelationDesc, &tup->t_self, tup);
 
 	if (!HeapTupleIsHeapOnly(tup))
 		ExecInsertCQMatRelIndexTuples(ri, slot, estate);
+
+	return true;
 }
 
 /*
  * ExecCQMatViewInsert
  *
- * Insert a new row into a CV materialization table
+ * Insert a new row into a CV materialization table. Returns false if the
+ * row violated a constraint and wasn't inserted.
  */
-void
+bool
 ExecCQMatRelInsert(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate)
 {
 	HeapTuple tup;
-	bool result = true;
 
-	if (ri->ri_RelationDesc->rd_att->constr)
+	if (!ExecCQMatRelCheckConstraints(ri, slot, estate))
+		return false;
+
+	tup = ExecMaterializeSlot(slot);
+
+	heap_insert(ri->ri_RelationDesc, tup, GetCurrentCommandId(true), 0, NULL);
+	ExecInsertCQMatRelIndexTuples(ri, slot, estate);
+
+	return true;
+}
+
+/*
+ * ExecCQMatRelMultiInsert
+ *
+ * Insert a batch of new rows into a CV materialization table. The heap tuples are written a page
+ * at a time with heap_multi_insert, and then each index gets all of the batch's index tuples in
+ * turn. The caller must have already checked each row's constraints.
+ */
+void
+ExecCQMatRelMultiInsert(ResultRelInfo *ri, HeapTuple *tups, int ntups, TupleTableSlot *slot, EState *estate)
+{
+	int i;
+	int j;
+
+	if (!ntups)
+		return;
+
+	heap_multi_insert(ri->ri_RelationDesc, tups, ntups, GetCurrentCommandId(true), 0, NULL);
+
+	for (i = 0; i < ri->ri_NumIndices; i++)
 	{
-		/*
-		 * We don't want the entire sync transaction to fail when a constraint fails
-		 */
-		PG_TRY();
-		{
-			ExecConstraints(ri, slot, estate);
-		}
-		PG_CATCH();
+		Relation index = ri->ri_IndexRelationDescs[i];
+		IndexInfo *indexInfo = ri->ri_IndexRelationInfo[i];
+		ExprContext *econtext = GetPerTupleExprContext(estate);
+		Datum values[INDEX_MAX_KEYS];
+		bool isnull[INDEX_MAX_KEYS];
+
+		/* If the index is marked as read-only, ignore it */
+		if (!indexInfo->ii_ReadyForInserts)
+			continue;
+
+		for (j = 0; j < ntups; j++)
 		{
-			EmitErrorReport();
-			FlushErrorState();
+			ExecStoreTuple(tups[j], slot, InvalidBuffer, false);
 
-			result = false;
-		}
-		PG_END_TRY();
-	}
+			/* Index expressions need an EState to be eval'd in */
+			if (indexInfo->ii_Expressions)
+				econtext->ecxt_scantuple = slot;
 
-	if (!result)
-		return;
+			FormIndexDatum(indexInfo, slot, estate, values, isnull);
 
-	tup = ExecMaterializeSlot(slot);
+			index_insert(index, values, isnull, &(tups[j]->t_self),
+					ri->ri_RelationDesc, index->rd_index->indisunique ? UNIQUE_CHECK_YES : UNIQUE_CHECK_NO);
 
-	heap_insert(ri->ri_RelationDesc, tup, GetCurrentCommandId(true), 0, NULL);
-	ExecInsertCQMatRelIndexTuples(ri, slot, estate);
+			ResetPerTupleExprContext(estate);
+		}
+	}
+
+	ExecClearTuple(slot);
 }
 
 char *
@@ -256,3 +329,267 @@ CVNameToSeqRelName(char *cv_name)
 
 	return relname;
 }
+
+/*
+ * TTL partitions
+ *
+ * Continuous views created WITH (ttl_partition = ...) store their rows in inheritance children of
+ * the matrel, each of which holds the rows whose ttl_column falls within one ttl_partition wide
+ * range. Each child is named after the start of its range in seconds since the epoch and has a
+ * CHECK constraint on it, so that the planner can exclude it. Expiring such a view then drops
+ * entire children instead of deleting their rows one by one.
+ *
+ * Partitions are created ahead of time by the reaper, so combiners never run DDL. Rows that
+ * don't fall within any partition are written to the matrel itself and expired by DELETE.
+ */
+
+/*
+ * get_partition_start
+ */
+static pg_time_t
+get_partition_start(ContQuery *cq, TimestampTz ts)
+{
+	pg_time_t secs = timestamptz_to_time_t(ts);
+	pg_time_t start = secs - secs % cq->ttl_partition;
+
+	if (start > secs)
+		start -= cq->ttl_partition;
+
+	return start;
+}
+
+/*
+ * get_partition_name
+ */
+static char *
+get_partition_name(ContQuery *cq, pg_time_t start)
+{
+	char *relname = palloc0(NAMEDATALEN);
+	char suffix[NAMEDATALEN];
+
+	snprintf(suffix, NAMEDATALEN, CQ_MATREL_PARTITION_SUFFIX INT64_FORMAT, (int64) start);
+
+	strcpy(relname, cq->matrel->relname);
+	append_suffix(relname, suffix, NAMEDATALEN - 1);
+
+	return relname;
+}
+
+/*
+ * get_partition_start_from_name
+ */
+static bool
+get_partition_start_from_name(char *relname, pg_time_t *start)
+{
+	char *suffix = strrchr(relname, CQ_MATREL_PARTITION_SUFFIX[0]);
+	char *end;
+
+	if (suffix == NULL || strncmp(suffix, CQ_MATREL_PARTITION_SUFFIX, strlen(CQ_MATREL_PARTITION_SUFFIX)) != 0)
+		return false;
+
+	suffix += strlen(CQ_MATREL_PARTITION_SUFFIX);
+	*start = (pg_time_t) strtol(suffix, &end, 10);
+
+	return end != suffix && *end == '\0';
+}
+
+/*
+ * get_partition_bound
+ *
+ * Returns a literal for the given time that can be cast to the type of the ttl_column. Timestamps
+ * without a time zone are partitioned as if they were in UTC.
+ */
+static char *
+get_partition_bound(Form_pg_attribute attr, pg_time_t t)
+{
+	Oid typoutput;
+	bool typisvarlena;
+
+	getTypeOutputInfo(attr->atttypid, &typoutput, &typisvarlena);
+
+	return OidOutputFunctionCall(typoutput, TimestampTzGetDatum(time_t_to_timestamptz(t)));
+}
+
+/*
+ * GetMatRelPartition
+ *
+ * Returns the matrel partition that a row with the given ttl_column value belongs in, or
+ * InvalidOid if there isn't one
+ */
+Oid
+GetMatRelPartition(ContQuery *cq, Relation matrel, Datum ttl_value)
+{
+	pg_time_t start = get_partition_start(cq, DatumGetTimestampTz(ttl_value));
+
+	return get_relname_relid(get_partition_name(cq, start), RelationGetNamespace(matrel));
+}
+
+/*
+ * create_partition
+ */
+static void
+create_partition(ContQuery *cq, Relation matrel, char *relname, pg_time_t start)
+{
+	Form_pg_attribute attr = RelationGetDescr(matrel)->attrs[cq->ttl_attno - 1];
+	const char *nspname = quote_identifier(get_namespace_name(RelationGetNamespace(matrel)));
+	const char *parent = quote_identifier(RelationGetRelationName(matrel));
+	const char *child = quote_identifier(relname);
+	const char *col = quote_identifier(NameStr(attr->attname));
+	char *type = format_type_be(attr->atttypid);
+	char *lower = quote_literal_cstr(get_partition_bound(attr, start));
+	char *upper = quote_literal_cstr(get_partition_bound(attr, start + cq->ttl_partition));
+	bool save_allow_system_table_mods = allowSystemTableMods;
+	ObjectAddress dependent;
+	ObjectAddress referenced;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, CREATE_PARTITION_TEMPLATE, nspname, child, nspname, parent,
+			col, lower, type, col, upper, type, RelationGetFillFactor(matrel, HEAP_DEFAULT_FILLFACTOR),
+			nspname, child, nspname, parent);
+
+	/* Matrels may have columns of pseudo-types such as anyarray, which LIKE must be allowed to copy */
+	allowSystemTableMods = true;
+
+	PG_TRY();
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "could not connect to SPI manager");
+
+		if (SPI_execute(buf.data, false, 0) != SPI_OK_UTILITY)
+			elog(ERROR, "SPI_execute failed: %s", buf.data);
+
+		if (SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+	}
+	PG_CATCH();
+	{
+		allowSystemTableMods = save_allow_system_table_mods;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	allowSystemTableMods = save_allow_system_table_mods;
+
+	/*
+	 * Inheritance makes the partition a normal dependency of the matrel, which would prevent the
+	 * matrel from being dropped along with its continuous view, so make it an auto one instead
+	 */
+	dependent.classId = RelationRelationId;
+	dependent.objectId = get_relname_relid(relname, RelationGetNamespace(matrel));
+	dependent.objectSubId = 0;
+
+	referenced.classId = RelationRelationId;
+	referenced.objectId = RelationGetRelid(matrel);
+	referenced.objectSubId = 0;
+
+	Assert(OidIsValid(dependent.objectId));
+
+	deleteDependencyRecordsForClass(RelationRelationId, dependent.objectId, RelationRelationId, DEPENDENCY_NORMAL);
+	recordDependencyOn(&dependent, &referenced, DEPENDENCY_AUTO);
+
+	CommandCounterIncrement();
+}
+
+/*
+ * CreateMatRelPartitions
+ *
+ * Creates the partitions of the given continuous view's matrel for the current and next
+ * ttl_partition, if they don't exist yet. Returns the number of partitions created.
+ */
+int
+CreateMatRelPartitions(ContQuery *cq)
+{
+	Relation matrel;
+	pg_time_t start;
+	int created = 0;
+	int i;
+
+	Assert(cq->ttl_partition > 0);
+
+	matrel = heap_openrv_extended(cq->matrel, AccessShareLock, true);
+	if (matrel == NULL)
+		return 0;
+
+	start = get_partition_start(cq, GetCurrentTimestamp());
+
+	for (i = 0; i < 2; i++)
+	{
+		char *relname = get_partition_name(cq, start);
+
+		if (!OidIsValid(get_relname_relid(relname, RelationGetNamespace(matrel))))
+		{
+			create_partition(cq, matrel, relname, start);
+			created++;
+		}
+
+		start += cq->ttl_partition;
+	}
+
+	heap_close(matrel, AccessShareLock);
+
+	return created;
+}
+
+/*
+ * DropExpiredMatRelPartitions
+ *
+ * Drops all partitions of the given continuous view's matrel whose rows have all expired. Partitions
+ * that are still being written to are skipped rather than waited for. Returns the number of partitions
+ * dropped.
+ */
+int
+DropExpiredMatRelPartitions(ContQuery *cq)
+{
+	Relation matrel;
+	pg_time_t expired = timestamptz_to_time_t(GetCurrentTimestamp()) - cq->ttl - PARTITION_DROP_DELAY_S;
+	List *children;
+	ListCell *lc;
+	int dropped = 0;
+
+	Assert(cq->ttl_partition > 0);
+
+	matrel = heap_openrv_extended(cq->matrel, AccessShareLock, true);
+	if (matrel == NULL)
+		return 0;
+
+	children = find_inheritance_children(RelationGetRelid(matrel), NoLock);
+
+	foreach(lc, children)
+	{
+		Oid relid = lfirst_oid(lc);
+		char *relname = get_rel_name(relid);
+		ObjectAddress partition;
+		pg_time_t start;
+
+		if (relname == NULL || !get_partition_start_from_name(relname, &start))
+			continue;
+
+		if (start + cq->ttl_partition > expired)
+			continue;
+
+		if (!ConditionalLockRelationOid(relid, AccessExclusiveLock))
+			continue;
+
+		/* It may have been dropped while we were checking it */
+		if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relid)))
+		{
+			UnlockRelationOid(relid, AccessExclusiveLock);
+			continue;
+		}
+
+		partition.classId = RelationRelationId;
+		partition.objectId = relid;
+		partition.objectSubId = 0;
+
+		performDeletion(&partition, DROP_RESTRICT, PERFORM_DELETION_INTERNAL);
+		dropped++;
+	}
+
+	heap_close(matrel, AccessShareLock);
+
+	if (dropped)
+		CommandCounterIncrement();
+
+	return dropped;
+}
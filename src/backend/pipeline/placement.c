@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * placement.c
+ *
+ *	  CPU and NUMA placement of continuous query processes
+ *
+ * Workers, combiners and queues can be pinned to CPU lists such as "0-7,16-23". A list may also
+ * contain several CPU sets separated by semicolons, such as "0-7;8-15", in which case processes
+ * are assigned to the sets round-robin by their group id. On a multi-socket machine that allows
+ * spreading a pool over sockets while keeping each process on a single one.
+ *
+ * Linux allocates memory on the NUMA node of the CPU that first touches it, so a process is pinned
+ * before it allocates anything, and receivers touch their IPC buffers once they've been pinned so
+ * that those end up on their own node rather than on that of whichever process writes to them
+ * first.
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/backend/pipeline/placement.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+#include <sched.h>
+
+#include "lib/stringinfo.h"
+#include "nodes/bitmapset.h"
+#include "nodes/pg_list.h"
+#include "pipeline/placement.h"
+#include "storage/fd.h"
+
+#define NUMA_NODE_DIR "/sys/devices/system/node"
+
+/*
+ * CPU sets are only available on Linux, but CPU lists are parsed on every platform
+ */
+#ifdef __linux__
+#define MAX_CPUS CPU_SETSIZE
+#else
+#define MAX_CPUS 1024
+#endif
+
+/* guc parameters */
+char *continuous_query_worker_cpus;
+char *continuous_query_combiner_cpus;
+char *continuous_query_queue_cpus;
+
+static bool placed = false;
+
+/*
+ * parse_cpu_list
+ *
+ * Parses a comma separated list of CPUs and CPU ranges, returning NULL if it isn't valid
+ */
+static Bitmapset *
+parse_cpu_list(const char *str, const char **end)
+{
+	Bitmapset *cpus = NULL;
+	const char *pos = str;
+
+	for (;;)
+	{
+		long first;
+		long last;
+		char *next;
+
+		while (isspace((unsigned char) *pos))
+			pos++;
+
+		if (!isdigit((unsigned char) *pos))
+			return NULL;
+
+		first = last = strtol(pos, &next, 10);
+		pos = next;
+
+		if (*pos == '-')
+		{
+			pos++;
+			if (!isdigit((unsigned char) *pos))
+				return NULL;
+			last = strtol(pos, &next, 10);
+			pos = next;
+		}
+
+		if (first > last || last >= MAX_CPUS)
+			return NULL;
+
+		for (; first <= last; first++)
+			cpus = bms_add_member(cpus, (int) first);
+
+		while (isspace((unsigned char) *pos))
+			pos++;
+
+		if (*pos != ',')
+			break;
+		pos++;
+	}
+
+	*end = pos;
+
+	return cpus;
+}
+
+/*
+ * parse_cpu_sets
+ *
+ * Parses a semicolon separated list of CPU lists
+ */
+static bool
+parse_cpu_sets(const char *str, List **sets)
+{
+	const char *pos = str;
+
+	*sets = NIL;
+
+	for (;;)
+	{
+		Bitmapset *cpus = parse_cpu_list(pos, &pos);
+
+		if (cpus == NULL)
+			return false;
+
+		*sets = lappend(*sets, cpus);
+
+		if (*pos == '\0')
+			return true;
+		if (*pos != ';')
+			return false;
+		pos++;
+	}
+}
+
+/*
+ * format_cpu_list
+ */
+static char *
+format_cpu_list(Bitmapset *cpus)
+{
+	StringInfoData buf;
+	int first = -1;
+	int last = -1;
+	int cpu;
+
+	initStringInfo(&buf);
+
+	while ((cpu = bms_first_member(cpus)) >= 0)
+	{
+		if (first >= 0 && cpu == last + 1)
+		{
+			last = cpu;
+			continue;
+		}
+
+		if (first >= 0)
+			appendStringInfo(&buf, first == last ? "%d," : "%d-%d,", first, last);
+		first = last = cpu;
+	}
+
+	if (first >= 0)
+		appendStringInfo(&buf, first == last ? "%d" : "%d-%d", first, last);
+
+	return buf.data;
+}
+
+/*
+ * check_cont_query_cpus
+ */
+bool
+check_cont_query_cpus(char **newval, void **extra, GucSource source)
+{
+#ifdef __linux__
+	List *sets;
+#endif
+
+	if (*newval == NULL || **newval == '\0')
+		return true;
+
+#ifdef __linux__
+	if (!parse_cpu_sets(*newval, &sets))
+	{
+		GUC_check_errdetail("CPUs must be given as comma separated CPU numbers or ranges such as \"0-7,16\", and CPU sets must be separated by semicolons.");
+		return false;
+	}
+
+	return true;
+#else
+	GUC_check_errdetail("Pinning processes to CPUs is not supported on this platform.");
+	return false;
+#endif
+}
+
+/*
+ * SetContQueryProcPlacement
+ *
+ * Pins the given process to the CPUs configured for its type. Failing to do so isn't fatal, since
+ * the process will work just as well without it.
+ */
+void
+SetContQueryProcPlacement(ContQueryProc *proc)
+{
+#ifdef __linux__
+	char *value;
+	List *sets;
+	Bitmapset *cpus;
+	cpu_set_t mask;
+	int cpu;
+
+	switch (proc->type)
+	{
+		case Worker:
+			value = continuous_query_worker_cpus;
+			break;
+		case Combiner:
+			value = continuous_query_combiner_cpus;
+			break;
+		case Queue:
+			value = continuous_query_queue_cpus;
+			break;
+		default:
+			return;
+	}
+
+	if (value == NULL || *value == '\0' || !parse_cpu_sets(value, &sets))
+		return;
+
+	cpus = (Bitmapset *) list_nth(sets, proc->group_id % list_length(sets));
+
+	CPU_ZERO(&mask);
+	while ((cpu = bms_first_member(cpus)) >= 0)
+		CPU_SET(cpu, &mask);
+
+	if (sched_setaffinity(0, sizeof(mask), &mask) < 0)
+	{
+		elog(WARNING, "could not set CPU affinity of pipelinedb process \"%s\": %m",
+				GetContQueryProcName(proc));
+		return;
+	}
+
+	placed = true;
+#endif
+}
+
+/*
+ * ContQueryProcIsPlaced
+ *
+ * Was this process pinned to a CPU set?
+ */
+bool
+ContQueryProcIsPlaced(void)
+{
+	return placed;
+}
+
+/*
+ * get_proc_cpus
+ */
+static Bitmapset *
+get_proc_cpus(pid_t pid)
+{
+	Bitmapset *cpus = NULL;
+#ifdef __linux__
+	cpu_set_t mask;
+	int cpu;
+
+	if (sched_getaffinity(pid, sizeof(mask), &mask) < 0)
+		return NULL;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &mask))
+			cpus = bms_add_member(cpus, cpu);
+#endif
+
+	return cpus;
+}
+
+/*
+ * GetProcCPUs
+ *
+ * Returns the CPUs the given process may run on, or NULL if they can't be determined
+ */
+char *
+GetProcCPUs(pid_t pid)
+{
+	Bitmapset *cpus = get_proc_cpus(pid);
+
+	if (cpus == NULL)
+		return NULL;
+
+	return format_cpu_list(cpus);
+}
+
+/*
+ * GetProcNUMANodes
+ *
+ * Returns the NUMA nodes whose CPUs the given process may run on, or NULL if they can't be determined
+ */
+char *
+GetProcNUMANodes(pid_t pid)
+{
+	Bitmapset *cpus = get_proc_cpus(pid);
+	Bitmapset *nodes = NULL;
+	DIR *dir;
+	struct dirent *de;
+
+	if (cpus == NULL)
+		return NULL;
+
+	dir = AllocateDir(NUMA_NODE_DIR);
+	if (dir == NULL)
+		return NULL;
+
+	while ((de = ReadDir(dir, NUMA_NODE_DIR)) != NULL)
+	{
+		char path[MAXPGPATH];
+		char line[1024];
+		const char *end;
+		Bitmapset *node_cpus;
+		FILE *file;
+		int node;
+
+		if (strncmp(de->d_name, "node", 4) != 0 || !isdigit((unsigned char) de->d_name[4]))
+			continue;
+
+		node = atoi(de->d_name + 4);
+		snprintf(path, MAXPGPATH, "%s/%s/cpulist", NUMA_NODE_DIR, de->d_name);
+
+		file = AllocateFile(path, "r");
+		if (file == NULL)
+			continue;
+
+		/* Nodes without any CPUs have an empty list */
+		if (fgets(line, sizeof(line), file) != NULL)
+		{
+			node_cpus = parse_cpu_list(line, &end);
+			if (bms_overlap(cpus, node_cpus))
+				nodes = bms_add_member(nodes, node);
+		}
+
+		FreeFile(file);
+	}
+
+	FreeDir(dir);
+
+	if (nodes == NULL)
+		return NULL;
+
+	return format_cpu_list(nodes);
+}
@@ -14,8 +14,10 @@
 #include "access/xact.h"
 #include "miscadmin.h"
 #include "pipeline/ipc/microbatch.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/miscutils.h"
 #include "pipeline/scheduler.h"
+#include "storage/buffile.h"
 #include "utils/memutils.h"
 
 static char *
@@ -37,124 +39,305 @@ typedef struct pending_microbatch_t
 {
 	char *batch;
 	char *buf;
-	uint64 recv_id;
 	int len;
 } pending_microbatch_t;
 
+/*
+ * Microbatches that couldn't be delivered yet are queued per destination so that they're always
+ * delivered in the order they were received, which matters for output stream writes. Once the queue
+ * process is at continuous_query_queue_mem, further microbatches for a destination are appended to a
+ * temp file and read back one at a time as the in-memory part of its queue drains.
+ */
+typedef struct pending_queue_t
+{
+	uint64 recv_id; /* hash key */
+	List *batches; /* in-memory head of the queue */
+
+	BufFile *spill;
+	int nspilled;
+	int read_fileno;
+	off_t read_offset;
+	int write_fileno;
+	off_t write_offset;
+} pending_queue_t;
+
 static HTAB *pending = NULL;
 
-#define MAX_QUEUE_FLUSH_ATTEMPTS 10
+/* destinations with a non-empty pending queue */
+static List *pending_queues = NIL;
+static Size memory_consumed = 0;
+
 #define QUEUE_RECV_TIMEOUT 2 * 1000 /* 2s */
+#define MIN_RETRY_TIMEOUT 1 /* 1ms */
+#define MAX_RETRY_TIMEOUT 100 /* 100ms */
 #define PENDING_MICROBATCH_SIZE(mb) (mb->len + sizeof(pending_microbatch_t))
+#define queue_is_empty(q) ((q)->batches == NIL && (q)->nspilled == 0)
+
+/*
+ * get_receiver
+ *
+ * Look up the worker or combiner process that owns the given pzmq id
+ */
+static ContQueryProc *
+get_receiver(uint64 recv_id)
+{
+	ContQueryDatabaseMetadata *db_meta = MyContQueryProc->db_meta;
+	int i;
+
+	/* Pools may have been resized since the batch was queued, so look through every slot */
+	for (i = 0; i < max_worker_processes; i++)
+	{
+		if (db_meta->workers[i].pzmq_id == recv_id)
+			return &db_meta->workers[i];
+		if (db_meta->combiners[i].pzmq_id == recv_id)
+			return &db_meta->combiners[i];
+	}
+
+	elog(ERROR, "no receiver process found for id %ld", recv_id);
+
+	return NULL;
+}
 
 static bool
 send_microbatch(uint64_t recv_id, char *batch, int len)
 {
+	if (ipc_transport_is_shm())
+		return shmq_send(get_receiver(recv_id), batch, len, false);
+
 	pzmq_connect(recv_id);
 	return pzmq_send(recv_id, batch, len, false);
 }
 
+/*
+ * spill_microbatch
+ *
+ * Append a microbatch to the end of the given queue's temp file
+ */
+static void
+spill_microbatch(pending_queue_t *q, char *batch, int len)
+{
+	if (!q->spill)
+	{
+		/* interXact because the queue process doesn't run within transactions */
+		q->spill = BufFileCreateTemp(true);
+		BufFileTell(q->spill, &q->read_fileno, &q->read_offset);
+		BufFileTell(q->spill, &q->write_fileno, &q->write_offset);
+	}
+
+	if (BufFileSeek(q->spill, q->write_fileno, q->write_offset, SEEK_SET))
+		elog(ERROR, "could not seek in pending microbatch temporary file: %m");
+
+	if (BufFileWrite(q->spill, &len, sizeof(int)) != sizeof(int) ||
+			BufFileWrite(q->spill, batch, len) != len)
+		elog(ERROR, "could not write to pending microbatch temporary file: %m");
+
+	BufFileTell(q->spill, &q->write_fileno, &q->write_offset);
+	q->nspilled++;
+}
+
+/*
+ * unspill_microbatch
+ *
+ * Move the oldest spilled microbatch of the given queue into memory
+ */
+static void
+unspill_microbatch(pending_queue_t *q)
+{
+	pending_microbatch_t *mb;
+	int len;
+
+	Assert(q->nspilled > 0);
+
+	if (BufFileSeek(q->spill, q->read_fileno, q->read_offset, SEEK_SET))
+		elog(ERROR, "could not seek in pending microbatch temporary file: %m");
+
+	if (BufFileRead(q->spill, &len, sizeof(int)) != sizeof(int))
+		elog(ERROR, "could not read from pending microbatch temporary file: %m");
+
+	mb = palloc(sizeof(pending_microbatch_t));
+	mb->buf = mb->batch = palloc(len);
+	mb->len = len;
+
+	if (BufFileRead(q->spill, mb->batch, len) != len)
+		elog(ERROR, "could not read from pending microbatch temporary file: %m");
+
+	BufFileTell(q->spill, &q->read_fileno, &q->read_offset);
+	q->nspilled--;
+
+	/* Everything spilled has been read back, so we can start over with an empty file */
+	if (!q->nspilled)
+	{
+		BufFileClose(q->spill);
+		q->spill = NULL;
+	}
+
+	q->batches = lappend(q->batches, mb);
+	memory_consumed += PENDING_MICROBATCH_SIZE(mb);
+}
+
+/*
+ * enqueue_microbatch
+ *
+ * Add an undeliverable microbatch to the tail of its destination's queue. The microbatch is spilled
+ * to disk if we're out of memory, or if the queue already has spilled microbatches since those are
+ * older than this one.
+ */
+static void
+enqueue_microbatch(pending_queue_t *q, char *buf, char *batch, int len)
+{
+	pending_microbatch_t *mb;
+
+	if (queue_is_empty(q))
+		pending_queues = lappend(pending_queues, q);
+
+	if (q->nspilled || memory_consumed + len + sizeof(pending_microbatch_t) > continuous_query_queue_mem * 1024L)
+	{
+		spill_microbatch(q, batch, len);
+		pfree(buf);
+		return;
+	}
+
+	mb = palloc(sizeof(pending_microbatch_t));
+	mb->buf = buf;
+	mb->batch = batch;
+	mb->len = len;
+
+	q->batches = lappend(q->batches, mb);
+	memory_consumed += PENDING_MICROBATCH_SIZE(mb);
+}
+
+/*
+ * flush_queue
+ *
+ * Deliver as many microbatches from the head of the given queue as possible, stopping at the first one
+ * the destination can't accept yet. Returns the number of microbatches that were delivered.
+ */
 static int
-retry_pending(Size *memory_freed)
+flush_queue(pending_queue_t *q)
 {
-	Size freed = 0;
-	HASH_SEQ_STATUS iter;
-	pending_microbatch_t *entry;
-	List *to_delete = NIL;
-	ListCell *lc;
 	int count = 0;
 
-	Assert(pending);
+	for (;;)
+	{
+		pending_microbatch_t *mb;
 
-	if (!hash_get_num_entries(pending))
-		return 0;
+		if (q->batches == NIL)
+		{
+			if (!q->nspilled)
+				break;
+			unspill_microbatch(q);
+		}
 
-	hash_seq_init(&iter, pending);
+		mb = (pending_microbatch_t *) linitial(q->batches);
+		if (!send_microbatch(q->recv_id, mb->batch, mb->len))
+			break;
 
-	while ((entry = (pending_microbatch_t *) hash_seq_search(&iter)) != NULL)
-	{
-		if (send_microbatch(entry->recv_id, entry->batch, entry->len))
-			to_delete = lappend(to_delete, entry);
+		q->batches = list_delete_first(q->batches);
+		memory_consumed -= PENDING_MICROBATCH_SIZE(mb);
+		pfree(mb->buf);
+		pfree(mb);
 		count++;
 	}
 
-	foreach(lc, to_delete)
+	return count;
+}
+
+/*
+ * retry_pending
+ *
+ * Retry the head of each destination's pending queue. Returns the number of microbatches delivered.
+ */
+static int
+retry_pending(void)
+{
+	ListCell *lc;
+	ListCell *prev = NULL;
+	ListCell *next;
+	int count = 0;
+
+	for (lc = list_head(pending_queues); lc != NULL; lc = next)
 	{
-		pending_microbatch_t *entry = (pending_microbatch_t *) lfirst(lc);
-		bool found;
+		pending_queue_t *q = (pending_queue_t *) lfirst(lc);
 
-		pfree(entry->buf);
-		hash_search(pending, &entry->batch, HASH_REMOVE, &found);
-		Assert(found);
+		next = lnext(lc);
+		count += flush_queue(q);
 
-		freed += PENDING_MICROBATCH_SIZE(entry);
-		count--;
+		if (queue_is_empty(q))
+			pending_queues = list_delete_cell(pending_queues, lc, prev);
+		else
+			prev = lc;
 	}
 
-	list_free(to_delete);
-	*memory_freed -= freed;
-
 	return count;
 }
 
 void
 ContinuousQueryQueueMain(void)
 {
-	Size memory_consumed = 0;
 	HASHCTL ctl;
 	MemoryContext old;
 	MemoryContext cxt = AllocSetContextCreate(TopMemoryContext, "ContinuousQueryQueueContext",
 				ALLOCSET_DEFAULT_MINSIZE,
 				ALLOCSET_DEFAULT_INITSIZE,
 				ALLOCSET_DEFAULT_MAXSIZE);
+	int retry_timeout = MIN_RETRY_TIMEOUT;
 
 	old = MemoryContextSwitchTo(cxt);
 
 	MemSet(&ctl, 0, sizeof(HASHCTL));
-	ctl.keysize = sizeof(char *);
-	ctl.entrysize = sizeof(pending_microbatch_t);
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(pending_queue_t);
 	ctl.hcxt = cxt;
 	ctl.hash = tag_hash;
-	pending = hash_create("PendingHash", 8092, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
-
-	MemoryContextSwitchTo(old);
+	pending = hash_create("PendingHash", 64, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
 	for (;;)
 	{
 		int len;
 		char *buf;
 		char *batch;
-		int timeout = 0;
-		int remaining;
-		int flush_attempts = 0;
+		int timeout = QUEUE_RECV_TIMEOUT;
 		uint64 recv_id;
+		pending_queue_t *q;
+		bool found;
 
 		CHECK_FOR_INTERRUPTS();
 
 		if (get_sigterm_flag())
 			break;
 
-		remaining = retry_pending(&memory_consumed);
-
 		/*
-		 * If we're above memory capacity, aggressively try to send all batches until
-		 * we're under capacity, but don't try forever
+		 * If there are blocked destinations, we don't want to spin retrying them. The poll returns as
+		 * soon as a new microbatch arrives, otherwise we back off exponentially until one of them drains.
 		 */
-		while (memory_consumed >= continuous_query_queue_mem * 1024 &&
-				flush_attempts < MAX_QUEUE_FLUSH_ATTEMPTS)
+		if (pending_queues != NIL)
 		{
-			remaining = retry_pending(&memory_consumed);
-			flush_attempts++;
+			if (retry_pending())
+				retry_timeout = MIN_RETRY_TIMEOUT;
+			else
+				retry_timeout = Min(retry_timeout * 2, MAX_RETRY_TIMEOUT);
+
+			if (pending_queues != NIL)
+				timeout = retry_timeout;
 		}
 
-		timeout = remaining ? 0 : QUEUE_RECV_TIMEOUT;
 		buf = pzmq_recv(&len, timeout);
 
 		if (!buf)
 			continue;
 
 		batch = peek_microbatch(buf, &recv_id, &len);
-		if (send_microbatch(recv_id, batch, len))
+		q = (pending_queue_t *) hash_search(pending, &recv_id, HASH_ENTER, &found);
+		if (!found)
+		{
+			MemSet(q, 0, sizeof(pending_queue_t));
+			q->recv_id = recv_id;
+		}
+
+		/*
+		 * If earlier microbatches for this destination are still pending, this one has to wait its turn
+		 */
+		if (queue_is_empty(q) && send_microbatch(recv_id, batch, len))
 		{
 			/*
 			 * Nonblocking send was successful, we're done with this microbatch
@@ -166,13 +349,10 @@ ContinuousQueryQueueMain(void)
 			/*
 			 * Nonblocking send was not successful, enqueue the batch for a later attempt
 			 */
-			bool found;
-			pending_microbatch_t *entry = (pending_microbatch_t *) hash_search(pending, &batch, HASH_ENTER, &found);
-			entry->batch = batch;
-			entry->buf = buf;
-			entry->recv_id = recv_id;
-			entry->len = len;
-			memory_consumed += PENDING_MICROBATCH_SIZE(entry);
+			enqueue_microbatch(q, buf, batch, len);
+			retry_timeout = MIN_RETRY_TIMEOUT;
 		}
 	}
+
+	MemoryContextSwitchTo(old);
 }
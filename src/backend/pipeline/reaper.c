@@ -32,6 +32,7 @@
 #include "storage/lmgr.h"
 #include "tcop/pquery.h"
 #include "tcop/tcopprot.h"
+#include "utils/builtins.h"
 #include "utils/hsearch.h"
 #include "utils/int8.h"
 #include "utils/lsyscache.h"
@@ -42,18 +43,35 @@
 
 #define DEFAULT_SLEEP_S 2 /* Sleep for 2s unless there are CVs with TTLs */
 
-#define DELETE_TEMPLATE "DELETE FROM %s.%s WHERE \"$pk\" IN (%s);"
-#define SELECT_PK_WITH_LIMIT "SELECT \"$pk\" FROM %s.%s WHERE %s < now() - interval '%d seconds' LIMIT %d FOR UPDATE SKIP LOCKED"
-#define SELECT_PK_NO_LIMIT "SELECT \"$pk\" FROM %s.%s WHERE %s < now() - interval '%d seconds' FOR UPDATE SKIP LOCKED"
+/*
+ * Views with TTL partitions only DELETE rows that didn't fall within any partition, since entire
+ * partitions are dropped once they expire
+ */
+#define DELETE_TEMPLATE "DELETE FROM %s%s.%s WHERE \"$pk\" IN (%s);"
+#define SELECT_PK_WITH_LIMIT "SELECT \"$pk\" FROM %s%s.%s WHERE %s < now() - interval '%d seconds' LIMIT %d FOR UPDATE SKIP LOCKED"
+#define SELECT_PK_NO_LIMIT "SELECT \"$pk\" FROM %s%s.%s WHERE %s < now() - interval '%d seconds' FOR UPDATE SKIP LOCKED"
+
+/*
+ * The merged rows are computed from the delta rows the DELETE actually returned, so rows deleted
+ * by a concurrent merge can't be merged a second time. Merges also lock the matrel against each
+ * other, since otherwise both would insert merged rows for the deltas they started out with.
+ */
+#define MERGE_DELTAS_TEMPLATE "WITH deltas AS (DELETE FROM %s WHERE %s RETURNING *) " \
+	"INSERT INTO %s (\"$pk\", %s) SELECT nextval(%s), %s FROM deltas"
+#define GROUPED_DELTAS_QUAL "hash_group(%s) IN (SELECT hash_group(%s) FROM %s GROUP BY 1 HAVING count(*) > 1)"
+#define UNGROUPED_DELTAS_QUAL "(SELECT count(*) FROM %s) > 1"
 
 int continuous_query_ttl_expiration_batch_size;
 int continuous_query_ttl_expiration_threshold;
+int continuous_query_delta_merge_interval;
 
 static char *
 get_delete_sql(RangeVar *cvname, RangeVar *matrelname)
 {
 	StringInfoData delete_sql;
 	StringInfoData select_sql;
+	ContQuery *cq = GetContQueryForView(cvname);
+	char *only = cq && cq->ttl_partition ? "ONLY " : "";
 	char *ttl_col;
 	int ttl;
 
@@ -62,13 +80,13 @@ get_delete_sql(RangeVar *cvname, RangeVar *matrelname)
 	initStringInfo(&select_sql);
 
 	if (continuous_query_ttl_expiration_batch_size)
-		appendStringInfo(&select_sql, SELECT_PK_WITH_LIMIT,
+		appendStringInfo(&select_sql, SELECT_PK_WITH_LIMIT, only,
 				matrelname->schemaname, matrelname->relname, ttl_col, ttl, continuous_query_ttl_expiration_batch_size);
 	else
-		appendStringInfo(&select_sql, SELECT_PK_NO_LIMIT, matrelname->schemaname, matrelname->relname, ttl_col, ttl);
+		appendStringInfo(&select_sql, SELECT_PK_NO_LIMIT, only, matrelname->schemaname, matrelname->relname, ttl_col, ttl);
 
 	initStringInfo(&delete_sql);
-	appendStringInfo(&delete_sql, DELETE_TEMPLATE,
+	appendStringInfo(&delete_sql, DELETE_TEMPLATE, only,
 			matrelname->schemaname, matrelname->relname, select_sql.data);
 
 	return delete_sql.data;
@@ -117,12 +135,137 @@ DeleteTTLExpiredRows(RangeVar *cvname, RangeVar *matrel)
 	return num_deleted;
 }
 
+/*
+ * get_merge_sql
+ *
+ * Builds the statement that replaces the delta rows of each group having more than one of them
+ * with a single row combining them all
+ */
+static char *
+get_merge_sql(ContQuery *cq)
+{
+	Query *q = GetContCombinerQuery(cq->name);
+	char *matrel = quote_qualified_identifier(cq->matrel->schemaname, cq->matrel->relname);
+	char *seqrel = quote_qualified_identifier(get_namespace_name(get_rel_namespace(cq->seqrelid)),
+			get_rel_name(cq->seqrelid));
+	StringInfoData cols;
+	StringInfoData targets;
+	StringInfoData groups;
+	StringInfoData qual;
+	StringInfoData merge_sql;
+	ListCell *lc;
+
+	initStringInfo(&cols);
+	initStringInfo(&targets);
+	initStringInfo(&groups);
+	initStringInfo(&qual);
+
+	foreach(lc, q->targetList)
+	{
+		TargetEntry *te = (TargetEntry *) lfirst(lc);
+		char *col = (char *) quote_identifier(te->resname);
+		bool group = false;
+		ListCell *glc;
+
+		if (te->resjunk)
+			continue;
+
+		foreach(glc, q->groupClause)
+		{
+			SortGroupClause *g = (SortGroupClause *) lfirst(glc);
+			if (g->tleSortGroupRef == te->ressortgroupref)
+			{
+				group = true;
+				break;
+			}
+		}
+
+		appendStringInfo(&cols, "%s%s", cols.len ? ", " : "", col);
+
+		/* Every column that isn't grouped on is an aggregate, so its deltas are combined */
+		if (group)
+		{
+			appendStringInfo(&groups, "%s%s", groups.len ? ", " : "", col);
+			appendStringInfo(&targets, "%s%s", targets.len ? ", " : "", col);
+		}
+		else
+			appendStringInfo(&targets, "%scombine(%s)", targets.len ? ", " : "", col);
+	}
+
+	if (groups.len)
+		appendStringInfo(&qual, GROUPED_DELTAS_QUAL, groups.data, groups.data, matrel);
+	else
+		appendStringInfo(&qual, UNGROUPED_DELTAS_QUAL, matrel);
+
+	initStringInfo(&merge_sql);
+	appendStringInfo(&merge_sql, MERGE_DELTAS_TEMPLATE, matrel, qual.data,
+			matrel, cols.data, quote_literal_cstr(seqrel), targets.data);
+
+	/* An ungrouped aggregate always returns a row, even when there is nothing to merge */
+	if (groups.len)
+		appendStringInfo(&merge_sql, " GROUP BY %s", groups.data);
+	else
+		appendStringInfoString(&merge_sql, " HAVING count(*) > 0");
+
+	return merge_sql.data;
+}
+
+/*
+ * MergeDeltaRows
+ *
+ * Compacts the delta rows that combiners have appended to a delta storage continuous view's
+ * matrel, so that each group is once again stored as a single row. Returns the number of
+ * groups that were merged.
+ */
+int
+MergeDeltaRows(ContQuery *cq)
+{
+	bool save_continuous_query_materialization_table_updatable = continuous_query_materialization_table_updatable;
+	char *merge_cmd;
+	int num_merged = 0;
+
+	/*
+	 * This prevents the relation from being dropped before we run the merge, and concurrent merges
+	 * from running at all. Combiners only need RowExclusiveLock, so they're never blocked by it.
+	 */
+	Relation rel = heap_openrv_extended(cq->matrel, ShareUpdateExclusiveLock, true);
+
+	if (!rel)
+		return 0;
+
+	Assert(cq->delta_storage);
+
+	continuous_query_materialization_table_updatable = true;
+	merge_cmd = get_merge_sql(cq);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "could not connect to SPI manager");
+
+	if (SPI_execute(merge_cmd, false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "SPI_execute failed: %s", merge_cmd);
+
+	num_merged = SPI_processed;
+
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	PopActiveSnapshot();
+	continuous_query_materialization_table_updatable = save_continuous_query_materialization_table_updatable;
+
+	heap_close(rel, NoLock);
+
+	return num_merged;
+}
+
 typedef struct ReaperEntry
 {
 	Oid relid;
 	TimestampTz last_expired;
 	int last_deleted;
 	int ttl;
+	TimestampTz last_merged;
 } ReaperEntry;
 
 static HTAB *last_expired = NULL;
@@ -217,6 +360,7 @@ get_ttl_rels(int *min_ttl)
 		if (!found)
 		{
 			entry->last_expired = 0;
+			entry->last_merged = 0;
 			entry->ttl = cq->ttl;
 		}
 	}
@@ -224,6 +368,69 @@ get_ttl_rels(int *min_ttl)
 	return result;
 }
 
+/*
+ * maintain_ttl_partitions
+ *
+ * Creates the upcoming partitions of all continuous views with TTL partitions and drops the ones
+ * that have expired
+ */
+static void
+maintain_ttl_partitions(void)
+{
+	int id = -1;
+	Bitmapset *ids = GetContinuousViewIds();
+
+	while ((id = bms_next_member(ids, id)) >= 0)
+	{
+		ContQuery *cq = GetContQueryForId(id);
+
+		if (!cq || !cq->ttl_partition || !AttributeNumberIsValid(cq->ttl_attno))
+			continue;
+
+		CreateMatRelPartitions(cq);
+		DropExpiredMatRelPartitions(cq);
+	}
+}
+
+/*
+ * merge_delta_rels
+ *
+ * Merges the deltas of all delta storage continuous views that haven't been merged
+ * within the last continuous_query_delta_merge_interval seconds
+ */
+static void
+merge_delta_rels(void)
+{
+	int id = -1;
+	Bitmapset *ids = GetContinuousViewIds();
+
+	while ((id = bms_next_member(ids, id)) >= 0)
+	{
+		ContQuery *cq = GetContQueryForId(id);
+		ReaperEntry *entry;
+		bool found;
+
+		if (!cq || !cq->delta_storage)
+			continue;
+
+		entry = (ReaperEntry *) hash_search(last_expired, &cq->relid, HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->last_expired = 0;
+			entry->last_deleted = 0;
+			entry->ttl = cq->ttl;
+			entry->last_merged = GetCurrentTimestamp();
+		}
+
+		if (!TimestampDifferenceExceeds(entry->last_merged, GetCurrentTimestamp(),
+				continuous_query_delta_merge_interval * 1000))
+			continue;
+
+		MergeDeltaRows(cq);
+		entry->last_merged = GetCurrentTimestamp();
+	}
+}
+
 void
 ContinuousQueryReaperMain(void)
 {
@@ -310,6 +517,33 @@ ContinuousQueryReaperMain(void)
 				break;
 		}
 
+		/*
+		 * Maintain TTL partitions and merge delta storage views in a transaction of their own, so
+		 * a failure doesn't roll back any expirations
+		 */
+		StartTransactionCommand();
+		SetCurrentStatementStartTimestamp();
+
+		PG_TRY();
+		{
+			maintain_ttl_partitions();
+			merge_delta_rels();
+		}
+		PG_CATCH();
+		{
+			EmitErrorReport();
+			FlushErrorState();
+
+			if (ActiveSnapshotSet())
+				PopActiveSnapshot();
+
+			AbortCurrentTransaction();
+			StartTransactionCommand();
+		}
+		PG_END_TRY();
+
+		CommitTransactionCommand();
+
 		reset_entries();
 		total_deleted = 0;
 		pg_usleep(min_sleep * 1000 * 1000);
@@ -22,6 +22,7 @@
 #include "access/htup_details.h"
 #include "access/xact.h"
 #include "catalog/pg_database.h"
+#include "commands/dbcommands.h"
 #include "libpq/pqsignal.h"
 #include "miscadmin.h"
 #include "nodes/print.h"
@@ -29,7 +30,9 @@
 #include "pipeline/executor.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/ipc/pzmq.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/placement.h"
 #include "pipeline/reaper.h"
 #include "postmaster/fork_process.h"
 #include "postmaster/postmaster.h"
@@ -42,12 +45,14 @@
 #include "tcop/pquery.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/memutils.h"
 #include "utils/portal.h"
 #include "utils/ps_status.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
 #include "utils/timeout.h"
+#include "utils/timestamp.h"
 
 #define MAX_PRIORITY 20 /* XXX(usmanm): can we get this from some sys header? */
 
@@ -56,6 +61,7 @@
 
 #define BG_PROC_STATUS_TIMEOUT 10000
 #define CQ_STATE_CHANGE_TIMEOUT 5000
+#define POOL_RESIZE_TIMEOUT 60000
 
 typedef struct DatabaseEntry
 {
@@ -85,8 +91,12 @@ int  continuous_query_num_reapers;
 int continuous_query_queue_mem;
 int  continuous_query_max_wait;
 int  continuous_query_combiner_work_mem;
+int  continuous_query_join_cache_mem;
 int  continuous_query_combiner_synchronous_commit;
 int continuous_query_commit_interval;
+int continuous_query_rebalance_interval;
+double continuous_query_rebalance_threshold;
+bool continuous_query_parallel_combine;
 double continuous_query_proc_priority;
 
 /* memory context for long-lived data */
@@ -94,6 +104,15 @@ static MemoryContext ContQuerySchedulerContext;
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_SIGINT = false;
+static volatile sig_atomic_t got_SIGHUP = false;
+
+/* pool sizes as of the last time the configuration was loaded */
+static int config_num_workers;
+static int config_num_combiners;
+
+/* shard map pins held by this process, which are released if its transaction ends while holding them */
+static ContQueryDatabaseMetadata *PinnedDatabase = NULL;
+static uint32 ShardMapPins[4];
 
 /* the main continuous process scheduler shmem struct */
 typedef struct ContQuerySchedulerShmemStruct
@@ -105,13 +124,14 @@ typedef struct ContQuerySchedulerShmemStruct
 static ContQuerySchedulerShmemStruct *ContQuerySchedulerShmem;
 
 NON_EXEC_STATIC void ContQuerySchedulerMain(int argc, char *argv[]) __attribute__((noreturn));
+static void signal_cont_query_scheduler(int signal);
 
 static Size
 ContQueryDatabaseMetadataSize(void)
 {
 	return (sizeof(ContQueryDatabaseMetadata) +
-			(sizeof(ContQueryProc) * NUM_BG_WORKERS_PER_DB) +
-			(sizeof(ContQueryProc) * max_worker_processes));
+			(sizeof(ContQueryProc) * 2 * max_worker_processes) +
+			(sizeof(ContQueryProc) * (continuous_query_num_queues + continuous_query_num_reapers)));
 }
 
 /* shared memory stuff */
@@ -256,6 +276,19 @@ sigusr2_handler(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+/* SIGHUP: reload configuration */
+static void
+sighup_handler(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_SIGHUP = true;
+	if (MyProc)
+		SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
 /* SIGINT: refresh database list */
 static void
 sigint_handler(SIGNAL_ARGS)
@@ -351,7 +384,15 @@ cont_bgworker_main(Datum arg)
 	ContQueryProc *proc;
 
 	proc = MyContQueryProc = (ContQueryProc *) DatumGetPointer(arg);
-	pg_atomic_fetch_add_u64(&MyContQueryProc->db_meta->generation, 1);
+	proc->pid = MyProcPid;
+
+	/* Memory is allocated on the NUMA node of the CPU that first touches it, so do this first */
+	SetContQueryProcPlacement(proc);
+
+	/* If we're restarting, anything sent to us before we crashed may have been lost */
+	if (!proc->resize_start)
+		pg_atomic_fetch_add_u64(&MyContQueryProc->db_meta->generation, 1);
+	proc->resize_start = false;
 
 	pqsignal(SIGTERM, sigterm_handler);
 #define BACKTRACE_SEGFAULTS
@@ -395,16 +436,23 @@ cont_bgworker_main(Datum arg)
 	pzmq_init();
 	pzmq_bind(MyContQueryProc->pzmq_id);
 
+	if (ipc_transport_is_shm() && ShmqIsReceiver(MyContQueryProc))
+		shmq_bind(MyContQueryProc);
+
 	set_nice_priority();
 
 	run();
 
-	pg_atomic_fetch_add_u64(&MyContQueryProc->db_meta->generation, 1);
+	/* Processes that retire on their own have read everything that was sent to them */
+	if (!proc->retire || get_sigterm_flag())
+		pg_atomic_fetch_add_u64(&MyContQueryProc->db_meta->generation, 1);
+	shmq_destroy();
 	pzmq_destroy();
 	pgstat_send_cqpurge(0, MyProcPid, proc->type);
+	proc->pid = 0;
 
 	/* If this isn't a clean termination, exit with a non-zero status code */
-	if (!proc->db_meta->terminate)
+	if (!proc->db_meta->terminate && !proc->retire)
 	{
 		elog(LOG, "pipelinedb process \"%s\" was killed", GetContQueryProcName(proc));
 		proc_exit(1);
@@ -467,14 +515,14 @@ run_cont_bgworker(ContQueryProc *proc)
 }
 
 static void
-wait_for_db_workers(ContQueryDatabaseMetadata *db_meta, BgwHandleStatus state)
+wait_for_procs(ContQueryProc *procs, int from, int to, BgwHandleStatus state)
 {
 	ContQueryProc *cqproc;
 	int i;
 
-	for (i = 0; i < NUM_BG_WORKERS_PER_DB; i++)
+	for (i = from; i < to; i++)
 	{
-		cqproc = &db_meta->db_procs[i];
+		cqproc = &procs[i];
 		if (!wait_for_bg_worker_state(cqproc->bgw_handle, state, BG_PROC_STATUS_TIMEOUT))
 			elog(WARNING, "timed out waiting for pipelinedb process \"%s\" to reach state %d",
 					GetContQueryProcName(cqproc), state);
@@ -482,10 +530,39 @@ wait_for_db_workers(ContQueryDatabaseMetadata *db_meta, BgwHandleStatus state)
 }
 
 static void
-terminate_database_workers(ContQueryDatabaseMetadata *db_meta)
+wait_for_db_workers(ContQueryDatabaseMetadata *db_meta, BgwHandleStatus state)
+{
+	wait_for_procs(db_meta->workers, 0, db_meta->shard_map.num_workers, state);
+	wait_for_procs(db_meta->combiners, 0, db_meta->shard_map.num_combiners, state);
+	wait_for_procs(db_meta->queues, 0, continuous_query_num_queues, state);
+	wait_for_procs(db_meta->reapers, 0, continuous_query_num_reapers, state);
+}
+
+static void
+terminate_procs(ContQueryProc *procs, int n)
 {
 	int i;
 
+	for (i = 0; i < n; i++)
+		TerminateBackgroundWorker(procs[i].bgw_handle);
+}
+
+static void
+free_proc_handles(ContQueryProc *procs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (procs[i].bgw_handle)
+			pfree(procs[i].bgw_handle);
+		procs[i].bgw_handle = NULL;
+	}
+}
+
+static void
+terminate_database_workers(ContQueryDatabaseMetadata *db_meta)
+{
 	Assert(db_meta->running);
 
 	elog(LOG, "terminating pipelinedb processes for database: \"%s\"", NameStr(db_meta->db_name));
@@ -494,13 +571,17 @@ terminate_database_workers(ContQueryDatabaseMetadata *db_meta)
 
 	SpinLockAcquire(&db_meta->mutex);
 
-	for (i = 0; i < NUM_BG_WORKERS_PER_DB; i++)
-		TerminateBackgroundWorker(db_meta->db_procs[i].bgw_handle);
+	terminate_procs(db_meta->workers, db_meta->shard_map.num_workers);
+	terminate_procs(db_meta->combiners, db_meta->shard_map.num_combiners);
+	terminate_procs(db_meta->queues, continuous_query_num_queues);
+	terminate_procs(db_meta->reapers, continuous_query_num_reapers);
 
 	wait_for_db_workers(db_meta, BGWH_STOPPED);
 
-	for (i = 0; i < NUM_BG_WORKERS_PER_DB; i++)
-		pfree(db_meta->db_procs[i].bgw_handle);
+	free_proc_handles(db_meta->workers, db_meta->shard_map.num_workers);
+	free_proc_handles(db_meta->combiners, db_meta->shard_map.num_combiners);
+	free_proc_handles(db_meta->queues, continuous_query_num_queues);
+	free_proc_handles(db_meta->reapers, continuous_query_num_reapers);
 
 	db_meta->terminate = false;
 	db_meta->running = false;
@@ -508,12 +589,34 @@ terminate_database_workers(ContQueryDatabaseMetadata *db_meta)
 	SpinLockRelease(&db_meta->mutex);
 }
 
+/*
+ * start_proc
+ *
+ * Initializes a pool slot and launches its background process. Processes started by a resize
+ * join a running database, so they must not look like a restart to anyone waiting for acks.
+ */
+static bool
+start_proc(ContQueryDatabaseMetadata *db_meta, ContQueryProc *proc, ContQueryProcType type,
+		int group_id, bool resize)
+{
+	MemSet(proc, 0, sizeof(ContQueryProc));
+	proc->db_meta = db_meta;
+	proc->pzmq_id = rand() ^ MyProcPid;
+
+	proc->type = type;
+	proc->group_id = group_id;
+	proc->resize_start = resize;
+	proc->shard_map_version = pg_atomic_read_u32(&db_meta->shard_map.version);
+	pg_atomic_init_u32(&proc->inflight, 0);
+
+	return run_cont_bgworker(proc);
+}
+
 static void
 start_database_workers(ContQueryDatabaseMetadata *db_meta)
 {
+	ContQueryShardMap *map = &db_meta->shard_map;
 	int i;
-	int offset = 0;
-	ContQueryProc *proc;
 	bool success = true;
 
 	Assert(!db_meta->running);
@@ -524,80 +627,661 @@ start_database_workers(ContQueryDatabaseMetadata *db_meta)
 
 	db_meta->terminate = false;
 
+	pg_atomic_init_u32(&map->version, 0);
+	for (i = 0; i < lengthof(map->epochs); i++)
+		pg_atomic_init_u32(&map->epochs[i], 0);
+	for (i = 0; i < lengthof(map->pins); i++)
+		pg_atomic_init_u32(&map->pins[i], 0);
+	pg_atomic_init_u64(&map->combiner_sends, 0);
+	map->num_workers = continuous_query_num_workers;
+	map->num_combiners = continuous_query_num_combiners;
+	map->draining = false;
+
+	for (i = 0; i < SHARD_MAP_NUM_BUCKETS; i++)
+	{
+		map->buckets[i] = i % map->num_combiners;
+		pg_atomic_init_u32(&map->bucket_tuples[i], 0);
+		map->bucket_load[i] = 0;
+	}
+
+	db_meta->target_workers = map->num_workers;
+	db_meta->target_combiners = map->num_combiners;
+
 	/* Start background processes */
-	for (i = 0; i < continuous_query_num_workers; i++)
+	for (i = 0; i < map->num_workers; i++)
+		success &= start_proc(db_meta, &db_meta->workers[i], Worker, i, false);
+
+	for (i = 0; i < map->num_combiners; i++)
+		success &= start_proc(db_meta, &db_meta->combiners[i], Combiner, i, false);
+
+	for (i = 0; i < continuous_query_num_queues; i++)
+		success &= start_proc(db_meta, &db_meta->queues[i], Queue, i, false);
+
+	for (i = 0; i < continuous_query_num_reapers; i++)
+		success &= start_proc(db_meta, &db_meta->reapers[i], Reaper, i, false);
+
+	SpinLockRelease(&db_meta->mutex);
+
+	if (!success)
 	{
-		proc = &db_meta->db_procs[i];
-		MemSet(proc, 0, sizeof(ContQueryProc));
-		proc->db_meta = db_meta;
-		proc->pzmq_id = rand() ^ MyProcPid;
+		terminate_database_workers(db_meta);
+		elog(ERROR, "failed to start some pipelinedb processes");
+	}
+
+	wait_for_db_workers(db_meta, BGWH_STARTED);
+	db_meta->running = true;
+}
+
+/*
+ * release_shard_map_pins
+ *
+ * Releases any shard map pins that an error prevented us from releasing, since the scheduler
+ * would otherwise wait for them forever
+ */
+static void
+release_shard_map_pins(XactEvent event, void *arg)
+{
+	int i;
 
-		proc->type = Worker;
-		proc->group_id = i;
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+		return;
 
-		success &= run_cont_bgworker(proc);
+	for (i = 0; i < lengthof(ShardMapPins); i++)
+	{
+		if (ShardMapPins[i])
+			pg_atomic_fetch_sub_u32(&PinnedDatabase->shard_map.pins[i], ShardMapPins[i]);
+		ShardMapPins[i] = 0;
 	}
-	offset = continuous_query_num_workers;
+}
+
+/*
+ * ContQueryShardMapPin
+ *
+ * Pins the current shard map epoch for routing to the worker or combiner pool, so that the size
+ * of that pool stays valid until ContQueryShardMapUnpin is called with the returned pin. Workers
+ * and clients routing to combiners also wait here while groups are moving between combiners.
+ */
+uint32
+ContQueryShardMapPin(ContQueryDatabaseMetadata *db_meta, bool combiners)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int domain = combiners ? SHARD_MAP_COMBINERS : SHARD_MAP_WORKERS;
+	bool wait = combiners && !IsContQueryCombinerProcess();
 
-	for (i = 0; i < continuous_query_num_combiners; i++)
+	for (;;)
 	{
-		proc = &db_meta->db_procs[i + offset];
-		MemSet(proc, 0, sizeof(ContQueryProc));
-		proc->db_meta = db_meta;
-		proc->pzmq_id = rand() ^ MyProcPid;
+		uint32 epoch = pg_atomic_read_u32(&map->epochs[domain]);
+		uint32 pin = domain * 2 + epoch % 2;
 
-		proc->type = Combiner;
-		proc->group_id = i;
+		pg_atomic_fetch_add_u32(&map->pins[pin], 1);
 
-		success &= run_cont_bgworker(proc);
+		/*
+		 * If the scheduler started a new epoch in the meantime it may already have seen this
+		 * one's pins drain, so we must start over with the new one
+		 */
+		if (pg_atomic_read_u32(&map->epochs[domain]) == epoch && (!wait || !map->draining))
+		{
+			if (PinnedDatabase == NULL)
+				RegisterXactCallback(release_shard_map_pins, NULL);
+			PinnedDatabase = db_meta;
+			ShardMapPins[pin]++;
+			return pin;
+		}
+
+		pg_atomic_fetch_sub_u32(&map->pins[pin], 1);
+
+		if (wait && map->draining)
+		{
+			/* We're shutting down, and anything we'd send would be lost anyways */
+			if (get_sigterm_flag())
+				wait = false;
+			else
+				pg_usleep(1000);
+		}
 	}
-	offset += continuous_query_num_combiners;
+}
 
-	for (i = 0; i < continuous_query_num_queues; i++)
+/*
+ * ContQueryShardMapUnpin
+ */
+void
+ContQueryShardMapUnpin(ContQueryDatabaseMetadata *db_meta, uint32 pin)
+{
+	Assert(ShardMapPins[pin] > 0);
+
+	ShardMapPins[pin]--;
+	pg_atomic_fetch_sub_u32(&db_meta->shard_map.pins[pin], 1);
+}
+
+/*
+ * wait_for_shard_map_pins
+ *
+ * Starts a new shard map epoch for routing to the given pool and waits until nothing is routing
+ * to it with the previous one
+ */
+static void
+wait_for_shard_map_pins(ContQueryShardMap *map, int domain)
+{
+	uint32 epoch = pg_atomic_fetch_add_u32(&map->epochs[domain], 1);
+
+	while (pg_atomic_read_u32(&map->pins[domain * 2 + epoch % 2]) > 0)
 	{
-		proc = &db_meta->db_procs[i + offset];
-		MemSet(proc, 0, sizeof(ContQueryProc));
-		proc->db_meta = db_meta;
-		proc->pzmq_id = rand() ^ MyProcPid;
+		if (get_sigterm_flag())
+			return;
+		pg_usleep(1000);
+	}
+}
 
-		proc->type = Queue;
-		proc->group_id = i;
+/*
+ * retire_procs
+ *
+ * Stops processes that were removed from their pool. They exit by themselves once they've
+ * read everything that was sent to them, and are only terminated if that takes too long.
+ */
+static void
+retire_procs(ContQueryProc *procs, int from, int to)
+{
+	int i;
 
-		success &= run_cont_bgworker(proc);
+	for (i = from; i < to; i++)
+	{
+		procs[i].retire = true;
+		if (procs[i].latch)
+			SetLatch(procs[i].latch);
 	}
-	offset += continuous_query_num_queues;
 
-	for (i = 0; i < continuous_query_num_reapers; i++)
+	for (i = from; i < to; i++)
 	{
-		proc = &db_meta->db_procs[i + offset];
-		MemSet(proc, 0, sizeof(ContQueryProc));
-		proc->db_meta = db_meta;
-		proc->pzmq_id = rand() ^ MyProcPid;
+		ContQueryProc *proc = &procs[i];
 
-		proc->type = Reaper;
-		proc->group_id = i;
+		if (!wait_for_bg_worker_state(proc->bgw_handle, BGWH_STOPPED, POOL_RESIZE_TIMEOUT))
+		{
+			elog(WARNING, "timed out waiting for pipelinedb process \"%s\" to retire",
+					GetContQueryProcName(proc));
+			TerminateBackgroundWorker(proc->bgw_handle);
+			wait_for_procs(procs, i, i + 1, BGWH_STOPPED);
+		}
+	}
+
+	free_proc_handles(procs + from, to - from);
+}
+
+/*
+ * start_procs
+ *
+ * Starts processes for new pool slots, stopping any that did start if some of them couldn't
+ */
+static bool
+start_procs(ContQueryDatabaseMetadata *db_meta, ContQueryProc *procs, ContQueryProcType type,
+		int from, int to)
+{
+	int i;
 
-		success &= run_cont_bgworker(proc);
+	for (i = from; i < to; i++)
+	{
+		if (!start_proc(db_meta, &procs[i], type, i, true))
+		{
+			retire_procs(procs, from, i);
+			return false;
+		}
 	}
 
-	SpinLockRelease(&db_meta->mutex);
+	wait_for_procs(procs, from, to, BGWH_STARTED);
+
+	return true;
+}
+
+static bool
+resize_workers(ContQueryDatabaseMetadata *db_meta, int n)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int old = map->num_workers;
+
+	if (n > old)
+	{
+		if (!start_procs(db_meta, db_meta->workers, Worker, old, n))
+			return false;
+		map->num_workers = n;
+	}
+	else
+	{
+		/* Once nobody can be sending to the removed workers anymore, let them finish up */
+		map->num_workers = n;
+		wait_for_shard_map_pins(map, SHARD_MAP_WORKERS);
+		retire_procs(db_meta->workers, n, old);
+	}
+
+	return true;
+}
+
+/*
+ * wait_for_combiners_to_drain
+ *
+ * Waits until none of the given combiners have any partial results that haven't been committed
+ * or that are still on their way to them
+ */
+static bool
+wait_for_combiners_to_drain(ContQueryDatabaseMetadata *db_meta, int n)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	TimestampTz start = GetCurrentTimestamp();
+
+	for (;;)
+	{
+		uint64 sends = pg_atomic_read_u64(&map->combiner_sends);
+		bool drained = true;
+		int i;
+
+		pg_read_barrier();
+
+		for (i = 0; i < n && drained; i++)
+		{
+			ContQueryProc *proc = &db_meta->combiners[i];
+
+			drained = (int32) pg_atomic_read_u32(&proc->inflight) <= 0;
+			pg_read_barrier();
+			drained &= !proc->pending;
+		}
+
+		pg_read_barrier();
+
+		/* A combiner we've already looked at may have been sent partials by one we hadn't yet */
+		if (drained && pg_atomic_read_u64(&map->combiner_sends) == sends)
+			return true;
+
+		if (get_sigterm_flag() ||
+				TimestampDifferenceExceeds(start, GetCurrentTimestamp(), POOL_RESIZE_TIMEOUT))
+			return false;
+
+		pg_usleep(10 * 1000);
+	}
+}
+
+/*
+ * wait_for_combiners_to_switch
+ *
+ * Waits until each combiner has discarded the state it had cached for groups it owned under the
+ * previous shard map
+ */
+static void
+wait_for_combiners_to_switch(ContQueryDatabaseMetadata *db_meta, int n, uint32 version)
+{
+	TimestampTz start = GetCurrentTimestamp();
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (db_meta->combiners[i].latch)
+			SetLatch(db_meta->combiners[i].latch);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		while (db_meta->combiners[i].shard_map_version != version)
+		{
+			if (get_sigterm_flag())
+				return;
+
+			if (TimestampDifferenceExceeds(start, GetCurrentTimestamp(), POOL_RESIZE_TIMEOUT))
+			{
+				elog(WARNING, "timed out waiting for pipelinedb process \"%s\" to switch shard maps",
+						GetContQueryProcName(&db_meta->combiners[i]));
+				return;
+			}
+
+			pg_usleep(10 * 1000);
+		}
+	}
+}
+
+/*
+ * move_buckets
+ *
+ * Changing which combiner owns a bucket changes which combiner owns its groups, so before switching
+ * over we stop workers from sending partial results and wait for the combiners to commit everything
+ * they've already been sent. Combiners that gained or lost buckets then drop their cached state
+ * before any new partials are routed with the new map, so the new owner reads the groups it took
+ * over from the matrel.
+ */
+static bool
+move_buckets(ContQueryDatabaseMetadata *db_meta, int n, uint16 *buckets)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	uint32 version;
+
+	map->draining = true;
+	wait_for_shard_map_pins(map, SHARD_MAP_COMBINERS);
+
+	if (!wait_for_combiners_to_drain(db_meta, Max(map->num_combiners, n)))
+	{
+		elog(WARNING, "timed out waiting for pipelinedb combiners in database \"%s\" to drain",
+				NameStr(db_meta->db_name));
+		map->draining = false;
+		return false;
+	}
+
+	memcpy(map->buckets, buckets, sizeof(map->buckets));
+	map->num_combiners = n;
+	version = pg_atomic_add_fetch_u32(&map->version, 1);
+	wait_for_combiners_to_switch(db_meta, n, version);
+
+	map->draining = false;
+	wait_for_shard_map_pins(map, SHARD_MAP_COMBINERS);
+
+	return true;
+}
+
+/*
+ * assign_buckets
+ *
+ * Spreads buckets evenly over n combiners while moving as few of them as possible: only buckets
+ * owned by removed combiners or by combiners with more than their share are reassigned.
+ */
+static void
+assign_buckets(uint16 *buckets, int n)
+{
+	int *counts = palloc0(sizeof(int) * n);
+	int *orphans = palloc(sizeof(int) * SHARD_MAP_NUM_BUCKETS);
+	int norphans = 0;
+	int i;
+	int c = 0;
+
+#define bucket_quota(c) (SHARD_MAP_NUM_BUCKETS / n + ((c) < SHARD_MAP_NUM_BUCKETS % n))
+
+	for (i = 0; i < SHARD_MAP_NUM_BUCKETS; i++)
+	{
+		int owner = buckets[i];
+
+		if (owner < n && counts[owner] < bucket_quota(owner))
+			counts[owner]++;
+		else
+			orphans[norphans++] = i;
+	}
+
+	for (i = 0; i < norphans; i++)
+	{
+		while (counts[c] >= bucket_quota(c))
+			c++;
+
+		buckets[orphans[i]] = c;
+		counts[c]++;
+	}
+
+	pfree(orphans);
+	pfree(counts);
+}
+
+static bool
+resize_combiners(ContQueryDatabaseMetadata *db_meta, int n)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int old = map->num_combiners;
+	uint16 buckets[SHARD_MAP_NUM_BUCKETS];
+
+	if (n > old && !start_procs(db_meta, db_meta->combiners, Combiner, old, n))
+		return false;
+
+	memcpy(buckets, map->buckets, sizeof(buckets));
+	assign_buckets(buckets, n);
+
+	if (!move_buckets(db_meta, n, buckets))
+	{
+		if (n > old)
+			retire_procs(db_meta->combiners, old, n);
+		return false;
+	}
+
+	if (n < old)
+		retire_procs(db_meta->combiners, n, old);
+
+	return true;
+}
+
+/*
+ * sample_bucket_loads
+ *
+ * Folds the tuples routed to each bucket since the last sample into its smoothed load
+ */
+static void
+sample_bucket_loads(ContQueryDatabaseMetadata *db_meta, long ms)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int i;
+
+	for (i = 0; i < SHARD_MAP_NUM_BUCKETS; i++)
+	{
+		uint32 ntups = pg_atomic_exchange_u32(&map->bucket_tuples[i], 0);
+		float4 rate = (float4) ntups * 1000 / ms;
+
+		map->bucket_load[i] = (map->bucket_load[i] + rate) / 2;
+	}
+}
+
+#define MAX_BUCKET_MOVES 64
+
+/*
+ * rebalance_combiners
+ *
+ * If the busiest combiner's load exceeds continuous_query_rebalance_threshold times the mean, move
+ * its hottest buckets that fit to the least loaded combiners. A single bucket that's hotter than
+ * everything else can't be split, but moving everything else away from its owner still helps.
+ */
+static void
+rebalance_combiners(ContQueryDatabaseMetadata *db_meta)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int n = map->num_combiners;
+	uint16 buckets[SHARD_MAP_NUM_BUCKETS];
+	float8 *loads;
+	float8 total = 0;
+	int max;
+	int nmoved = 0;
+	int i;
+
+	if (n < 2)
+		return;
+
+	loads = palloc0(sizeof(float8) * n);
+	memcpy(buckets, map->buckets, sizeof(buckets));
+
+	for (i = 0; i < SHARD_MAP_NUM_BUCKETS; i++)
+	{
+		loads[buckets[i]] += map->bucket_load[i];
+		total += map->bucket_load[i];
+	}
+
+	max = 0;
+	for (i = 1; i < n; i++)
+		if (loads[i] > loads[max])
+			max = i;
+
+	if (total == 0 || loads[max] <= continuous_query_rebalance_threshold * total / n)
+	{
+		pfree(loads);
+		return;
+	}
+
+	while (nmoved < MAX_BUCKET_MOVES)
+	{
+		int min = 0;
+		int hottest = -1;
+
+		max = 0;
+		for (i = 1; i < n; i++)
+		{
+			if (loads[i] > loads[max])
+				max = i;
+			if (loads[i] < loads[min])
+				min = i;
+		}
+
+		/* Find the hottest bucket whose move would make both combiners less loaded than max is now */
+		for (i = 0; i < SHARD_MAP_NUM_BUCKETS; i++)
+		{
+			float8 load = map->bucket_load[i];
+
+			if (buckets[i] != max || load <= 0 || loads[min] + load >= loads[max])
+				continue;
+			if (hottest < 0 || load > map->bucket_load[hottest])
+				hottest = i;
+		}
+
+		if (hottest < 0)
+			break;
+
+		buckets[hottest] = min;
+		loads[max] -= map->bucket_load[hottest];
+		loads[min] += map->bucket_load[hottest];
+		nmoved++;
+	}
+
+	pfree(loads);
+
+	if (!nmoved)
+		return;
+
+	elog(LOG, "moving %d hot buckets between pipelinedb combiners for database \"%s\"",
+			nmoved, NameStr(db_meta->db_name));
+
+	move_buckets(db_meta, n, buckets);
+}
+
+/*
+ * resize_database_workers
+ *
+ * Brings the database's pools to their requested sizes. If that isn't possible the request is
+ * withdrawn, which tells whoever made it that it failed.
+ */
+static void
+resize_database_workers(ContQueryDatabaseMetadata *db_meta)
+{
+	ContQueryShardMap *map = &db_meta->shard_map;
+	int workers = db_meta->target_workers;
+	int combiners = db_meta->target_combiners;
+	bool success = true;
+
+	elog(LOG, "resizing pipelinedb processes for database \"%s\" from %d workers and %d combiners to %d workers and %d combiners",
+			NameStr(db_meta->db_name), map->num_workers, map->num_combiners, workers, combiners);
+
+	if (workers != map->num_workers)
+		success = resize_workers(db_meta, workers);
+	if (success && combiners != map->num_combiners)
+		success = resize_combiners(db_meta, combiners);
 
 	if (!success)
 	{
-		terminate_database_workers(db_meta);
-		elog(ERROR, "failed to start some pipelinedb processes");
+		elog(WARNING, "failed to resize pipelinedb processes for database \"%s\"",
+				NameStr(db_meta->db_name));
+		db_meta->target_workers = map->num_workers;
+		db_meta->target_combiners = map->num_combiners;
 	}
+}
 
-	wait_for_db_workers(db_meta, BGWH_STARTED);
-	db_meta->running = true;
+/*
+ * ResizeContQueryProcPools
+ *
+ * Asks the scheduler to resize the current database's worker and combiner pools and waits
+ * until it has. Returns false if the pools couldn't be resized.
+ */
+bool
+ResizeContQueryProcPools(int num_workers, int num_combiners)
+{
+	ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
+	TimestampTz start = GetCurrentTimestamp();
+
+	if (db_meta == NULL || !db_meta->running)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pipelinedb processes are not running for database \"%s\"",
+						get_database_name(MyDatabaseId))));
+
+	if (num_workers < 1 || num_workers > max_worker_processes ||
+			num_combiners < 1 || num_combiners > max_worker_processes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("number of workers and combiners must be between 1 and %d", max_worker_processes)));
+
+	db_meta->target_workers = num_workers;
+	db_meta->target_combiners = num_combiners;
+	signal_cont_query_scheduler(SIGUSR2);
+
+	for (;;)
+	{
+		if (db_meta->shard_map.num_workers == num_workers &&
+				db_meta->shard_map.num_combiners == num_combiners &&
+				!db_meta->shard_map.draining)
+			return true;
+
+		/* The scheduler gave up, or different sizes were requested in the meantime */
+		if (db_meta->target_workers != num_workers || db_meta->target_combiners != num_combiners)
+			return false;
+
+		if (TimestampDifferenceExceeds(start, GetCurrentTimestamp(), 2 * POOL_RESIZE_TIMEOUT))
+			return false;
+
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(10 * 1000);
+	}
+}
+
+/*
+ * reload_pool_sizes
+ *
+ * Requests new pool sizes for all databases if they were changed in the configuration
+ */
+static void
+reload_pool_sizes(void)
+{
+	HASH_SEQ_STATUS status;
+	ContQueryDatabaseMetadata *db_meta;
+
+	if (continuous_query_num_workers == config_num_workers &&
+			continuous_query_num_combiners == config_num_combiners)
+		return;
+
+	config_num_workers = continuous_query_num_workers;
+	config_num_combiners = continuous_query_num_combiners;
+
+	if (config_num_workers > max_worker_processes || config_num_combiners > max_worker_processes)
+	{
+		elog(WARNING, "pipelinedb pools can't have more than max_worker_processes (%d) processes",
+				max_worker_processes);
+		return;
+	}
+
+	hash_seq_init(&status, ContQuerySchedulerShmem->db_table);
+	while ((db_meta = (ContQueryDatabaseMetadata *) hash_seq_search(&status)) != NULL)
+	{
+		db_meta->target_workers = config_num_workers;
+		db_meta->target_combiners = config_num_combiners;
+	}
 }
 
 static void
 reaper(void)
 {
+	static TimestampTz last_sample = 0;
+	static TimestampTz last_rebalance = 0;
 	HASH_SEQ_STATUS status;
 	ContQueryDatabaseMetadata *db_meta;
 	ListCell *lc;
+	TimestampTz now = GetCurrentTimestamp();
+	long secs;
+	int usecs;
+	long sample_ms;
+	bool rebalance;
+
+	TimestampDifference(last_sample, now, &secs, &usecs);
+	sample_ms = secs * 1000 + usecs / 1000;
+	if (sample_ms >= 1000)
+		last_sample = now;
+	else
+		sample_ms = 0;
+
+	rebalance = continuous_query_rebalance_interval && sample_ms &&
+		TimestampDifferenceExceeds(last_rebalance, now, continuous_query_rebalance_interval * 1000);
+	if (rebalance)
+		last_rebalance = now;
 
 	/*
 	 * Check if any database is being dropped, remove it from the DatabaseList and terminate its
@@ -652,7 +1336,10 @@ reaper(void)
 
 			pos = (char *) db_meta;
 			pos += sizeof(ContQueryDatabaseMetadata);
-			db_meta->db_procs = (ContQueryProc *) pos;
+			db_meta->workers = (ContQueryProc *) pos;
+			db_meta->combiners = db_meta->workers + max_worker_processes;
+			db_meta->queues = db_meta->combiners + max_worker_processes;
+			db_meta->reapers = db_meta->queues + continuous_query_num_queues;
 
 			pg_atomic_init_u64(&db_meta->generation, 0);
 
@@ -660,6 +1347,15 @@ reaper(void)
 		}
 
 		Assert(db_meta->running);
+
+		if (db_meta->target_workers != db_meta->shard_map.num_workers ||
+				db_meta->target_combiners != db_meta->shard_map.num_combiners)
+			resize_database_workers(db_meta);
+
+		if (sample_ms)
+			sample_bucket_loads(db_meta, sample_ms);
+		if (rebalance)
+			rebalance_combiners(db_meta);
 	}
 }
 
@@ -696,6 +1392,7 @@ ContQuerySchedulerMain(int argc, char *argv[])
 	 */
 	pqsignal(SIGINT, sigint_handler);
 	pqsignal(SIGTERM, sigterm_handler);
+	pqsignal(SIGHUP, sighup_handler);
 
 	pqsignal(SIGQUIT, quickdie);
 	InitializeTimeouts(); /* establishes SIGALRM handler */
@@ -794,6 +1491,8 @@ ContQuerySchedulerMain(int argc, char *argv[])
 
 	pzmq_purge_sock_files();
 	refresh_database_list();
+	config_num_workers = continuous_query_num_workers;
+	config_num_combiners = continuous_query_num_combiners;
 	if (list_length(DatabaseList) * (NUM_BG_WORKERS_PER_DB + 1) > max_worker_processes)
 		ereport(FATAL,
 				(errmsg("%d background worker slots are required but there are only %d available",
@@ -831,6 +1530,14 @@ ContQuerySchedulerMain(int argc, char *argv[])
 			got_SIGINT = false;
 			refresh_database_list();
 		}
+
+		/* pick up new pool sizes, which are applied by the next call to reaper() */
+		if (got_SIGHUP)
+		{
+			got_SIGHUP = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			reload_pool_sizes();
+		}
 	}
 
 	/* Normal exit from the continuous query scheduler is here */
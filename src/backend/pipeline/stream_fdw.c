@@ -12,6 +12,9 @@
  */
 #include "postgres.h"
 
+#include <ctype.h>
+
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
@@ -19,7 +22,9 @@
 #include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #include "nodes/relation.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/plancat.h"
@@ -37,7 +42,9 @@
 #include "pipeline/miscutils.h"
 #include "pipeline/stream.h"
 #include "pipeline/stream_fdw.h"
+#include "rewrite/rewriteManip.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/typcache.h"
@@ -47,6 +54,62 @@ typedef struct StreamFdwInfo
 	List *colnames;
 } StreamFdwInfo;
 
+/*
+ * A worker runs each continuous query's plan separately over the same batch, so without
+ * sharing, a stream read by many queries would have every one of its tuples decoded and
+ * filtered once per query. Instead, scans that project a stream's tuples to the same
+ * descriptor share the decoded tuples, and WHERE clauses that appear in several of those
+ * scans are only evaluated once per tuple. All of this lives in ContQueryBatchContext and
+ * is thrown away at the end of each batch.
+ */
+typedef struct StreamDecodeCache
+{
+	Oid relid; /* hash key */
+	TupleDesc desc;
+	/* decoded tuples, indexed by their position within the batch */
+	HeapTuple *tups;
+} StreamDecodeCache;
+
+#define SHARED_QUAL_UNKNOWN 0
+#define SHARED_QUAL_PASS 1
+#define SHARED_QUAL_FAIL 2
+
+typedef struct StreamSharedQual
+{
+	/* clause with its Vars pointing at range table entry 1, and without parse locations */
+	char *str;
+	/* SHARED_QUAL_* result of each tuple, indexed by its position within the batch */
+	char *results;
+} StreamSharedQual;
+
+typedef struct StreamSharedQualKey
+{
+	Oid relid;
+	uint32 hash;
+} StreamSharedQualKey;
+
+typedef struct StreamSharedQualEntry
+{
+	StreamSharedQualKey key;
+	List *quals; /* all StreamSharedQuals with this hash */
+} StreamSharedQualEntry;
+
+typedef struct StreamBatchCache
+{
+	HTAB *decode;
+	HTAB *quals;
+	MemoryContextCallback callback;
+} StreamBatchCache;
+
+static StreamBatchCache *MyStreamBatchCache = NULL;
+
+/* A scan's handle on a shared clause, along with its own executable state for it */
+typedef struct SharedQualState
+{
+	StreamSharedQual *qual;
+	List *exprs;
+} SharedQualState;
+
 struct StreamProjectionInfo {
 	/*
 	 * Temporary context to use during stream projections,
@@ -74,6 +137,40 @@ struct StreamProjectionInfo {
 
 	/* Descriptor for the tuples being output by this scan */
 	TupleDesc outdesc;
+
+	/*
+	 * Per event attribute coercions to the corresponding result attribute's type, NULL if the
+	 * types already match. These read the event attribute from the scan tuple of ecxt.
+	 */
+	ExprState **coercions;
+
+	/*
+	 * Event attributes that can't be coerced directly are sent through their type's output
+	 * function and then read in with the result type's input function
+	 */
+	bool *raw_coerce;
+	FmgrInfo *raw_outfuncs;
+	FmgrInfo *raw_infuncs;
+	Oid *raw_ioparams;
+
+	/* arrival_timestamp attribute of the result tuple, or -1 if it doesn't have one */
+	int arrival_ts_attr;
+
+	/* values and nulls for building result tuples, reused across projections */
+	Datum *values;
+	bool *nulls;
+
+	/* decoded tuples shared with the other scans of this stream, NULL if not shared */
+	StreamDecodeCache *decode;
+
+	/* SharedQualStates for the WHERE clauses evaluated by this scan rather than ExecScan */
+	List *shared_quals;
+
+	/* all of the scan's WHERE clauses, including the shared ones */
+	List *quals;
+
+	/* attach to the current batch's shared state before reading the next tuple? */
+	bool needs_shared_scan;
 };
 
 /*
@@ -233,6 +330,234 @@ GetStreamScanPlan(PlannerInfo *root, RelOptInfo *baserel,
 							NIL, list_make3(sinfo->colnames, physical_tlist, sample_cutoff), NIL, NIL, outer_plan);
 }
 
+static void
+reset_batch_cache(void *arg)
+{
+	MyStreamBatchCache = NULL;
+}
+
+/*
+ * get_batch_cache
+ *
+ * Returns the current batch's StreamBatchCache, creating it if this is the first scan of the batch
+ */
+static StreamBatchCache *
+get_batch_cache(void)
+{
+	MemoryContext old;
+	HASHCTL ctl;
+	StreamBatchCache *cache;
+
+	if (MyStreamBatchCache)
+		return MyStreamBatchCache;
+
+	old = MemoryContextSwitchTo(ContQueryBatchContext);
+
+	cache = palloc0(sizeof(StreamBatchCache));
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(StreamDecodeCache);
+	ctl.hcxt = ContQueryBatchContext;
+	cache->decode = hash_create("StreamDecodeCache", 16, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(StreamSharedQualKey);
+	ctl.entrysize = sizeof(StreamSharedQualEntry);
+	ctl.hcxt = ContQueryBatchContext;
+	cache->quals = hash_create("StreamSharedQuals", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* forget the cache once the batch context is reset */
+	cache->callback.func = reset_batch_cache;
+	cache->callback.arg = NULL;
+	MemoryContextRegisterResetCallback(ContQueryBatchContext, &cache->callback);
+
+	MemoryContextSwitchTo(old);
+
+	MyStreamBatchCache = cache;
+
+	return cache;
+}
+
+static bool
+contain_param_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Param))
+		return true;
+
+	return expression_tree_walker(node, contain_param_walker, context);
+}
+
+/*
+ * Clauses can only be shared if they'll give the same result for a given tuple in every
+ * query that has them
+ */
+static bool
+is_shareable_qual(Node *clause)
+{
+	if (contain_volatile_functions(clause) || contain_subplans(clause))
+		return false;
+
+	return !contain_param_walker(clause, NULL);
+}
+
+/*
+ * shared_qual_key
+ *
+ * Returns a string identifying the given scan clause, which is the same for equal clauses
+ * that come from different queries
+ */
+static char *
+shared_qual_key(Node *clause, Index scanrelid)
+{
+	char *str;
+	char *src;
+	char *dst;
+
+	clause = copyObject(clause);
+	if (scanrelid != 1)
+		ChangeVarNodes(clause, scanrelid, 1, 0);
+
+	str = nodeToString(clause);
+
+	/* parse locations differ between otherwise identical clauses, so drop them */
+	src = dst = str;
+	while (*src)
+	{
+		if (strncmp(src, " :location ", 11) == 0)
+		{
+			src += 11;
+			if (*src == '-')
+				src++;
+			while (isdigit((unsigned char) *src))
+				src++;
+			continue;
+		}
+
+		*dst++ = *src++;
+	}
+	*dst = '\0';
+
+	return str;
+}
+
+/*
+ * get_shared_qual
+ *
+ * Returns the shared clause for the given scan clause of the given stream, adding it if no
+ * other scan in this batch has it yet
+ */
+static StreamSharedQual *
+get_shared_qual(StreamBatchCache *cache, Oid relid, Node *clause, Index scanrelid)
+{
+	StreamSharedQualKey key;
+	StreamSharedQualEntry *entry;
+	StreamSharedQual *qual;
+	MemoryContext old;
+	ListCell *lc;
+	char *str = shared_qual_key(clause, scanrelid);
+	bool found;
+
+	MemSet(&key, 0, sizeof(StreamSharedQualKey));
+	key.relid = relid;
+	key.hash = DatumGetUInt32(hash_any((unsigned char *) str, strlen(str)));
+
+	entry = (StreamSharedQualEntry *) hash_search(cache->quals, &key, HASH_ENTER, &found);
+	if (!found)
+		entry->quals = NIL;
+
+	foreach(lc, entry->quals)
+	{
+		qual = (StreamSharedQual *) lfirst(lc);
+		if (strcmp(qual->str, str) == 0)
+		{
+			pfree(str);
+			return qual;
+		}
+	}
+
+	old = MemoryContextSwitchTo(ContQueryBatchContext);
+
+	qual = palloc0(sizeof(StreamSharedQual));
+	qual->str = pstrdup(str);
+	entry->quals = lappend(entry->quals, qual);
+
+	MemoryContextSwitchTo(old);
+
+	pfree(str);
+
+	return qual;
+}
+
+/*
+ * init_shared_scan
+ *
+ * Attaches the given scan to the decoded tuples of the other scans of its stream in this batch,
+ * and takes over evaluating any of its WHERE clauses that can be shared with them
+ */
+static void
+init_shared_scan(ForeignScanState *node, StreamScanState *state)
+{
+	ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+	StreamBatchCache *cache = get_batch_cache();
+	StreamDecodeCache *decode;
+	Oid relid = RelationGetRelid(node->ss.ss_currentRelation);
+	List *quals = NIL;
+	ListCell *lce;
+	ListCell *lcs;
+	bool found;
+	MemoryContext old;
+
+	state->pi->needs_shared_scan = false;
+
+	decode = (StreamDecodeCache *) hash_search(cache->decode, &relid, HASH_ENTER, &found);
+	if (!found)
+	{
+		decode->desc = CreateTupleDescCopy(state->pi->outdesc);
+		decode->tups = NULL;
+	}
+
+	/*
+	 * A scan projecting to a different descriptor decodes tuples on its own, and its clauses
+	 * can't be compared with anyone else's
+	 */
+	if (!equalTupleDescs(decode->desc, state->pi->outdesc))
+		return;
+
+	state->pi->decode = decode;
+
+	Assert(list_length(plan->scan.plan.qual) == list_length(state->pi->quals));
+
+	/* this only lasts until the scan is reset */
+	old = MemoryContextSwitchTo(state->pi->mcxt);
+
+	forboth(lce, plan->scan.plan.qual, lcs, state->pi->quals)
+	{
+		Node *clause = (Node *) lfirst(lce);
+		SharedQualState *sqs;
+
+		if (!is_shareable_qual(clause))
+		{
+			quals = lappend(quals, lfirst(lcs));
+			continue;
+		}
+
+		sqs = palloc0(sizeof(SharedQualState));
+		sqs->qual = get_shared_qual(cache, relid, clause, plan->scan.scanrelid);
+		sqs->exprs = list_make1(lfirst(lcs));
+
+		state->pi->shared_quals = lappend(state->pi->shared_quals, sqs);
+	}
+
+	MemoryContextSwitchTo(old);
+
+	/* ExecScan only evaluates the clauses we aren't sharing */
+	node->ss.ps.qual = quals;
+}
+
 /*
  * BeginStreamScan
  */
@@ -259,6 +584,7 @@ BeginStreamScan(ForeignScanState *node, int eflags)
 	state->pi->ecxt = CreateStandaloneExprContext();
 	state->pi->outdesc = ExecTypeFromTL(physical_tlist, false);
 	state->pi->indesc = NULL;
+	state->pi->arrival_ts_attr = -1;
 	state->sample_cutoff = sample_cutoff ? intVal(sample_cutoff) : -1;
 
 	Assert(state->pi->outdesc->natts == list_length(colnames));
@@ -266,9 +592,23 @@ BeginStreamScan(ForeignScanState *node, int eflags)
 	foreach(lc, colnames)
 	{
 		Value *v = (Value *) lfirst(lc);
+
+		if (pg_strcasecmp(strVal(v), ARRIVAL_TIMESTAMP) == 0 && state->pi->arrival_ts_attr == -1)
+			state->pi->arrival_ts_attr = i;
+
 		namestrcpy(&(state->pi->outdesc->attrs[i++]->attname), strVal(v));
 	}
 
+	state->pi->values = palloc(sizeof(Datum) * state->pi->outdesc->natts);
+	state->pi->nulls = palloc(sizeof(bool) * state->pi->outdesc->natts);
+	state->pi->decode = NULL;
+	state->pi->shared_quals = NIL;
+	state->pi->quals = node->ss.ps.qual;
+	state->pi->needs_shared_scan = false;
+
+	if (IsContQueryWorkerProcess())
+		init_shared_scan(node, state);
+
 	ExecAssignScanType(&node->ss, state->pi->outdesc);
 
 	/*
@@ -280,13 +620,39 @@ BeginStreamScan(ForeignScanState *node, int eflags)
 	node->fdw_state = (void *) state;
 }
 
+/*
+ * report_reads
+ */
+static void
+report_reads(StreamScanState *state)
+{
+	pgstat_increment_cq_read(state->ntuples, state->nbytes);
+	state->ntuples = 0;
+	state->nbytes = 0;
+}
+
 /*
  * ReScanStreamScan
+ *
+ * Stream tuples can't be read twice, so a rescan just prepares the scan to read the next batch
  */
 void
 ReScanStreamScan(ForeignScanState *node)
 {
-	/* Ephemeral data anyone? x_x */
+	StreamScanState *ss = (StreamScanState *) node->fdw_state;
+
+	MemoryContextReset(ss->pi->mcxt);
+
+	ss->pi->indesc = NULL;
+	ss->pi->decode = NULL;
+	ss->pi->shared_quals = NIL;
+	node->ss.ps.qual = ss->pi->quals;
+
+	/* the next batch's shared state doesn't exist yet, so attach to it on the first read */
+	ss->pi->needs_shared_scan = IsContQueryWorkerProcess();
+
+	reset_record_type_cache();
+	report_reads(ss);
 }
 
 /*
@@ -303,7 +669,7 @@ EndStreamScan(ForeignScanState *node)
 	ss->pi->indesc = NULL;
 
 	reset_record_type_cache();
-	pgstat_increment_cq_read(ss->ntuples, ss->nbytes);
+	report_reads(ss);
 }
 
 /*
@@ -344,12 +710,68 @@ init_proj_info(StreamProjectionInfo *pi, ipc_tuple *itup)
 {
 	MemoryContext old;
 	ListCell *lc;
+	TupleDesc indesc = itup->desc;
+	TupleDesc outdesc = pi->outdesc;
+	int i;
 
 	old = MemoryContextSwitchTo(pi->mcxt);
 
-	pi->indesc = itup->desc;
+	pi->indesc = indesc;
 	pi->attrmap = map_field_positions(pi->indesc, pi->outdesc);
 	pi->slot = MakeSingleTupleTableSlot(pi->indesc);
+	pi->ecxt->ecxt_scantuple = pi->slot;
+
+	pi->coercions = palloc0(sizeof(ExprState *) * indesc->natts);
+	pi->raw_coerce = palloc0(sizeof(bool) * indesc->natts);
+	pi->raw_outfuncs = palloc0(sizeof(FmgrInfo) * indesc->natts);
+	pi->raw_infuncs = palloc0(sizeof(FmgrInfo) * indesc->natts);
+	pi->raw_ioparams = palloc0(sizeof(Oid) * indesc->natts);
+
+	/*
+	 * Build the coercions from each event attribute's append-time type to its target type once here,
+	 * rather than for every projected event.
+	 */
+	for (i = 0; i < indesc->natts; i++)
+	{
+		int outattno = pi->attrmap[i];
+		Form_pg_attribute inattr = indesc->attrs[i];
+		Form_pg_attribute outattr;
+		Var *var;
+		Node *n;
+
+		if (outattno < 0)
+			continue;
+
+		outattr = outdesc->attrs[outattno];
+		if (inattr->atttypid == outattr->atttypid)
+			continue;
+
+		var = makeVar(1, i + 1, inattr->atttypid, inattr->atttypmod, inattr->attcollation, 0);
+		n = coerce_to_target_type(NULL, (Node *) var, inattr->atttypid, outattr->atttypid,
+				outattr->atttypmod, COERCION_ASSIGNMENT, COERCE_IMPLICIT_CAST, -1);
+
+		if (n != NULL)
+		{
+			pi->coercions[i] = ExecInitExpr((Expr *) n, NULL);
+		}
+		else
+		{
+			/*
+			 * Slow path, fall back to the original user input and try to
+			 * coerce that to the target type
+			 */
+			Oid outfn;
+			Oid infn;
+			bool isvlen;
+
+			getTypeOutputInfo(inattr->atttypid, &outfn, &isvlen);
+			getTypeInputInfo(outattr->atttypid, &infn, &pi->raw_ioparams[i]);
+
+			fmgr_info(outfn, &pi->raw_outfuncs[i]);
+			fmgr_info(infn, &pi->raw_infuncs[i]);
+			pi->raw_coerce[i] = true;
+		}
+	}
 
 	/*
 	 * Load RECORDOID tuple descriptors in the cache.
@@ -362,49 +784,27 @@ init_proj_info(StreamProjectionInfo *pi, ipc_tuple *itup)
 	MemoryContextSwitchTo(old);
 }
 
-/*
- * Given a value, convert it to its original user input representation,
- * then attempt to read it in as the target output type
- */
-static Datum
-coerce_raw_input(Datum value, Oid intype, Oid outtype)
-{
-	char *orig;
-	Oid outfn;
-	Oid infn;
-	Oid ioparam;
-	bool isvlen;
-	Datum result;
-
-	getTypeOutputInfo(intype, &outfn, &isvlen);
-	orig = OidOutputFunctionCall(outfn, value);
-
-	getTypeInputInfo(outtype, &infn, &ioparam);
-	result = OidInputFunctionCall(infn, orig, ioparam, -1);
-
-	return result;
-}
-
 static HeapTuple
 exec_stream_project(StreamScanState *node, ipc_tuple *itup)
 {
 	HeapTuple decoded;
 	MemoryContext old;
-	Datum *values;
-	bool *nulls;
 	int i;
 	StreamProjectionInfo *pi = node->pi;
 	TupleDesc indesc = pi->indesc;
 	TupleDesc outdesc = pi->outdesc;
-
-	values = palloc0(sizeof(Datum) * outdesc->natts);
-	nulls = palloc0(sizeof(bool) * outdesc->natts);
+	Datum *values = pi->values;
+	bool *nulls = pi->nulls;
 
 	/* assume every element in the output tuple is null until we actually see values */
 	MemSet(nulls, true, outdesc->natts);
 
 	ExecStoreTuple(itup->tup, pi->slot, InvalidBuffer, false);
 
+	/* coerced values only need to live until they're copied into the result tuple */
+	ResetExprContext(pi->ecxt);
+	old = MemoryContextSwitchTo(pi->ecxt->ecxt_per_tuple_memory);
+
 	/*
 	 * For each field in the event, place it in the corresponding field in the
 	 * output tuple, coercing types if necessary.
@@ -414,7 +814,6 @@ exec_stream_project(StreamScanState *node, ipc_tuple *itup)
 		Datum v;
 		bool isnull;
 		int outattno = pi->attrmap[i];
-		Form_pg_attribute inattr;
 
 		if (outattno < 0)
 			continue;
@@ -425,45 +824,29 @@ exec_stream_project(StreamScanState *node, ipc_tuple *itup)
 		if (isnull)
 			continue;
 
-		inattr = indesc->attrs[i];
 		nulls[outattno] = false;
 
-		/* if the append-time value's type is different from the target type, try to coerce it */
-		if (inattr->atttypid != outdesc->attrs[outattno]->atttypid)
+		/* if the append-time value's type is different from the target type, coerce it */
+		if (pi->coercions[i])
 		{
-			Const *c = makeConst(inattr->atttypid, inattr->atttypmod, inattr->attcollation,
-					inattr->attlen, v, false, inattr->attbyval);
-			Node *n = coerce_to_target_type(NULL, (Node *) c, inattr->atttypid, outdesc->attrs[outattno]->atttypid,
-					outdesc->attrs[outattno]->atttypmod, COERCION_ASSIGNMENT, COERCE_IMPLICIT_CAST, -1);
-
-			/* if the coercion is possible, do it */
-			if (n != NULL)
-			{
-				ExprState *estate = ExecInitExpr((Expr *) n, NULL);
-				v = ExecEvalExpr(estate, pi->ecxt, &nulls[outattno], NULL);
-			}
-			else
-			{
-				/*
-				 * Slow path, fall back to the original user input and try to
-				 * coerce that to the target type
-				 */
-				v = coerce_raw_input(v, inattr->atttypid, outdesc->attrs[outattno]->atttypid);
-			}
+			v = ExecEvalExpr(pi->coercions[i], pi->ecxt, &nulls[outattno], NULL);
+		}
+		else if (pi->raw_coerce[i])
+		{
+			char *orig = OutputFunctionCall(&pi->raw_outfuncs[i], v);
+			v = InputFunctionCall(&pi->raw_infuncs[i], orig, pi->raw_ioparams[i], -1);
 		}
 
 		values[outattno] = v;
 	}
 
+	MemoryContextSwitchTo(old);
+
 	/* Assign arrival_timestamp to this tuple! */
-	for (i = 0; i < outdesc->natts; i++)
+	if (pi->arrival_ts_attr >= 0)
 	{
-		if (pg_strcasecmp(NameStr(outdesc->attrs[i]->attname), ARRIVAL_TIMESTAMP) == 0)
-		{
-			values[i] = TimestampGetDatum(GetCurrentTimestamp());
-			nulls[i] = false;
-			break;
-		}
+		values[pi->arrival_ts_attr] = TimestampGetDatum(GetCurrentTimestamp());
+		nulls[pi->arrival_ts_attr] = false;
 	}
 
 	old = MemoryContextSwitchTo(ContQueryBatchContext);
@@ -486,6 +869,81 @@ PlanStreamModify(PlannerInfo *root, ModifyTable *plan, Index resultRelation, int
 }
 
 
+/*
+ * get_decoded_tuple
+ *
+ * Returns the given tuple projected to this scan's descriptor, decoding it only if no other
+ * scan sharing its decoded tuples has done so yet in this batch
+ */
+static HeapTuple
+get_decoded_tuple(StreamScanState *state, ipc_tuple *itup)
+{
+	StreamDecodeCache *decode = state->pi->decode;
+	HeapTuple tup;
+
+	if (decode)
+	{
+		if (decode->tups == NULL)
+			decode->tups = MemoryContextAllocZero(ContQueryBatchContext,
+					sizeof(HeapTuple) * state->cont_executor->batch->ntups);
+
+		if (decode->tups[itup->idx])
+			return decode->tups[itup->idx];
+	}
+
+	/*
+	 * Each microbatch has its own descriptor, but consecutive microbatches usually come from
+	 * the same kind of writer, so only rebuild the projection if the descriptor actually changed.
+	 */
+	if (state->pi->indesc != itup->desc)
+	{
+		if (state->pi->indesc && equalTupleDescs(state->pi->indesc, itup->desc))
+			state->pi->indesc = itup->desc;
+		else
+			init_proj_info(state->pi, itup);
+	}
+
+	tup = exec_stream_project(state, itup);
+
+	if (decode)
+		decode->tups[itup->idx] = tup;
+
+	return tup;
+}
+
+/*
+ * check_shared_quals
+ *
+ * Returns whether the tuple in the scan slot satisfies all of the shared clauses of this scan,
+ * reusing the result of any clause another scan has already evaluated for it
+ */
+static bool
+check_shared_quals(ForeignScanState *node, StreamScanState *state, int idx)
+{
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	ListCell *lc;
+
+	econtext->ecxt_scantuple = node->ss.ss_ScanTupleSlot;
+
+	foreach(lc, state->pi->shared_quals)
+	{
+		SharedQualState *sqs = (SharedQualState *) lfirst(lc);
+		StreamSharedQual *qual = sqs->qual;
+
+		if (qual->results == NULL)
+			qual->results = MemoryContextAllocZero(ContQueryBatchContext,
+					state->cont_executor->batch->ntups);
+
+		if (qual->results[idx] == SHARED_QUAL_UNKNOWN)
+			qual->results[idx] = ExecQual(sqs->exprs, econtext, false) ? SHARED_QUAL_PASS : SHARED_QUAL_FAIL;
+
+		if (qual->results[idx] == SHARED_QUAL_FAIL)
+			return false;
+	}
+
+	return true;
+}
+
 /*
  * IterateStreamScan
  */
@@ -497,24 +955,30 @@ IterateStreamScan(ForeignScanState *node)
 	StreamScanState *state = (StreamScanState *) node->fdw_state;
 	HeapTuple tup;
 
-	do
+	if (state->pi->needs_shared_scan)
+		init_shared_scan(node, state);
+
+	for (;;)
 	{
-		itup = (ipc_tuple *) ipc_tuple_reader_next(state->cont_executor->curr_query_id);
+		do
+		{
+			itup = (ipc_tuple *) ipc_tuple_reader_next(state->cont_executor->curr_query_id);
 
-		if (itup == NULL)
-			return NULL;
-	} while (state->sample_cutoff != -1 && rand() > state->sample_cutoff);
+			if (itup == NULL)
+				return NULL;
+		} while (state->sample_cutoff != -1 && rand() > state->sample_cutoff);
 
-	state->ntuples++;
-	state->nbytes += itup->tup->t_len + HEAPTUPLESIZE;
+		state->ntuples++;
+		state->nbytes += itup->tup->t_len + HEAPTUPLESIZE;
 
-	if (state->pi->indesc != itup->desc)
-		init_proj_info(state->pi, itup);
+		tup = get_decoded_tuple(state, itup);
+		ExecStoreTuple(tup, slot, InvalidBuffer, false);
 
-	tup = exec_stream_project(state, itup);
-	ExecStoreTuple(tup, slot, InvalidBuffer, false);
+		if (state->pi->shared_quals == NIL || check_shared_quals(node, state, itup->idx))
+			return slot;
 
-	return slot;
+		ResetExprContext(node->ss.ps.ps_ExprContext);
+	}
 }
 
 /*
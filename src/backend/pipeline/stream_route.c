@@ -0,0 +1,539 @@
+/*-------------------------------------------------------------------------
+ *
+ * stream_route.c
+ *
+ *	  Routing of stream tuples to the continuous queries whose WHERE clause can match them
+ *
+ * Many continuous queries on the same stream often differ only in an equality predicate on one of
+ * its columns, e.g. WHERE tenant_id = 'x'. Running all of them over every tuple means nearly every
+ * query rejects nearly every tuple. Instead, workers keep an index from each such column's constant
+ * values to the queries that want them, so that a tuple's value determines which of those queries
+ * need to see it at all, and queries that none of a batch's tuples are routed to don't run.
+ *
+ * Routing is only an optimization: the routed predicate is still evaluated by the query itself,
+ * so a query can safely be handed tuples its predicate rejects, but never lose tuples it accepts.
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/backend/pipeline/stream_route.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pipeline_stream_fn.h"
+#include "nodes/nodeFuncs.h"
+#include "parser/parsetree.h"
+#include "pipeline/scheduler.h"
+#include "pipeline/stream_route.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
+
+/* A constant some queries' predicates on a column are equal to */
+typedef struct RouteValue
+{
+	uint32 hash;
+	Datum value;
+	Bitmapset *queries;
+} RouteValue;
+
+typedef struct RouteBucket
+{
+	uint32 hash; /* hash key */
+	List *values; /* RouteValues with this hash */
+} RouteBucket;
+
+/* A stream column that queries have equality predicates on */
+typedef struct RouteColumn
+{
+	NameData attname;
+	Oid typid;
+	Oid collation;
+	int16 typlen;
+	bool typbyval;
+	FmgrInfo *eq_finfo;
+	FmgrInfo *hash_finfo;
+	HTAB *buckets;
+	/* all queries routed by this column */
+	Bitmapset *queries;
+} RouteColumn;
+
+typedef struct RouteQuery
+{
+	RouteColumn *column;
+	List *values; /* RouteValues this query is routed by */
+} RouteQuery;
+
+/* Per microbatch routing state, since each microbatch has its own descriptor */
+struct StreamRouter
+{
+	TupleDesc desc;
+	Bitmapset *queries;
+	int ncolumns;
+	RouteColumn **columns;
+	AttrNumber *attnos;
+	/* routed queries whose column isn't in this descriptor, so they get every tuple */
+	Bitmapset *unroutable;
+};
+
+static MemoryContext RouteContext = NULL;
+static List *RouteColumns = NIL;
+static RouteQuery *RouteQueries[MAX_CQS];
+static Bitmapset *RoutedQueries = NULL;
+
+/*
+ * find_stream_scan
+ */
+static ForeignScan *
+find_stream_scan(Plan *plan, List *rtable)
+{
+	ForeignScan *scan;
+
+	if (plan == NULL)
+		return NULL;
+
+	if (IsA(plan, ForeignScan))
+	{
+		RangeTblEntry *rte;
+
+		scan = (ForeignScan *) plan;
+		rte = rt_fetch(scan->scan.scanrelid, rtable);
+
+		return IsStream(rte->relid) ? scan : NULL;
+	}
+
+	if (IsA(plan, SubqueryScan))
+		return find_stream_scan(((SubqueryScan *) plan)->subplan, rtable);
+
+	scan = find_stream_scan(plan->lefttree, rtable);
+	if (scan == NULL)
+		scan = find_stream_scan(plan->righttree, rtable);
+
+	return scan;
+}
+
+/*
+ * get_route_values
+ *
+ * If the given scan clause is an equality between a column of the scanned stream and one or more
+ * constants, returns the column's Var and sets values to the non-NULL constants
+ */
+static Var *
+get_route_values(Node *clause, Index scanrelid, List **values)
+{
+	Var *var = NULL;
+	Const *c = NULL;
+	Oid opno;
+	TypeCacheEntry *typ;
+
+	*values = NIL;
+
+	if (IsA(clause, OpExpr) && list_length(((OpExpr *) clause)->args) == 2)
+	{
+		OpExpr *op = (OpExpr *) clause;
+		Node *l = linitial(op->args);
+		Node *r = lsecond(op->args);
+
+		if (IsA(l, Var) && IsA(r, Const))
+		{
+			var = (Var *) l;
+			c = (Const *) r;
+		}
+		else if (IsA(l, Const) && IsA(r, Var))
+		{
+			var = (Var *) r;
+			c = (Const *) l;
+		}
+		else
+			return NULL;
+
+		if (c->constisnull || c->consttype != var->vartype)
+			return NULL;
+
+		opno = op->opno;
+		*values = list_make1(DatumGetPointer(c->constvalue));
+	}
+	else if (IsA(clause, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) clause;
+		ArrayType *arr;
+		Datum *elems;
+		bool *nulls;
+		int nelems;
+		int16 typlen;
+		bool typbyval;
+		char typalign;
+		int i;
+
+		if (!saop->useOr || !IsA(linitial(saop->args), Var) || !IsA(lsecond(saop->args), Const))
+			return NULL;
+
+		var = (Var *) linitial(saop->args);
+		c = (Const *) lsecond(saop->args);
+
+		if (c->constisnull)
+			return NULL;
+
+		arr = DatumGetArrayTypeP(c->constvalue);
+		if (ARR_ELEMTYPE(arr) != var->vartype)
+			return NULL;
+
+		get_typlenbyvalalign(ARR_ELEMTYPE(arr), &typlen, &typbyval, &typalign);
+		deconstruct_array(arr, ARR_ELEMTYPE(arr), typlen, typbyval, typalign, &elems, &nulls, &nelems);
+
+		for (i = 0; i < nelems; i++)
+		{
+			if (!nulls[i])
+				*values = lappend(*values, DatumGetPointer(elems[i]));
+		}
+
+		opno = saop->opno;
+	}
+	else
+		return NULL;
+
+	if (var->varno != scanrelid || var->varlevelsup != 0 || var->varattno <= 0)
+		return NULL;
+
+	/* we can only route by values whose equality agrees with their hash */
+	typ = lookup_type_cache(var->vartype, TYPECACHE_EQ_OPR | TYPECACHE_EQ_OPR_FINFO | TYPECACHE_HASH_PROC_FINFO);
+	if (opno != typ->eq_opr || !OidIsValid(typ->hash_proc_finfo.fn_oid))
+		return NULL;
+
+	return var;
+}
+
+static inline uint32
+hash_value(RouteColumn *col, Datum value)
+{
+	return DatumGetUInt32(FunctionCall1Coll(col->hash_finfo, col->collation, value));
+}
+
+static RouteValue *
+find_value(RouteColumn *col, Datum value, uint32 hash)
+{
+	RouteBucket *bucket;
+	ListCell *lc;
+
+	bucket = (RouteBucket *) hash_search(col->buckets, &hash, HASH_FIND, NULL);
+	if (bucket == NULL)
+		return NULL;
+
+	foreach(lc, bucket->values)
+	{
+		RouteValue *rv = (RouteValue *) lfirst(lc);
+
+		if (DatumGetBool(FunctionCall2Coll(col->eq_finfo, col->collation, rv->value, value)))
+			return rv;
+	}
+
+	return NULL;
+}
+
+static RouteColumn *
+get_column(char *attname, Var *var)
+{
+	RouteColumn *col;
+	TypeCacheEntry *typ;
+	HASHCTL ctl;
+	ListCell *lc;
+
+	foreach(lc, RouteColumns)
+	{
+		col = (RouteColumn *) lfirst(lc);
+		if (pg_strcasecmp(NameStr(col->attname), attname) == 0 &&
+				col->typid == var->vartype && col->collation == var->varcollid)
+			return col;
+	}
+
+	typ = lookup_type_cache(var->vartype, TYPECACHE_EQ_OPR_FINFO | TYPECACHE_HASH_PROC_FINFO);
+
+	col = palloc0(sizeof(RouteColumn));
+	namestrcpy(&col->attname, attname);
+	col->typid = var->vartype;
+	col->collation = var->varcollid;
+	col->typlen = typ->typlen;
+	col->typbyval = typ->typbyval;
+	col->eq_finfo = &typ->eq_opr_finfo;
+	col->hash_finfo = &typ->hash_proc_finfo;
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(RouteBucket);
+	ctl.hcxt = RouteContext;
+	col->buckets = hash_create("RouteColumn", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	RouteColumns = lappend(RouteColumns, col);
+
+	return col;
+}
+
+/*
+ * StreamRouteAddQuery
+ *
+ * Adds the given worker plan's query to the routing index if its stream scan has an equality
+ * predicate on a stream column
+ */
+void
+StreamRouteAddQuery(Oid query_id, PlannedStmt *pstmt)
+{
+	ForeignScan *scan;
+	RouteQuery *rq;
+	RouteColumn *col;
+	MemoryContext old;
+	ListCell *lc;
+	List *values = NIL;
+	Var *var = NULL;
+	char *attname;
+
+	StreamRouteRemoveQuery(query_id);
+
+	scan = find_stream_scan(pstmt->planTree, pstmt->rtable);
+	if (scan == NULL)
+		return;
+
+	foreach(lc, scan->scan.plan.qual)
+	{
+		var = get_route_values((Node *) lfirst(lc), scan->scan.scanrelid, &values);
+		if (var)
+			break;
+	}
+
+	if (var == NULL || values == NIL)
+		return;
+
+	attname = get_attname(rt_fetch(scan->scan.scanrelid, pstmt->rtable)->relid, var->varattno);
+	if (attname == NULL)
+		return;
+
+	if (RouteContext == NULL)
+		RouteContext = AllocSetContextCreate(TopMemoryContext, "StreamRouteContext",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+
+	old = MemoryContextSwitchTo(RouteContext);
+
+	col = get_column(attname, var);
+
+	rq = palloc0(sizeof(RouteQuery));
+	rq->column = col;
+
+	foreach(lc, values)
+	{
+		Datum value = PointerGetDatum(lfirst(lc));
+		uint32 hash = hash_value(col, value);
+		RouteValue *rv = find_value(col, value, hash);
+
+		if (rv == NULL)
+		{
+			RouteBucket *bucket;
+			bool found;
+
+			rv = palloc0(sizeof(RouteValue));
+			rv->hash = hash;
+			rv->value = datumCopy(value, col->typbyval, col->typlen);
+
+			bucket = (RouteBucket *) hash_search(col->buckets, &hash, HASH_ENTER, &found);
+			if (!found)
+				bucket->values = NIL;
+			bucket->values = lappend(bucket->values, rv);
+		}
+
+		/* IN lists may repeat a value */
+		if (bms_is_member(query_id, rv->queries))
+			continue;
+
+		rv->queries = bms_add_member(rv->queries, query_id);
+		rq->values = lappend(rq->values, rv);
+	}
+
+	col->queries = bms_add_member(col->queries, query_id);
+	RoutedQueries = bms_add_member(RoutedQueries, query_id);
+	RouteQueries[query_id] = rq;
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * StreamRouteRemoveQuery
+ */
+void
+StreamRouteRemoveQuery(Oid query_id)
+{
+	RouteQuery *rq = RouteQueries[query_id];
+	RouteColumn *col;
+	MemoryContext old;
+	ListCell *lc;
+
+	if (rq == NULL)
+		return;
+
+	old = MemoryContextSwitchTo(RouteContext);
+
+	col = rq->column;
+
+	foreach(lc, rq->values)
+	{
+		RouteValue *rv = (RouteValue *) lfirst(lc);
+		RouteBucket *bucket;
+
+		rv->queries = bms_del_member(rv->queries, query_id);
+		if (!bms_is_empty(rv->queries))
+			continue;
+
+		bucket = (RouteBucket *) hash_search(col->buckets, &rv->hash, HASH_FIND, NULL);
+		Assert(bucket);
+
+		bucket->values = list_delete_ptr(bucket->values, rv);
+		if (bucket->values == NIL)
+			hash_search(col->buckets, &rv->hash, HASH_REMOVE, NULL);
+
+		if (!col->typbyval)
+			pfree(DatumGetPointer(rv->value));
+		pfree(rv);
+	}
+
+	col->queries = bms_del_member(col->queries, query_id);
+	if (bms_is_empty(col->queries))
+	{
+		RouteColumns = list_delete_ptr(RouteColumns, col);
+		hash_destroy(col->buckets);
+		pfree(col);
+	}
+
+	list_free(rq->values);
+	pfree(rq);
+
+	RouteQueries[query_id] = NULL;
+	RoutedQueries = bms_del_member(RoutedQueries, query_id);
+
+	MemoryContextSwitchTo(old);
+}
+
+/*
+ * StreamRouteGetQueries
+ *
+ * Returns the queries that are routed, rather than read every tuple of their streams
+ */
+Bitmapset *
+StreamRouteGetQueries(void)
+{
+	return RoutedQueries;
+}
+
+/*
+ * StreamRouteBegin
+ *
+ * Prepares to route tuples with the given descriptor to the routed queries among the given ones
+ */
+StreamRouter *
+StreamRouteBegin(TupleDesc desc, Bitmapset *queries)
+{
+	StreamRouter *router = palloc0(sizeof(StreamRouter));
+	ListCell *lc;
+
+	router->desc = desc;
+	router->queries = queries;
+	router->columns = palloc(sizeof(RouteColumn *) * list_length(RouteColumns));
+	router->attnos = palloc(sizeof(AttrNumber) * list_length(RouteColumns));
+
+	foreach(lc, RouteColumns)
+	{
+		RouteColumn *col = (RouteColumn *) lfirst(lc);
+		AttrNumber attno = InvalidAttrNumber;
+		int i;
+
+		if (!bms_overlap(col->queries, queries))
+			continue;
+
+		for (i = 0; i < desc->natts; i++)
+		{
+			Form_pg_attribute attr = desc->attrs[i];
+
+			if (!attr->attisdropped && attr->atttypid == col->typid &&
+					pg_strcasecmp(NameStr(attr->attname), NameStr(col->attname)) == 0)
+			{
+				attno = i + 1;
+				break;
+			}
+		}
+
+		if (attno == InvalidAttrNumber)
+		{
+			Bitmapset *unroutable = bms_intersect(col->queries, queries);
+
+			router->unroutable = bms_add_members(router->unroutable, unroutable);
+			bms_free(unroutable);
+			continue;
+		}
+
+		router->columns[router->ncolumns] = col;
+		router->attnos[router->ncolumns] = attno;
+		router->ncolumns++;
+	}
+
+	return router;
+}
+
+/*
+ * StreamRouteTuple
+ *
+ * Sets matches to the routed queries that the given tuple should be read by, and returns how
+ * many there are. Routed queries that aren't in matches can't accept the tuple.
+ */
+int
+StreamRouteTuple(StreamRouter *router, HeapTuple tup, int *matches)
+{
+	int n = 0;
+	int q = -1;
+	int i;
+
+	while ((q = bms_next_member(router->unroutable, q)) >= 0)
+		matches[n++] = q;
+
+	for (i = 0; i < router->ncolumns; i++)
+	{
+		RouteColumn *col = router->columns[i];
+		RouteValue *rv;
+		Datum value;
+		bool isnull;
+
+		/* NULLs are never equal to anything */
+		value = heap_getattr(tup, router->attnos[i], router->desc, &isnull);
+		if (isnull)
+			continue;
+
+		rv = find_value(col, value, hash_value(col, value));
+		if (rv == NULL)
+			continue;
+
+		q = -1;
+		while ((q = bms_next_member(rv->queries, q)) >= 0)
+		{
+			if (bms_is_member(q, router->queries))
+				matches[n++] = q;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * StreamRouteEnd
+ */
+void
+StreamRouteEnd(StreamRouter *router)
+{
+	bms_free(router->unroutable);
+	pfree(router->columns);
+	pfree(router->attnos);
+	pfree(router);
+}
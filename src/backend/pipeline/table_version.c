@@ -0,0 +1,191 @@
+/*-------------------------------------------------------------------------
+ *
+ * table_version.c
+ *
+ *	  Cheap detection of changes to tables read by continuous queries
+ *
+ * A table's version changes whenever a transaction that modified it commits, or its relcache
+ * entry is invalidated (e.g. by DDL or TRUNCATE). Modifications are noted by the heap access
+ * methods themselves, so this doesn't depend on statistics collection being enabled. Processes that cache something derived from
+ * a table, such as the hash table a stream-table join builds from it, can compare versions to
+ * decide whether the cached copy is still current instead of reading the table again.
+ *
+ * Versions live in a fixed number of shared counters that tables are hashed to, so a change to
+ * one table may also change the version of another. That only costs a spurious rebuild.
+ *
+ * A version must be read before taking the snapshot that the table is read with. Versions are
+ * bumped only once the modifying transaction is visible to new snapshots, so a table read
+ * with a snapshot taken after its version was read reflects at least that version.
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/backend/pipeline/table_version.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/twophase_rmgr.h"
+#include "pipeline/table_version.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/inval.h"
+
+#define NUM_TABLE_VERSIONS 1024
+#define TABLE_VERSION_SLOT(relid) ((relid) % NUM_TABLE_VERSIONS)
+
+typedef struct TableVersionShmemStruct
+{
+	pg_atomic_uint32 versions[NUM_TABLE_VERSIONS];
+} TableVersionShmemStruct;
+
+static TableVersionShmemStruct *TableVersionShmem = NULL;
+
+/* relcache invalidations this process has seen, per slot and for all relations */
+static uint32 LocalInvalidations[NUM_TABLE_VERSIONS];
+static uint32 LocalResets = 0;
+static bool callback_registered = false;
+
+/* slots of the tables the current transaction modified */
+static bool ModifiedSlots[NUM_TABLE_VERSIONS];
+static int NumModifiedSlots = 0;
+
+Size
+TableVersionShmemSize(void)
+{
+	return sizeof(TableVersionShmemStruct);
+}
+
+void
+TableVersionShmemInit(void)
+{
+	bool found;
+
+	TableVersionShmem = (TableVersionShmemStruct *)
+			ShmemInitStruct("TableVersionShmem", TableVersionShmemSize(), &found);
+
+	if (!found)
+	{
+		int i;
+
+		for (i = 0; i < NUM_TABLE_VERSIONS; i++)
+			pg_atomic_init_u32(&TableVersionShmem->versions[i], 0);
+	}
+}
+
+/*
+ * TableVersionNoteModified
+ *
+ * Called by the heap access methods whenever the current transaction modifies the given table
+ */
+void
+TableVersionNoteModified(Oid relid)
+{
+	int slot = TABLE_VERSION_SLOT(relid);
+
+	if (ModifiedSlots[slot])
+		return;
+
+	ModifiedSlots[slot] = true;
+	NumModifiedSlots++;
+}
+
+/*
+ * reset_modified_slots
+ */
+static void
+reset_modified_slots(void)
+{
+	if (NumModifiedSlots)
+		MemSet(ModifiedSlots, 0, sizeof(ModifiedSlots));
+	NumModifiedSlots = 0;
+}
+
+/*
+ * AtEOXact_TableVersion
+ *
+ * Bumps the versions of the tables the transaction modified if it committed. This is called once
+ * the transaction is visible to new snapshots.
+ */
+void
+AtEOXact_TableVersion(bool isCommit)
+{
+	int i;
+
+	if (isCommit && NumModifiedSlots && TableVersionShmem != NULL)
+	{
+		for (i = 0; i < NUM_TABLE_VERSIONS; i++)
+			if (ModifiedSlots[i])
+				pg_atomic_fetch_add_u32(&TableVersionShmem->versions[i], 1);
+	}
+
+	reset_modified_slots();
+}
+
+/*
+ * AtPrepare_TableVersion
+ *
+ * A prepared transaction's changes only become visible once it's committed, which may happen in
+ * another backend, so the slots it modified are saved in its state file
+ */
+void
+AtPrepare_TableVersion(void)
+{
+	uint16 i;
+
+	for (i = 0; i < NUM_TABLE_VERSIONS && NumModifiedSlots; i++)
+		if (ModifiedSlots[i])
+			RegisterTwoPhaseRecord(TWOPHASE_RM_TABLE_VERSION_ID, 0, &i, sizeof(uint16));
+}
+
+/*
+ * PostPrepare_TableVersion
+ */
+void
+PostPrepare_TableVersion(void)
+{
+	reset_modified_slots();
+}
+
+/*
+ * table_version_twophase_postcommit
+ */
+void
+table_version_twophase_postcommit(TransactionId xid, uint16 info, void *recdata, uint32 len)
+{
+	uint16 slot = *(uint16 *) recdata;
+
+	Assert(len == sizeof(uint16));
+
+	if (TableVersionShmem != NULL && slot < NUM_TABLE_VERSIONS)
+		pg_atomic_fetch_add_u32(&TableVersionShmem->versions[slot], 1);
+}
+
+static void
+invalidate_table_version(Datum arg, Oid relid)
+{
+	if (OidIsValid(relid))
+		LocalInvalidations[TABLE_VERSION_SLOT(relid)]++;
+	else
+		LocalResets++;
+}
+
+/*
+ * GetTableVersion
+ */
+uint32
+GetTableVersion(Oid relid)
+{
+	int slot = TABLE_VERSION_SLOT(relid);
+
+	Assert(TableVersionShmem);
+
+	if (!callback_registered)
+	{
+		CacheRegisterRelcacheCallback(invalidate_table_version, (Datum) 0);
+		callback_registered = true;
+	}
+
+	return pg_atomic_read_u32(&TableVersionShmem->versions[slot]) + LocalInvalidations[slot] + LocalResets;
+}
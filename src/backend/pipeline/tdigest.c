@@ -46,12 +46,17 @@ TDigest *
 TDigestCreateWithCompression(int compression)
 {
 	uint32 size = ceil(compression * M_PI / 2) + 1;
-	TDigest *t = palloc0(sizeof(TDigest) + size * sizeof(Centroid));
+	uint32 threshold = estimate_compression_threshold(compression);
+	TDigest *t;
+
+	/* Leave room for all merged centroids so that merging never needs to grow the digest */
+	t = palloc0(sizeof(TDigest) + (size + threshold + 1) * sizeof(Centroid));
 
 	t->compression = 1.0 * compression;
-	t->threshold = estimate_compression_threshold(compression);
+	t->threshold = threshold;
 	t->size = size;
 	t->min = INFINITY;
+	t->buffer_size = TDigestBufferSize(t);
 
 	SET_VARSIZE(t, TDigestSize(t));
 
@@ -61,38 +66,152 @@ TDigestCreateWithCompression(int compression)
 void
 TDigestDestroy(TDigest *t)
 {
-	if (t->unmerged_centroids != NIL)
-		list_free_deep(t->unmerged_centroids);
 	pfree(t);
 }
 
-TDigest *
-TDigestAdd(TDigest *t, float8 x, int64 w)
+/*
+ * resize
+ *
+ * Make sure the given digest has room for the given number of merged and unmerged centroids
+ */
+static TDigest *
+resize(TDigest *t, uint32 num_centroids, uint32 buffer_size)
 {
-	Centroid *c;
+	Size size = sizeof(TDigest) + (num_centroids + buffer_size) * sizeof(Centroid);
 
-	c = palloc0(sizeof(Centroid));
-	c->weight = w;
-	c->mean = x;
+	if (MemoryContextContains(CurrentMemoryContext, t))
+		t = repalloc(t, size);
+	else
+	{
+		TDigest *new = (TDigest *) palloc(size);
+		memcpy(new, t, Min(TDigestSize(t), size));
+		t = new;
+	}
 
-	t->unmerged_centroids = lappend(t->unmerged_centroids, c);
+	return t;
+}
 
-	if (list_length(t->unmerged_centroids) > t->threshold)
-		t = TDigestCompress(t);
+/*
+ * Merging requires some scratch space that only lives for the duration of a compression,
+ * so we keep it around rather than allocating it every time
+ */
+static Centroid *scratch = NULL;
+static uint32 scratch_size = 0;
 
-	return t;
+static Centroid *
+get_scratch(uint32 size)
+{
+	if (size > scratch_size)
+	{
+		if (scratch)
+			pfree(scratch);
+		scratch = MemoryContextAlloc(TopMemoryContext, sizeof(Centroid) * size);
+		scratch_size = size;
+	}
+
+	return scratch;
 }
 
-static int
-centroid_cmp(const void *a, const void *b)
+/*
+ * Centroids are sorted by mean using an LSD radix sort over the bits of the means, mapped
+ * so that their unsigned order matches their floating point order. Passes over bytes that
+ * all means share are skipped, which is most of them for means of similar magnitude.
+ */
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (sizeof(uint64) * BITS_PER_BYTE / RADIX_BITS)
+#define RADIX_DIGIT(key, pass) (((key) >> ((pass) * RADIX_BITS)) & (RADIX_SIZE - 1))
+
+/* Below this many centroids, insertion sort is cheaper than building histograms */
+#define MIN_RADIX_SORT 64
+
+static inline uint64
+sort_key(float8 mean)
 {
-	Centroid *c1 = (Centroid *) a;
-	Centroid *c2 = (Centroid *) b;
-	if (c1->mean < c2->mean)
-		return -1;
-	if (c1->mean > c2->mean)
-		return 1;
-	return 0;
+	uint64 bits;
+
+	memcpy(&bits, &mean, sizeof(uint64));
+
+	/* Negative values sort in reverse order of their magnitude */
+	if (bits & (UINT64CONST(1) << 63))
+		return ~bits;
+
+	return bits | (UINT64CONST(1) << 63);
+}
+
+static void
+insertion_sort_centroids(Centroid *centroids, int n)
+{
+	int i;
+
+	for (i = 1; i < n; i++)
+	{
+		Centroid c = centroids[i];
+		int j = i - 1;
+
+		while (j >= 0 && centroids[j].mean > c.mean)
+		{
+			centroids[j + 1] = centroids[j];
+			j--;
+		}
+
+		centroids[j + 1] = c;
+	}
+}
+
+static void
+sort_centroids(Centroid *centroids, int n, Centroid *tmp)
+{
+	uint32 counts[RADIX_PASSES][RADIX_SIZE];
+	Centroid *src = centroids;
+	Centroid *dst = tmp;
+	int pass;
+	int i;
+
+	if (n < MIN_RADIX_SORT)
+	{
+		insertion_sort_centroids(centroids, n);
+		return;
+	}
+
+	MemSet(counts, 0, sizeof(counts));
+
+	for (i = 0; i < n; i++)
+	{
+		uint64 key = sort_key(centroids[i].mean);
+
+		for (pass = 0; pass < RADIX_PASSES; pass++)
+			counts[pass][RADIX_DIGIT(key, pass)]++;
+	}
+
+	for (pass = 0; pass < RADIX_PASSES; pass++)
+	{
+		uint32 *count = counts[pass];
+		uint32 offset = 0;
+		Centroid *swap;
+
+		/* Every centroid has the same digit, so this pass wouldn't change anything */
+		if (count[RADIX_DIGIT(sort_key(src[0].mean), pass)] == n)
+			continue;
+
+		for (i = 0; i < RADIX_SIZE; i++)
+		{
+			uint32 c = count[i];
+
+			count[i] = offset;
+			offset += c;
+		}
+
+		for (i = 0; i < n; i++)
+			dst[count[RADIX_DIGIT(sort_key(src[i].mean), pass)]++] = src[i];
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != centroids)
+		memcpy(centroids, src, sizeof(Centroid) * n);
 }
 
 typedef struct mergeArgs
@@ -121,6 +240,9 @@ merge_centroid(mergeArgs *args, Centroid *merge)
 		args->idx++;
 		args->k1 = integrated_location(args->t->compression,
 				(args->weight_so_far - merge->weight) / args->t->total_weight);
+
+		Assert(args->idx < args->t->size);
+		MemSet(&args->centroids[args->idx], 0, sizeof(Centroid));
 	}
 
 	c = &args->centroids[args->idx];
@@ -134,121 +256,179 @@ merge_centroid(mergeArgs *args, Centroid *merge)
 	}
 }
 
-TDigest *
-TDigestCompress(TDigest *t)
+/*
+ * merge_unmerged
+ *
+ * Merge the buffered centroids into the digest, leaving its buffer empty
+ */
+static TDigest *
+merge_unmerged(TDigest *t)
 {
-	int num_unmerged = list_length(t->unmerged_centroids);
-	Centroid *unmerged_centroids;
+	Centroid *unmerged = TDigestUnmerged(t);
+	int num_unmerged = t->num_unmerged;
 	uint64_t unmerged_weight = 0;
-	ListCell *lc;
+	Centroid *merged;
+	mergeArgs args;
 	int i, j;
-	mergeArgs *args;
-	uint32_t num_centroids = t->num_centroids;
 
 	if (!num_unmerged)
 		return t;
 
-	unmerged_centroids = palloc(sizeof(Centroid) * num_unmerged);
+	t->num_unmerged = 0;
 
-	i = 0;
-	foreach(lc, t->unmerged_centroids)
-	{
-		Centroid *c = (Centroid *) lfirst(lc);
-		memcpy(&unmerged_centroids[i], c, sizeof(Centroid));
-		unmerged_weight += c->weight;
-		i++;
-	}
-
-	list_free_deep(t->unmerged_centroids);
-	t->unmerged_centroids = NIL;
+	for (i = 0; i < num_unmerged; i++)
+		unmerged_weight += unmerged[i].weight;
 
 	if (unmerged_weight == 0)
 		return t;
 
 	t->total_weight += unmerged_weight;
 
-	qsort(unmerged_centroids, num_unmerged, sizeof(Centroid), centroid_cmp);
+	/* The first t->size scratch centroids hold the merged centroids, the rest are used for sorting */
+	merged = get_scratch(t->size + num_unmerged);
+	sort_centroids(unmerged, num_unmerged, merged + t->size);
 
-	args = palloc0(sizeof(mergeArgs));
-	args->centroids = palloc0(sizeof(Centroid) * t->size);
-	args->t = t;
-	args->min = INFINITY;
+	MemSet(&args, 0, sizeof(mergeArgs));
+	MemSet(merged, 0, sizeof(Centroid));
+	args.centroids = merged;
+	args.t = t;
+	args.min = INFINITY;
 
 	i = 0;
 	j = 0;
 	while (i < num_unmerged && j < t->num_centroids)
 	{
-		Centroid *a = &unmerged_centroids[i];
+		Centroid *a = &unmerged[i];
 		Centroid *b = &t->centroids[j];
 
 		if (a->mean <= b->mean)
 		{
-			merge_centroid(args, a);
+			merge_centroid(&args, a);
 			i++;
 		}
 		else
 		{
-			merge_centroid(args, b);
+			merge_centroid(&args, b);
 			j++;
 		}
 	}
 
 	while (i < num_unmerged)
-		merge_centroid(args, &unmerged_centroids[i++]);
-
-	pfree(unmerged_centroids);
+		merge_centroid(&args, &unmerged[i++]);
 
 	while (j < t->num_centroids)
-		merge_centroid(args, &t->centroids[j++]);
+		merge_centroid(&args, &t->centroids[j++]);
 
-	if (t->total_weight > 0)
-	{
-		t->min = Min(t->min, args->min);
+	t->min = Min(t->min, args.min);
 
-		if (args->centroids[args->idx].weight <= 0)
-			args->idx--;
+	if (args.centroids[args.idx].weight <= 0)
+		args.idx--;
 
-		t->num_centroids = args->idx + 1;
-		t->max = Max(t->max, args->max);
-	}
+	t->max = Max(t->max, args.max);
 
-	if (t->num_centroids > num_centroids)
-	{
-		if (MemoryContextContains(CurrentMemoryContext, t))
-			t = repalloc(t, TDigestSize(t));
-		else
-		{
-			TDigest *new = (TDigest *) palloc(TDigestSize(t));
-			memcpy(new, t, sizeof(TDigest));
-			t = new;
-		}
-	}
+	/* Grow to full capacity at once so that we don't have to do it again on every merge */
+	if (args.idx + 1 > t->num_centroids)
+		t = resize(t, t->size, t->buffer_size);
+
+	t->num_centroids = args.idx + 1;
 
 	Assert(t->num_centroids <= t->size);
 
-	memcpy(t->centroids, args->centroids, sizeof(Centroid) * t->num_centroids);
-	pfree(args->centroids);
-	pfree(args);
+	memcpy(t->centroids, merged, sizeof(Centroid) * t->num_centroids);
 
 	SET_VARSIZE(t, TDigestSize(t));
 
 	return t;
 }
 
+/*
+ * make_room
+ *
+ * Make sure the digest has a buffer of unmerged centroids, which compressed digests don't have
+ */
+static TDigest *
+make_room(TDigest *t)
+{
+	if (t->buffer_size)
+		return t;
+
+	t = resize(t, Max(t->num_centroids, t->size), TDigestBufferSize(t));
+	t->buffer_size = TDigestBufferSize(t);
+	SET_VARSIZE(t, TDigestSize(t));
+
+	return t;
+}
+
 TDigest *
-TDigestMerge(TDigest *t1, TDigest *t2)
+TDigestAdd(TDigest *t, float8 x, int64 w)
 {
-	int i;
+	Centroid *c;
 
-	t2 = TDigestCompress(t2);
+	t = make_room(t);
+
+	c = &TDigestUnmerged(t)[t->num_unmerged++];
+	c->weight = w;
+	c->mean = x;
 
-	for (i = 0; i < t2->num_centroids; i++)
+	if (t->num_unmerged == t->buffer_size)
+		t = merge_unmerged(t);
+
+	return t;
+}
+
+/*
+ * add_centroids
+ *
+ * Add the given centroids to the buffer, merging whenever it fills up
+ */
+static TDigest *
+add_centroids(TDigest *t, Centroid *centroids, int n)
+{
+	t = make_room(t);
+
+	while (n > 0)
 	{
-		Centroid *c = &t2->centroids[i];
-		t1 = TDigestAdd(t1, c->mean, c->weight);
+		int count = Min(n, t->buffer_size - t->num_unmerged);
+
+		memcpy(&TDigestUnmerged(t)[t->num_unmerged], centroids, sizeof(Centroid) * count);
+		t->num_unmerged += count;
+
+		if (t->num_unmerged == t->buffer_size)
+			t = merge_unmerged(t);
+
+		centroids += count;
+		n -= count;
 	}
 
-	return t1;
+	return t;
+}
+
+/*
+ * TDigestCompress
+ *
+ * Merge all buffered centroids and drop the buffer so that the digest takes up as little space as possible
+ */
+TDigest *
+TDigestCompress(TDigest *t)
+{
+	/* Already compressed, and may not be writable if it came straight from disk */
+	if (!t->buffer_size)
+		return t;
+
+	t = merge_unmerged(t);
+
+	t->buffer_size = 0;
+	SET_VARSIZE(t, TDigestSize(t));
+
+	return t;
+}
+
+TDigest *
+TDigestMerge(TDigest *t1, TDigest *t2)
+{
+	t2 = TDigestCompress(t2);
+
+	return add_centroids(t1, t2->centroids, t2->num_centroids);
 }
 
 float8
@@ -383,5 +563,5 @@ TDigestCopy(TDigest *t)
 Size
 TDigestSize(TDigest *t)
 {
-	return sizeof(TDigest) + (sizeof(Centroid) * t->num_centroids);
+	return sizeof(TDigest) + (sizeof(Centroid) * (t->num_centroids + t->buffer_size));
 }
@@ -26,6 +26,7 @@
 #include "pipeline/scheduler.h"
 #include "pipeline/matrel.h"
 #include "pipeline/stream_fdw.h"
+#include "pipeline/stream_route.h"
 #include "pipeline/transform_receiver.h"
 #include "storage/ipc.h"
 #include "tcop/dest.h"
@@ -43,6 +44,9 @@ typedef struct {
 	QueryDesc *query_desc;
 	AttrNumber *groupatts;
 	FuncExpr *hashfunc;
+	/* if the plan can be reused, it's initialized once and kept across batches */
+	bool reuse_plan;
+	ContPlanState *plan;
 } ContQueryWorkerState;
 
 static void
@@ -144,6 +148,8 @@ init_query_state(ContExecutor *exec, ContQueryState *base)
 
 			SetCombinerDestReceiverHashFunc(state->dest, hash);
 		}
+		else if (!base->query->is_sw)
+			SetCombinerDestReceiverUngroupedAgg(state->dest);
 
 		CQMatRelClose(ri);
 		heap_close(matrel, NoLock);
@@ -160,6 +166,11 @@ init_query_state(ContExecutor *exec, ContQueryState *base)
 	ExecEndNode(state->query_desc->planstate);
 	FreeExecutorState(state->query_desc->estate);
 
+	state->reuse_plan = ContPlanIsReusable(pstmt);
+	state->plan = NULL;
+
+	StreamRouteAddQuery(base->query_id, pstmt);
+
 	CurrentResourceOwner = res;
 
 	return base;
@@ -216,6 +227,37 @@ end_plan(QueryDesc *query_desc)
 	query_desc->planstate = NULL;
 }
 
+/*
+ * start_plan
+ *
+ * Returns the EState to execute the given query's plan with in this batch. Reusable plans are
+ * only initialized the first time around and after their query or the tables they hash have
+ * changed. This must be called before this batch's snapshot is taken.
+ */
+static EState *
+start_plan(ContQueryWorkerState *state, ContExecutor *exec)
+{
+	if (!state->reuse_plan)
+	{
+		state->query_desc->estate = CreateEState(state->query_desc);
+		return state->query_desc->estate;
+	}
+
+	if (state->plan && !ContPlanPrepare(state->plan))
+	{
+		ContPlanEnd(state->plan);
+		state->plan = NULL;
+	}
+
+	if (state->plan == NULL)
+	{
+		state->plan = ContPlanStart(state->query_desc, state->base.state_cxt, EXEC_NO_STREAM_LOCKING);
+		set_cont_executor(state->plan->planstate, exec);
+	}
+
+	return state->plan->estate;
+}
+
 static void
 cleanup_worker_state(ContQueryWorkerState *state)
 {
@@ -310,7 +352,7 @@ ContinuousQueryWorkerMain(void)
 	{
 		CHECK_FOR_INTERRUPTS();
 
-		if (get_sigterm_flag())
+		if (get_sigterm_flag() || cont_exec->retired)
 			break;
 
 		ContExecutorStartBatch(cont_exec, 0);
@@ -327,28 +369,34 @@ ContinuousQueryWorkerMain(void)
 					goto next;
 
 				MemoryContextSwitchTo(state->base.tmp_cxt);
+				CurrentResourceOwner = WorkerResOwner;
 
-				estate = CreateEState(state->query_desc);
-				state->query_desc->estate = (EState *) estate;
+				estate = start_plan(state, cont_exec);
 				SetEStateSnapshot((EState *) estate);
 
-				CurrentResourceOwner = WorkerResOwner;
-
 				if (should_exec_query(state->base.query))
 				{
 					TimestampTz start_time = GetCurrentTimestamp();
 					long secs;
 					int usecs;
 
-					/* initialize the plan for execution within this xact */
-					init_plan(state->query_desc);
-					set_cont_executor(state->query_desc->planstate, cont_exec);
+					if (state->plan)
+					{
+						/* this also resets the plan for the next batch */
+						ContPlanExecute(state->plan, state->query_desc->operation, state->dest);
+					}
+					else
+					{
+						/* initialize the plan for execution within this xact */
+						init_plan(state->query_desc);
+						set_cont_executor(state->query_desc->planstate, cont_exec);
 
-					ExecutePlan((EState *) estate, state->query_desc->planstate, state->query_desc->operation,
-							true, 0, ForwardScanDirection, state->dest);
+						ExecutePlan((EState *) estate, state->query_desc->planstate, state->query_desc->operation,
+								true, 0, ForwardScanDirection, state->dest);
 
-					/* free up any resources used by this plan before committing */
-					end_plan(state->query_desc);
+						/* free up any resources used by this plan before committing */
+						end_plan(state->query_desc);
+					}
 
 					/* flush tuples to combiners or transform out functions */
 					flush_tuples(state);
@@ -356,6 +404,7 @@ ContinuousQueryWorkerMain(void)
 					/* record execution time */
 					TimestampDifference(start_time, GetCurrentTimestamp(), &secs, &usecs);
 					pgstat_increment_cq_exec_time(secs * 1000 + (usecs / 1000));
+					pgstat_increment_cq_latency(CQ_PHASE_EXECUTE, secs * USECS_PER_SEC + usecs);
 				}
 
 				UnsetEStateSnapshot((EState *) estate);
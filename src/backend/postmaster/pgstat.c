@@ -358,6 +358,8 @@ pgstat_init(void)
 	 */
 	StaticAssertStmt(sizeof(PgStat_Msg) <= PGSTAT_MAX_MSG_SIZE,
 				   "maximum stats message size exceeds PGSTAT_MAX_MSG_SIZE");
+	StaticAssertStmt(sizeof(PgStat_MsgCQstat) <= PGSTAT_MAX_MSG_SIZE,
+				   "continuous query stats message size exceeds PGSTAT_MAX_MSG_SIZE");
 
 	/*
 	 * Create the UDP socket for sending and receiving statistic messages
@@ -5728,6 +5730,7 @@ cq_stat_report_entry(volatile PgStat_StatCQEntry *entry)
 	entry->updated_bytes = 0;
 	entry->executions = 0;
 	entry->errors = 0;
+	MemSet((char *) entry->latency, 0, sizeof(entry->latency));
 }
 
 /*
@@ -5808,6 +5811,8 @@ pgstat_fetch_stat_cqentry(HTAB *cont_queries, Oid viewoid, pid_t pid, ContQueryP
 static void
 cq_stat_aggregate(PgStat_StatCQEntry *result, PgStat_StatCQEntry *incoming)
 {
+	int i;
+
 	result->input_rows += incoming->input_rows;
 	result->output_rows += incoming->output_rows;
 	result->input_bytes += incoming->input_bytes;
@@ -5826,6 +5831,14 @@ cq_stat_aggregate(PgStat_StatCQEntry *result, PgStat_StatCQEntry *incoming)
 	result->tuples_pb = incoming->tuples_pb;
 
 	result->exec_ms = incoming->exec_ms;
+
+	for (i = 0; i < CQ_NUM_PHASES; i++)
+	{
+		int j;
+
+		for (j = 0; j < PGSTAT_LATENCY_BUCKETS; j++)
+			result->latency[i][j] += incoming->latency[i][j];
+	}
 }
 
 static void
@@ -6092,6 +6105,86 @@ pgstat_increment_cq_read(uint64 nrows, Size nbytes)
 	}
 }
 
+/*
+ * latency_bucket
+ *
+ * Map a latency to its log-scale histogram bucket
+ */
+static int
+latency_bucket(int64 usecs)
+{
+	int bucket = 0;
+
+	while (usecs > 1 && bucket < PGSTAT_LATENCY_BUCKETS - 1)
+	{
+		usecs >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/*
+ * pgstat_increment_cq_latency
+ *
+ * Record the time spent in the given phase, in microseconds
+ */
+void
+pgstat_increment_cq_latency(CQPhase phase, int64 usecs)
+{
+	int bucket = latency_bucket(usecs);
+
+	Assert(phase < CQ_NUM_PHASES);
+
+	MyProcStatCQEntry->latency[phase][bucket]++;
+	if (MyStatCQEntry)
+		MyStatCQEntry->latency[phase][bucket]++;
+}
+
+/*
+ * pgstat_cq_latency_percentile
+ *
+ * Estimate the given percentile (0 - 1) of a phase's latency histogram, in milliseconds.
+ * Latencies are assumed to be uniformly distributed within each bucket. Returns -1 if
+ * no latencies have been recorded for the phase.
+ */
+double
+pgstat_cq_latency_percentile(PgStat_StatCQEntry *entry, CQPhase phase, double percentile)
+{
+	uint64 total = 0;
+	uint64 seen = 0;
+	double rank;
+	int i;
+
+	for (i = 0; i < PGSTAT_LATENCY_BUCKETS; i++)
+		total += entry->latency[phase][i];
+
+	if (!total)
+		return -1;
+
+	rank = percentile * total;
+
+	for (i = 0; i < PGSTAT_LATENCY_BUCKETS; i++)
+	{
+		uint32 count = entry->latency[phase][i];
+		double lower;
+		double upper;
+
+		if (!count || seen + count < rank)
+		{
+			seen += count;
+			continue;
+		}
+
+		lower = i ? (double) (1L << i) : 0;
+		upper = (double) (1L << (i + 1));
+
+		return (lower + (upper - lower) * (rank - seen) / count) / 1000.0;
+	}
+
+	return (double) (1L << PGSTAT_LATENCY_BUCKETS) / 1000.0;
+}
+
 void
 pgstat_end_cq_batch(uint64 nrows, Size nbytes)
 {
@@ -27,6 +27,7 @@
 #include "pgstat.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/ipc/microbatch.h"
+#include "pipeline/table_version.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/bgworker_internals.h"
 #include "postmaster/bgwriter.h"
@@ -153,6 +154,7 @@ CreateSharedMemoryAndSemaphores(bool makePrivate, int port)
 		/* PipelineDB */
 		size = add_size(size, ContQuerySchedulerShmemSize());
 		size = add_size(size, MicrobatchAckShmemSize());
+		size = add_size(size, TableVersionShmemSize());
 
 		/* might as well round it off to a multiple of a typical page size */
 		size = add_size(size, 8192 - (size % 8192));
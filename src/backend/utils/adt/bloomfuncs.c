@@ -21,6 +21,7 @@
 #include "parser/parser.h"
 #include "pipeline/bloom.h"
 #include "pipeline/miscutils.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
 #include "utils/bloomfuncs.h"
@@ -44,7 +45,7 @@ bloom_print(PG_FUNCTION_ARGS)
 }
 
 static BloomFilter *
-bloom_create(float8 p, uint64_t n)
+bloom_create(float8 p, uint64_t n, bool blocked)
 {
 	if (p <= 0 || p >= 1)
 		ereport(ERROR,
@@ -55,11 +56,14 @@ bloom_create(float8 p, uint64_t n)
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				errmsg("n must be non-zero")));
 
+	if (blocked)
+		return BloomFilterCreateBlocked(p, n);
+
 	return BloomFilterCreateWithPAndN(p, n);
 }
 
 static BloomFilter *
-bloom_startup(FunctionCallInfo fcinfo, float8 p, uint64_t n)
+bloom_startup(FunctionCallInfo fcinfo, float8 p, uint64_t n, bool blocked)
 {
 	BloomFilter *bloom;
 	Oid type = AggGetInitialArgType(fcinfo);
@@ -67,9 +71,7 @@ bloom_startup(FunctionCallInfo fcinfo, float8 p, uint64_t n)
 	fcinfo->flinfo->fn_extra = lookup_type_cache(type, 0);
 
 	if (p && n)
-	{
-		bloom = bloom_create(p, n);
-	}
+		bloom = bloom_create(p, n, blocked);
 	else
 		bloom = BloomFilterCreate();
 
@@ -109,7 +111,7 @@ bloom_agg_trans(PG_FUNCTION_ARGS)
 	old = MemoryContextSwitchTo(context);
 
 	if (PG_ARGISNULL(0))
-		state = bloom_startup(fcinfo, 0, 0);
+		state = bloom_startup(fcinfo, 0, 0, false);
 	else
 		state = (BloomFilter *) PG_GETARG_VARLENA_P(0);
 
@@ -141,7 +143,41 @@ bloom_agg_transp(PG_FUNCTION_ARGS)
 	old = MemoryContextSwitchTo(context);
 
 	if (PG_ARGISNULL(0))
-		state = bloom_startup(fcinfo, p, n);
+		state = bloom_startup(fcinfo, p, n, false);
+	else
+		state = (BloomFilter *) PG_GETARG_VARLENA_P(0);
+
+	if (!PG_ARGISNULL(1))
+		state = bloom_add_datum(fcinfo, state, PG_GETARG_DATUM(1));
+
+	MemoryContextSwitchTo(old);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * bloom_agg transition function -
+ *
+ * 	adds the given element to the transition Bloom Filter using the given value for p and n,
+ * 	optionally using the blocked layout
+ */
+Datum
+bloom_agg_trans_blocked(PG_FUNCTION_ARGS)
+{
+	MemoryContext old;
+	MemoryContext context;
+	BloomFilter *state;
+	float8 p = PG_GETARG_FLOAT8(2);
+	uint64_t n = PG_GETARG_INT64(3);
+	bool blocked = PG_GETARG_BOOL(4);
+
+	if (!AggCheckCallContext(fcinfo, &context))
+		elog(ERROR, "bloom_agg_trans_blocked called in non-aggregate context");
+
+	old = MemoryContextSwitchTo(context);
+
+	if (PG_ARGISNULL(0))
+		state = bloom_startup(fcinfo, p, n, blocked);
 	else
 		state = (BloomFilter *) PG_GETARG_VARLENA_P(0);
 
@@ -344,6 +380,86 @@ bloom_contains(PG_FUNCTION_ARGS)
 	PG_RETURN_BOOL(contains);
 }
 
+/*
+ * Returns whether the Bloom filter contains each element of the given array
+ */
+Datum
+bloom_contains_each(PG_FUNCTION_ARGS)
+{
+	ArrayType *array;
+	Oid elem_type;
+	TypeCacheEntry *typ;
+	BloomFilter *bloom = NULL;
+	Datum *elems;
+	bool *nulls;
+	Datum *results;
+	bool *contains;
+	void **keys;
+	Size *sizes;
+	StringInfoData buf;
+	int *offsets;
+	int n;
+	int nkeys = 0;
+	int dims[1];
+	int lbs[1];
+	int i;
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	if (!PG_ARGISNULL(0))
+		bloom = (BloomFilter *) PG_GETARG_VARLENA_P(0);
+
+	array = PG_GETARG_ARRAYTYPE_P(1);
+	elem_type = ARR_ELEMTYPE(array);
+	typ = lookup_type_cache(elem_type, 0);
+
+	deconstruct_array(array, elem_type, typ->typlen, typ->typbyval, typ->typalign, &elems, &nulls, &n);
+
+	results = palloc0(sizeof(Datum) * n);
+	contains = palloc0(sizeof(bool) * n);
+	keys = palloc(sizeof(void *) * n);
+	sizes = palloc(sizeof(Size) * n);
+	offsets = palloc(sizeof(int) * n);
+
+	/* serialize all non-NULL elements first so that they can be probed as a batch */
+	initStringInfo(&buf);
+	for (i = 0; i < n; i++)
+	{
+		if (nulls[i] || bloom == NULL)
+			continue;
+
+		offsets[nkeys] = buf.len;
+		DatumToBytes(elems[i], typ, &buf);
+		sizes[nkeys] = buf.len - offsets[nkeys];
+		nkeys++;
+	}
+
+	/* buf.data may have moved while we were appending to it */
+	for (i = 0; i < nkeys; i++)
+		keys[i] = buf.data + offsets[i];
+
+	if (nkeys)
+		BloomFilterContainsBatch(bloom, keys, sizes, nkeys, contains);
+
+	/* NULL elements are neither contained nor not contained */
+	nkeys = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (nulls[i] || bloom == NULL)
+			continue;
+		results[i] = BoolGetDatum(contains[nkeys++]);
+	}
+
+	if (n == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(BOOLOID));
+
+	dims[0] = n;
+	lbs[0] = 1;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(results, nulls, 1, dims, lbs, BOOLOID, 1, true, 'c'));
+}
+
 Datum
 bloom_empty(PG_FUNCTION_ARGS)
 {
@@ -356,7 +472,7 @@ bloom_emptyp(PG_FUNCTION_ARGS)
 {
 	float8 p = PG_GETARG_FLOAT8(0);
 	uint64_t n = PG_GETARG_INT64(1);
-	BloomFilter *bloom = bloom_create(p, n);
+	BloomFilter *bloom = bloom_create(p, n, false);
 	PG_RETURN_POINTER(bloom);
 }
 
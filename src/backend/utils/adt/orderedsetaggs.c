@@ -1787,7 +1787,7 @@ cqosastatesend(PG_FUNCTION_ARGS)
 	char *pos;
 
 	t = state->tdigest;
-	t = TDigestCompress(t);
+	t = state->tdigest = TDigestCompress(t);
 
 	nbytes = (sizeof(CQOSAAggState) + sizeof(float8) * state->num_percentiles + sizeof(bool) * state->num_percentiles +
 			TDigestSize(t));
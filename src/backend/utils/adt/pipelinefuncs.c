@@ -24,6 +24,8 @@
 #include "fmgr.h"
 #include "pipeline/analyzer.h"
 #include "pipeline/ipc/microbatch.h"
+#include "pipeline/matrel.h"
+#include "pipeline/placement.h"
 #include "pipeline/reaper.h"
 #include "pipeline/stream.h"
 #include "miscadmin.h"
@@ -48,6 +50,63 @@ typedef struct JsonObjectIntSumEntry
 	int64 value;
 } JsonObjectIntSumEntry;
 
+/*
+ * Each latency histogram is exposed as p50, p95 and p99 columns, in milliseconds
+ */
+static const char *cq_latency_phases[CQ_NUM_PHASES] = {"read", "exec", "combine", "sync", "ack_wait"};
+static const int cq_latency_percentiles[] = {50, 95, 99};
+#define CQ_NUM_PERCENTILES lengthof(cq_latency_percentiles)
+#define CQ_LATENCY_COLS (CQ_NUM_PHASES * CQ_NUM_PERCENTILES)
+
+/*
+ * init_latency_entries
+ */
+static void
+init_latency_entries(TupleDesc desc, AttrNumber attno)
+{
+	int i;
+
+	for (i = 0; i < CQ_NUM_PHASES; i++)
+	{
+		int j;
+
+		for (j = 0; j < CQ_NUM_PERCENTILES; j++)
+		{
+			char name[NAMEDATALEN];
+
+			snprintf(name, NAMEDATALEN, "%s_p%d", cq_latency_phases[i], cq_latency_percentiles[j]);
+			TupleDescInitEntry(desc, attno++, name, FLOAT8OID, -1, 0);
+		}
+	}
+}
+
+/*
+ * set_latency_values
+ *
+ * Percentiles of phases with no recorded latencies are NULL
+ */
+static void
+set_latency_values(PgStat_StatCQEntry *entry, Datum *values, bool *nulls, int i)
+{
+	CQPhase phase;
+
+	for (phase = 0; phase < CQ_NUM_PHASES; phase++)
+	{
+		int j;
+
+		for (j = 0; j < CQ_NUM_PERCENTILES; j++)
+		{
+			double p = pgstat_cq_latency_percentile(entry, phase, cq_latency_percentiles[j] / 100.0);
+
+			if (p < 0)
+				nulls[i] = true;
+			else
+				values[i] = Float8GetDatum(p);
+			i++;
+		}
+	}
+}
+
 /*
  * cq_proc_stat_get
  *
@@ -74,7 +133,7 @@ cq_proc_stat_get(PG_FUNCTION_ARGS)
 		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
 		/* build tupdesc for result tuples */
-		tupdesc = CreateTemplateTupleDesc(17, false);
+		tupdesc = CreateTemplateTupleDesc(17 + CQ_LATENCY_COLS, false);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "type", TEXTOID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "pid", INT4OID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "start_time", TIMESTAMPTZOID, -1, 0);
@@ -92,6 +151,7 @@ cq_proc_stat_get(PG_FUNCTION_ARGS)
 		TupleDescInitEntry(tupdesc, (AttrNumber) 15, "executions", INT8OID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 16, "errors", INT8OID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 17, "exec_ms", INT8OID, -1, 0);
+		init_latency_entries(tupdesc, 18);
 
 		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
@@ -112,8 +172,8 @@ cq_proc_stat_get(PG_FUNCTION_ARGS)
 
 	while ((entry = (PgStat_StatCQEntry *) hash_seq_search(iter)) != NULL)
 	{
-		Datum values[17];
-		bool nulls[17];
+		Datum values[17 + CQ_LATENCY_COLS];
+		bool nulls[17 + CQ_LATENCY_COLS];
 		HeapTuple tup;
 		Datum result;
 		pid_t pid = GetStatCQEntryProcPid(entry->key);
@@ -153,6 +213,7 @@ cq_proc_stat_get(PG_FUNCTION_ARGS)
 		values[14] = Int64GetDatum(entry->executions);
 		values[15] = Int64GetDatum(entry->errors);
 		values[16] = Int64GetDatum(entry->exec_ms);
+		set_latency_values(entry, values, nulls, 17);
 
 		tup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
 		result = HeapTupleGetDatum(tup);
@@ -189,7 +250,7 @@ cq_stat_get(PG_FUNCTION_ARGS)
 		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
 		/* build tupdesc for result tuples */
-		tupdesc = CreateTemplateTupleDesc(14, false);
+		tupdesc = CreateTemplateTupleDesc(14 + CQ_LATENCY_COLS, false);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "name", TEXTOID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "type", TEXTOID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "input_rows", INT8OID, -1, 0);
@@ -204,6 +265,7 @@ cq_stat_get(PG_FUNCTION_ARGS)
 		TupleDescInitEntry(tupdesc, (AttrNumber) 12, "tuples_pb", INT8OID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 13, "errors", INT8OID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 14, "exec_ms", INT8OID, -1, 0);
+		init_latency_entries(tupdesc, 15);
 
 		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
@@ -224,8 +286,8 @@ cq_stat_get(PG_FUNCTION_ARGS)
 
 	while ((entry = (PgStat_StatCQEntry *) hash_seq_search(iter)) != NULL)
 	{
-		Datum values[14];
-		bool nulls[14];
+		Datum values[14 + CQ_LATENCY_COLS];
+		bool nulls[14 + CQ_LATENCY_COLS];
 		HeapTuple tup;
 		Datum result;
 		Oid viewid = GetStatCQEntryViewId(entry->key);
@@ -264,6 +326,7 @@ cq_stat_get(PG_FUNCTION_ARGS)
 		values[11] = Int64GetDatum(entry->tuples_pb);
 		values[12] = Int64GetDatum(entry->errors);
 		values[13] = Int64GetDatum(entry->exec_ms);
+		set_latency_values(entry, values, nulls, 14);
 
 		tup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
 		result = HeapTupleGetDatum(tup);
@@ -980,18 +1043,24 @@ pipeline_flush(PG_FUNCTION_ARGS)
 	uint64 start_generation = pg_atomic_read_u64(&db_meta->generation);
 	microbatch_ack_t *ack = microbatch_ack_new(STREAM_INSERT_FLUSH);
 	microbatch_t *mb = microbatch_new(FlushTuple, NULL, NULL);
+	uint32 pin;
+	int nworkers;
 	bool success;
 
 	pzmq_init();
 
 	microbatch_add_ack(mb, ack);
 
-	for (i = 0; i < continuous_query_num_workers; i++)
+	pin = ContQueryShardMapPin(db_meta, false);
+	nworkers = db_meta->shard_map.num_workers;
+
+	for (i = 0; i < nworkers; i++)
 		microbatch_send_to_worker(mb, i);
 
+	ContQueryShardMapUnpin(db_meta, pin);
 	microbatch_destroy(mb);
 
-	microbatch_ack_increment_wtups(ack, continuous_query_num_workers);
+	microbatch_ack_increment_wtups(ack, nworkers);
 	success = microbatch_ack_wait(ack, db_meta, start_generation);
 	microbatch_ack_free(ack);
 
@@ -1060,6 +1129,9 @@ set_ttl(PG_FUNCTION_ARGS)
 	if (IsSWContView(cv_name))
 		elog(ERROR, "the ttl of a sliding-window continuous view cannot be changed");
 
+	if (cv->ttl_partition && (!ttli || !ttl_colname))
+		elog(ERROR, "the ttl of a continuous view with ttl partitions cannot be removed");
+
 	if (ttl_colname)
 	{
 		matrel = heap_openrv(cv->matrel, NoLock);
@@ -1083,6 +1155,9 @@ set_ttl(PG_FUNCTION_ARGS)
 
 		if (!AttributeNumberIsValid(ttl_attno))
 			elog(ERROR, "column \"%s\" does not exist", ttl_colname);
+
+		if (cv->ttl_partition && ttl_attno != cv->ttl_attno)
+			elog(ERROR, "the ttl_column of a continuous view with ttl partitions cannot be changed");
 	}
 
 	ttl = ttli ? IntervalToEpoch(ttli) : -1;
@@ -1121,6 +1196,7 @@ ttl_expire(PG_FUNCTION_ARGS)
 {
 	RangeVar *cv_name;
 	RangeVar *matrel;
+	ContQuery *cv;
 	int result;
 	int save_batch_size = continuous_query_ttl_expiration_batch_size;
 
@@ -1134,12 +1210,238 @@ ttl_expire(PG_FUNCTION_ARGS)
 		elog(ERROR, "continuous view \"%s\" does not have a TTL", cv_name->relname);
 
 	/*
-	 * DELETE everything
+	 * DELETE everything, and drop any TTL partitions that have entirely expired
 	 */
 	continuous_query_ttl_expiration_batch_size = 0;
 	result = DeleteTTLExpiredRows(cv_name, matrel);
 	continuous_query_ttl_expiration_batch_size = save_batch_size;
 
+	cv = GetContQueryForView(cv_name);
+	if (cv->ttl_partition)
+		DropExpiredMatRelPartitions(cv);
+
 	PG_RETURN_INT32(result);
 }
 
+/*
+ * merge_deltas
+ */
+Datum
+merge_deltas(PG_FUNCTION_ARGS)
+{
+	RangeVar *cv_name;
+	ContQuery *cv;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "continuous view name cannot be NULL");
+
+	cv_name = makeRangeVarFromNameList(textToQualifiedNameList(PG_GETARG_TEXT_P(0)));
+	cv = GetContQueryForView(cv_name);
+
+	if (cv == NULL)
+		elog(ERROR, "continuous view \"%s\" does not exist", cv_name->relname);
+
+	if (!cv->delta_storage)
+		elog(ERROR, "continuous view \"%s\" does not use delta storage", cv_name->relname);
+
+	PG_RETURN_INT64(MergeDeltaRows(cv));
+}
+
+/*
+ * pipeline_resize_procs
+ *
+ * Resize the current database's worker and combiner pools without restarting anything. NULL
+ * leaves a pool's size unchanged.
+ */
+Datum
+pipeline_resize_procs(PG_FUNCTION_ARGS)
+{
+	ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
+	int workers;
+	int combiners;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to resize pipelinedb processes")));
+
+	if (db_meta == NULL)
+		elog(ERROR, "pipelinedb processes are not running for this database");
+
+	workers = PG_ARGISNULL(0) ? db_meta->shard_map.num_workers : PG_GETARG_INT32(0);
+	combiners = PG_ARGISNULL(1) ? db_meta->shard_map.num_combiners : PG_GETARG_INT32(1);
+
+	PG_RETURN_BOOL(ResizeContQueryProcPools(workers, combiners));
+}
+
+/*
+ * pipeline_shard_map
+ *
+ * Returns the combiner that owns each shard map bucket and the smoothed number of tuples per second
+ * routed to it
+ */
+Datum
+pipeline_shard_map(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	ContQueryShardMap *map;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+
+		if (db_meta == NULL)
+			elog(ERROR, "pipelinedb processes are not running for this database");
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		tupdesc = CreateTemplateTupleDesc(3, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "bucket", INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "combiner", INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "load", FLOAT8OID, -1, 0);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		funcctx->user_fctx = &db_meta->shard_map;
+		funcctx->max_calls = SHARD_MAP_NUM_BUCKETS;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	map = (ContQueryShardMap *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		int bucket = funcctx->call_cntr;
+		Datum values[3];
+		bool nulls[3];
+		HeapTuple tup;
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(bucket);
+		values[1] = Int32GetDatum(map->buckets[bucket]);
+		values[2] = Float8GetDatum(map->bucket_load[bucket]);
+
+		tup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tup));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * pipeline_proc_placement
+ *
+ * Returns the CPUs and NUMA nodes that each of the current database's continuous query processes
+ * may run on
+ */
+Datum
+pipeline_proc_placement(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	List *procs;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		ContQueryDatabaseMetadata *db_meta = GetMyContQueryDatabaseMetadata();
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+		int i;
+
+		if (db_meta == NULL)
+			elog(ERROR, "pipelinedb processes are not running for this database");
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		tupdesc = CreateTemplateTupleDesc(5, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "type", TEXTOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "id", INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "pid", INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "cpus", TEXTOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "numa_nodes", TEXTOID, -1, 0);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		procs = NIL;
+		for (i = 0; i < db_meta->shard_map.num_workers; i++)
+			procs = lappend(procs, &db_meta->workers[i]);
+		for (i = 0; i < db_meta->shard_map.num_combiners; i++)
+			procs = lappend(procs, &db_meta->combiners[i]);
+		for (i = 0; i < continuous_query_num_queues; i++)
+			procs = lappend(procs, &db_meta->queues[i]);
+		for (i = 0; i < continuous_query_num_reapers; i++)
+			procs = lappend(procs, &db_meta->reapers[i]);
+
+		funcctx->user_fctx = procs;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	procs = (List *) funcctx->user_fctx;
+
+	while (procs != NIL)
+	{
+		ContQueryProc *proc = (ContQueryProc *) linitial(procs);
+		pid_t pid = proc->pid;
+		Datum values[5];
+		bool nulls[5];
+		char *cpus;
+		char *nodes;
+		char *type;
+		HeapTuple tup;
+
+		funcctx->user_fctx = procs = list_delete_first(procs);
+
+		/* It may be restarting */
+		if (pid == 0)
+			continue;
+
+		switch (proc->type)
+		{
+			case Worker:
+				type = "worker";
+				break;
+			case Combiner:
+				type = "combiner";
+				break;
+			case Queue:
+				type = "queue";
+				break;
+			default:
+				type = "reaper";
+				break;
+		}
+
+		cpus = GetProcCPUs(pid);
+		nodes = GetProcNUMANodes(pid);
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(type);
+		values[1] = Int32GetDatum(proc->group_id);
+		values[2] = Int32GetDatum(pid);
+
+		if (cpus)
+			values[3] = CStringGetTextDatum(cpus);
+		else
+			nulls[3] = true;
+
+		if (nodes)
+			values[4] = CStringGetTextDatum(nodes);
+		else
+			nulls[4] = true;
+
+		tup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tup));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -18,6 +18,7 @@
 #include "pipeline/planner.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/ipc/microbatch.h"
+#include "pipeline/table_version.h"
 #include "tcop/utility.h"
 
 /*
@@ -31,6 +32,7 @@ PipelineShmemInit()
 	srand(time(NULL) ^ MyProcPid);
 	ContQuerySchedulerShmemInit();
 	MicrobatchAckShmemInit();
+	TableVersionShmemInit();
 }
 
 /*
@@ -60,6 +60,8 @@
 #include "pipeline/reaper.h"
 #include "pipeline/stream.h"
 #include "pipeline/ipc/pzmq.h"
+#include "pipeline/placement.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/update.h"
 #include "postmaster/autovacuum.h"
 #include "postmaster/bgworker.h"
@@ -395,6 +397,19 @@ static const struct config_enum_entry stream_insert_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry worker_routing_options[] = {
+	{"random", WORKER_ROUTING_RANDOM, false},
+	{"power_of_two", WORKER_ROUTING_POWER_OF_TWO, false},
+	{"least_loaded", WORKER_ROUTING_LEAST_LOADED, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry ipc_transport_options[] = {
+	{"zmq", IPC_TRANSPORT_ZMQ, false},
+	{"shm", IPC_TRANSPORT_SHM, false},
+	{NULL, 0, false}
+};
+
 /*
  * Options for enum values stored in other modules
  */
@@ -1645,6 +1660,17 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_parallel_combine", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
+		 gettext_noop("Spreads partial results of continuous views without a GROUP BY across all combiner processes."),
+		 gettext_noop("Each combiner keeps its own partial result and periodically sends it to the combiner that "
+				 "owns the view, which merges them and writes the result to the view.")
+		},
+		&continuous_query_parallel_combine,
+		false,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"anonymous_update_checks", PGC_POSTMASTER, DEVELOPER_OPTIONS,
 		 gettext_noop("Anonymously check for available updates."),
@@ -2749,6 +2775,18 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_join_cache_mem", PGC_SIGHUP, RESOURCES_MEM,
+		 gettext_noop("Sets the maximum memory each worker process may use to keep stream-table join hash tables across batches."),
+		 gettext_noop("A table joined with a stream is hashed once and the hash table is reused until the table "
+					  "changes, as long as it fits within this limit. Zero disables this."),
+		 GUC_UNIT_KB
+		},
+		&continuous_query_join_cache_mem,
+		65536, 0, MAX_KILOBYTES,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"continuous_query_max_wait", PGC_SIGHUP, QUERY_TUNING,
 		 gettext_noop("Sets the time a continuous query process will wait for a batch to accumulate."),
@@ -2793,7 +2831,18 @@ static struct config_int ConfigureNamesInt[] =
 	},
 
 	{
-		{"continuous_query_num_combiners", PGC_BACKEND, RESOURCES_ASYNCHRONOUS,
+		{"continuous_query_ipc_shared_mem", PGC_POSTMASTER, RESOURCES_MEM,
+		 gettext_noop("Sets the size of the shared memory ring buffer used by each worker and combiner process."),
+		 gettext_noop("Only used when continuous_query_ipc_transport is shm. Microbatches are capped at a quarter of this size."),
+		 GUC_UNIT_KB
+		},
+		&continuous_query_ipc_shared_mem,
+		65536, 1024, MAX_KILOBYTES,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"continuous_query_num_combiners", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
 		 gettext_noop("Sets the number of parallel continuous query combiner processes to use for each database."),
 		 gettext_noop("A higher number will utilize multiple cores and increase throughput.")
 		},
@@ -2803,7 +2852,7 @@ static struct config_int ConfigureNamesInt[] =
 	},
 
 	{
-		{"continuous_query_num_workers", PGC_BACKEND, RESOURCES_ASYNCHRONOUS,
+		{"continuous_query_num_workers", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
 		 gettext_noop("Sets the number of parallel continuous query worker processes to use for each database."),
 		 gettext_noop("A higher number will utilize multiple cores and increase throughput.")
 		},
@@ -2852,6 +2901,17 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_delta_merge_interval", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
+		 gettext_noop("Sets the minimum time between merges of a delta storage continuous view's appended rows."),
+		 NULL,
+		 GUC_UNIT_S
+		},
+		&continuous_query_delta_merge_interval,
+		10, 0, INT_MAX / 1000,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"continuous_query_queue_mem", PGC_BACKEND, RESOURCES_MEM,
 		 gettext_noop("Sets the maximum amount of memory each queue process will use."),
@@ -2882,6 +2942,16 @@ static struct config_int ConfigureNamesInt[] =
 		50, 0, 60000,
 		NULL, NULL, NULL
 	},
+	{
+		{"continuous_query_rebalance_interval", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
+		 gettext_noop("Sets how often the load of each combiner is checked in order to move hot shards between them."),
+		 gettext_noop("Zero disables rebalancing."),
+		 GUC_UNIT_S
+		},
+		&continuous_query_rebalance_interval,
+		0, 0, INT_MAX / 1000,
+		NULL, NULL, NULL
+	},
 	/* End-of-list marker */
 	{
 		{NULL, 0, 0, NULL, NULL}, NULL, 0, 0, 0, NULL, NULL, NULL
@@ -3032,6 +3102,16 @@ static struct config_real ConfigureNamesReal[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_rebalance_threshold", PGC_SIGHUP, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets how many times the mean combiner load the busiest combiner must reach before shards are moved away from it."),
+			NULL
+		},
+		&continuous_query_rebalance_threshold,
+		1.5, 1.0, 100.0,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"sliding_window_step_factor", PGC_USERSET, QUERY_TUNING_OTHER,
 		 gettext_noop("Sets the default step size for a sliding window query as a percentage of the window size."),
@@ -3646,6 +3726,36 @@ static struct config_string ConfigureNamesString[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_worker_cpus", PGC_POSTMASTER, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the CPUs that continuous query worker processes are pinned to."),
+			gettext_noop("Semicolon separated CPU sets are assigned to workers round-robin. An empty string disables pinning.")
+		},
+		&continuous_query_worker_cpus,
+		"",
+		check_cont_query_cpus, NULL, NULL
+	},
+
+	{
+		{"continuous_query_combiner_cpus", PGC_POSTMASTER, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the CPUs that continuous query combiner processes are pinned to."),
+			gettext_noop("Semicolon separated CPU sets are assigned to combiners round-robin. An empty string disables pinning.")
+		},
+		&continuous_query_combiner_cpus,
+		"",
+		check_cont_query_cpus, NULL, NULL
+	},
+
+	{
+		{"continuous_query_queue_cpus", PGC_POSTMASTER, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the CPUs that continuous query queue processes are pinned to."),
+			gettext_noop("Semicolon separated CPU sets are assigned to queues round-robin. An empty string disables pinning.")
+		},
+		&continuous_query_queue_cpus,
+		"",
+		check_cont_query_cpus, NULL, NULL
+	},
+
 	/* End-of-list marker */
 	{
 		{NULL, 0, 0, NULL, NULL}, NULL, NULL, NULL, NULL, NULL
@@ -3902,6 +4012,26 @@ static struct config_enum ConfigureNamesEnum[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"continuous_query_ipc_transport", PGC_POSTMASTER, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the transport used to send microbatches to worker and combiner processes."),
+			NULL
+		},
+		&continuous_query_ipc_transport,
+		IPC_TRANSPORT_ZMQ, ipc_transport_options,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"continuous_query_worker_routing", PGC_SIGHUP, QUERY_TUNING,
+			gettext_noop("Sets the policy used to choose which worker process a stream write is sent to."),
+			gettext_noop("power_of_two and least_loaded prefer workers with fewer unread tuples.")
+		},
+		&continuous_query_worker_routing,
+		WORKER_ROUTING_POWER_OF_TWO, worker_routing_options,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"stream_insert_level", PGC_USERSET, QUERY_TUNING,
 			gettext_noop("Sets the current transaction's synchronization level."),
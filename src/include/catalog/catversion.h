@@ -53,6 +53,6 @@
  */
 
 /*							yyyymmddN */
-#define CATALOG_VERSION_NO	201703160
+#define CATALOG_VERSION_NO	201703168
 
 #endif
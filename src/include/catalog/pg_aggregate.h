@@ -335,6 +335,7 @@ DATA(insert ( 4326	n 0 hll_union_agg_trans	hll_cache_cardinality		-				-				-
 /* bloom filter aggregates */
 DATA(insert ( 4329	n 0 bloom_agg_trans			-	-				-				-				f f 0	5030	0	0		0	_null_ _null_ ));
 DATA(insert ( 4330	n 0 bloom_agg_transp		-	-				-				-				f f 0	5030	0	0		0	_null_ _null_ ));
+DATA(insert ( 4325	n 0 bloom_agg_trans_blocked	-	-				-				-				f f 0	5030	0	0		0	_null_ _null_ ));
 DATA(insert ( 4333	n 0 bloom_union_agg_trans	-	-				-				-				f f 0	5030	0	0		0	_null_ _null_ ));
 DATA(insert ( 4335	n 0 bloom_intersection_agg_trans	-	-		-				-				f f 0	5030	0	0		0	_null_ _null_ ));
 
@@ -5497,6 +5497,14 @@ DESCR("bloom filter aggregate");
 DATA(insert OID = 4332 ( bloom_agg_transp	PGNSP PGUID 12 1 0 0 0 f f f f f f i 4 0 5030 "5030 2283 701 20" _null_ _null_ _null_ _null_ _null_ bloom_agg_transp _null_ _null_ _null_ ));
 DESCR("bloom filter aggregate");
 
+/* bloom filter aggregate with user-supplied p, n and layout */
+DATA(insert OID = 4325 ( bloom_agg	PGNSP PGUID 12 1 0 0 0 t f f f f f i 4 0 5030 "2283 701 20 16" _null_ _null_ _null_ _null_ _null_ aggregate_dummy _null_ _null_ _null_ ));
+DESCR("bloom filter aggregate");
+
+/* bloom filter aggregate with p, n and layout transition function */
+DATA(insert OID = 4402 ( bloom_agg_trans_blocked	PGNSP PGUID 12 1 0 0 0 f f f f f f i 5 0 5030 "5030 2283 701 20 16" _null_ _null_ _null_ _null_ _null_ bloom_agg_trans_blocked _null_ _null_ _null_ ));
+DESCR("bloom filter aggregate");
+
 /* bloom filter union aggregate */
 DATA(insert OID = 4333 ( bloom_union_agg	PGNSP PGUID 12 1 0 0 0 t f f f f f i 1 0 5030 "5030" _null_ _null_ _null_ _null_ _null_ aggregate_dummy _null_ _null_ _null_ ));
 DESCR("bloom filter union aggregate");
@@ -5523,6 +5531,10 @@ DESCR("bloom filter contains item?");
 DATA(insert OID = 4385 ( bloom_contains	PGNSP PGUID 12 1 0 0 0 f f f f f f i 2 0 16 "5030 25" _null_ _null_ _null_ _null_ _null_ bloom_contains _null_ _null_ _null_ ));
 DESCR("bloom filter contains item?");
 
+/* bloom filter batched contains function */
+DATA(insert OID = 4406 ( bloom_contains_each	PGNSP PGUID 12 1 0 0 0 f f f f f f i 2 0 1000 "5030 2277" _null_ _null_ _null_ _null_ _null_ bloom_contains_each _null_ _null_ _null_ ));
+DESCR("bloom filter contains each item?");
+
 /* t-digest aggregate */
 DATA(insert OID = 4339 ( tdigest_agg	PGNSP PGUID 12 1 0 0 0 t f f f f f i 1 0 5034 "701" _null_ _null_ _null_ _null_ _null_ aggregate_dummy _null_ _null_ _null_ ));
 DESCR("t-digest aggregate");
@@ -5589,10 +5601,10 @@ DESCR("count-min sketch estimate frequency");
 DATA(insert OID = 4386 ( cmsketch_frequency	PGNSP PGUID 12 1 0 0 0 f f f f f f i 2 0 23 "5038 25" _null_ _null_ _null_ _null_ _null_ cmsketch_frequency _null_ _null_ _null_ ));
 DESCR("count-min sketch estimate frequency");
 
-DATA(insert OID = 4355 ( cq_proc_stat_get PGNSP PGUID 12 1 1000 0 0 f f f f t t s 0 0 2249 "" "{25,23,1184,20,20,20,20,20,20,20,20,20,20,20,20,20,20}" "{o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o}" "{type,pid,start_time,input_rows,output_rows,updated_rows,input_bytes,output_bytes,updated_bytes,tuples_ps,bytes_ps,time_pb,tuples_pb,memory,executions,errors,exec_ms}" _null_ _null_ cq_proc_stat_get _null_ _null_ _null_ ));
+DATA(insert OID = 4355 ( cq_proc_stat_get PGNSP PGUID 12 1 1000 0 0 f f f f t t s 0 0 2249 "" "{25,23,1184,20,20,20,20,20,20,20,20,20,20,20,20,20,20,701,701,701,701,701,701,701,701,701,701,701,701,701,701,701}" "{o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o}" "{type,pid,start_time,input_rows,output_rows,updated_rows,input_bytes,output_bytes,updated_bytes,tuples_ps,bytes_ps,time_pb,tuples_pb,memory,executions,errors,exec_ms,read_p50,read_p95,read_p99,exec_p50,exec_p95,exec_p99,combine_p50,combine_p95,combine_p99,sync_p50,sync_p95,sync_p99,ack_wait_p50,ack_wait_p95,ack_wait_p99}" _null_ _null_ cq_proc_stat_get _null_ _null_ _null_ ));
 DESCR("get continuous query process stats");
 
-DATA(insert OID = 4356 ( cq_stat_get PGNSP PGUID 12 1 1000 0 0 f f f f t t s 0 0 2249 "" "{25,25,20,20,20,20,20,20,20,20,20,20,20,20}" "{o,o,o,o,o,o,o,o,o,o,o,o,o,o}" "{name,type,input_rows,output_rows,updated_rows,input_bytes,output_bytes,updated_bytes,tuples_ps,bytes_ps,time_pb,tuples_pb,errors,exec_ms}" _null_ _null_ cq_stat_get _null_ _null_ _null_ ));
+DATA(insert OID = 4356 ( cq_stat_get PGNSP PGUID 12 1 1000 0 0 f f f f t t s 0 0 2249 "" "{25,25,20,20,20,20,20,20,20,20,20,20,20,20,701,701,701,701,701,701,701,701,701,701,701,701,701,701,701}" "{o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o}" "{name,type,input_rows,output_rows,updated_rows,input_bytes,output_bytes,updated_bytes,tuples_ps,bytes_ps,time_pb,tuples_pb,errors,exec_ms,read_p50,read_p95,read_p99,exec_p50,exec_p95,exec_p99,combine_p50,combine_p95,combine_p99,sync_p50,sync_p95,sync_p99,ack_wait_p50,ack_wait_p95,ack_wait_p99}" _null_ _null_ cq_stat_get _null_ _null_ _null_ ));
 DESCR("get continuous query stats");
 
 /* hyperloglog empty */
@@ -5992,6 +6004,16 @@ DESCR("bucket ids retrieval function");
 DATA(insert OID = 4518 ( ttl_expire	PGNSP PGUID 12 1 1 0 0 f f f f f t i 1 0 20 "25" _null_ _null_ _null_ _null_ _null_ ttl_expire _null_ _null_ _null_ ));
 DESCR("force ttl expiration for a continuous view");
 
+DATA(insert OID = 4521 ( merge_deltas	PGNSP PGUID 12 1 0 0 0 f f f f t f v 1 0 20 "25" _null_ _null_ _null_ _null_ _null_ merge_deltas _null_ _null_ _null_ ));
+DESCR("force a merge of the delta rows of a delta storage continuous view");
+
+DATA(insert OID = 4522 ( pipeline_resize_procs	PGNSP PGUID 12 1 0 0 0 f f f f f f v 2 0 16 "23 23" _null_ _null_ _null_ _null_ _null_ pipeline_resize_procs _null_ _null_ _null_ ));
+DESCR("resize the worker and combiner pools of the current database");
+DATA(insert OID = 4523 ( pipeline_shard_map PGNSP PGUID 12 1 4096 0 0 f f f f t t v 0 0 2249 "" "{23,23,701}" "{o,o,o}" "{bucket,combiner,load}" _null_ _null_ pipeline_shard_map _null_ _null_ _null_ ));
+DESCR("combiner that owns each shard map bucket and the tuples per second routed to it");
+DATA(insert OID = 4524 ( pipeline_proc_placement PGNSP PGUID 12 1 20 0 0 f f f f t t v 0 0 2249 "" "{25,23,23,25,25}" "{o,o,o,o,o}" "{type,id,pid,cpus,numa_nodes}" _null_ _null_ pipeline_proc_placement _null_ _null_ _null_ ));
+DESCR("CPUs and NUMA nodes that continuous query processes may run on");
+
 DATA(insert OID = 4519 ( bucket_agg	PGNSP PGUID 12 1 0 0 0 t f f f t f i 3 0 17 "2283 21 1184" _null_ _null_ _null_ _null_ _null_ aggregate_dummy _null_ _null_ _null_ ));
 DESCR("bucket aggregate function");
 DATA(insert OID = 4520 ( bucket_agg_trans_ts	PGNSP PGUID 12 1 0 0 0 f f f f f f i 4 0 2281 "2281 2283 21 1184" _null_ _null_ _null_ _null_ _null_ bucket_agg_trans_ts _null_ _null_ _null_ ));
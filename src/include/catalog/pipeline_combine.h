@@ -192,6 +192,7 @@ DATA(insert (hll_cache_cardinality hll_agg_transp hll_cache_cardinality 0 hll_un
 /* bloom_agg */
 DATA(insert (0 bloom_agg_trans  0 0 bloom_union_agg_trans 5030));
 DATA(insert (0 bloom_agg_transp 0 0 bloom_union_agg_trans 5030));
+DATA(insert (0 bloom_agg_trans_blocked 0 0 bloom_union_agg_trans 5030));
 
 /* tdigest_agg */
 DATA(insert (tdigest_compress tdigest_agg_trans  tdigest_compress 0 tdigest_merge_agg_trans 5034));
@@ -53,6 +53,8 @@ typedef struct ContQuery
 	AttrNumber ttl_attno;
 	AttrNumber sw_attno;
 	int ttl;
+	bool delta_storage;
+	int ttl_partition;
 
 	/* for transform */
 	Oid tgfn;
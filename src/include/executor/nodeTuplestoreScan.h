@@ -17,5 +17,6 @@
 extern TuplestoreScanState *ExecInitTuplestoreScan(TuplestoreScan *node, EState *estate, int eflags);
 extern TupleTableSlot *ExecTuplestoreScan(TuplestoreScanState *node);
 extern void ExecEndTuplestoreScan(TuplestoreScanState *node);
+extern void ExecReScanTuplestoreScan(TuplestoreScanState *node);
 
 #endif   /* NODETUPLESTORESCAN_HH */
@@ -1652,6 +1652,7 @@ typedef struct CustomScanState
 typedef struct TuplestoreScanState
 {
 	ScanState	ss;				/* its first field is NodeTag */
+	int			next_tuple;		/* position in the plan's external tuple array */
 } TuplestoreScanState;
 
 /* ----------------------------------------------------------------
@@ -1988,6 +1989,7 @@ typedef struct HashState
 	HashJoinTable hashtable;	/* hash table for the hashjoin */
 	List	   *hashkeys;		/* list of ExprState nodes */
 	/* hashkeys is same as parent's hj_InnerHashKeys */
+	int			hash_mem;		/* memory the hash table may use, in kB */
 } HashState;
 
 /* ----------------
@@ -169,6 +169,8 @@ typedef struct Query
 	bool isCombine; /* is this query being run as a merge query? */
 	bool isCombineLookup; /* is this query a combiner looking up groups to combine with? */
 	double swStepFactor;
+	bool deltaStorage; /* does the matrel store appended deltas rather than one row per group? */
+	int ttlPartition; /* width in seconds of the matrel's TTL partitions, or 0 if it isn't partitioned */
 } Query;
 
 
@@ -1329,6 +1331,7 @@ typedef struct SelectStmt
 	bool forContinuousView; /* does this SELECT statement for a CREATE CONTINUOUS VIEW statement? */
 	bool forCombineLookup; /* is this SELECT stmt for looking up groups in the combiner? */
 	double swStepFactor;
+	bool deltaStorage; /* should the matrel store appended deltas rather than one row per group? */
 } SelectStmt;
 
 
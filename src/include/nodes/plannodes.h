@@ -601,12 +601,17 @@ typedef struct CustomScan
  * 	to run the continuous query plan one final time on a tuplestore containing
  * 	the partial results as well as any existing tuples that the partial results
  * 	need to be merged with.
+ *
+ * 	Tuples may also be passed by reference in an external array, which is
+ * 	scanned before the tuplestore without copying its tuples.
  */
 typedef struct TuplestoreScan
 {
 	Scan		scan;
 	Tuplestorestate *store; /* tuplestore to scan from */
 	TupleDesc	desc; /* tuple descriptor of store to scan */
+	HeapTuple  *tuples; /* external array of tuples to scan before store */
+	int			ntuples; /* number of valid entries in tuples */
 } TuplestoreScan;
 
 /*
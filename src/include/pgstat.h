@@ -557,7 +557,7 @@ typedef union PgStat_Msg
  * ------------------------------------------------------------
  */
 
-#define PGSTAT_FILE_FORMAT_ID	0x01A5BC9D
+#define PGSTAT_FILE_FORMAT_ID	0x01A5BC9E
 
 /* ----------
  * PgStat_StatDBEntry			The collector's data per database
@@ -1058,6 +1058,26 @@ typedef struct PgStat_StatCQAverageEntry
 	PgStat_Counter bytes[PGSTAT_AVERAGE_BUFFER_SIZE];
 } PgStat_StatCQAverageEntry;
 
+/*
+ * Phases of continuous query execution whose latencies are tracked
+ */
+typedef enum
+{
+	CQ_PHASE_READ,
+	CQ_PHASE_EXECUTE,
+	CQ_PHASE_COMBINE,
+	CQ_PHASE_SYNC,
+	CQ_PHASE_ACK_WAIT,
+	CQ_NUM_PHASES
+} CQPhase;
+
+/*
+ * Latencies are kept in fixed-size log-scale histograms so that they can be
+ * shipped to the collector and summed without loss. Bucket 0 counts latencies
+ * below 2us, and each bucket i > 0 counts latencies within [2^i, 2^(i+1)) us.
+ */
+#define PGSTAT_LATENCY_BUCKETS 32
+
 /*
  * The collector's data per continuous-query
  */
@@ -1102,6 +1122,9 @@ typedef struct PgStat_StatCQEntry
 
 	TimestampTz last_report;
 	PgStat_Counter exec_ms;
+
+	/* per-phase latency histograms, reset after each report just like the counters */
+	uint32 latency[CQ_NUM_PHASES][PGSTAT_LATENCY_BUCKETS];
 } PgStat_StatCQEntry;
 
 typedef struct PgStat_StatCQEntryLocal
@@ -1186,6 +1209,9 @@ extern void pgstat_increment_cq_read(uint64 nrows, Size nbytes);
 			MyStatCQEntry->exec_ms += (ms); \
 	} while(0)
 
+extern void pgstat_increment_cq_latency(CQPhase phase, int64 usecs);
+extern double pgstat_cq_latency_percentile(PgStat_StatCQEntry *entry, CQPhase phase, double percentile);
+
 extern void pgstat_init_cqstat(volatile PgStat_StatCQEntry *entry, Oid viewid, pid_t pid);
 extern void pgstat_report_cqstat(bool force);
 extern void pgstat_report_create_drop_cv(bool create);
@@ -49,6 +49,11 @@ typedef struct ContAnalyzeContext
 #define OPTION_STEP_FACTOR "step_factor"
 #define OPTION_TTL "ttl"
 #define OPTION_TTL_COLUMN "ttl_column"
+#define OPTION_STORAGE "storage"
+#define OPTION_TTL_PARTITION "ttl_partition"
+
+#define STORAGE_HEAP "heap"
+#define STORAGE_DELTA "delta"
 
 
 #define SW_TIMESTAMP_REF 65100
@@ -19,18 +19,28 @@ typedef struct BloomFilter
 	uint32_t vl_len_;
 	uint32_t m;
 	uint16_t k;
+	/*
+	 * Blocked filters set all k bits of a key within a single block of BLOOM_BLOCK_BITS
+	 * bits, and have a power of two number of blocks
+	 */
+	bool blocked;
 	uint32_t blen;
 	uint64_t b[1];
 } BloomFilter;
 
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+
 extern BloomFilter *BloomFilterCreateWithMAndK(uint32_t m, uint16_t k);
 extern BloomFilter *BloomFilterCreateWithPAndN(float8 p, uint32_t n);
+extern BloomFilter *BloomFilterCreateBlocked(float8 p, uint64_t n);
 extern BloomFilter *BloomFilterCreate(void);
 extern void BloomFilterDestroy(BloomFilter *bf);
 
 extern BloomFilter *BloomFilterCopy(BloomFilter *bf);
 extern void BloomFilterAdd(BloomFilter *bf, void *key, Size size);
 extern bool BloomFilterContains(BloomFilter *bf, void *key, Size size);
+extern void BloomFilterContainsBatch(BloomFilter *bf, void **keys, Size *sizes, int n, bool *results);
 extern BloomFilter *BloomFilterUnion(BloomFilter *result, BloomFilter *incoming);
 extern BloomFilter *BloomFilterIntersection(BloomFilter *result, BloomFilter *incoming);
 extern uint64_t BloomFilterCardinality(BloomFilter *bf);
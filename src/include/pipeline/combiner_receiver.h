@@ -24,6 +24,7 @@ extern CombinerFlushFunc CombinerFlushHook;
 extern DestReceiver *CreateCombinerDestReceiver(void);
 extern void SetCombinerDestReceiverParams(DestReceiver *self, ContExecutor *cont_exec, ContQuery *query);
 extern void SetCombinerDestReceiverHashFunc(DestReceiver *self, FuncExpr *hash);
+extern void SetCombinerDestReceiverUngroupedAgg(DestReceiver *self);
 extern void CombinerDestReceiverFlush(DestReceiver *self);
 
 #endif
@@ -17,6 +17,7 @@
 #include "access/htup.h"
 #include "access/tupdesc.h"
 #include "catalog/pipeline_query_fn.h"
+#include "executor/execdesc.h"
 #include "nodes/bitmapset.h"
 #include "nodes/pg_list.h"
 #include "pgstat.h"
@@ -24,6 +25,7 @@
 #include "pipeline/ipc/reader.h"
 #include "port/atomics.h"
 #include "storage/spin.h"
+#include "utils/resowner.h"
 #include "utils/timestamp.h"
 
 typedef struct ContQueryState
@@ -54,6 +56,9 @@ struct ContExecutor
 	ContQueryState *curr_query;
 	ContQueryState *states[MAX_CQS];
 	ContQueryStateInit initfn;
+
+	/* removed from its pool and has read everything that was sent to it */
+	bool retired;
 };
 
 extern ContExecutor *ContExecutorNew(ContQueryStateInit initfn);
@@ -65,4 +70,36 @@ extern void *ContExecutorIterate(ContExecutor *exec, int *len);
 extern void ContExecutorEndQuery(ContExecutor *exec);
 extern void ContExecutorEndBatch(ContExecutor *exec, bool commit);
 
+/*
+ * An executor state that is kept alive across batches rather than being initialized and
+ * torn down for each one. It's reset after every execution and rebuilt whenever a
+ * pipeline_query row is invalidated, or a table it hashes for a stream-table join changes.
+ */
+typedef struct ContPlanState
+{
+	MemoryContext cxt;
+	EState *estate;
+	PlanState *planstate;
+	ResourceOwner owner;
+	uint64 generation;
+	MemoryContextCallback callback;
+
+	/* tables hashed by stream-table joins, and their versions when the plan was started */
+	int ntables;
+	Oid *tables;
+	uint32 *table_versions;
+
+	/* joins whose hash tables are kept across executions while they fit in the budget */
+	List *cached_joins;
+	Size join_cache_size;
+} ContPlanState;
+
+extern bool ContPlanCanCacheJoins(void);
+extern int ContPlanJoinCacheAvailable(void);
+extern bool ContPlanIsReusable(PlannedStmt *pstmt);
+extern ContPlanState *ContPlanStart(QueryDesc *query_desc, MemoryContext parent, int eflags);
+extern bool ContPlanPrepare(ContPlanState *plan);
+extern void ContPlanExecute(ContPlanState *plan, CmdType operation, DestReceiver *dest);
+extern void ContPlanEnd(ContPlanState *plan);
+
 #endif
@@ -27,7 +27,7 @@
 #define IS_NEW(el) ((el)->flags & ELEMENT_NEW)
 #define IS_NULL(el) ((el)->flags & ELEMENT_NULL)
 #define SET_NEW(el) ((el)->flags |= (ELEMENT_SET | ELEMENT_NEW))
-#define UNSET_NEW(el) ((el)->flags = ELEMENT_SET)
+#define UNSET_NEW(el) ((el)->flags &= ~ELEMENT_NEW)
 #define SET(el) ((el)->flags |= ELEMENT_SET)
 #define SET_NULL(el) ((el)-> flags |= ELEMENT_NULL)
 
@@ -18,15 +18,26 @@
 #include "nodes/pg_list.h"
 #include "pipeline/scheduler.h"
 #include "pipeline/miscutils.h"
+#include "pipeline/ipc/shmq.h"
 #include "pipeline/stream.h"
 #include "port/atomics.h"
+#include "storage/latch.h"
 
-#define MAX_MICROBATCH_SIZE (continuous_query_batch_mem * 1024)
+#define MAX_MICROBATCH_SIZE (ipc_transport_is_shm() ? \
+		Min(continuous_query_batch_mem * 1024, (int) SHMQ_MAX_MESSAGE_SIZE) : continuous_query_batch_mem * 1024)
 
 /* guc */
 extern int continuous_query_batch_mem;
+typedef enum
+{
+	WORKER_ROUTING_RANDOM,
+	WORKER_ROUTING_POWER_OF_TWO,
+	WORKER_ROUTING_LEAST_LOADED
+} WorkerRoutingPolicy;
+
 extern int continuous_query_batch_size;
 extern int continuous_query_ipc_hwm;
+extern int continuous_query_worker_routing;
 
 extern Size MicrobatchAckShmemSize(void);
 extern void MicrobatchAckShmemInit(void);
@@ -46,6 +57,10 @@ typedef struct microbatch_ack_t
 	pg_atomic_uint32 num_wtups;
 	/* Total number of tuples sent to combiners */
 	pg_atomic_uint32 num_ctups;
+	/* When the inserting process started waiting on this ack */
+	TimestampTz created;
+	/* Latch of the inserting process, set once the ack is complete */
+	Latch *latch;
 } microbatch_ack_t;
 
 extern microbatch_ack_t *microbatch_ack_new(StreamInsertLevel level);
@@ -55,16 +70,8 @@ extern void microbatch_ack_free(microbatch_ack_t *ack);
 #define microbatch_ack_get_level(ack) (pg_atomic_read_u64(&ack->id) >> 62L)
 #define microbatch_ack_increment_wtups(ack, n) pg_atomic_fetch_add_u32(&(ack)->num_wtups, (n))
 #define microbatch_ack_increment_ctups(ack, n) pg_atomic_fetch_add_u32(&(ack)->num_ctups, (n))
-#define microbatch_ack_increment_wrecv(ack, n) pg_atomic_fetch_add_u32(&(ack)->num_wrecv, (n))
-#define microbatch_ack_increment_acks(ack, n) \
-	do \
-	{ \
-		if (IsContQueryWorkerProcess()) \
-			pg_atomic_fetch_add_u32(&(ack)->num_wacks, (n)); \
-		else \
-			pg_atomic_fetch_add_u32(&(ack)->num_cacks, (n)); \
-	} \
-	while (0);
+extern void microbatch_ack_increment_wrecv(microbatch_ack_t *ack, int n);
+extern void microbatch_ack_increment_acks(microbatch_ack_t *ack, int n);
 #define microbatch_acks_check_and_exec(acks, fn, arg) \
 	do \
 	{ \
@@ -103,7 +110,8 @@ typedef struct microbatch_t
 	List *acks;
 	List *record_descs;
 
-	tagged_ref_t *tups;
+	/* packed tuples, only set for unpacked microbatches which are iterated in place */
+	char *tups;
 	int ntups;
 	StringInfo buf;
 } microbatch_t;
@@ -120,9 +128,11 @@ extern bool microbatch_add_tuple(microbatch_t *mb, HeapTuple tup, uint64 group_h
 extern char *microbatch_pack(microbatch_t *mb, int *len);
 extern char *microbatch_pack_for_queue(uint64 recv_id, char *packed, int *len);
 extern microbatch_t *microbatch_unpack(char *buf, int len);
-extern void microbatch_send(microbatch_t *mb, uint64 recv_id, bool async, ContQueryDatabaseMetadata *db_meta);
+extern HeapTuple microbatch_next_tuple(microbatch_t *mb, char **pos, uint64 *hash);
+extern void microbatch_send(microbatch_t *mb, ContQueryProc *proc, bool async, ContQueryDatabaseMetadata *db_meta);
 extern void microbatch_add_acks(microbatch_t *mb, List *acks);
 extern void microbatch_send_to_worker(microbatch_t *mb, int worker_id);
+extern void microbatch_proc_done(ContQueryProc *proc, int ntups);
 extern void microbatch_send_to_combiner(microbatch_t *mb, int combiner_id);
 
 #endif
@@ -13,12 +13,18 @@
 
 #include "pipeline/ipc/pzmq.h"
 
+/*
+ * Tuples returned by the reader point directly into the received microbatch buffers, which are
+ * pinned until ipc_tuple_reader_reset() is called at the end of the ContExecutor batch
+ */
 typedef struct ipc_tuple
 {
 	TupleDesc desc;
 	List *record_descs;
 	HeapTuple tup;
 	uint64 hash;
+	/* position of this tuple within the batch, the same for every query that reads it */
+	int idx;
 } ipc_tuple;
 
 typedef struct ipc_tuple_reader_batch
@@ -34,7 +40,7 @@ typedef struct ipc_tuple_reader_batch
 extern void ipc_tuple_reader_init(void);
 extern void ipc_tuple_reader_destroy(void);
 
-#define ipc_tuple_reader_poll(timeout) (pzmq_poll(timeout))
+extern bool ipc_tuple_reader_poll(int timeout);
 extern ipc_tuple_reader_batch *ipc_tuple_reader_pull(void);
 extern void ipc_tuple_reader_reset(void);
 extern void ipc_tuple_reader_ack(void);
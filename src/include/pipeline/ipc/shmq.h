@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * shmq.h
+ *
+ * Copyright (c) 2013-2016, PipelineDB
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef SHMQ_H
+#define SHMQ_H
+
+#include "postgres.h"
+
+#include "pipeline/scheduler.h"
+
+typedef enum
+{
+	IPC_TRANSPORT_ZMQ,
+	IPC_TRANSPORT_SHM
+} IPCTransport;
+
+/* guc */
+extern int continuous_query_ipc_transport;
+extern int continuous_query_ipc_shared_mem;
+
+#define ipc_transport_is_shm() (continuous_query_ipc_transport == IPC_TRANSPORT_SHM)
+
+/*
+ * A reader holds every message of the batch it is accumulating in place until it releases the whole
+ * batch, so a producer may have to wait for a release before its message fits. Readers never wait
+ * on producers to do that, so any message that fits into an empty ring is eventually delivered.
+ * Entries never wrap around and skipping to the start of the ring can waste up to one entry, so
+ * that means half the ring. Messages are capped at a quarter of it so that producers can usually
+ * keep writing while a reader holds a batch, which MAX_MICROBATCH_SIZE bounds by the same limit.
+ */
+#define SHMQ_MAX_MESSAGE_SIZE ((Size) continuous_query_ipc_shared_mem * 1024 / 4)
+
+#define ShmqIsReceiver(proc) ((proc)->type == Worker || (proc)->type == Combiner)
+
+extern void shmq_bind(ContQueryProc *proc);
+extern void shmq_destroy(void);
+extern bool shmq_is_bound(void);
+
+extern bool shmq_send(ContQueryProc *proc, char *buf, int len, bool wait);
+extern char *shmq_recv(int *len);
+extern bool shmq_poll(int timeout);
+extern void shmq_release(void);
+
+#endif
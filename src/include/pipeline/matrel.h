@@ -12,6 +12,7 @@
 #ifndef CQMATVIEW_H
 #define CQMATVIEW_H
 
+#include "catalog/pipeline_query_fn.h"
 #include "nodes/execnodes.h"
 
 extern bool continuous_query_materialization_table_updatable;
@@ -19,6 +20,7 @@ extern bool continuous_query_materialization_table_updatable;
 #define CQ_OSREL_SUFFIX "_osrel"
 #define CQ_MATREL_SUFFIX "_mrel"
 #define CQ_SEQREL_SUFFIX "_seq"
+#define CQ_MATREL_PARTITION_SUFFIX "_p"
 #define CQ_MATREL_PKEY "$pk"
 #define MatRelUpdatesEnabled() (continuous_query_materialization_table_updatable)
 
@@ -27,11 +29,17 @@ extern void CQOSRelClose(ResultRelInfo *rinfo);
 extern ResultRelInfo *CQOSRelOpen(Relation osrel);
 extern void CQMatRelClose(ResultRelInfo *rinfo);
 extern void ExecInsertCQMatRelIndexTuples(ResultRelInfo *indstate, TupleTableSlot *slot, EState *estate);
-extern void ExecCQMatRelUpdate(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate);
-extern void ExecCQMatRelInsert(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate);
+extern bool ExecCQMatRelUpdate(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate);
+extern bool ExecCQMatRelInsert(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate);
+extern bool ExecCQMatRelCheckConstraints(ResultRelInfo *ri, TupleTableSlot *slot, EState *estate);
+extern void ExecCQMatRelMultiInsert(ResultRelInfo *ri, HeapTuple *tups, int ntups, TupleTableSlot *slot, EState *estate);
 
 extern char *CVNameToOSRelName(char *cv_name);
 extern char *CVNameToMatRelName(char *cv_name);
 extern char *CVNameToSeqRelName(char *cv_name);
 
+extern Oid GetMatRelPartition(ContQuery *cq, Relation matrel, Datum ttl_value);
+extern int CreateMatRelPartitions(ContQuery *cq);
+extern int DropExpiredMatRelPartitions(ContQuery *cq);
+
 #endif
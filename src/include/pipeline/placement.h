@@ -0,0 +1,32 @@
+/*-------------------------------------------------------------------------
+ *
+ * placement.h
+ *	  CPU and NUMA placement of continuous query processes
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/include/pipeline/placement.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "pipeline/scheduler.h"
+#include "utils/guc.h"
+
+/* guc parameters */
+extern char *continuous_query_worker_cpus;
+extern char *continuous_query_combiner_cpus;
+extern char *continuous_query_queue_cpus;
+
+extern bool check_cont_query_cpus(char **newval, void **extra, GucSource source);
+
+extern void SetContQueryProcPlacement(ContQueryProc *proc);
+extern bool ContQueryProcIsPlaced(void);
+
+extern char *GetProcCPUs(pid_t pid);
+extern char *GetProcNUMANodes(pid_t pid);
+
+#endif   /* PLACEMENT_H */
@@ -12,9 +12,13 @@
 #ifndef REAPER_H
 #define REAPER_H
 
+#include "catalog/pipeline_query_fn.h"
+
 extern int continuous_query_ttl_expiration_batch_size;
 extern int continuous_query_ttl_expiration_threshold;
+extern int continuous_query_delta_merge_interval;
 
 int DeleteTTLExpiredRows(RangeVar *cvname, RangeVar *matrel);
+int MergeDeltaRows(ContQuery *cq);
 
 #endif   /* REAPER_H */
@@ -39,12 +39,58 @@ typedef struct ContQueryProc
 	Latch *latch;
 
 	volatile int pzmq_id;
+	volatile dsm_handle shmq_handle; /* zero unless using the shm IPC transport */
 	volatile int group_id; /* unqiue [0, n) for each db_oid, type pair */
+	volatile pid_t pid;
+
+	pg_atomic_uint32 inflight; /* tuples sent to this proc that it hasn't finished reading yet */
+
+	volatile bool pending; /* combiner has combined tuples that it hasn't committed yet */
+	volatile uint32 shard_map_version; /* shard map version a combiner has switched to */
+	volatile bool resize_start; /* started by a pool resize rather than restarted after a crash */
+	volatile bool retire; /* removed from its pool, so exit once everything sent to it is read */
 
 	BackgroundWorkerHandle *bgw_handle;
 	ContQueryDatabaseMetadata *db_meta;
 } ContQueryProc;
 
+/*
+ * Determines how many of a database's workers and combiners tuples are routed to, and which combiner
+ * owns each group. Group hashes are mapped to a fixed number of virtual buckets, each of which is
+ * owned by a single combiner, so that ownership can be moved a bucket at a time. Senders pin the current epoch while they route tuples, so that the
+ * scheduler can wait for everything routed with an old map to have been sent before it moves groups
+ * between combiners or stops processes that were removed from their pool.
+ *
+ * Routing to workers and routing to combiners are pinned separately, since clients may be blocked
+ * writing to workers that are themselves waiting for combiners to drain.
+ */
+#define SHARD_MAP_WORKERS 0
+#define SHARD_MAP_COMBINERS 1
+
+#define SHARD_MAP_NUM_BUCKETS 4096
+#define ShardMapBucket(hash) ((hash) & (SHARD_MAP_NUM_BUCKETS - 1))
+
+typedef struct ContQueryShardMap
+{
+	pg_atomic_uint32 version; /* bumped whenever group ownership changes */
+	pg_atomic_uint32 epochs[2]; /* indexed by SHARD_MAP_WORKERS or SHARD_MAP_COMBINERS */
+	pg_atomic_uint32 pins[4]; /* senders routing to either pool during an even or odd epoch */
+	pg_atomic_uint64 combiner_sends; /* microbatches sent to combiners so far */
+
+	volatile int num_workers;
+	volatile int num_combiners;
+
+	/* groups are moving between combiners, so workers hold on to their partials until they have */
+	volatile bool draining;
+
+	uint16 buckets[SHARD_MAP_NUM_BUCKETS]; /* combiner that owns each bucket */
+
+	/* tuples routed to each bucket since the scheduler last sampled them */
+	pg_atomic_uint32 bucket_tuples[SHARD_MAP_NUM_BUCKETS];
+	/* smoothed tuples per second routed to each bucket */
+	float4 bucket_load[SHARD_MAP_NUM_BUCKETS];
+} ContQueryShardMap;
+
 struct ContQueryDatabaseMetadata
 {
 	Oid      db_id;
@@ -58,8 +104,17 @@ struct ContQueryDatabaseMetadata
 	sig_atomic_t dropdb;
 	sig_atomic_t terminate;
 
-	/* Number of entries is equal to continuous_query_num_combiners + continuous_query_num_workers. */
-	ContQueryProc *db_procs;
+	/* Worker and combiner pools have room for up to max_worker_processes processes each */
+	ContQueryProc *workers;
+	ContQueryProc *combiners;
+	ContQueryProc *queues;
+	ContQueryProc *reapers;
+
+	ContQueryShardMap shard_map;
+
+	/* pool sizes requested with pipeline_resize_procs() or by reloading the configuration */
+	volatile int target_workers;
+	volatile int target_combiners;
 };
 
 typedef struct ContQueryRunParams
@@ -82,9 +137,13 @@ extern int  continuous_query_num_reapers;
 extern int  continuous_query_queue_mem;
 extern int  continuous_query_max_wait;
 extern int  continuous_query_combiner_work_mem;
+extern int  continuous_query_join_cache_mem;
 extern int  continuous_query_combiner_synchronous_commit;
 
 extern int continuous_query_commit_interval;
+extern int continuous_query_rebalance_interval;
+extern double continuous_query_rebalance_threshold;
+extern bool continuous_query_parallel_combine;
 extern double continuous_query_proc_priority;
 
 #define MyDSMCQueue (MyContQueryProc->cq_handle->cqueue)
@@ -115,6 +174,10 @@ extern void ContinuousQueryReaperMain(void);
 
 extern void SignalContQuerySchedulerDropDB(Oid db_oid);
 extern void SignalContQuerySchedulerRefreshDBList(void);
+extern bool ResizeContQueryProcPools(int num_workers, int num_combiners);
+
+extern uint32 ContQueryShardMapPin(ContQueryDatabaseMetadata *db_meta, bool combiners);
+extern void ContQueryShardMapUnpin(ContQueryDatabaseMetadata *db_meta, uint32 pin);
 
 extern ContQueryDatabaseMetadata *GetContQueryDatabaseMetadata(Oid db_oid);
 extern ContQueryDatabaseMetadata *GetMyContQueryDatabaseMetadata(void);
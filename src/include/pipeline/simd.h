@@ -0,0 +1,34 @@
+/*-------------------------------------------------------------------------
+ *
+ * simd.h
+ *	  SIMD and prefetch support for the probabilistic data structures
+ *
+ * Kernels that use SSE2 are only compiled if configure found the SSE2 and AVX2
+ * intrinsics, in which case the AVX2 variants are compiled with pg_attribute_avx2
+ * and may only be called if pg_avx2_available() says the CPU supports them.
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * src/include/pipeline/simd.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PIPELINE_SIMD_H
+#define PIPELINE_SIMD_H
+
+#include "c.h"
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+#include <immintrin.h>
+
+#define pg_attribute_avx2 __attribute__((target("avx2")))
+#define pg_avx2_available() __builtin_cpu_supports("avx2")
+#endif
+
+#ifdef HAVE__BUILTIN_PREFETCH
+#define pg_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define pg_prefetch(addr) ((void) 0)
+#endif
+
+#endif
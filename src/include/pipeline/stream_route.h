@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * stream_route.h
+ *	  Routing of stream tuples to the continuous queries whose WHERE clause can match them
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/include/pipeline/stream_route.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef STREAM_ROUTE_H
+#define STREAM_ROUTE_H
+
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "nodes/bitmapset.h"
+#include "nodes/plannodes.h"
+
+typedef struct StreamRouter StreamRouter;
+
+extern void StreamRouteAddQuery(Oid query_id, PlannedStmt *pstmt);
+extern void StreamRouteRemoveQuery(Oid query_id);
+extern Bitmapset *StreamRouteGetQueries(void);
+
+extern StreamRouter *StreamRouteBegin(TupleDesc desc, Bitmapset *queries);
+extern int StreamRouteTuple(StreamRouter *router, HeapTuple tup, int *matches);
+extern void StreamRouteEnd(StreamRouter *router);
+
+#endif   /* STREAM_ROUTE_H */
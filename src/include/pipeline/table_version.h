@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * table_version.h
+ *	  Cheap detection of changes to tables read by continuous queries
+ *
+ * Copyright (c) 2017, PipelineDB
+ *
+ * IDENTIFICATION
+ *    src/include/pipeline/table_version.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef TABLE_VERSION_H
+#define TABLE_VERSION_H
+
+extern Size TableVersionShmemSize(void);
+extern void TableVersionShmemInit(void);
+
+extern uint32 GetTableVersion(Oid relid);
+
+extern void TableVersionNoteModified(Oid relid);
+extern void AtEOXact_TableVersion(bool isCommit);
+extern void AtPrepare_TableVersion(void);
+extern void PostPrepare_TableVersion(void);
+extern void table_version_twophase_postcommit(TransactionId xid, uint16 info,
+		void *recdata, uint32 len);
+
+#endif   /* TABLE_VERSION_H */
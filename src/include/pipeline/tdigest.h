@@ -13,7 +13,6 @@
 #define TDIGEST_H
 
 #include "c.h"
-#include "nodes/pg_list.h"
 
 typedef struct Centroid
 {
@@ -32,11 +31,20 @@ typedef struct TDigest {
 	float8 min;
 	float8 max;
 
-	List *unmerged_centroids;
+	/*
+	 * Values are first added to a buffer of unmerged centroids that immediately follows the
+	 * merged centroids, and are merged in once it is full. Compressed digests don't carry a
+	 * buffer, so buffer_size is either 0 or TDigestBufferSize.
+	 */
+	uint32 buffer_size;
+	uint32 num_unmerged;
 	uint32 num_centroids;
 	Centroid centroids[1];
 } TDigest;
 
+#define TDigestBufferSize(t) ((t)->threshold + 1)
+#define TDigestUnmerged(t) (&(t)->centroids[(t)->num_centroids])
+
 extern TDigest *TDigestCreate(void);
 extern TDigest *TDigestCreateWithCompression(int compression);
 extern void TDigestDestroy(TDigest *t);
@@ -17,12 +17,14 @@
 extern Datum bloom_print(PG_FUNCTION_ARGS);
 extern Datum bloom_agg_trans(PG_FUNCTION_ARGS);
 extern Datum bloom_agg_transp(PG_FUNCTION_ARGS);
+extern Datum bloom_agg_trans_blocked(PG_FUNCTION_ARGS);
 extern Datum bloom_union_agg_trans(PG_FUNCTION_ARGS);
 extern Datum bloom_union(PG_FUNCTION_ARGS);
 extern Datum bloom_intersection_agg_trans(PG_FUNCTION_ARGS);
 extern Datum bloom_intersection(PG_FUNCTION_ARGS);
 extern Datum bloom_cardinality(PG_FUNCTION_ARGS);
 extern Datum bloom_contains(PG_FUNCTION_ARGS);
+extern Datum bloom_contains_each(PG_FUNCTION_ARGS);
 extern Datum bloom_empty(PG_FUNCTION_ARGS);
 extern Datum bloom_emptyp(PG_FUNCTION_ARGS);
 extern Datum bloom_add(PG_FUNCTION_ARGS);
@@ -15,7 +15,7 @@
 #include "postgres.h"
 #include "fmgr.h"
 
-#define get_combiner_for_shard_hash(hash) ((hash) % continuous_query_num_combiners)
+#define get_combiner_for_shard_hash(hash) (MyContQueryProc->db_meta->shard_map.buckets[ShardMapBucket(hash)])
 #define is_group_hash_mine(hash) (get_combiner_for_shard_hash(hash) == MyContQueryProc->group_id)
 
 extern Datum hash_group(PG_FUNCTION_ARGS);
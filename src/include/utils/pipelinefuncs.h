@@ -60,4 +60,12 @@ extern Datum set_ttl(PG_FUNCTION_ARGS);
 
 extern Datum ttl_expire(PG_FUNCTION_ARGS);
 
+extern Datum merge_deltas(PG_FUNCTION_ARGS);
+
+extern Datum pipeline_resize_procs(PG_FUNCTION_ARGS);
+
+extern Datum pipeline_shard_map(PG_FUNCTION_ARGS);
+
+extern Datum pipeline_proc_placement(PG_FUNCTION_ARGS);
+
 #endif
@@ -334,14 +334,22 @@ def pipeline(request):
 
     return pdb
 
-def async_insert(f):
-  @wraps(f)
-  def wrapper(pipeline, clean_db):
-    pipeline.stop()
-    pipeline.run({'stream_insert_level': 'sync_receive'})
-    try:
-      f(pipeline, clean_db)
-    finally:
+def run_with(params):
+  """
+  Runs the decorated test against an instance restarted with the given
+  parameters, restarting it with the default ones afterwards
+  """
+  def decorator(f):
+    @wraps(f)
+    def wrapper(pipeline, clean_db):
       pipeline.stop()
-      pipeline.run()
-  return wrapper
+      pipeline.run(params)
+      try:
+        f(pipeline, clean_db)
+      finally:
+        pipeline.stop()
+        pipeline.run()
+    return wrapper
+  return decorator
+
+async_insert = run_with({'stream_insert_level': 'sync_receive'})
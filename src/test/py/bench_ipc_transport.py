@@ -0,0 +1,100 @@
+#! /usr/bin/python
+"""
+Compares stream ingest throughput of the zmq and shm IPC transports with
+1, 8 and 32 concurrent COPY clients.
+
+This isn't collected by py.test, run it directly from this directory:
+
+    python bench_ipc_transport.py [--rows N] [--clients 1,8,32]
+"""
+import argparse
+import os
+import threading
+import time
+
+from base import PipelineDB
+
+
+TRANSPORTS = ['zmq', 'shm']
+
+
+def _generate_csv(path, rows):
+  with open(path, 'w') as csv:
+    for n in xrange(rows):
+      csv.write('%d,%d,%s\n' % (n, n % 1024, 'x' * 64))
+
+
+def _wait_for_count(pdb, expected, timeout=120):
+  start = time.time()
+  while time.time() - start < timeout:
+    row = pdb.execute('SELECT count FROM bench_ipc_total').first()
+    if row and row['count'] >= expected:
+      return
+    time.sleep(0.01)
+  raise Exception('timed out waiting for %d events' % expected)
+
+
+def run_bench(pdb, path, rows, nclients):
+  pdb.execute('TRUNCATE CONTINUOUS VIEW bench_ipc')
+  pdb.execute('TRUNCATE CONTINUOUS VIEW bench_ipc_total')
+
+  def copy():
+    conn = pdb.engine.connect()
+    conn.execute("COPY bench_ipc_stream (x, y, z) FROM '%s' CSV" % path)
+    conn.close()
+
+  threads = [threading.Thread(target=copy) for _ in xrange(nclients)]
+
+  start = time.time()
+  map(lambda t: t.start(), threads)
+  map(lambda t: t.join(), threads)
+  _wait_for_count(pdb, rows * nclients)
+  elapsed = time.time() - start
+
+  return rows * nclients / elapsed
+
+
+def main(args):
+  clients = map(int, args.clients.split(','))
+  results = {}
+
+  pdb = PipelineDB()
+  path = os.path.abspath(os.path.join(pdb.tmp_dir, 'bench_ipc.csv'))
+  _generate_csv(path, args.rows)
+
+  try:
+    for transport in TRANSPORTS:
+      pdb.run({
+        'continuous_query_ipc_transport': transport,
+        'continuous_query_num_workers': args.workers,
+        'continuous_query_num_combiners': args.combiners,
+        'stream_insert_level': 'sync_receive',
+        'max_connections': max(clients) + 16
+        })
+      pdb.drop_all()
+      pdb.create_stream('bench_ipc_stream', x='int', y='int', z='text')
+      pdb.create_cv('bench_ipc', 'SELECT y, count(*) FROM bench_ipc_stream GROUP BY y')
+      pdb.create_cv('bench_ipc_total', 'SELECT count(*) FROM bench_ipc_stream')
+
+      for n in clients:
+        results[(transport, n)] = run_bench(pdb, path, args.rows, n)
+
+      pdb.stop()
+  finally:
+    pdb.destroy()
+
+  print '%-10s %10s %16s' % ('transport', 'clients', 'events/s')
+  for transport in TRANSPORTS:
+    for n in clients:
+      print '%-10s %10d %16.0f' % (transport, n, results[(transport, n)])
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--rows', type=int, default=200000,
+                      help='Number of rows each client COPYs')
+  parser.add_argument('--clients', default='1,8,32',
+                      help='Comma separated list of concurrent COPY clients')
+  parser.add_argument('--workers', type=int, default=4)
+  parser.add_argument('--combiners', type=int, default=4)
+  main(parser.parse_args())
@@ -1,6 +1,7 @@
-from base import pipeline, clean_db
+from base import pipeline, clean_db, run_with
 import os
 import random
+import threading
 
 
 def _generate_csv(path, rows, desc=None, delimiter=','):
@@ -88,3 +89,82 @@ def test_regression(pipeline, clean_db):
   pipeline.create_cv('test_copy_regression', 'SELECT sum(count) FROM copy_regression_stream')
 
   pipeline.execute("COPY copy_regression_stream (day, project, title, count, size) FROM '%s' CSV HEADER" % path)
+
+@run_with({
+  'continuous_query_ipc_transport': 'shm',
+  'continuous_query_ipc_shared_mem': '1MB'
+  })
+def test_copy_shm_transport(pipeline, clean_db):
+  """
+  Verify that concurrent COPYs are delivered correctly over the shared memory
+  ring buffer transport, using a small ring so that it wraps around repeatedly
+  """
+  pipeline.create_stream('stream0', x='int', s='text')
+  pipeline.create_cv('test_copy_shm', 'SELECT count(*), sum(x) FROM stream0')
+
+  path = os.path.abspath(os.path.join(pipeline.tmp_dir, 'test_copy_shm.csv'))
+  rows = [(n, 'a' * 512) for n in range(20000)]
+  _generate_csv(path, rows, desc=('x', 's'))
+
+  def copy():
+    conn = pipeline.engine.connect()
+    conn.execute('COPY stream0 (x, s) FROM \'%s\' HEADER CSV' % path)
+    conn.close()
+
+  threads = [threading.Thread(target=copy) for _ in range(4)]
+  map(lambda t: t.start(), threads)
+  map(lambda t: t.join(), threads)
+
+  result = pipeline.execute('SELECT * FROM test_copy_shm').first()
+  assert result['count'] == 4 * len(rows)
+  assert result['sum'] == 4 * sum(r[0] for r in rows)
+
+
+def _copy_with_routing(pipeline):
+  """
+  Runs concurrent COPYs into a grouped view and verifies that every row was
+  delivered exactly once
+  """
+  path = os.path.abspath(os.path.join(pipeline.tmp_dir, 'test_copy_routing.csv'))
+  rows = [(n, n % 16) for n in range(20000)]
+  _generate_csv(path, rows, desc=('x', 'y'))
+
+  pipeline.create_stream('stream0', x='int', y='int')
+  pipeline.create_cv('test_copy_routing', 'SELECT y, count(*), sum(x) FROM stream0 GROUP BY y')
+
+  def copy():
+    conn = pipeline.engine.connect()
+    conn.execute('COPY stream0 (x, y) FROM \'%s\' HEADER CSV' % path)
+    conn.close()
+
+  threads = [threading.Thread(target=copy) for _ in range(4)]
+  map(lambda t: t.start(), threads)
+  map(lambda t: t.join(), threads)
+
+  result = pipeline.execute('SELECT sum(count) AS count, sum(sum) AS sum FROM test_copy_routing').first()
+  assert result['count'] == 4 * len(rows)
+  assert result['sum'] == 4 * sum(r[0] for r in rows)
+
+
+@run_with({
+  'continuous_query_num_workers': 4,
+  'continuous_query_worker_routing': 'random'
+  })
+def test_copy_random_routing(pipeline, clean_db):
+  """
+  Verify that concurrent COPYs are delivered correctly when routed to random
+  workers
+  """
+  _copy_with_routing(pipeline)
+
+
+@run_with({
+  'continuous_query_num_workers': 4,
+  'continuous_query_worker_routing': 'least_loaded'
+  })
+def test_copy_least_loaded_routing(pipeline, clean_db):
+  """
+  Verify that concurrent COPYs are delivered correctly when routed to the
+  least loaded workers
+  """
+  _copy_with_routing(pipeline)
@@ -0,0 +1,100 @@
+from base import pipeline, clean_db
+
+
+def test_delta_storage(pipeline, clean_db):
+  """
+  Verify that delta storage views append a row per sync and are read and merged
+  as if they had one row per group
+  """
+  pipeline.create_stream('stream0', key='int', x='int')
+  pipeline.create_cv('delta_grouped',
+                     'SELECT key::int, COUNT(*), sum(x::int), avg(x::int), count(DISTINCT x::int) AS distinct_count '
+                     'FROM stream0 GROUP BY key',
+                     storage='delta')
+  pipeline.create_cv('delta_ungrouped',
+                     'SELECT COUNT(*), max(x::int) FROM stream0',
+                     storage='delta')
+
+  rows = [(n % 10, n) for n in range(100)]
+
+  for _ in range(5):
+    pipeline.insert('stream0', ('key', 'x'), rows)
+
+  # Every sync appended its own delta for each group
+  assert pipeline.execute('SELECT count(*) FROM delta_grouped_mrel').first()['count'] > 10
+
+  def verify():
+    result = list(pipeline.execute('SELECT * FROM delta_grouped ORDER BY key'))
+    assert len(result) == 10
+    for r in result:
+      assert r['count'] == 50
+      assert r['sum'] == 5 * sum(range(r['key'], 100, 10))
+      assert r['avg'] == r['key'] + 45
+      assert r['distinct_count'] == 10
+
+    result = pipeline.execute('SELECT * FROM delta_ungrouped').first()
+    assert result['count'] == 500
+    assert result['max'] == 99
+
+  verify()
+
+  pipeline.execute("SELECT merge_deltas('delta_grouped')")
+  pipeline.execute("SELECT merge_deltas('delta_ungrouped')")
+
+  assert pipeline.execute('SELECT count(*) FROM delta_grouped_mrel').first()['count'] == 10
+  assert pipeline.execute('SELECT count(*) FROM delta_ungrouped_mrel').first()['count'] == 1
+
+  verify()
+
+  # Nothing left to merge
+  assert pipeline.execute("SELECT merge_deltas('delta_grouped') AS n").first()['n'] == 0
+
+
+def test_delta_storage_invalid(pipeline, clean_db):
+  """
+  Verify that delta storage is only allowed for aggregate views it can merge
+  """
+  pipeline.create_stream('stream0', key='int')
+
+  invalid = [
+    ('SELECT key::int FROM stream0', {}),
+    ('SELECT DISTINCT key::int FROM stream0', {}),
+    ('SELECT COUNT(*) FROM stream0', {'sw': '1 minute'}),
+    ('SELECT key::int, COUNT(*) FROM stream0 GROUP BY key', {'pk': 'key'})
+  ]
+
+  for q, opts in invalid:
+    try:
+      pipeline.create_cv('delta0', q, storage='delta', **opts)
+      assert False
+    except Exception, e:
+      assert 'storage' in e.message
+
+  try:
+    pipeline.create_cv('delta0', 'SELECT COUNT(*) FROM stream0', storage='columnar')
+    assert False
+  except Exception, e:
+    assert '"storage" must be either' in e.message
+
+
+def test_delta_storage_output_stream(pipeline, clean_db):
+  """
+  Verify that nothing can read from the output stream of a delta storage view,
+  since its combiners only ever see partial group values
+  """
+  pipeline.create_stream('stream0', key='int')
+  pipeline.create_stream('stream1', key='int')
+  pipeline.create_cv('delta0', 'SELECT key::int, COUNT(*) FROM stream0 GROUP BY key', storage='delta')
+
+  try:
+    pipeline.create_cv('delta0_output', 'SELECT (new).key, (new).count FROM delta0_osrel')
+    assert False
+  except Exception, e:
+    assert 'output stream' in e.message
+
+  try:
+    pipeline.create_ct('delta0_ct', 'SELECT (new).key FROM delta0_osrel',
+                       "pipeline_stream_insert('stream1')")
+    assert False
+  except Exception, e:
+    assert 'output stream' in e.message
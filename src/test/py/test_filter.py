@@ -30,3 +30,87 @@ def test_filter_clause(pipeline, clean_db):
 
     assert result1['sum2'] == result2['sum2'] == sum2
     assert result1['sum3'] == result2['sum3'] == sum3
+
+
+def test_shared_where_clauses(pipeline, clean_db):
+    """
+    Verify that many continuous views reading the same stream with overlapping WHERE clauses,
+    which share decoded tuples and clause results within a worker batch, each see the right rows
+    """
+    pipeline.create_stream('test_shared_stream', x='int', y='text')
+
+    # Each divisor's clause appears in several views, combined with other clauses in different orders
+    views = {}
+    for n in range(30):
+        d = n % 5 + 2
+        if n % 3 == 0:
+            where = 'mod(x, %d) = 0' % d
+            fn = lambda x, y, d=d: x % d == 0
+        elif n % 3 == 1:
+            where = "mod(x, %d) = 0 AND y = 'a'" % d
+            fn = lambda x, y, d=d: x % d == 0 and y == 'a'
+        else:
+            where = "y = 'a' AND mod(x, %d) = 0 AND x > %d" % (d, n)
+            fn = lambda x, y, d=d, n=n: y == 'a' and x % d == 0 and x > n
+
+        name = 'test_shared_%d' % n
+        pipeline.create_cv(name, 'SELECT count(*), sum(x::int) FROM test_shared_stream WHERE %s' % where)
+        views[name] = fn
+
+    # Volatile clauses are evaluated by each view on its own
+    pipeline.create_cv('test_shared_random',
+                       'SELECT count(*) FROM test_shared_stream WHERE random() < 2 AND mod(x, 2) = 0')
+
+    rows = [(n, 'a' if n % 4 else 'b') for n in range(1000)]
+    pipeline.insert('test_shared_stream', ('x', 'y'), rows)
+
+    for name, fn in views.items():
+        expected = [x for x, y in rows if fn(x, y)]
+        result = pipeline.execute('SELECT * FROM %s' % name).first()
+        assert result['count'] == len(expected)
+        assert (result['sum'] or 0) == sum(expected)
+
+    evens = [x for x, _ in rows if x % 2 == 0]
+
+    result = pipeline.execute('SELECT * FROM test_shared_random').first()
+    assert result['count'] == len(evens)
+
+
+def test_routed_where_clauses(pipeline, clean_db):
+    """
+    Verify that continuous views with equality predicates on a stream column, which workers
+    use to route tuples only to the views that can match them, still see exactly their rows
+    """
+    pipeline.create_stream('test_routed_stream', tenant='text', x='int')
+
+    tenants = ['t%d' % n for n in range(20)]
+    for t in tenants:
+        pipeline.create_cv('test_routed_%s' % t,
+                           "SELECT count(*), sum(x) FROM test_routed_stream WHERE tenant = '%s'" % t)
+
+    # IN lists, predicates combined with other clauses, constants on the left and no predicate at all
+    pipeline.create_cv('test_routed_in',
+                       "SELECT count(*), sum(x) FROM test_routed_stream WHERE tenant IN ('t1', 't3', 't3', 'nope')")
+    pipeline.create_cv('test_routed_and',
+                       "SELECT count(*), sum(x) FROM test_routed_stream WHERE x > 500 AND 't2' = tenant")
+    pipeline.create_cv('test_routed_none',
+                       'SELECT count(*), sum(x) FROM test_routed_stream')
+
+    rows = [(tenants[n % 7] if n % 11 else None, n) for n in range(1000)]
+
+    # Several batches so that views are routed once their plans exist
+    for i in range(0, len(rows), 100):
+        pipeline.insert('test_routed_stream', ('tenant', 'x'), rows[i:i + 100])
+
+    def check(name, fn):
+        expected = [x for t, x in rows if fn(t, x)]
+        result = pipeline.execute('SELECT * FROM %s' % name).first()
+        assert result['count'] == len(expected)
+        assert (result['sum'] or 0) == sum(expected)
+
+    for t in tenants:
+        check('test_routed_%s' % t, lambda tenant, x, t=t: tenant == t)
+
+    check('test_routed_in', lambda tenant, x: tenant in ('t1', 't3'))
+    check('test_routed_and', lambda tenant, x: tenant == 't2' and x > 500)
+    check('test_routed_none', lambda tenant, x: True)
@@ -33,3 +33,29 @@ def test_fss_agg(pipeline, clean_db):
   assert sorted(topk) == sorted(a_items[-5:])
   topk = map(int, result[1][1].rstrip('}').lstrip('{').split(','))
   assert sorted(topk) == sorted(b_items[-5:])
+
+
+def test_fss_agg_large_k(pipeline, clean_db):
+  """
+  Verify that top-k results stay correct with enough monitored elements
+  and merges to exercise eviction and reordering
+  """
+  pipeline.create_stream('test_fss_stream', x='text')
+  pipeline.create_cv('test_fss_large_k', 'SELECT fss_agg(x::text, 100) FROM test_fss_stream')
+
+  # 100 heavy hitters, each more frequent than the next, plus a long tail of singletons
+  values = []
+  for i in range(100):
+    values.extend([('heavy%d' % i,)] * (200 - i))
+  values.extend([('tail%d' % i,) for i in range(5000)])
+  random.shuffle(values)
+
+  for n in range(0, len(values), 1000):
+    pipeline.insert('test_fss_stream', ('x',), values[n:n + 1000])
+
+  result = list(pipeline.execute('SELECT * FROM fss_topk((SELECT fss_agg FROM test_fss_large_k))'))
+  assert len(result) == 100
+  assert sorted(r['value'] for r in result) == sorted('heavy%d' % i for i in range(100))
+
+  freqs = [r['frequency'] for r in result]
+  assert freqs == sorted(freqs, reverse=True)
@@ -33,3 +33,67 @@ def test_null_groups(pipeline, clean_db):
 
     for r, e in zip(result, expected):
         assert r == e
+
+
+def test_groups_across_batches(pipeline, clean_db):
+    """
+    Verify that grouped results stay correct when the same worker and combiner plans
+    execute many batches, including after another query's creation forces them to be rebuilt
+    """
+    pipeline.create_stream('s', x='int', y='int')
+    q = """
+    SELECT x::integer % 10 AS k, COUNT(*), sum(y::integer), count(DISTINCT y::integer) AS distinct_count
+    FROM s WHERE y::integer >= 0 GROUP BY k
+    """
+    pipeline.create_cv('test_batches', q)
+
+    def insert(start):
+        rows = [(n, n % 7) for n in range(start, start + 100)]
+        pipeline.insert('s', ('x', 'y'), rows + [(0, -1)])
+
+    for n in range(20):
+        insert(n * 100)
+
+    # Invalidates every persisted plan
+    pipeline.create_cv('test_batches_other', 'SELECT COUNT(*) FROM s')
+
+    for n in range(20, 40):
+        insert(n * 100)
+
+    result = list(pipeline.execute('SELECT * FROM test_batches ORDER BY k'))
+    assert len(result) == 10
+
+    for r in result:
+        xs = range(r['k'], 4000, 10)
+        assert r['count'] == len(xs)
+        assert r['sum'] == sum(x % 7 for x in xs)
+        assert r['distinct_count'] == 7
+
+    assert pipeline.execute('SELECT count FROM test_batches_other').first()['count'] == 20 * 101
+
+
+def test_new_groups_multi_insert(pipeline, clean_db):
+    """
+    Verify that new groups written together by a combiner are all found by later
+    lookups and are all emitted to the output stream
+    """
+    pipeline.create_stream('s', x='int')
+    pipeline.create_cv('test_multi_insert', 'SELECT x::integer, COUNT(*) FROM s GROUP BY x')
+    pipeline.create_cv('test_multi_insert_new',
+                       'SELECT COUNT(*) FROM test_multi_insert_osrel WHERE (old).x IS NULL')
+
+    # More new groups than a combiner writes at once
+    rows = [(n,) for n in range(5000)]
+    pipeline.insert('s', ('x',), rows)
+
+    # Empties the combiners' group caches so that the next batch has to look up every group
+    pipeline.stop()
+    pipeline.run()
+
+    pipeline.insert('s', ('x',), rows)
+
+    result = list(pipeline.execute('SELECT * FROM test_multi_insert ORDER BY x'))
+    assert len(result) == 5000
+    assert all(r['count'] == 2 for r in result)
+
+    assert pipeline.execute('SELECT count FROM test_multi_insert_new').first()['count'] == 5000
@@ -113,3 +113,41 @@ def test_transforms(pipeline, clean_db):
 
   rows = list(pipeline.execute('SELECT * FROM ct_recv'))
   assert len(rows) == 100
+
+
+def test_sw_output_blocks(pipeline, clean_db):
+  """
+  Verify that sliding-window output streams remain correct once step tuples
+  are combined into blocks, including for non-invertible aggregates
+  """
+  pipeline.create_stream('stream0', x='int', y='int')
+  pipeline.create_cv('sw0', """
+  SELECT x::integer, count(*), sum(y::integer), max(y), count(DISTINCT y) AS distinct_y
+  FROM stream0 GROUP BY x
+  """, sw='1 minute', step_factor=1)
+  pipeline.create_cv('sw0_output', 'SELECT (new).x, (new).count, (new).sum, (new).max, (new).distinct_y FROM sw0_osrel')
+
+  # With a 600ms step, blocks are 10 steps long so this spans a few of them
+  for i in range(15):
+    pipeline.insert('stream0', ('x', 'y'), [(x % 10, i) for x in range(100)])
+    time.sleep(1)
+
+  expected = dict((r['x'], r) for r in pipeline.execute('SELECT * FROM sw0'))
+  assert len(expected) == 10
+
+  for x, row in expected.items():
+    assert row['count'] == 150
+    assert row['sum'] == 10 * sum(range(15))
+    assert row['max'] == 14
+    assert row['distinct_y'] == 15
+
+    latest = pipeline.execute(
+      'SELECT max(count) AS count, max(sum) AS sum, max(max) AS max, max(distinct_y) AS distinct_y '
+      'FROM sw0_output WHERE x = %d' % x).first()
+    assert latest['count'] == row['count']
+    assert latest['sum'] == row['sum']
+    assert latest['max'] == row['max']
+    assert latest['distinct_y'] == row['distinct_y']
+
+  pipeline.drop_cv('sw0_output')
+  pipeline.drop_cv('sw0')
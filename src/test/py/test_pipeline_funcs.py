@@ -1,4 +1,4 @@
-from base import async_insert, pipeline, clean_db
+from base import async_insert, pipeline, clean_db, run_with
 import getpass
 import psycopg2
 import threading
@@ -87,3 +87,187 @@ def test_pipeline_flush(pipeline, clean_db):
   assert row[0] == 1000
 
   pipeline.execute('SET stream_insert_level=sync_commit')
+
+
+def test_pipeline_resize_procs(pipeline, clean_db):
+  """
+  Verify that worker and combiner pools can be resized while events are being
+  inserted without losing or double counting any of them
+  """
+  pipeline.create_stream('s', x='int')
+  pipeline.create_cv('resize_grouped', 'SELECT x::int, COUNT(*) FROM s GROUP BY x')
+  pipeline.create_cv('resize_ungrouped', 'SELECT COUNT(*) FROM s')
+
+  values = [(i % 100,) for i in xrange(1000)]
+  stop = False
+  ninserts = [0]
+
+  def insert():
+    while not stop:
+      pipeline.insert('s', ('x',), values)
+      ninserts[0] += 1
+      time.sleep(0.01)
+
+  t = threading.Thread(target=insert)
+  t.start()
+
+  try:
+    for workers, combiners in [(3, 3), (1, 1), (1, 3), (3, 1), (2, 2)]:
+      time.sleep(0.5)
+      row = pipeline.execute('SELECT pipeline_resize_procs(%d, %d) AS r' %
+                             (workers, combiners)).first()
+      assert row['r']
+  finally:
+    stop = True
+    t.join()
+
+  # NULL leaves a pool as it is
+  assert pipeline.execute('SELECT pipeline_resize_procs(NULL, 2) AS r').first()['r']
+
+  assert ninserts[0] > 0
+
+  rows = list(pipeline.execute('SELECT * FROM resize_grouped ORDER BY x'))
+  assert len(rows) == 100
+  for row in rows:
+    assert row['count'] == 10 * ninserts[0]
+
+  row = pipeline.execute('SELECT count FROM resize_ungrouped').first()
+  assert row['count'] == 1000 * ninserts[0]
+
+  try:
+    pipeline.execute('SELECT pipeline_resize_procs(0, 1)')
+    assert False
+  except Exception, e:
+    assert 'must be between' in e.message
+
+
+def test_pipeline_shard_map(pipeline, clean_db):
+  """
+  Verify that shard map buckets are spread evenly over combiners, that resizing
+  moves as few of them as possible and that bucket loads are reported
+  """
+  def owners():
+    rows = pipeline.execute('SELECT * FROM pipeline_shard_map() ORDER BY bucket')
+    return dict((r['bucket'], r['combiner']) for r in rows)
+
+  def counts(m):
+    c = {}
+    for owner in m.values():
+      c[owner] = c.get(owner, 0) + 1
+    return c
+
+  before = owners()
+  assert len(before) == 4096
+  assert counts(before) == {0: 2048, 1: 2048}
+
+  pipeline.create_stream('s', x='int')
+  pipeline.create_cv('shard_map', 'SELECT x::int, COUNT(*) FROM s GROUP BY x')
+
+  for _ in xrange(10):
+    pipeline.insert('s', ('x',), [(i,) for i in xrange(1000)])
+  time.sleep(2)
+
+  row = pipeline.execute('SELECT count(*) FROM pipeline_shard_map() WHERE load > 0').first()
+  assert row['count'] > 0
+
+  assert pipeline.execute('SELECT pipeline_resize_procs(NULL, 3) AS r').first()['r']
+  after = owners()
+  assert sorted(counts(after).values()) == [1365, 1365, 1366]
+
+  # Only the new combiner's share of buckets moved
+  moved = [b for b in after if after[b] != before[b]]
+  assert all(after[b] == 2 for b in moved)
+  assert len(moved) == counts(after)[2]
+
+  pipeline.insert('s', ('x',), [(i,) for i in xrange(1000)])
+
+  assert pipeline.execute('SELECT pipeline_resize_procs(NULL, 2) AS r').first()['r']
+  assert sorted(counts(owners()).values()) == [2048, 2048]
+
+  rows = list(pipeline.execute('SELECT * FROM shard_map'))
+  assert len(rows) == 1000
+  assert all(r['count'] == 11 for r in rows)
+
+
+def test_pipeline_proc_placement(pipeline, clean_db):
+  """
+  Verify that the placement of every continuous query process is reported
+  """
+  rows = list(pipeline.execute('SELECT * FROM pipeline_proc_placement()'))
+
+  types = [r['type'] for r in rows]
+  assert types.count('worker') == 2
+  assert types.count('combiner') == 2
+  assert 'queue' in types
+
+  for r in rows:
+    assert r['pid'] > 0
+    assert r['cpus']
+
+
+@run_with({
+  'continuous_query_worker_cpus': '0',
+  'continuous_query_combiner_cpus': '0;0'
+  })
+def test_pipeline_proc_placement_pinned(pipeline, clean_db):
+  """
+  Verify that workers and combiners are pinned to the CPU sets they're
+  configured with
+  """
+  rows = list(pipeline.execute('SELECT * FROM pipeline_proc_placement()'))
+
+  pinned = [r for r in rows if r['type'] in ('worker', 'combiner')]
+  assert len(pinned) == 4
+  assert all(r['cpus'] == '0' for r in pinned)
+
+
+@run_with({'continuous_query_rebalance_interval': 1})
+def test_pipeline_shard_map_rebalance(pipeline, clean_db):
+  """
+  Verify that hot buckets are moved away from an overloaded combiner without
+  affecting results
+  """
+  def owners():
+    rows = pipeline.execute('SELECT * FROM pipeline_shard_map() ORDER BY bucket')
+    return dict((r['bucket'], r['combiner']) for r in rows)
+
+  before = owners()
+
+  # Pick keys that all fall into different buckets owned by combiner 0
+  keys = {}
+  rows = pipeline.execute('SELECT x, hash_group(x) & 4095 AS bucket FROM generate_series(0, 9999) AS x')
+  for r in rows:
+    if before[r['bucket']] == 0 and r['bucket'] not in keys:
+      keys[r['bucket']] = r['x']
+    if len(keys) == 8:
+      break
+  hot = set(keys.keys())
+
+  pipeline.create_stream('s', x='int')
+  pipeline.create_cv('rebalance', 'SELECT x::int, COUNT(*) FROM s GROUP BY x')
+
+  batch = [(x,) for x in keys.values()] * 100
+  batches = 0
+  moved = []
+  for _ in xrange(60):
+    pipeline.insert('s', ('x',), batch)
+    batches += 1
+    time.sleep(0.5)
+
+    after = owners()
+    moved = [b for b in after if after[b] != before[b]]
+    if moved:
+      break
+
+  assert moved
+  assert all(b in hot and after[b] == 1 for b in moved)
+
+  # Buckets are moved until the two combiners are about equally loaded
+  assert len(moved) < len(hot)
+
+  pipeline.insert('s', ('x',), batch)
+  batches += 1
+
+  rows = list(pipeline.execute('SELECT * FROM rebalance'))
+  assert len(rows) == len(keys)
+  assert all(r['count'] == 100 * batches for r in rows)
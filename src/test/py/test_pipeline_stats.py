@@ -59,3 +59,31 @@ def test_cq_stats(pipeline, clean_db):
 
     result = pipeline.execute("SELECT * FROM pipeline_query_stats WHERE name = 'test_1_group' AND type = 'combiner'").first()
     assert result['output_rows'] == 1
+
+
+def test_cq_latency_stats(pipeline, clean_db):
+    """
+    Verify that per-phase latency percentiles are reported for each CQ
+    """
+    pipeline.create_stream('stream0', x='int')
+    pipeline.create_cv('test_latency', 'SELECT x::integer %% 10 AS g, COUNT(*) FROM stream0 GROUP BY g')
+
+    values = [(random.randint(1, 1024),) for n in range(1000)]
+
+    pipeline.insert('stream0', ('x',), values)
+    time.sleep(1)
+    pipeline.insert('stream0', ('x',), values)
+    time.sleep(1)
+
+    result = pipeline.execute("SELECT * FROM pipeline_query_stats WHERE name = 'test_latency' AND type = 'worker'").first()
+    assert result['exec_p50'] is not None
+    assert result['exec_p50'] <= result['exec_p95'] <= result['exec_p99']
+
+    # Workers don't combine or sync
+    assert result['sync_p50'] is None
+    assert result['ack_wait_p50'] is None
+
+    result = pipeline.execute("SELECT * FROM pipeline_query_stats WHERE name = 'test_latency' AND type = 'combiner'").first()
+    for phase in ['read', 'combine', 'sync', 'ack_wait']:
+        assert result['%s_p50' % phase] is not None
+        assert result['%s_p50' % phase] <= result['%s_p95' % phase] <= result['%s_p99' % phase]
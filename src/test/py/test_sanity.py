@@ -1,4 +1,4 @@
-from base import async_insert, pipeline, clean_db
+from base import async_insert, pipeline, clean_db, run_with
 
 import getpass
 import os
@@ -98,6 +98,65 @@ def test_combine(pipeline, clean_db):
   assert total == 10000
 
 
+def test_combine_cached_groups(pipeline, clean_db):
+  """
+  Verify that groups cached by combiners across syncs are combined correctly,
+  including after the matrel is truncated or deleted from
+  """
+  pipeline.create_stream('stream0', key='int')
+  pipeline.create_cv('combine_cached',
+                     'SELECT key::int, COUNT(*) FROM stream0 GROUP BY key')
+
+  rows = [(n % 100,) for n in range(1000)]
+
+  for _ in range(5):
+    pipeline.insert('stream0', ('key',), rows)
+
+  result = list(pipeline.execute('SELECT * FROM combine_cached ORDER BY key'))
+  assert len(result) == 100
+  assert all(r['count'] == 50 for r in result)
+
+  pipeline.execute('TRUNCATE CONTINUOUS VIEW combine_cached')
+  pipeline.insert('stream0', ('key',), rows)
+
+  result = list(pipeline.execute('SELECT * FROM combine_cached ORDER BY key'))
+  assert len(result) == 100
+  assert all(r['count'] == 10 for r in result)
+
+  pipeline.execute('SET continuous_query_materialization_table_updatable TO on; '
+                   'DELETE FROM combine_cached_mrel WHERE key < 50')
+  pipeline.insert('stream0', ('key',), rows)
+
+  result = list(pipeline.execute('SELECT * FROM combine_cached ORDER BY key'))
+  assert len(result) == 100
+  assert all(r['count'] == 10 for r in result if r['key'] < 50)
+  assert all(r['count'] == 20 for r in result if r['key'] >= 50)
+
+
+@run_with({
+  'continuous_query_num_combiners': 4,
+  'continuous_query_parallel_combine': 'on'
+  })
+def test_parallel_combine(pipeline, clean_db):
+  """
+  Verify that ungrouped partials spread across combiners are merged by the
+  view's owning combiner
+  """
+  pipeline.create_stream('stream0', x='int')
+  pipeline.create_cv('parallel_combine',
+                     'SELECT COUNT(*), SUM(x), COUNT(DISTINCT x) FROM stream0')
+
+  for n in range(20):
+    rows = [(n * 1000 + m,) for m in range(1000)]
+    pipeline.insert('stream0', ('x',), rows)
+
+  result = list(pipeline.execute('SELECT * FROM parallel_combine'))
+  assert len(result) == 1
+  assert result[0]['count'] == 20000
+  assert result[0]['sum'] == sum(range(20000))
+  assert result[0][2] == 20000
+
+
 def test_multiple_stmts(pipeline, clean_db):
   pipeline.create_stream('stream0', unused='int')
   conn = psycopg2.connect('dbname=pipeline user=%s host=localhost port=%s'
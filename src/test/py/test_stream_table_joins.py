@@ -274,3 +274,45 @@ def test_indexed(pipeline, clean_db):
     result = pipeline.execute('SELECT sum(count) FROM test_indexed').first()
 
     assert result['sum'] == len(expected)
+
+def test_join_table_changes(pipeline, clean_db):
+    """
+    Verify that stream-table joins see changes made to the table between
+    batches, even though the table's hash table is kept across batches
+    """
+    pipeline.create_stream('stream0', x='int')
+    pipeline.create_table('dim', x='integer', y='integer')
+    pipeline.insert('dim', ('x', 'y'), [(n, 1) for n in range(10)])
+
+    q = """
+    SELECT sum(dim.y) FROM stream0 JOIN dim ON stream0.x::integer = dim.x
+    """
+    pipeline.create_cv('test_join_changes', q)
+
+    def verify(expected):
+        for n in range(10):
+            pipeline.insert('stream0', ('x',), [(n,)])
+        result = pipeline.execute('SELECT sum FROM test_join_changes').first()
+        assert result['sum'] == expected
+
+    verify(10)
+    verify(20)
+
+    pipeline.execute('UPDATE dim SET y = 2')
+    verify(40)
+
+    pipeline.insert('dim', ('x', 'y'), [(n, 3) for n in range(5)])
+    verify(40 + 20 + 15)
+
+    pipeline.execute('DELETE FROM dim WHERE y = 3')
+    verify(75 + 20)
+
+    pipeline.execute('TRUNCATE dim')
+    verify(95)
+
+    # Changes are detected even when the modifying session doesn't track counts
+    pipeline.insert('dim', ('x', 'y'), [(n, 1) for n in range(10)])
+    verify(105)
+
+    pipeline.execute('SET track_counts = off; UPDATE dim SET y = 5; RESET track_counts')
+    verify(105 + 50)
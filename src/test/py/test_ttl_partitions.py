@@ -0,0 +1,129 @@
+from base import pipeline, clean_db
+import time
+
+
+def _partitions(pipeline, matrel):
+  return list(pipeline.execute(
+    "SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+    "WHERE i.inhparent = '%s'::regclass ORDER BY c.relname" % matrel))
+
+
+def test_ttl_partitions(pipeline, clean_db):
+  """
+  Verify that TTL partitioned views route groups to the partition for their ttl_column,
+  update them there, and drop them along with the view
+  """
+  pipeline.create_stream('stream0', x='int', ts='timestamptz')
+  pipeline.create_cv('ttl_part',
+                     'SELECT x::int, ts::timestamptz, count(*) FROM stream0 GROUP BY x, ts',
+                     ttl='1 hour', ttl_column='ts', ttl_partition='10 minutes')
+
+  # The current and next partitions are created along with the view
+  assert len(_partitions(pipeline, 'ttl_part_mrel')) == 2
+
+  now = pipeline.execute("SELECT date_trunc('second', now()) AS ts").first()['ts']
+  old = pipeline.execute("SELECT date_trunc('second', now()) - interval '2 hours' AS ts").first()['ts']
+
+  rows = [(x, now) for x in range(10)] + [(x, old) for x in range(10)]
+  for _ in range(3):
+    pipeline.insert('stream0', ('x', 'ts'), rows)
+
+  result = list(pipeline.execute('SELECT * FROM ttl_part'))
+  assert len(result) == 20
+  assert all(r['count'] == 3 for r in result)
+
+  # Rows outside of any partition stay in the matrel itself
+  assert pipeline.execute('SELECT count(*) FROM ONLY ttl_part_mrel').first()['count'] == 10
+  assert pipeline.execute('SELECT count(*) FROM ttl_part_mrel').first()['count'] == 20
+
+  pipeline.execute("SELECT ttl_expire('ttl_part')")
+  assert pipeline.execute('SELECT count(*) FROM ttl_part').first()['count'] == 10
+  assert len(_partitions(pipeline, 'ttl_part_mrel')) == 2
+
+  pipeline.drop_cv('ttl_part')
+  assert pipeline.execute("SELECT count(*) FROM pg_class WHERE relname LIKE 'ttl_part_mrel%'").first()['count'] == 0
+
+
+def test_ttl_partition_lookup(pipeline, clean_db):
+  """
+  Verify that groups in partitions and in the matrel itself are found by the combiner's
+  lookup once they're no longer in its memory, rather than being inserted again
+  """
+  pipeline.create_stream('stream0', x='int', ts='timestamptz')
+  pipeline.create_cv('ttl_part',
+                     'SELECT x::int, ts::timestamptz, count(*) FROM stream0 GROUP BY x, ts',
+                     ttl='1 hour', ttl_column='ts', ttl_partition='10 minutes')
+
+  now = pipeline.execute("SELECT date_trunc('second', now()) AS ts").first()['ts']
+  old = pipeline.execute("SELECT date_trunc('second', now()) - interval '2 hours' AS ts").first()['ts']
+  rows = [(x, now) for x in range(10)] + [(x, old) for x in range(10)]
+
+  pipeline.insert('stream0', ('x', 'ts'), rows)
+
+  # Restarting drops the combiners' cached groups
+  pipeline.stop()
+  pipeline.run()
+
+  pipeline.insert('stream0', ('x', 'ts'), rows)
+
+  assert pipeline.execute('SELECT count(*) FROM ttl_part_mrel').first()['count'] == 20
+  result = list(pipeline.execute('SELECT * FROM ttl_part'))
+  assert len(result) == 20
+  assert all(r['count'] == 2 for r in result)
+
+
+def test_ttl_partition_expiration(pipeline, clean_db):
+  """
+  Verify that expired partitions are dropped instead of having their rows deleted
+  """
+  pipeline.create_stream('stream0', x='int')
+  pipeline.create_cv('ttl_part',
+                     'SELECT x::int, arrival_timestamp AS ts FROM stream0',
+                     ttl='5 seconds', ttl_column='ts', ttl_partition='5 seconds')
+
+  pipeline.insert('stream0', ('x',), [(x,) for x in range(100)])
+  assert pipeline.execute('SELECT count(*) FROM ttl_part').first()['count'] == 100
+
+  before = _partitions(pipeline, 'ttl_part_mrel')
+
+  # Partitions are kept for a little while after they expire
+  time.sleep(35)
+  pipeline.execute("SELECT ttl_expire('ttl_part')")
+
+  assert pipeline.execute('SELECT count(*) FROM ttl_part').first()['count'] == 0
+
+  after = _partitions(pipeline, 'ttl_part_mrel')
+  assert not set(r['relname'] for r in before) & set(r['relname'] for r in after)
+
+
+def test_ttl_partition_invalid(pipeline, clean_db):
+  """
+  Verify that TTL partitions are only allowed where rows never move between partitions
+  """
+  pipeline.create_stream('stream0', x='int', ts='timestamptz')
+
+  invalid = [
+    ('SELECT x::int, ts::timestamptz FROM stream0', {'ttl_partition': '1 minute'}),
+    ('SELECT x::int, ts::timestamptz FROM stream0',
+     {'ttl': '1 minute', 'ttl_column': 'ts', 'ttl_partition': '1 hour'}),
+    ('SELECT x::int, max(ts::timestamptz) AS ts FROM stream0 GROUP BY x',
+     {'ttl': '1 hour', 'ttl_column': 'ts', 'ttl_partition': '1 minute'}),
+    ('SELECT ts::timestamptz, count(*) FROM stream0 GROUP BY ts',
+     {'ttl': '1 hour', 'ttl_column': 'ts', 'ttl_partition': '1 minute', 'storage': 'delta'})
+  ]
+
+  for q, opts in invalid:
+    try:
+      pipeline.create_cv('ttl0', q, **opts)
+      assert False
+    except Exception, e:
+      assert 'ttl' in e.message
+
+  pipeline.create_cv('ttl0', 'SELECT ts::timestamptz, count(*) FROM stream0 GROUP BY ts',
+                     ttl='1 hour', ttl_column='ts', ttl_partition='1 minute')
+
+  try:
+    pipeline.execute("SELECT set_ttl('ttl0', NULL, NULL)")
+    assert False
+  except Exception, e:
+    assert 'ttl partitions' in e.message
@@ -42,3 +42,29 @@ SELECT bloom_cardinality(
     bloom_intersection(
       'not a bloom filter',
       (SELECT bloom_agg(x) FROM generate_series(100, 1100) AS x)));
+
+-- Blocked layout
+SELECT bloom_contains_each((SELECT bloom_agg(g, 0.01, 100, true) FROM generate_series(1, 100) AS g), ARRAY[1, 50, 100, 101, 1000, NULL]);
+SELECT bloom_contains_each(NULL, ARRAY[1, 2]);
+
+SELECT bloom_cardinality(
+    bloom_union(
+      (SELECT bloom_agg(x, 0.01, 1000, true) FROM generate_series(1, 1000) AS x),
+      (SELECT bloom_agg(x, 0.01, 1000, true) FROM generate_series(100, 1100) AS x)));
+
+SELECT bloom_cardinality(
+    bloom_intersection(
+      (SELECT bloom_agg(x, 0.01, 1000, true) FROM generate_series(1, 1000) AS x),
+      (SELECT bloom_agg(x, 0.01, 1000, true) FROM generate_series(100, 1100) AS x)));
+
+SELECT bloom_union_agg(b) FROM (
+    SELECT bloom_agg(x, 0.01, 1000, true) AS b FROM generate_series(1, 10) AS x
+    UNION ALL
+    SELECT bloom_agg(x, 0.01, 1000) AS b FROM generate_series(1, 10) AS x) s;
+
+SELECT bloom_intersection_agg(b) FROM (
+    SELECT bloom_agg(x, 0.01, 1000, true) AS b FROM generate_series(1, 10) AS x
+    UNION ALL
+    SELECT bloom_agg(x, 0.01, 1000) AS b FROM generate_series(1, 10) AS x) s;
+
+SELECT bloom_agg(x, 0.000001, 1000000000, true) FROM generate_series(1, 10) AS x;